@@ -0,0 +1,408 @@
+// Stage level benchmark of the CPU pipeline. Every combination of world size, particle count and thread
+// count runs a short warmup simulation to get a realistic trail and particle distribution, then times each
+// stage on its own and writes results as JSON.
+//
+// Sense, turn and move are one fused kernel pass, so they are timed together with collisions disabled,
+// collision cost is the difference to the same pass with collisions enabled. Fused decay runs several
+// decay steps (see sim::decay_steps) over the whole world with all bricks active, so it always takes the
+// dense path, it's timed last since it activates bricks. GB/s is computed from
+// the minimal memory traffic of each stage (see stage_bytes and dof_bytes), not measured.
+#include "sim.h"
+#include "sim_trail.h"
+#include "dof.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_VALUES 16
+// DoF trail mode runs 32 sources for every 2x2x2 cell of active bricks, same as dof.cpp.
+#define DOF_TRAIL_SOURCES_PER_VOXEL 4
+
+enum Stage {
+    STAGE_SENSE_MOVE,
+    STAGE_COLLISION,
+    STAGE_DEPOSIT,
+    STAGE_DECAY,
+    STAGE_FUSED_DECAY,
+    STAGE_DOF_TRAIL,
+    STAGE_DOF_PARTICLES,
+    STAGE_DOF_PAIRS,
+    STAGE_COUNT,
+};
+
+static const char *stage_names[STAGE_COUNT] = {
+    "sense_move", "collision", "deposit", "decay", "fused_decay", "dof_trail", "dof_particles", "dof_pairs",
+};
+
+struct ValueList {
+    uint32_t values[MAX_VALUES];
+    uint32_t count;
+};
+
+struct Arguments {
+    ValueList sizes;
+    ValueList particle_counts;
+    ValueList thread_counts;
+    uint32_t warmup_steps;
+    uint32_t repeats;
+    bool skip_dof;
+    SimHeading heading;
+    SimTrailFormat trail_format;
+    SimDecayBuffer decay_buffer;
+    int sample_points;
+    uint32_t fused_steps;
+    uint32_t image_width;
+    uint32_t image_height;
+    float max_memory;
+    const char *output_path;
+};
+
+struct StageResult {
+    double seconds;
+    // Number of items stage processes, particles or voxels.
+    double items;
+    double bytes;
+};
+
+static void print_usage() {
+    printf("Usage: physarum_bench [options]\n");
+    printf("  --sizes A,B,..     world sizes, default 128,256,512,1024\n");
+    printf("  --particles A,B,.. particle counts, default 10000,100000,1000000,10000000\n");
+    printf("  --threads A,B,..   thread counts, default powers of two up to all cores\n");
+    printf("  --warmup N         simulation steps before timing, default 20\n");
+    printf("  --repeats N        timed runs of every stage, median is reported, default 5\n");
+    printf("  --heading H        particle heading state: angles, direction, default angles\n");
+    printf("  --trail F          trail storage format: fp32, fp16, u8, default fp32\n");
+    printf("  --in-place-decay   decay trail in place instead of into a second trail buffer\n");
+    printf("  --samples N        directions sensed around heading: 4, 8, 16, 26, default 8\n");
+    printf("  --fused-decay N    decay steps of the fused decay stage, default 8\n");
+    printf("  --no-dof           skip DoF stages\n");
+    printf("  --image W H        DoF image size, default 1280 720\n");
+    printf("  --max-memory GB    skip configurations needing more memory, default 16\n");
+    printf("  --output PATH      JSON output, default bench.json\n");
+}
+
+static bool parse_list(const char *text, ValueList *list) {
+    list->count = 0;
+    while (*text) {
+        if (list->count == MAX_VALUES) return false;
+        char *end;
+        double value = strtod(text, &end);
+        if (end == text || value < 1.0) return false;
+        list->values[list->count++] = uint32_t(value);
+        text = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',') return false;
+    }
+    return list->count > 0;
+}
+
+static bool parse_arguments(int argc, char **argv, Arguments *args) {
+    for (int i = 1; i < argc; ++i) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--sizes") == 0 && has_value) {
+            if (!parse_list(argv[++i], &args->sizes)) return false;
+        } else if (strcmp(argv[i], "--particles") == 0 && has_value) {
+            if (!parse_list(argv[++i], &args->particle_counts)) return false;
+        } else if (strcmp(argv[i], "--threads") == 0 && has_value) {
+            if (!parse_list(argv[++i], &args->thread_counts)) return false;
+        } else if (strcmp(argv[i], "--warmup") == 0 && has_value) {
+            args->warmup_steps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--repeats") == 0 && has_value) {
+            args->repeats = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--heading") == 0 && has_value) {
+            const char *name = argv[++i];
+            if (strcmp(name, "angles") == 0) {
+                args->heading = SimHeading::ANGLES;
+            } else if (strcmp(name, "direction") == 0) {
+                args->heading = SimHeading::DIRECTION;
+            } else {
+                return false;
+            }
+        } else if (strcmp(argv[i], "--trail") == 0 && has_value) {
+            const char *name = argv[++i];
+            SimTrailFormat formats[3] = { SimTrailFormat::FLOAT32, SimTrailFormat::FLOAT16, SimTrailFormat::UNORM8 };
+            bool found = false;
+            for (int f = 0; f < 3; ++f) {
+                if (strcmp(name, sim::get_trail_format_name(formats[f])) == 0) {
+                    args->trail_format = formats[f];
+                    found = true;
+                }
+            }
+            if (!found) return false;
+        } else if (strcmp(argv[i], "--in-place-decay") == 0) {
+            args->decay_buffer = SimDecayBuffer::IN_PLACE;
+        } else if (strcmp(argv[i], "--samples") == 0 && has_value) {
+            args->sample_points = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--fused-decay") == 0 && has_value) {
+            args->fused_steps = uint32_t(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--no-dof") == 0) {
+            args->skip_dof = true;
+        } else if (strcmp(argv[i], "--image") == 0 && i + 2 < argc) {
+            args->image_width = atoi(argv[++i]);
+            args->image_height = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-memory") == 0 && has_value) {
+            args->max_memory = float(atof(argv[++i]));
+        } else if (strcmp(argv[i], "--output") == 0 && has_value) {
+            args->output_path = argv[++i];
+        } else {
+            return false;
+        }
+    }
+    return args->repeats > 0 && args->fused_steps > 0 && args->image_width > 0 && args->image_height > 0;
+}
+
+static double get_time() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Rough memory footprint: one or two trail buffers, occupancy bits and per particle state, deposit scratch
+// and buddy grid.
+static double get_memory_size(uint32_t size, uint32_t particle_count, SimTrailFormat trail_format, SimDecayBuffer decay_buffer) {
+    double voxels = double(size) * size * size;
+    double trail_buffers = decay_buffer == SimDecayBuffer::IN_PLACE ? 1.0 : 2.0;
+    return voxels * (trail_buffers * trail::get_voxel_size(trail_format) + 0.125) + double(particle_count) * 80.0;
+}
+
+// Minimal memory traffic of a stage per item. Particle state is 5 floats (6 with heading vectors) read and
+// written, sensing gathers a trail value per sample direction plus one straight ahead, collision is
+// a read-modify-write of an occupancy word, deposit reads position, writes and reads binned voxel index
+// and read-modify-writes trail, decay reads and writes every voxel, fused decay does so once per pass of up
+// to 8 steps and its items are voxel steps. Trail voxels are counted in the stored
+// format, brick ranges of UNORM8 aren't counted. DoF stages are modelled per render by dof_bytes.
+static double stage_bytes(Stage stage, Arguments *args) {
+    uint32_t state_floats = args->heading == SimHeading::DIRECTION ? 6 : 5;
+    uint32_t samples = args->sample_points > 0 ? args->sample_points : 8;
+    size_t voxel_size = trail::get_voxel_size(args->trail_format);
+    switch (stage) {
+        case STAGE_SENSE_MOVE: return 2 * state_floats * sizeof(float) + (samples + 1) * voxel_size;
+        case STAGE_COLLISION: return 2 * sizeof(uint32_t);
+        case STAGE_DEPOSIT: return 3 * sizeof(float) + 4 * sizeof(uint32_t) + 2 * voxel_size;
+        case STAGE_DECAY: return 2 * voxel_size;
+        case STAGE_FUSED_DECAY: return 2.0 * voxel_size * ((args->fused_steps + 7) / 8) / args->fused_steps;
+        default: return 0.0;
+    }
+}
+
+// Memory traffic of a DoF render. Every sample is written into a batch as tile index, pixel offset and value,
+// read back when it's binned by tile, written and read once more as offset and value and added into a float
+// accumulator. Trail mode reads a voxel for every sample, particle modes read particle positions (pair mode also
+// the other endpoint and its index). Every pixel is written once from at least one accumulator. Samples off
+// screen and zero trail samples are dropped before batching but are counted, so GB/s of a scene which is
+// largely out of view or sparse is overestimated. Buddy search of pair mode isn't counted.
+static double dof_bytes(DofMode mode, DofSettings *settings, Arguments *args, double items) {
+    double sample_bytes = 2 * (sizeof(uint32_t) + sizeof(uint16_t) + sizeof(float)) + 2 * (sizeof(uint16_t) + sizeof(float)) +
+                          2 * sizeof(float);
+    double iterations = settings->iterations > 0 ? double(settings->iterations) : 0.0;
+    double image_bytes = 2.0 * sizeof(float) * args->image_width * args->image_height;
+    switch (mode) {
+        case DofMode::TRAIL:
+            return items * DOF_TRAIL_SOURCES_PER_VOXEL * iterations * (trail::get_voxel_size(args->trail_format) + sample_bytes) + image_bytes;
+        case DofMode::PARTICLES:
+            return items * (3 * sizeof(float) + iterations * sample_bytes) + image_bytes;
+        default:
+            return items * (6 * sizeof(float) + sizeof(uint32_t) + iterations * sample_bytes) + image_bytes;
+    }
+}
+
+static double median(double *values, uint32_t count) {
+    std::sort(values, values + count);
+    return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) * 0.5;
+}
+
+// Times all stages on current state of world and particles.
+static void run_stages(Arguments *args, Config *config, World *world, Particles *particles, ThreadPool *pool, StageResult *results) {
+    double *times = (double *)malloc(sizeof(double) * args->repeats * 2);
+    double *collision_times = times + args->repeats;
+    Config no_collision = *config;
+    no_collision.collision = 0.0f;
+    Config with_collision = *config;
+    with_collision.collision = 1.0f;
+
+    for (uint32_t r = 0; r < args->repeats; ++r) {
+        double start = get_time();
+        sim::move_particles(world, particles, &no_collision, pool);
+        times[r] = get_time() - start;
+        start = get_time();
+        sim::move_particles(world, particles, &with_collision, pool);
+        collision_times[r] = get_time() - start;
+    }
+    double sense_move = median(times, args->repeats);
+    results[STAGE_SENSE_MOVE] = { sense_move, double(particles->count), 0.0 };
+    results[STAGE_COLLISION] = { std::max(median(collision_times, args->repeats) - sense_move, 0.0), double(particles->count), 0.0 };
+
+    for (uint32_t r = 0; r < args->repeats; ++r) {
+        double start = get_time();
+        sim::deposit(world, particles, config, pool);
+        times[r] = get_time() - start;
+    }
+    results[STAGE_DEPOSIT] = { median(times, args->repeats), double(particles->count), 0.0 };
+
+    for (uint32_t r = 0; r < args->repeats; ++r) {
+        double start = get_time();
+        sim::decay(world, config, pool);
+        times[r] = get_time() - start;
+    }
+    results[STAGE_DECAY] = { median(times, args->repeats), double(sim::get_voxel_count(world)), 0.0 };
+
+    if (!args->skip_dof) {
+        DofSettings settings = dof::get_settings(args->image_width, args->image_height);
+        DofImage image = dof::get_image(args->image_width, args->image_height);
+        BuddyGrid grid = dof::get_buddy_grid();
+        DofMode modes[3] = { DofMode::TRAIL, DofMode::PARTICLES, DofMode::PARTICLE_PAIRS };
+        for (int m = 0; m < 3; ++m) {
+            for (uint32_t r = 0; r < args->repeats; ++r) {
+                double start = get_time();
+                dof::render(&image, &settings, modes[m], world, particles, &grid, pool);
+                times[r] = get_time() - start;
+            }
+            // Trail mode visits voxels of active bricks, other modes particles.
+            double items = modes[m] == DofMode::TRAIL ? double(world->active_brick_count) * SIM_BRICK_SIZE * SIM_BRICK_SIZE * SIM_BRICK_SIZE : double(particles->count);
+            results[STAGE_DOF_TRAIL + m] = { median(times, args->repeats), items, dof_bytes(modes[m], &settings, args, items) };
+        }
+        dof::release(&grid);
+        dof::release(&image);
+    }
+
+    for (uint32_t r = 0; r < args->repeats; ++r) {
+        sim::activate_bricks(world);
+        double start = get_time();
+        sim::decay_steps(world, config, args->fused_steps, pool);
+        times[r] = get_time() - start;
+    }
+    results[STAGE_FUSED_DECAY] = { median(times, args->repeats), double(sim::get_voxel_count(world)) * args->fused_steps, 0.0 };
+
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        results[s].bytes += results[s].items * stage_bytes(Stage(s), args);
+    }
+    free(times);
+}
+
+static void write_stage(FILE *file, StageResult *result, StageResult *baseline, uint32_t threads, uint32_t baseline_threads, bool last, Stage stage) {
+    double ns_per_item = result->items > 0.0 ? result->seconds * 1e9 / result->items : 0.0;
+    double gb_per_s = result->seconds > 0.0 ? result->bytes / result->seconds * 1e-9 : 0.0;
+    // Speedup over the smallest thread count divided by the increase in threads.
+    double efficiency = result->seconds > 0.0 ? baseline->seconds / result->seconds * baseline_threads / threads : 0.0;
+    fprintf(file, "        \"%s\": { \"ms\": %.4f, \"ns_per_item\": %.3f, \"gb_per_s\": %.3f, \"efficiency\": %.3f }%s\n",
+            stage_names[stage], result->seconds * 1e3, ns_per_item, gb_per_s, efficiency, last ? "" : ",");
+}
+
+int main(int argc, char **argv) {
+    ThreadPool *hardware_pool = thread_pool::get(0);
+    uint32_t hardware_threads = thread_pool::get_thread_count(hardware_pool);
+    thread_pool::release(hardware_pool);
+
+    Arguments args = {};
+    parse_list("128,256,512,1024", &args.sizes);
+    parse_list("10000,100000,1000000,10000000", &args.particle_counts);
+    for (uint32_t threads = 1; args.thread_counts.count < MAX_VALUES; threads *= 2) {
+        args.thread_counts.values[args.thread_counts.count++] = threads < hardware_threads ? threads : hardware_threads;
+        if (threads >= hardware_threads) break;
+    }
+    args.warmup_steps = 20;
+    args.repeats = 5;
+    args.fused_steps = 8;
+    args.image_width = 1280;
+    args.image_height = 720;
+    args.max_memory = 16.0f;
+    args.output_path = "bench.json";
+    if (!parse_arguments(argc, argv, &args)) {
+        print_usage();
+        return 1;
+    }
+
+    FILE *file = fopen(args.output_path, "w");
+    if (!file) {
+        printf("Failed to open %s\n", args.output_path);
+        return 1;
+    }
+    fprintf(file, "{\n  \"kernel\": \"%s\",\n  \"heading\": \"%s\",\n  \"trail\": \"%s\",\n  \"in_place_decay\": %s,\n  \"hardware_threads\": %u,\n  \"warmup_steps\": %u,\n  \"repeats\": %u,\n  \"results\": [\n",
+            sim::get_kernel_name(sim::get_kernel()), args.heading == SimHeading::DIRECTION ? "direction" : "angles",
+            sim::get_trail_format_name(args.trail_format),
+            args.decay_buffer == SimDecayBuffer::IN_PLACE ? "true" : "false", hardware_threads, args.warmup_steps, args.repeats);
+
+    bool first_result = true;
+    for (uint32_t s = 0; s < args.sizes.count; ++s) {
+        for (uint32_t p = 0; p < args.particle_counts.count; ++p) {
+            uint32_t size = args.sizes.values[s];
+            uint32_t particle_count = args.particle_counts.values[p];
+            if (get_memory_size(size, particle_count, args.trail_format, args.decay_buffer) > double(args.max_memory) * 1e9 ||
+                uint64_t(size) * size * size >= (uint64_t(1) << 31)) {
+                printf("size %u, particles %u: skipped, too large\n", size, particle_count);
+                continue;
+            }
+
+            // Same defaults as physarum.exe, spawn sphere scales with the world.
+            Config config = {};
+            config.sense_spread = 0.48f;
+            config.sense_distance = 23.0f;
+            config.turn_angle = 0.63f;
+            config.move_distance = 2.77f;
+            config.deposit_value = 5.0f;
+            config.decay_factor = 0.32f;
+            config.collision = 0.0f;
+            config.center_attraction = 1.0f;
+            config.world_width = int(size);
+            config.world_height = int(size);
+            config.world_depth = int(size);
+            config.move_sense_coef = 0.0f;
+            config.move_sense_offset = 1.0f;
+            config.sample_points = args.sample_points;
+            World world = sim::get_world(size, size, size, args.trail_format, args.decay_buffer);
+            Particles particles = sim::get_particles(particle_count);
+            if (!world.trail.voxels || !world.occupancy || !particles.x) {
+                printf("size %u, particles %u: skipped, allocation failed\n", size, particle_count);
+                sim::release(&world);
+                sim::release(&particles);
+                continue;
+            }
+            sim::set_heading(&particles, args.heading);
+
+            StageResult baseline[STAGE_COUNT] = {};
+            for (uint32_t t = 0; t < args.thread_counts.count; ++t) {
+                uint32_t threads = args.thread_counts.values[t];
+                ThreadPool *pool = thread_pool::get(threads);
+
+                // Every thread count starts from the same state.
+                sim::clear(&world, pool);
+                sim::spawn_particles(&particles, &world, size * 50.0f / 480.0f, 1);
+                for (uint32_t i = 0; i < args.warmup_steps; ++i) {
+                    sim::step(&world, &particles, &config, pool);
+                    sim::decay(&world, &config, pool);
+                }
+
+                StageResult results[STAGE_COUNT] = {};
+                run_stages(&args, &config, &world, &particles, pool, results);
+                if (t == 0) memcpy(baseline, results, sizeof(results));
+                thread_pool::release(pool);
+
+                printf("size %u, particles %u, threads %u:", size, particle_count, threads);
+                for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+                    if (args.skip_dof && stage >= STAGE_DOF_TRAIL) break;
+                    printf(" %s %.2f ms", stage_names[stage], results[stage].seconds * 1e3);
+                }
+                printf("\n");
+
+                fprintf(file, "%s    {\n      \"world_size\": %u,\n      \"particles\": %u,\n      \"threads\": %u,\n",
+                        first_result ? "" : ",\n", size, particle_count, threads);
+                fprintf(file, "      \"active_bricks\": %.4f,\n      \"stages\": {\n",
+                        double(world.active_brick_count) / sim::get_brick_count(&world));
+                int stage_count = args.skip_dof ? STAGE_DOF_TRAIL : STAGE_COUNT;
+                for (int stage = 0; stage < stage_count; ++stage) {
+                    write_stage(file, &results[stage], &baseline[stage], threads, args.thread_counts.values[0], stage == stage_count - 1, Stage(stage));
+                }
+                fprintf(file, "      }\n    }");
+                first_result = false;
+            }
+
+            sim::release(&world);
+            sim::release(&particles);
+        }
+    }
+    fprintf(file, "\n  ]\n}\n");
+    fclose(file);
+    return 0;
+}
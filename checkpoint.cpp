@@ -0,0 +1,326 @@
+// Checkpoint file is a header followed by sections, each aligned to 64 bytes so they can be read in place
+// from the mapped file: particle arrays (x, y, z, phi, theta, pair), indices of stored bricks, brick trail
+// values as half floats (SIM_BRICK_SIZE^3 per brick, including voxels outside of partial edge bricks)
+// and settings blob.
+#include "checkpoint.h"
+#include "sim_trail.h"
+#include "thread_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define CHECKPOINT_MAGIC "PHYSCKPT"
+#define CHECKPOINT_VERSION 1
+#define SECTION_ALIGNMENT 64
+#define PARTICLE_ARRAYS 6
+#define BRICK_VOXELS (SIM_BRICK_SIZE * SIM_BRICK_SIZE * SIM_BRICK_SIZE)
+#define PATH_LENGTH 1024
+
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+    uint32_t particle_count;
+    uint32_t brick_count;
+    uint32_t settings_size;
+    uint32_t filler;
+    Config config;
+
+    uint64_t particles_offset;
+    // Size of a single particle array including padding.
+    uint64_t particle_array_size;
+    uint64_t bricks_offset;
+    uint64_t trail_offset;
+    uint64_t settings_offset;
+    uint64_t file_size;
+};
+
+struct CheckpointWriter {
+    std::thread thread;
+    uint8_t *buffer;
+    size_t capacity;
+    size_t size;
+    char path[PATH_LENGTH];
+    bool failed;
+};
+
+struct MappedFile {
+    const uint8_t *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int file;
+#endif
+};
+
+static inline uint64_t align(uint64_t size) {
+    return (size + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+}
+
+static void encode_brick(World *world, uint32_t brick, uint16_t *dst) {
+    float values[BRICK_VOXELS];
+    trail::load_brick(world, &world->trail, brick, values);
+    for (uint32_t i = 0; i < BRICK_VOXELS; ++i) {
+        dst[i] = float_to_half(values[i]);
+    }
+}
+
+static void decode_brick(World *world, uint32_t brick, const uint16_t *src) {
+    float values[BRICK_VOXELS];
+    float max_value = 0.0f;
+    for (uint32_t i = 0; i < BRICK_VOXELS; ++i) {
+        values[i] = half_to_float(src[i]);
+        max_value = values[i] > max_value ? values[i] : max_value;
+    }
+    trail::store_brick(world, &world->trail, brick, values);
+    world->brick_max[brick] = max_value;
+}
+
+static void write_file(CheckpointWriter *writer) {
+    // Written under temporary name first, so a crash mid-write doesn't destroy previous checkpoint.
+    char temporary_path[PATH_LENGTH + 4];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", writer->path);
+    FILE *file = fopen(temporary_path, "wb");
+    if (!file) {
+        writer->failed = true;
+        return;
+    }
+    bool written = fwrite(writer->buffer, 1, writer->size, file) == writer->size;
+    written = fclose(file) == 0 && written;
+    remove(writer->path);
+    if (!written || rename(temporary_path, writer->path) != 0) {
+        remove(temporary_path);
+        writer->failed = true;
+    }
+}
+
+static bool map_file(const char *path, MappedFile *mapped) {
+    *mapped = {};
+#ifdef _WIN32
+    mapped->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (mapped->file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(mapped->file, &size) || size.QuadPart == 0) {
+        CloseHandle(mapped->file);
+        return false;
+    }
+    mapped->size = size_t(size.QuadPart);
+    mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapped->mapping) {
+        CloseHandle(mapped->file);
+        return false;
+    }
+    mapped->data = (const uint8_t *)MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!mapped->data) {
+        CloseHandle(mapped->mapping);
+        CloseHandle(mapped->file);
+        return false;
+    }
+#else
+    mapped->file = open(path, O_RDONLY);
+    if (mapped->file < 0) return false;
+    struct stat info;
+    if (fstat(mapped->file, &info) != 0 || info.st_size == 0) {
+        close(mapped->file);
+        return false;
+    }
+    mapped->size = size_t(info.st_size);
+    void *data = mmap(NULL, mapped->size, PROT_READ, MAP_PRIVATE, mapped->file, 0);
+    if (data == MAP_FAILED) {
+        close(mapped->file);
+        return false;
+    }
+    // Whole file is decoded right away, so let the kernel read ahead aggressively.
+    madvise(data, mapped->size, MADV_WILLNEED);
+    mapped->data = (const uint8_t *)data;
+#endif
+    return true;
+}
+
+static void unmap_file(MappedFile *mapped) {
+#ifdef _WIN32
+    UnmapViewOfFile(mapped->data);
+    CloseHandle(mapped->mapping);
+    CloseHandle(mapped->file);
+#else
+    munmap((void *)mapped->data, mapped->size);
+    close(mapped->file);
+#endif
+    *mapped = {};
+}
+
+CheckpointWriter *checkpoint::get_writer() {
+    CheckpointWriter *writer = new CheckpointWriter();
+    return writer;
+}
+
+void checkpoint::release(CheckpointWriter *writer) {
+    checkpoint::wait(writer);
+    free(writer->buffer);
+    delete writer;
+}
+
+bool checkpoint::wait(CheckpointWriter *writer) {
+    if (writer->thread.joinable()) {
+        writer->thread.join();
+    }
+    bool succeeded = !writer->failed;
+    writer->failed = false;
+    return succeeded;
+}
+
+void checkpoint::save(CheckpointWriter *writer, const char *path, World *world, Particles *particles, Config *config,
+                      const void *settings, uint32_t settings_size, ThreadPool *pool) {
+    if (writer->thread.joinable()) {
+        writer->thread.join();
+    }
+
+    CheckpointHeader header = {};
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.width = world->width;
+    header.height = world->height;
+    header.depth = world->depth;
+    header.particle_count = particles->count;
+    header.brick_count = world->active_brick_count;
+    header.settings_size = settings ? settings_size : 0;
+    header.config = *config;
+    header.particle_array_size = align(sizeof(uint32_t) * uint64_t(particles->count));
+    header.particles_offset = align(sizeof(CheckpointHeader));
+    header.bricks_offset = header.particles_offset + header.particle_array_size * PARTICLE_ARRAYS;
+    header.trail_offset = header.bricks_offset + align(sizeof(uint32_t) * uint64_t(header.brick_count));
+    header.settings_offset = header.trail_offset + align(sizeof(uint16_t) * BRICK_VOXELS * uint64_t(header.brick_count));
+    header.file_size = header.settings_offset + align(header.settings_size);
+
+    if (writer->capacity < header.file_size) {
+        free(writer->buffer);
+        writer->buffer = (uint8_t *)malloc(size_t(header.file_size));
+        writer->capacity = size_t(header.file_size);
+    }
+    uint8_t *buffer = writer->buffer;
+    writer->size = size_t(header.file_size);
+    memset(buffer, 0, size_t(header.particles_offset));
+    memcpy(buffer, &header, sizeof(header));
+
+    // Headings are always stored as angles, so checkpoints don't depend on SimHeading.
+    sim::update_angles(particles);
+    const void *arrays[PARTICLE_ARRAYS] = { particles->x, particles->y, particles->z, particles->phi, particles->theta, particles->pair };
+    thread_pool::run(pool, particles->count, 64 * 1024, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (int i = 0; i < PARTICLE_ARRAYS; ++i) {
+            uint8_t *dst = buffer + header.particles_offset + header.particle_array_size * i;
+            memcpy(dst + sizeof(uint32_t) * begin, (const uint8_t *)arrays[i] + sizeof(uint32_t) * begin, sizeof(uint32_t) * (end - begin));
+        }
+    });
+
+    // Inactive bricks are zero, so only active ones have to be stored.
+    memcpy(buffer + header.bricks_offset, world->active_bricks, sizeof(uint32_t) * header.brick_count);
+    uint16_t *trail = (uint16_t *)(buffer + header.trail_offset);
+    thread_pool::run(pool, header.brick_count, 64, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t i = begin; i < end; ++i) {
+            encode_brick(world, world->active_bricks[i], trail + size_t(i) * BRICK_VOXELS);
+        }
+    });
+    if (header.settings_size > 0) {
+        memcpy(buffer + header.settings_offset, settings, header.settings_size);
+    }
+
+    snprintf(writer->path, PATH_LENGTH, "%s", path);
+    writer->thread = std::thread(write_file, writer);
+}
+
+static bool is_valid(CheckpointHeader *header, size_t file_size) {
+    if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0) return false;
+    if (header->version != CHECKPOINT_VERSION) return false;
+    if (header->file_size > file_size) return false;
+    if (uint64_t(header->width) * header->height * header->depth >= (uint64_t(1) << 31)) return false;
+    if (header->particle_array_size < sizeof(uint32_t) * uint64_t(header->particle_count)) return false;
+    if (header->particles_offset + header->particle_array_size * PARTICLE_ARRAYS > header->bricks_offset) return false;
+    if (header->bricks_offset + sizeof(uint32_t) * uint64_t(header->brick_count) > header->trail_offset) return false;
+    if (header->trail_offset + sizeof(uint16_t) * BRICK_VOXELS * uint64_t(header->brick_count) > header->settings_offset) return false;
+    if (header->settings_offset + header->settings_size > header->file_size) return false;
+    return true;
+}
+
+bool checkpoint::load(const char *path, World *world, Particles *particles, Config *config,
+                      void *settings, uint32_t settings_size, ThreadPool *pool) {
+    MappedFile file;
+    if (!map_file(path, &file)) return false;
+    CheckpointHeader header;
+    if (file.size < sizeof(header)) {
+        unmap_file(&file);
+        return false;
+    }
+    memcpy(&header, file.data, sizeof(header));
+    if (!is_valid(&header, file.size)) {
+        unmap_file(&file);
+        return false;
+    }
+    const uint32_t *bricks = (const uint32_t *)(file.data + header.bricks_offset);
+
+    if (world->width != header.width || world->height != header.height || world->depth != header.depth) {
+        float brick_threshold = world->brick_threshold;
+        SimTrailFormat trail_format = world->trail_format;
+        SimDecayBuffer decay_buffer = world->decay_buffer;
+        sim::release(world);
+        *world = sim::get_world(header.width, header.height, header.depth, trail_format, decay_buffer);
+        world->brick_threshold = brick_threshold;
+    }
+    uint32_t brick_count = sim::get_brick_count(world);
+    for (uint32_t i = 0; i < header.brick_count; ++i) {
+        if (bricks[i] >= brick_count) {
+            unmap_file(&file);
+            return false;
+        }
+    }
+    sim::reserve_particles(particles, header.particle_count);
+    particles->count = header.particle_count;
+    // Birth steps aren't stored, particle lifetimes start over.
+    free(particles->birth);
+    particles->birth = NULL;
+
+    void *arrays[PARTICLE_ARRAYS] = { particles->x, particles->y, particles->z, particles->phi, particles->theta, particles->pair };
+    thread_pool::run(pool, particles->count, 64 * 1024, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (int i = 0; i < PARTICLE_ARRAYS; ++i) {
+            const uint8_t *src = file.data + header.particles_offset + header.particle_array_size * i;
+            memcpy((uint8_t *)arrays[i] + sizeof(uint32_t) * begin, src + sizeof(uint32_t) * begin, sizeof(uint32_t) * (end - begin));
+        }
+    });
+    sim::update_directions(particles);
+
+    sim::clear(world, pool);
+    const uint16_t *trail = (const uint16_t *)(file.data + header.trail_offset);
+    thread_pool::run(pool, header.brick_count, 64, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t i = begin; i < end; ++i) {
+            decode_brick(world, bricks[i], trail + size_t(i) * BRICK_VOXELS);
+        }
+    });
+    for (uint32_t i = 0; i < header.brick_count; ++i) {
+        if (world->brick_flags[bricks[i]]) continue;
+        world->brick_flags[bricks[i]] = 1;
+        world->active_bricks[world->active_brick_count++] = bricks[i];
+    }
+
+    *config = header.config;
+    if (settings && settings_size > 0) {
+        uint32_t size = settings_size < header.settings_size ? settings_size : header.settings_size;
+        memcpy(settings, file.data + header.settings_offset, size);
+    }
+    unmap_file(&file);
+    return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include "config.h"
+#include "sim.h"
+
+struct ThreadPool;
+
+// Binary snapshot of CPU simulation state: particle arrays including pairs, Config, opaque settings blob
+// (e.g. RenderingSettings) and trail. Trail is stored sparsely as half floats, only active bricks are
+// written, same precision as trail_tex_A/trail_tex_B. Occupancy isn't stored, step clears it anyway.
+//
+// Writer encodes the state on the calling thread and writes it to disk on a background thread, so the
+// simulation can continue right away. Loading maps the file and decodes straight into simulation buffers.
+struct CheckpointWriter;
+
+namespace checkpoint {
+    CheckpointWriter *get_writer();
+    // Waits for pending write.
+    void release(CheckpointWriter *writer);
+
+    // Encodes state into writer's buffer and starts writing it to `path`. Waits for previous write
+    // to finish first, its buffer is reused. `settings` can be NULL.
+    void save(CheckpointWriter *writer, const char *path, World *world, Particles *particles, Config *config,
+              const void *settings, uint32_t settings_size, ThreadPool *pool);
+    // Waits for pending write, returns false if any write since the last wait failed.
+    bool wait(CheckpointWriter *writer);
+
+    // Restores state saved by save. World is reallocated if checkpoint has a different size, particle arrays
+    // grow if it has more particles, particles keep their SimHeading.
+    // Up to settings_size bytes of settings are copied into `settings`, which can be NULL.
+    // Returns false if file can't be read or isn't a valid checkpoint, world and particles aren't touched then.
+    bool load(const char *path, World *world, Particles *particles, Config *config,
+              void *settings, uint32_t settings_size, ThreadPool *pool);
+}
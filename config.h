@@ -0,0 +1,33 @@
+#pragma once
+
+// Simulation parameters. Layout mirrors ConfigBuffer (register b0) in the simulation shaders,
+// so the struct can be uploaded to the GPU as is and shared with the CPU simulation. Constant buffers are
+// packed in rows of 16 bytes, fields are grouped by row and the last row is padded to a full one.
+struct Config {
+    float sense_spread;
+    float sense_distance;
+    float turn_angle;
+    float move_distance;
+
+    float deposit_value;
+    float decay_factor;
+    float collision;
+    float center_attraction;
+
+    int world_width;
+    int world_height;
+    int world_depth;
+    float move_sense_coef;
+
+    float move_sense_offset;
+    // Live slot (it used to be padding), read by the CPU simulation only: number of directions sensed around
+    // the heading, 4, 8, 16 or 26, 0 means 8 like in the shaders. particle_shader_3d.hlsl declares it to keep
+    // the offsets of the following fields, but always senses 8 directions.
+    int sample_points;
+    // GPU only, number of live particles in the particle buffers, the CPU simulation uses Particles::count.
+    int particle_count;
+    // Padding to a full row.
+    int filler3;
+};
+
+static_assert(sizeof(Config) == 64, "Config has to match ConfigBuffer of the shaders, 4 rows of 16 bytes");
@@ -0,0 +1,230 @@
+#include "control.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#define CONTROL_LOG_MAGIC "PHYSCTRL"
+#define CONTROL_LOG_VERSION 1
+
+struct ControlLogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+};
+
+struct ControlLog {
+    FILE *file;
+    bool failed;
+};
+
+struct ControlReplay {
+    ControlEvent *events;
+    uint32_t event_count;
+    uint32_t next_event;
+    uint32_t frame_count;
+};
+
+// Offsets of Config fields in the order of ControlField.
+static const size_t config_offsets[] = {
+    offsetof(Config, sense_spread),
+    offsetof(Config, sense_distance),
+    offsetof(Config, turn_angle),
+    offsetof(Config, move_distance),
+    offsetof(Config, deposit_value),
+    offsetof(Config, decay_factor),
+    offsetof(Config, collision),
+    offsetof(Config, center_attraction),
+    offsetof(Config, move_sense_coef),
+    offsetof(Config, move_sense_offset),
+};
+#define CONFIG_FIELD_COUNT (sizeof(config_offsets) / sizeof(config_offsets[0]))
+
+static inline float *get_field(Config *config, uint32_t field) {
+    return (float *)((char *)config + config_offsets[field]);
+}
+
+uint32_t control::get_time() {
+    using namespace std::chrono;
+    static const steady_clock::time_point start = steady_clock::now();
+    return uint32_t(duration_cast<microseconds>(steady_clock::now() - start).count());
+}
+
+ControlQueue *control::get_queue() {
+    ControlQueue *queue = new ControlQueue();
+    queue->head = 0;
+    queue->tail = 0;
+    queue->dropped = 0;
+    return queue;
+}
+
+void control::release(ControlQueue *queue) {
+    delete queue;
+}
+
+bool control::push(ControlQueue *queue, const ControlEvent *event) {
+    uint32_t tail = queue->tail.load(std::memory_order_relaxed);
+    if (tail - queue->head.load(std::memory_order_acquire) == CONTROL_QUEUE_SIZE) {
+        queue->dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    queue->events[tail & (CONTROL_QUEUE_SIZE - 1)] = *event;
+    // Release makes the event visible before the consumer sees the new tail.
+    queue->tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+bool control::push(ControlQueue *queue, ControlField field, ControlSource source, float value) {
+    ControlEvent event = {};
+    event.time = control::get_time();
+    event.field = field;
+    event.source = source;
+    event.value = value;
+    return control::push(queue, &event);
+}
+
+bool control::pop(ControlQueue *queue, ControlEvent *event) {
+    uint32_t head = queue->head.load(std::memory_order_relaxed);
+    if (head == queue->tail.load(std::memory_order_acquire)) return false;
+    *event = queue->events[head & (CONTROL_QUEUE_SIZE - 1)];
+    // Release keeps the producer from overwriting the slot before it was read.
+    queue->head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+void control::push_changes(ControlQueue *queue, ControlSource source, const Config *before, const Config *after) {
+    for (uint32_t field = 0; field < CONFIG_FIELD_COUNT; ++field) {
+        float value = *get_field((Config *)after, field);
+        if (value != *get_field((Config *)before, field)) {
+            control::push(queue, ControlField(field), source, value);
+        }
+    }
+}
+
+void control::init(ControlConfig *controls, const Config *config) {
+    controls->configs[0] = *config;
+    controls->configs[1] = *config;
+    controls->front = 0;
+}
+
+Config *control::get_front(ControlConfig *controls) {
+    return &controls->configs[controls->front];
+}
+
+Config *control::get_back(ControlConfig *controls) {
+    return &controls->configs[controls->front ^ 1];
+}
+
+bool control::apply(ControlConfig *controls, const ControlEvent *event) {
+    if (uint32_t(event->field) >= CONFIG_FIELD_COUNT) return false;
+    *get_field(control::get_back(controls), uint32_t(event->field)) = event->value;
+    return true;
+}
+
+void control::publish(ControlConfig *controls) {
+    controls->front ^= 1;
+    *control::get_back(controls) = *control::get_front(controls);
+}
+
+ControlLog *control::open_log(const char *path, uint32_t width, uint32_t height, uint32_t depth, const Config *config) {
+    FILE *file = fopen(path, "wb");
+    if (!file) return NULL;
+    ControlLogHeader header = {};
+    memcpy(header.magic, CONTROL_LOG_MAGIC, sizeof(header.magic));
+    header.version = CONTROL_LOG_VERSION;
+    header.width = width;
+    header.height = height;
+    header.depth = depth;
+    ControlLog *log = (ControlLog *)malloc(sizeof(ControlLog));
+    log->file = file;
+    log->failed = fwrite(&header, sizeof(header), 1, file) != 1;
+    for (uint32_t field = 0; field < CONFIG_FIELD_COUNT; ++field) {
+        ControlEvent event = {};
+        event.time = control::get_time();
+        event.field = ControlField(field);
+        event.source = ControlSource::KEYBOARD;
+        event.value = *get_field((Config *)config, field);
+        control::write(log, &event);
+    }
+    return log;
+}
+
+void control::write(ControlLog *log, const ControlEvent *event) {
+    // Events are small, stdio buffering batches them into large writes.
+    if (fwrite(event, sizeof(ControlEvent), 1, log->file) != 1) log->failed = true;
+}
+
+bool control::close_log(ControlLog *log, uint32_t frame_count) {
+    ControlEvent end = {};
+    end.frame = frame_count;
+    end.time = control::get_time();
+    end.field = ControlField::END;
+    end.source = ControlSource::KEYBOARD;
+    control::write(log, &end);
+    bool written = !log->failed && fclose(log->file) == 0;
+    free(log);
+    return written;
+}
+
+ControlReplay *control::open_replay(const char *path, uint32_t *width, uint32_t *height, uint32_t *depth) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+    ControlLogHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, CONTROL_LOG_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CONTROL_LOG_VERSION) {
+        fclose(file);
+        return NULL;
+    }
+    ControlReplay *replay = (ControlReplay *)malloc(sizeof(ControlReplay));
+    replay->events = NULL;
+    replay->event_count = 0;
+    replay->next_event = 0;
+    replay->frame_count = 0;
+    uint32_t capacity = 0;
+    ControlEvent event;
+    while (fread(&event, sizeof(event), 1, file) == 1) {
+        if (event.field == ControlField::END) {
+            replay->frame_count = event.frame;
+            break;
+        }
+        if (replay->event_count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            replay->events = (ControlEvent *)realloc(replay->events, sizeof(ControlEvent) * capacity);
+        }
+        replay->events[replay->event_count++] = event;
+    }
+    fclose(file);
+    // Log of a session which didn't close it properly ends with its last event.
+    if (replay->frame_count == 0 && replay->event_count > 0) {
+        replay->frame_count = replay->events[replay->event_count - 1].frame + 1;
+    }
+    *width = header.width;
+    *height = header.height;
+    *depth = header.depth;
+    return replay;
+}
+
+void control::release(ControlReplay *replay) {
+    free(replay->events);
+    free(replay);
+}
+
+uint32_t control::get_frame_count(ControlReplay *replay) {
+    return replay->frame_count;
+}
+
+bool control::replay_frame(ControlReplay *replay, uint32_t frame, ControlQueue *queue) {
+    while (replay->next_event < replay->event_count && replay->events[replay->next_event].frame <= frame) {
+        ControlEvent event = replay->events[replay->next_event];
+        event.source = ControlSource::REPLAY;
+        event.time = control::get_time();
+        // Consumer drains the queue after every frame, a full queue means the log has more events in a
+        // frame than the queue holds, the rest is pushed in the next frame.
+        if (!control::push(queue, &event)) break;
+        replay->next_event++;
+    }
+    return replay->next_event < replay->event_count;
+}
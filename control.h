@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include "config.h"
+
+// Control events: every change of a simulation parameter, whether it comes from MIDI, UI or keyboard, is an
+// event which producers push into a lock-free single producer single consumer queue. The frame loop drains
+// the queues at the start of a frame, applies the events to the back Config and publishes it, so the
+// simulation only sees complete changes at frame boundaries. Applied events can be written to a log and
+// replayed later, a replay is just another producer, pushing the logged events of every frame in turn.
+enum class ControlSource : uint8_t {
+    MIDI,
+    UI,
+    KEYBOARD,
+    REPLAY,
+};
+
+// Fields up to MOVE_SENSE_OFFSET are Config fields, the rest is state of the frame loop. Producers only push
+// these, MIDI controller IDs are mapped to fields before their events are pushed.
+enum class ControlField : uint8_t {
+    SENSE_SPREAD,
+    SENSE_DISTANCE,
+    TURN_ANGLE,
+    MOVE_DISTANCE,
+    DEPOSIT_VALUE,
+    DECAY_FACTOR,
+    COLLISION,
+    CENTER_ATTRACTION,
+    MOVE_SENSE_COEF,
+    MOVE_SENSE_OFFSET,
+    // Number of live particles.
+    PARTICLE_COUNT,
+    // Radius of the sphere particles are spawned in.
+    SPAWN_RADIUS,
+    // 1 stops simulation steps, frames still count.
+    PAUSED,
+    // Respawns particles and clears trail, value is unused.
+    RESET,
+    // Last event of a log, its frame is the number of logged frames.
+    END,
+};
+
+struct ControlEvent {
+    // Frame the event was applied in, set by the consumer. Frames of a log count from its start.
+    uint32_t frame;
+    // Microseconds since the first control::get_time call, set by the producer.
+    uint32_t time;
+    ControlField field;
+    ControlSource source;
+    uint16_t filler;
+    float value;
+};
+
+// Capacity of a queue, power of two. MIDI controllers send at most a few hundred events per second.
+#define CONTROL_QUEUE_SIZE 1024
+
+struct ControlQueue {
+    ControlEvent events[CONTROL_QUEUE_SIZE];
+    // Written only by the consumer.
+    std::atomic<uint32_t> head;
+    // Written only by the producer.
+    std::atomic<uint32_t> tail;
+    // Events pushed while the queue was full.
+    std::atomic<uint32_t> dropped;
+};
+
+// Config read by the simulation (front) and Config the events are applied to (back). Back starts every
+// frame as a copy of front, control::publish swaps them.
+struct ControlConfig {
+    Config configs[2];
+    uint32_t front;
+};
+
+struct ControlLog;
+struct ControlReplay;
+
+namespace control {
+    uint32_t get_time();
+
+    ControlQueue *get_queue();
+    void release(ControlQueue *queue);
+    // Producer side, returns false and counts the event as dropped if the queue is full. Never blocks, so it
+    // can be called from the MIDI callback thread.
+    bool push(ControlQueue *queue, ControlField field, ControlSource source, float value);
+    bool push(ControlQueue *queue, const ControlEvent *event);
+    // Consumer side, returns false if the queue is empty.
+    bool pop(ControlQueue *queue, ControlEvent *event);
+    // Pushes an event for every Config field which differs between `before` and `after`.
+    void push_changes(ControlQueue *queue, ControlSource source, const Config *before, const Config *after);
+
+    void init(ControlConfig *controls, const Config *config);
+    Config *get_front(ControlConfig *controls);
+    Config *get_back(ControlConfig *controls);
+    // Applies event to the back Config, returns false if the field isn't a Config field.
+    bool apply(ControlConfig *controls, const ControlEvent *event);
+    // Makes back Config the front one and starts the next back Config as its copy.
+    void publish(ControlConfig *controls);
+
+    // Log is a short header followed by ControlEvents in the order they were applied. It starts with events
+    // of frame 0 setting every Config field to its value in `config`. Returns NULL if the file can't be created.
+    ControlLog *open_log(const char *path, uint32_t width, uint32_t height, uint32_t depth, const Config *config);
+    void write(ControlLog *log, const ControlEvent *event);
+    // Writes END event for `frame_count` frames, returns false if any write failed.
+    bool close_log(ControlLog *log, uint32_t frame_count);
+
+    // Reads the whole log. World size of the recorded session is returned in width, height and depth.
+    // Returns NULL if the file can't be read or isn't a valid log.
+    ControlReplay *open_replay(const char *path, uint32_t *width, uint32_t *height, uint32_t *depth);
+    void release(ControlReplay *replay);
+    // Number of frames of the recorded session.
+    uint32_t get_frame_count(ControlReplay *replay);
+    // Pushes events logged in `frame` into queue, frames have to be replayed in order. Returns false once
+    // all events were pushed.
+    bool replay_frame(ControlReplay *replay, uint32_t frame, ControlQueue *queue);
+}
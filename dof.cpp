@@ -0,0 +1,603 @@
+// CPU DoF renderer for offline stills, port of dof_shader_trail.hlsl, dof_shader_particle.hlsl,
+// dof_shader_particle_pair.hlsl and blit_shader.hlsl.
+//
+// GPU scatters samples straight into display texture with InterlockedAdd. Here every task generates a batch
+// of samples, bins them by screen tile and adds each bin into thread's private accumulator for that tile.
+// Accumulators are allocated on first touch, so threads only pay for tiles they hit. Final image is the sum
+// of all threads' accumulators, computed tile by tile.
+#include "dof.h"
+#include "sim_trail.h"
+#include "thread_pool.h"
+#include "profiler.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TILE_SIZE 64
+#define TILE_PIXELS (TILE_SIZE * TILE_SIZE)
+// Max number of samples generated by a single task.
+#define TASK_SAMPLES (64 * 1024)
+
+// Trail shader runs a group of 32 threads for every 2x2x2 cell of the world.
+#define TRAIL_CELL_THREADS 32
+#define TRAIL_CELL_SIZE 2
+#define TRAIL_BRICK_CELLS (SIM_BRICK_SIZE / TRAIL_CELL_SIZE)
+#define TRAIL_CELLS_PER_BRICK (TRAIL_BRICK_CELLS * TRAIL_BRICK_CELLS * TRAIL_BRICK_CELLS)
+
+#define NO_ENDPOINT 0xFFFFFFFF
+// Buddy grid is sized for about this many particles per cell.
+#define BUDDY_CELL_PARTICLES 2.0f
+#define MAX_BUDDY_SHELLS 16
+
+// pixel_shader.hlsl displays image values divided by 5.
+#define DISPLAY_SCALE (1.0f / 5.0f)
+
+struct Float4 {
+    float x, y, z, w;
+};
+
+static inline Float4 transform(const float *m, Float4 v) {
+    Float4 result;
+    result.x = m[0] * v.x + m[1] * v.y + m[2] * v.z + m[3] * v.w;
+    result.y = m[4] * v.x + m[5] * v.y + m[6] * v.z + m[7] * v.w;
+    result.z = m[8] * v.x + m[9] * v.y + m[10] * v.z + m[11] * v.w;
+    result.w = m[12] * v.x + m[13] * v.y + m[14] * v.z + m[15] * v.w;
+    return result;
+}
+
+static inline uint32_t wang_hash(uint32_t seed) {
+    seed = (seed ^ 61) ^ (seed >> 16);
+    seed *= 9;
+    seed = seed ^ (seed >> 4);
+    seed *= 0x27d4eb2d;
+    seed = seed ^ (seed >> 15);
+    return seed;
+}
+
+static inline float random(uint32_t seed) {
+    return float(wang_hash(seed) % 1000) / 1000.0f;
+}
+
+static inline Float4 random_sphere(uint32_t hash) {
+    float a = random(hash);
+    float b = random(hash + 3);
+    float azimuth = a * 2 * 3.14159265f;
+    float polar = acosf(2 * b - 1);
+    Float4 result = { sinf(polar) * cosf(azimuth), cosf(polar), sinf(polar) * sinf(azimuth), 0.0f };
+    return result;
+}
+
+// Per-thread accumulators and sample batch.
+struct DofThread {
+    float **tiles;
+
+    uint32_t sample_count;
+    uint32_t *sample_tiles;
+    uint16_t *sample_offsets;
+    float *sample_values;
+
+    // Samples sorted by tile.
+    uint16_t *sorted_offsets;
+    float *sorted_values;
+    uint32_t *tile_offsets;
+};
+
+struct DofContext {
+    DofSettings *settings;
+    DofImage *image;
+    World *world;
+    Particles *particles;
+    uint32_t tiles_x;
+    uint32_t tile_count;
+    DofThread *threads;
+
+    // Second end of particle's line in particle pairs mode.
+    uint32_t *endpoints;
+};
+
+// Converts point from world texture space to scene space, then to view space, same as shaders.
+static inline Float4 to_view_space(DofContext *ctx, float x, float y, float z) {
+    Float4 p = {
+        x / float(ctx->world->width) * 2.0f - 1.0f,
+        -(y / float(ctx->world->height) * 2.0f - 1.0f),
+        -(z / float(ctx->world->depth) * 2.0f - 1.0f),
+        1.0f,
+    };
+    return transform(ctx->settings->view, p);
+}
+
+// Offsets view space point by DoF, projects it and adds it to thread's sample batch.
+static inline void add_sample(DofContext *ctx, DofThread *thread, Float4 pos, uint32_t sphere_hash, float value) {
+    DofSettings *s = ctx->settings;
+    float d = sqrtf(pos.x * pos.x + pos.y * pos.y + pos.z * pos.z);
+    float r = s->dof_size * powf(fabsf(s->focal_distance - d) / s->focal_depth, s->dof_distribution);
+    Float4 offset = random_sphere(sphere_hash);
+    pos.x += offset.x * r;
+    pos.y += offset.y * r;
+    pos.z += offset.z * r;
+
+    Float4 out = transform(s->projection, pos);
+    float sx = (out.x / out.w * 0.5f + 0.5f) * float(ctx->image->width);
+    float sy = (out.y / out.w * 0.5f + 0.5f) * float(ctx->image->height);
+    // Samples outside of the screen are dropped, comparisons are also false for NaN.
+    if (!(sx >= 0.0f && sx < float(ctx->image->width) && sy >= 0.0f && sy < float(ctx->image->height))) {
+        return;
+    }
+    uint32_t px = uint32_t(sx), py = uint32_t(sy);
+    uint32_t i = thread->sample_count++;
+    thread->sample_tiles[i] = (py / TILE_SIZE) * ctx->tiles_x + px / TILE_SIZE;
+    thread->sample_offsets[i] = uint16_t((py % TILE_SIZE) * TILE_SIZE + px % TILE_SIZE);
+    thread->sample_values[i] = value;
+}
+
+// Bins thread's samples by tile and adds them into thread's tile accumulators.
+static void flush_samples(DofContext *ctx, DofThread *thread) {
+    uint32_t *offsets = thread->tile_offsets;
+    memset(offsets, 0, sizeof(uint32_t) * (ctx->tile_count + 1));
+    for (uint32_t i = 0; i < thread->sample_count; ++i) {
+        offsets[thread->sample_tiles[i] + 1]++;
+    }
+    for (uint32_t tile = 0; tile < ctx->tile_count; ++tile) {
+        offsets[tile + 1] += offsets[tile];
+    }
+    for (uint32_t i = 0; i < thread->sample_count; ++i) {
+        uint32_t destination = offsets[thread->sample_tiles[i]]++;
+        thread->sorted_offsets[destination] = thread->sample_offsets[i];
+        thread->sorted_values[destination] = thread->sample_values[i];
+    }
+
+    // Offsets now point to the end of each tile's bin.
+    uint32_t begin = 0;
+    for (uint32_t tile = 0; tile < ctx->tile_count; ++tile) {
+        uint32_t end = offsets[tile];
+        if (begin == end) continue;
+        if (!thread->tiles[tile]) {
+            thread->tiles[tile] = (float *)calloc(TILE_PIXELS, sizeof(float));
+        }
+        float *accumulator = thread->tiles[tile];
+        for (uint32_t i = begin; i < end; ++i) {
+            accumulator[thread->sorted_offsets[i]] += thread->sorted_values[i];
+        }
+        begin = end;
+    }
+    thread->sample_count = 0;
+}
+
+static void trail_samples(DofContext *ctx, DofThread *thread, uint32_t source, uint32_t iteration_begin, uint32_t iteration_end) {
+    World *world = ctx->world;
+    uint32_t brick = world->active_bricks[source / (TRAIL_CELLS_PER_BRICK * TRAIL_CELL_THREADS)];
+    uint32_t cell = source / TRAIL_CELL_THREADS % TRAIL_CELLS_PER_BRICK;
+    uint32_t lane = source % TRAIL_CELL_THREADS;
+
+    // Group id of the cell in trail shader dispatch.
+    uint32_t gx = brick % world->brick_width * TRAIL_BRICK_CELLS + cell % TRAIL_BRICK_CELLS;
+    uint32_t gy = brick / world->brick_width % world->brick_height * TRAIL_BRICK_CELLS + cell / TRAIL_BRICK_CELLS % TRAIL_BRICK_CELLS;
+    uint32_t gz = brick / (world->brick_width * world->brick_height) * TRAIL_BRICK_CELLS + cell / (TRAIL_BRICK_CELLS * TRAIL_BRICK_CELLS);
+    if (gx >= world->width / TRAIL_CELL_SIZE || gy >= world->height / TRAIL_CELL_SIZE || gz >= world->depth / TRAIL_CELL_SIZE) {
+        return;
+    }
+    uint32_t idx = gx * TRAIL_CELL_THREADS + lane + gy * 800 + gz * 800 * 800;
+
+    for (uint32_t i = iteration_begin; i < iteration_end; ++i) {
+        float x = float(gx * TRAIL_CELL_SIZE) + random(idx * 11 + i * 33) * 2.0f;
+        float y = float(gy * TRAIL_CELL_SIZE) + random(idx * 13 + i * 33) * 2.0f;
+        float z = float(gz * TRAIL_CELL_SIZE) + random(idx * 17 + i * 33) * 2.0f;
+        uint32_t ix = uint32_t(x), iy = uint32_t(y), iz = uint32_t(z);
+        if (ix >= world->width || iy >= world->height || iz >= world->depth) continue;
+        float value = trail::load(world, &world->trail, ix, iy, iz);
+        // Zero samples don't change the image.
+        if (value == 0.0f) continue;
+        add_sample(ctx, thread, to_view_space(ctx, x, y, z), idx * 33 + i * 31, value);
+    }
+}
+
+static void particle_samples(DofContext *ctx, DofThread *thread, uint32_t idx, uint32_t iteration_begin, uint32_t iteration_end) {
+    Particles *particles = ctx->particles;
+    Float4 pos = to_view_space(ctx, particles->x[idx], particles->y[idx], particles->z[idx]);
+    for (uint32_t i = iteration_begin; i < iteration_end; ++i) {
+        add_sample(ctx, thread, pos, idx * 33 + i, 1.0f);
+    }
+}
+
+static void particle_pair_samples(DofContext *ctx, DofThread *thread, uint32_t idx, uint32_t iteration_begin, uint32_t iteration_end) {
+    uint32_t other = ctx->endpoints[idx];
+    if (other == NO_ENDPOINT) return;
+
+    // Interpolation happens in scene space, before view transform.
+    Particles *particles = ctx->particles;
+    World *world = ctx->world;
+    Float4 a = {
+        particles->x[idx] / float(world->width) * 2.0f - 1.0f,
+        -(particles->y[idx] / float(world->height) * 2.0f - 1.0f),
+        -(particles->z[idx] / float(world->depth) * 2.0f - 1.0f),
+        1.0f,
+    };
+    Float4 b = {
+        particles->x[other] / float(world->width) * 2.0f - 1.0f,
+        -(particles->y[other] / float(world->height) * 2.0f - 1.0f),
+        -(particles->z[other] / float(world->depth) * 2.0f - 1.0f),
+        1.0f,
+    };
+    for (uint32_t i = iteration_begin; i < iteration_end; ++i) {
+        float t = random(idx + i * 32 * 13);
+        Float4 line_pos = {
+            t * a.x + (1 - t) * b.x,
+            t * a.y + (1 - t) * b.y,
+            t * a.z + (1 - t) * b.z,
+            1.0f,
+        };
+        add_sample(ctx, thread, transform(ctx->settings->view, line_pos), idx * 33 + i, 1.0f);
+    }
+}
+
+static inline float particle_distance(Particles *particles, uint32_t a, uint32_t b) {
+    float dx = particles->x[a] - particles->x[b];
+    float dy = particles->y[a] - particles->y[b];
+    float dz = particles->z[a] - particles->z[b];
+    return sqrtf(dx * dx + dy * dy + dz * dz);
+}
+
+static inline uint32_t hash_cell(BuddyGrid *grid, int x, int y, int z) {
+    uint32_t hash = uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u ^ uint32_t(z) * 83492791u;
+    return hash & (grid->table_size - 1);
+}
+
+// Nearest particle within break distance, NO_ENDPOINT if there's none. Cells colliding in the hash
+// table only add candidates which fail the distance check.
+static uint32_t find_nearest(BuddyGrid *grid, Particles *particles, uint32_t idx, float break_distance) {
+    int cx = int(floorf(particles->x[idx] / grid->cell_size));
+    int cy = int(floorf(particles->y[idx] / grid->cell_size));
+    int cz = int(floorf(particles->z[idx] / grid->cell_size));
+    float nearest_distance = break_distance;
+    uint32_t nearest = NO_ENDPOINT;
+    int shell_count = int(ceilf(break_distance / grid->cell_size));
+    for (int shell = 0; shell <= shell_count; ++shell) {
+        for (int z = -shell; z <= shell; ++z) {
+            for (int y = -shell; y <= shell; ++y) {
+                // Only cells on the surface of the shell, inner cells were already visited.
+                bool inner = abs(z) < shell && abs(y) < shell;
+                for (int x = -shell; x <= shell; x += inner ? 2 * shell : 1) {
+                    uint32_t cell = hash_cell(grid, cx + x, cy + y, cz + z);
+                    for (uint32_t i = grid->cell_starts[cell]; i < grid->cell_starts[cell + 1]; ++i) {
+                        uint32_t other = grid->particles[i];
+                        if (other == idx) continue;
+                        float distance = particle_distance(particles, idx, other);
+                        if (distance < nearest_distance) {
+                            nearest_distance = distance;
+                            nearest = other;
+                        }
+                    }
+                }
+            }
+        }
+        // Particles in further shells are at least `shell` cells away.
+        if (nearest_distance <= shell * grid->cell_size) break;
+    }
+    return nearest;
+}
+
+// Buddy update from dof_shader_particle_pair.hlsl. Keeps current buddy while it's within break distance,
+// otherwise picks the nearest particle. Particles without a buddy aren't drawn.
+static uint32_t find_endpoint(BuddyGrid *grid, Particles *particles, uint32_t idx, float break_distance) {
+    uint32_t buddy = particles->pair[idx];
+    // Pairs past particle count, SIM_NO_PAIR included, mean that particle has no buddy yet.
+    if (buddy < particles->count && particle_distance(particles, idx, buddy) <= break_distance) {
+        return buddy;
+    }
+    uint32_t nearest = find_nearest(grid, particles, idx, break_distance);
+    if (nearest == NO_ENDPOINT) {
+        return NO_ENDPOINT;
+    }
+    particles->pair[idx] = nearest;
+    return nearest;
+}
+
+BuddyGrid dof::get_buddy_grid() {
+    BuddyGrid grid = {};
+    return grid;
+}
+
+void dof::release(BuddyGrid *grid) {
+    free(grid->cell_starts);
+    free(grid->particle_cells);
+    free(grid->particles);
+    *grid = {};
+}
+
+// Groups particles by cell, returns average number of particles in particle's cell.
+static float build_grid(BuddyGrid *grid, Particles *particles, float cell_size, ThreadPool *pool) {
+    uint32_t count = particles->count;
+    grid->cell_size = cell_size;
+    thread_pool::run(pool, count, 16 * 1024, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t i = begin; i < end; ++i) {
+            int x = int(floorf(particles->x[i] / cell_size));
+            int y = int(floorf(particles->y[i] / cell_size));
+            int z = int(floorf(particles->z[i] / cell_size));
+            grid->particle_cells[i] = hash_cell(grid, x, y, z);
+        }
+    });
+
+    // Counting sort by cell.
+    uint32_t *starts = grid->cell_starts;
+    memset(starts, 0, sizeof(uint32_t) * (grid->table_size + 1));
+    for (uint32_t i = 0; i < count; ++i) {
+        starts[grid->particle_cells[i] + 1]++;
+    }
+    double occupancy = 0.0;
+    for (uint32_t cell = 0; cell < grid->table_size; ++cell) {
+        occupancy += double(starts[cell + 1]) * starts[cell + 1];
+        starts[cell + 1] += starts[cell];
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        grid->particles[starts[grid->particle_cells[i]]++] = i;
+    }
+    // Starts were advanced to the end of each cell, shift them back.
+    for (uint32_t cell = grid->table_size; cell > 0; --cell) {
+        starts[cell] = starts[cell - 1];
+    }
+    starts[0] = 0;
+    return count ? float(occupancy / count) : 0.0f;
+}
+
+void dof::update(BuddyGrid *grid, Particles *particles, float search_distance, ThreadPool *pool) {
+    uint32_t count = particles->count;
+    if (grid->capacity < count) {
+        // Table has at least twice as many slots as particles, so most cells don't collide.
+        uint32_t table_size = 1;
+        while (table_size < count * 2) table_size *= 2;
+        free(grid->cell_starts);
+        free(grid->particle_cells);
+        free(grid->particles);
+        grid->cell_starts = (uint32_t *)malloc(sizeof(uint32_t) * (table_size + 1));
+        grid->particle_cells = (uint32_t *)malloc(sizeof(uint32_t) * count);
+        grid->particles = (uint32_t *)malloc(sizeof(uint32_t) * count);
+        grid->table_size = table_size;
+        grid->capacity = count;
+    }
+
+    // Particles move only a little between frames, so grid starts from the last cell size.
+    // First update estimates it from bounding box of particles.
+    float cell_size = grid->cell_size_hint;
+    if (cell_size <= 0.0f) {
+        float min_x = 1e30f, min_y = 1e30f, min_z = 1e30f, max_x = -1e30f, max_y = -1e30f, max_z = -1e30f;
+        for (uint32_t i = 0; i < count; ++i) {
+            min_x = fminf(min_x, particles->x[i]); max_x = fmaxf(max_x, particles->x[i]);
+            min_y = fminf(min_y, particles->y[i]); max_y = fmaxf(max_y, particles->y[i]);
+            min_z = fminf(min_z, particles->z[i]); max_z = fmaxf(max_z, particles->z[i]);
+        }
+        float volume = (max_x - min_x + 1.0f) * (max_y - min_y + 1.0f) * (max_z - min_z + 1.0f);
+        cell_size = cbrtf(volume / float(count) * BUDDY_CELL_PARTICLES);
+    }
+    float min_cell_size = search_distance / MAX_BUDDY_SHELLS;
+    cell_size = fminf(cell_size, search_distance);
+    cell_size = fmaxf(cell_size, min_cell_size);
+
+    // Particles gather in dense strands, shrink cells until they hold a couple of particles again.
+    float occupancy = build_grid(grid, particles, cell_size, pool);
+    while (occupancy > BUDDY_CELL_PARTICLES * 4 && cell_size * 0.5f >= min_cell_size) {
+        cell_size *= 0.5f;
+        occupancy = build_grid(grid, particles, cell_size, pool);
+    }
+    // Mostly empty cells make search visit too many cells, next update starts with bigger ones.
+    grid->cell_size_hint = occupancy < BUDDY_CELL_PARTICLES / 4 ? cell_size * 2.0f : cell_size;
+}
+
+DofSettings dof::get_settings(uint32_t width, uint32_t height) {
+    DofSettings settings = {};
+    settings.dof_size = 0.1f;
+    settings.dof_distribution = 1.0f;
+    settings.focal_distance = 2.0f;
+    settings.focal_depth = 1.0f;
+    settings.iterations = 1;
+    settings.break_distance = 10.0f;
+    settings.sample_weight = 1.0f / 32.0f;
+    dof::set_camera(&settings, width, height, 0.0f, 3.14159265f / 2.0f, 2.0f);
+    return settings;
+}
+
+void dof::set_camera(DofSettings *settings, uint32_t width, uint32_t height, float azimuth, float polar, float radius) {
+    // Same as math::get_perspective_projection_dx_rh(60 deg, aspect, 0.01, 10).
+    float aspect_ratio = float(width) / float(height);
+    float near_plane = 0.01f, far_plane = 10.0f;
+    float y_scale = 1.0f / tanf(3.14159265f / 6.0f);
+    float x_scale = y_scale / aspect_ratio;
+    float *p = settings->projection;
+    memset(p, 0, sizeof(float) * 16);
+    p[0] = x_scale;
+    p[5] = y_scale;
+    p[10] = far_plane / (near_plane - far_plane);
+    p[11] = near_plane * far_plane / (near_plane - far_plane);
+    p[14] = -1.0f;
+
+    // Same as math::get_look_at(eye, origin, up).
+    float eye[3] = { cosf(azimuth) * sinf(polar) * radius, cosf(polar) * radius, sinf(azimuth) * sinf(polar) * radius };
+    float z_axis[3] = { eye[0], eye[1], eye[2] };
+    float z_length = sqrtf(z_axis[0] * z_axis[0] + z_axis[1] * z_axis[1] + z_axis[2] * z_axis[2]);
+    for (int i = 0; i < 3; ++i) z_axis[i] /= z_length;
+    // x = up x z, with up = (0, 1, 0).
+    float x_axis[3] = { z_axis[2], 0.0f, -z_axis[0] };
+    float x_length = sqrtf(x_axis[0] * x_axis[0] + x_axis[2] * x_axis[2]);
+    for (int i = 0; i < 3; ++i) x_axis[i] /= x_length;
+    float y_axis[3] = {
+        z_axis[1] * x_axis[2] - z_axis[2] * x_axis[1],
+        z_axis[2] * x_axis[0] - z_axis[0] * x_axis[2],
+        z_axis[0] * x_axis[1] - z_axis[1] * x_axis[0],
+    };
+    float *axes[3] = { x_axis, y_axis, z_axis };
+    float *v = settings->view;
+    for (int row = 0; row < 3; ++row) {
+        v[row * 4 + 0] = axes[row][0];
+        v[row * 4 + 1] = axes[row][1];
+        v[row * 4 + 2] = axes[row][2];
+        v[row * 4 + 3] = -(axes[row][0] * eye[0] + axes[row][1] * eye[1] + axes[row][2] * eye[2]);
+    }
+    v[12] = 0.0f;
+    v[13] = 0.0f;
+    v[14] = 0.0f;
+    v[15] = 1.0f;
+}
+
+DofImage dof::get_image(uint32_t width, uint32_t height) {
+    DofImage image = {};
+    image.width = width;
+    image.height = height;
+    image.pixels = (float *)calloc(size_t(width) * height, sizeof(float));
+    return image;
+}
+
+void dof::release(DofImage *image) {
+    free(image->pixels);
+    *image = {};
+}
+
+void dof::render(DofImage *image, DofSettings *settings, DofMode mode, World *world, Particles *particles, BuddyGrid *grid, ThreadPool *pool) {
+    PROFILE_SCOPE("dof_render");
+    DofContext ctx = {};
+    ctx.settings = settings;
+    ctx.image = image;
+    ctx.world = world;
+    ctx.particles = particles;
+    ctx.tiles_x = (image->width + TILE_SIZE - 1) / TILE_SIZE;
+    uint32_t tiles_y = (image->height + TILE_SIZE - 1) / TILE_SIZE;
+    ctx.tile_count = ctx.tiles_x * tiles_y;
+
+    uint32_t thread_count = thread_pool::get_thread_count(pool);
+    ctx.threads = (DofThread *)calloc(thread_count, sizeof(DofThread));
+    for (uint32_t i = 0; i < thread_count; ++i) {
+        DofThread *thread = ctx.threads + i;
+        thread->tiles = (float **)calloc(ctx.tile_count, sizeof(float *));
+        thread->sample_tiles = (uint32_t *)malloc(sizeof(uint32_t) * TASK_SAMPLES);
+        thread->sample_offsets = (uint16_t *)malloc(sizeof(uint16_t) * TASK_SAMPLES);
+        thread->sample_values = (float *)malloc(sizeof(float) * TASK_SAMPLES);
+        thread->sorted_offsets = (uint16_t *)malloc(sizeof(uint16_t) * TASK_SAMPLES);
+        thread->sorted_values = (float *)malloc(sizeof(float) * TASK_SAMPLES);
+        thread->tile_offsets = (uint32_t *)malloc(sizeof(uint32_t) * (ctx.tile_count + 1));
+    }
+
+    uint32_t source_count = 0;
+    if (mode == DofMode::TRAIL) {
+        source_count = world->active_brick_count * TRAIL_CELLS_PER_BRICK * TRAIL_CELL_THREADS;
+    } else {
+        source_count = particles->count;
+    }
+    if (mode == DofMode::PARTICLE_PAIRS) {
+        ctx.endpoints = (uint32_t *)malloc(sizeof(uint32_t) * particles->count);
+        if (settings->break_distance > 0.0f) {
+            PROFILE_SCOPE("dof_buddies");
+            dof::update(grid, particles, settings->break_distance, pool);
+            thread_pool::run(pool, particles->count, 4096, [&](uint32_t begin, uint32_t end, uint32_t) {
+                for (uint32_t idx = begin; idx < end; ++idx) {
+                    ctx.endpoints[idx] = find_endpoint(grid, particles, idx, settings->break_distance);
+                }
+            });
+        } else {
+            memset(ctx.endpoints, 0xFF, sizeof(uint32_t) * particles->count);
+        }
+    }
+
+    // Every task processes a block of sources for a block of iterations, at most TASK_SAMPLES samples.
+    uint32_t iterations = settings->iterations > 0 ? uint32_t(settings->iterations) : 0;
+    uint32_t iteration_block = iterations < TASK_SAMPLES ? iterations : TASK_SAMPLES;
+    uint32_t iteration_block_count = iteration_block ? (iterations + iteration_block - 1) / iteration_block : 0;
+    uint32_t sources_per_task = iteration_block ? TASK_SAMPLES / iteration_block : 1;
+    uint32_t source_block_count = (source_count + sources_per_task - 1) / sources_per_task;
+    uint32_t task_count = source_block_count * iteration_block_count;
+    uint32_t frame = settings->progressive_frame > 0 ? uint32_t(settings->progressive_frame) : 0;
+    uint32_t first_iteration = frame * iterations;
+
+    {
+        PROFILE_SCOPE("dof_splat");
+        thread_pool::run(pool, task_count, 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+            DofThread *thread = ctx.threads + thread_index;
+            for (uint32_t task = begin; task < end; ++task) {
+                uint32_t source_begin = task / iteration_block_count * sources_per_task;
+                uint32_t source_end = source_begin + sources_per_task < source_count ? source_begin + sources_per_task : source_count;
+                uint32_t iteration_begin = task % iteration_block_count * iteration_block;
+                uint32_t iteration_end = iteration_begin + iteration_block < iterations ? iteration_begin + iteration_block : iterations;
+                iteration_begin += first_iteration;
+                iteration_end += first_iteration;
+                for (uint32_t source = source_begin; source < source_end; ++source) {
+                    if (mode == DofMode::TRAIL) {
+                        trail_samples(&ctx, thread, source, iteration_begin, iteration_end);
+                    } else if (mode == DofMode::PARTICLES) {
+                        particle_samples(&ctx, thread, source, iteration_begin, iteration_end);
+                    } else {
+                        particle_pair_samples(&ctx, thread, source, iteration_begin, iteration_end);
+                    }
+                }
+                flush_samples(&ctx, thread);
+            }
+        });
+    }
+
+    {
+        PROFILE_SCOPE("dof_blit");
+        // Sum thread accumulators, equivalent of blit_shader.hlsl.
+        thread_pool::run(pool, ctx.tile_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+            for (uint32_t tile = begin; tile < end; ++tile) {
+                uint32_t x0 = tile % ctx.tiles_x * TILE_SIZE, y0 = tile / ctx.tiles_x * TILE_SIZE;
+                uint32_t x1 = x0 + TILE_SIZE < image->width ? x0 + TILE_SIZE : image->width;
+                uint32_t y1 = y0 + TILE_SIZE < image->height ? y0 + TILE_SIZE : image->height;
+                for (uint32_t y = y0; y < y1; ++y) {
+                    float *row = image->pixels + size_t(y) * image->width;
+                    for (uint32_t x = x0; x < x1; ++x) {
+                        float sum = 0.0f;
+                        for (uint32_t i = 0; i < thread_count; ++i) {
+                            float *accumulator = ctx.threads[i].tiles[tile];
+                            if (accumulator) sum += accumulator[(y - y0) * TILE_SIZE + (x - x0)];
+                        }
+                        float value = sum * settings->sample_weight;
+                        row[x] = frame > 0 ? (row[x] * float(frame) + value) / float(frame + 1) : value;
+                    }
+                }
+            }
+        });
+    }
+
+    for (uint32_t i = 0; i < thread_count; ++i) {
+        DofThread *thread = ctx.threads + i;
+        for (uint32_t tile = 0; tile < ctx.tile_count; ++tile) {
+            free(thread->tiles[tile]);
+        }
+        free(thread->tiles);
+        free(thread->sample_tiles);
+        free(thread->sample_offsets);
+        free(thread->sample_values);
+        free(thread->sorted_offsets);
+        free(thread->sorted_values);
+        free(thread->tile_offsets);
+    }
+    free(ctx.threads);
+    free(ctx.endpoints);
+}
+
+bool dof::write_pgm(DofImage *image, const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file) return false;
+    fprintf(file, "P5\n%u %u\n65535\n", image->width, image->height);
+    uint8_t *row = (uint8_t *)malloc(size_t(image->width) * 2);
+    // PGM starts with the top row.
+    for (uint32_t y = image->height; y-- > 0;) {
+        const float *pixels = image->pixels + size_t(y) * image->width;
+        for (uint32_t x = 0; x < image->width; ++x) {
+            float v = pixels[x] * DISPLAY_SCALE;
+            v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+            uint32_t value = uint32_t(v * 65535.0f + 0.5f);
+            row[x * 2] = uint8_t(value >> 8);
+            row[x * 2 + 1] = uint8_t(value & 0xFF);
+        }
+        fwrite(row, 2, image->width, file);
+    }
+    free(row);
+    return fclose(file) == 0;
+}
+
+bool dof::write_pfm(DofImage *image, const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file) return false;
+    // Negative scale means little endian, PFM starts with the bottom row same as DofImage.
+    fprintf(file, "Pf\n%u %u\n-1.0\n", image->width, image->height);
+    fwrite(image->pixels, sizeof(float), size_t(image->width) * image->height, file);
+    return fclose(file) == 0;
+}
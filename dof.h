@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+#include "sim.h"
+
+struct ThreadPool;
+
+// DoF settings for CPU rendering, fields have the same meaning as in RenderingSettings in main.cpp
+// (dof_size, dof_distribution, focal_distance and focal_depth are m, e, f and g in dof shaders).
+// Matrices are row-major and transform column vectors, same as mul(matrix, v) in shaders.
+struct DofSettings {
+    float projection[16];
+    float view[16];
+
+    float dof_size;
+    float dof_distribution;
+    float focal_distance;
+    float focal_depth;
+    int iterations;
+    float break_distance;
+    float sample_weight;
+    // Number of frames already averaged in the image, 0 overwrites it. Frame k continues the random
+    // sequence of the frames before it (its iteration i is iteration k * iterations + i), so a still
+    // scene converges the same as if it were rendered with more iterations at once.
+    int progressive_frame;
+};
+
+enum class DofMode {
+    TRAIL,
+    PARTICLES,
+    PARTICLE_PAIRS,
+};
+
+// Single channel float image. Row 0 is the bottom row, same as display_tex.
+struct DofImage {
+    uint32_t width;
+    uint32_t height;
+    float *pixels;
+};
+
+// Uniform grid over particle positions used to find buddies in particle pairs mode. Particles are grouped
+// by hashed cell and nearest particle is searched in growing shells of cells around the particle.
+// Kept between renders so buffers are reused.
+struct BuddyGrid {
+    float cell_size;
+    float cell_size_hint;
+    uint32_t table_size;
+    uint32_t capacity;
+    uint32_t *cell_starts;
+    uint32_t *particle_cells;
+    uint32_t *particles;
+};
+
+namespace dof {
+    // Defaults same as in main.cpp, camera looking at the world from the default orbit position.
+    DofSettings get_settings(uint32_t width, uint32_t height);
+    // Places camera on orbit around the world center, same as camera controls in main.cpp.
+    void set_camera(DofSettings *settings, uint32_t width, uint32_t height, float azimuth, float polar, float radius);
+
+    DofImage get_image(uint32_t width, uint32_t height);
+    void release(DofImage *image);
+
+    BuddyGrid get_buddy_grid();
+    void release(BuddyGrid *grid);
+    // Rebuilds grid from current particle positions. Cell size adapts to particle density from frame to frame,
+    // so cells hold a couple of particles, but it's never smaller than search_distance / 16 to bound number of shells.
+    void update(BuddyGrid *grid, Particles *particles, float search_distance, ThreadPool *pool);
+
+    // CPU equivalent of dof_shader_trail.hlsl, dof_shader_particle.hlsl and dof_shader_particle_pair.hlsl
+    // followed by blit_shader.hlsl. Samples are binned into screen tiles and accumulated in per-thread tiles,
+    // which are summed at the end, so there are no atomics. Trail mode only visits active bricks.
+    // Particle pairs mode updates particle pairs same as the shader, except that new buddy is the nearest
+    // particle found through `grid`. Grid is only used in particle pairs mode. With progressive_frame > 0 the
+    // frame is averaged into image instead of replacing it.
+    void render(DofImage *image, DofSettings *settings, DofMode mode, World *world, Particles *particles, BuddyGrid *grid, ThreadPool *pool);
+
+    // 16-bit grayscale PGM, scaled the same way as pixel_shader.hlsl displays the image.
+    bool write_pgm(DofImage *image, const char *path);
+    // Unscaled float PFM.
+    bool write_pfm(DofImage *image, const char *path);
+}
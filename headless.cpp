@@ -0,0 +1,1028 @@
+// Headless CPU simulation runner. Runs the same simulation as physarum.exe without GPU or window
+// and reports simulation throughput.
+#include "sim.h"
+#include "sim_slabs.h"
+#include "sim_trail.h"
+#include "sim2d.h"
+#include "checkpoint.h"
+#include "control.h"
+#include "dof.h"
+#include "pipeline.h"
+#include "profiler.h"
+#include "raymarch.h"
+#include "recorder.h"
+#include "sweep.h"
+#include "thread_pool.h"
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#define RAMP_MAX_SIZES 16
+
+struct Arguments {
+    uint32_t world_size;
+    uint32_t particle_count;
+    uint32_t steps;
+    uint32_t threads;
+    bool scaling;
+    bool mode_2d;
+    float spawn_radius;
+    SimKernel kernel;
+    SimHeading heading;
+    SimTrailFormat trail_format;
+    bool trail_drift;
+    SimDecayBuffer decay_buffer;
+    int sample_points;
+    uint32_t paused_decay_steps;
+    uint32_t sort_interval;
+    uint32_t slab_count;
+    uint32_t slab_rank;
+    const char *slab_name;
+    float brick_threshold;
+    const char *load_path;
+    const char *replay_path;
+    const char *save_path;
+
+    ParticlePool particle_pool;
+    uint32_t ramp_sizes[RAMP_MAX_SIZES];
+    uint32_t ramp_size_count;
+
+    bool render;
+    DofMode dof_mode;
+    bool raymarch;
+    bool show_grid;
+    int iterations;
+    int progressive_frames;
+    uint32_t image_width;
+    uint32_t image_height;
+    const char *output_path;
+
+    const char *record_dir;
+    uint32_t record_interval;
+    bool record_drop;
+    bool pipeline;
+    uint32_t render_threads;
+
+    const char *profile_path;
+
+    SweepRange sweep_ranges[SWEEP_MAX_RANGES];
+    uint32_t sweep_range_count;
+    uint32_t sweep_random_samples;
+    uint32_t thumbnail_size;
+    const char *sweep_dir;
+};
+
+static void print_usage() {
+    printf("Usage: physarum_headless [options]\n");
+    printf("  --size N         world size (N x N x N), default 480\n");
+    printf("  --particles N    particle count, default 100000\n");
+    printf("  --steps N        number of simulation steps, default 100\n");
+    printf("  --threads N      thread count, 0 = all cores, default 0\n");
+    printf("  --spawn-radius R particle spawn radius, default 50\n");
+    printf("  --kernel K       step kernel: auto, scalar, avx2, avx512, default auto\n");
+    printf("  --heading H      particle heading state: angles, direction, default angles\n");
+    printf("  --trail F        trail storage format: fp32, fp16, u8, default fp32\n");
+    printf("  --trail-drift    rerun the simulation with fp32 trail and report how far --trail format drifts from it\n");
+    printf("  --in-place-decay decay trail in place instead of into a second trail buffer, halves trail memory\n");
+    printf("  --samples N      directions sensed around heading: 4, 8, 16, 26, default 8\n");
+    printf("  --scaling        measure throughput for 1 to N threads\n");
+    printf("  --2d             run 2D simulation on N x N world instead, --render writes its trail image\n");
+    printf("  --paused-decay N run N decay steps with particles paused after the simulation\n");
+    printf("  --sort K         sort particles by Morton code every K steps, 0 = never, default 0\n");
+    printf("  --slabs N        split world into N z-slabs spread over NUMA nodes, threads are divided between them\n");
+    printf("  --slab-process R NAME simulate slab R of --slabs N in this process, other slabs run in processes started\n");
+    printf("                   with the same arguments and their own R, sharing memory NAME. --threads are per process,\n");
+    printf("                   rank 0 gets the final state\n");
+    printf("  --brick-threshold T trail value below which bricks are retired, 0 = never, default 1e-4\n");
+    printf("  --load PATH      start from checkpoint instead of spawning particles, world size and Config come from it\n");
+    printf("  --save PATH      write checkpoint after the simulation\n");
+    printf("  --replay PATH    replay control log recorded by physarum.exe (F11) instead of running --steps steps,\n");
+    printf("                   world size, Config, particle count and spawn radius come from it\n");
+    printf("  --emit X Y Z R RATE spawn RATE particles per step in sphere of radius R at X Y Z, can be repeated\n");
+    printf("  --lifetime N     cull particles N steps after they were spawned, 0 = never, default 0\n");
+    printf("  --cull-density D cull particles in trail above D with probability 1 - D / trail, 0 = never, default 0\n");
+    printf("  --max-particles N stop emitting at N particles, 0 = no limit, default 0\n");
+    printf("  --ramp A,B,..    resize particle pool to each count in turn and measure throughput of --steps steps at each\n");
+    printf("  --render M       render DoF still after the simulation: trail, particles, pairs, or volume for raymarched\n");
+    printf("                   slice view preview\n");
+    printf("  --grid           show grid in volume render\n");
+    printf("  --iterations N   DoF samples per source, default 32\n");
+    printf("  --progressive N  average N DoF frames of --iterations samples into the still, default 1\n");
+    printf("  --image W H      image size, default 1400 800\n");
+    printf("  --output PATH    image path, .pfm for float image, 16-bit .pgm otherwise, default dof.pgm\n");
+    printf("  --record DIR     record DoF frames (same mode, size and iterations as --render) as PNGs into DIR\n");
+    printf("  --record-interval N record every N-th step, default 1\n");
+    printf("  --record-drop    drop frames when encoders fall behind instead of waiting\n");
+    printf("  --pipeline       record on a render thread which takes the latest published state, so the simulation\n");
+    printf("                   doesn't wait for rendering and encoding\n");
+    printf("  --render-threads N threads rendering recorded frames with --pipeline, default 1\n");
+    printf("  --profile PATH   print per-stage times and write Chrome trace of the last steps to PATH\n");
+    printf("  --sweep F A B N  sweep Config field F over N values from A to B, can be repeated\n");
+    printf("  --sweep-random N run N random configurations from sweep ranges instead of the full grid\n");
+    printf("  --sweep-dir DIR  directory for sweep thumbnails and sweep.csv, default .\n");
+    printf("  --thumbnail N    sweep thumbnail size, 0 = none, default 128\n");
+}
+
+static bool parse_arguments(int argc, char **argv, Arguments *args) {
+    for (int i = 1; i < argc; ++i) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--size") == 0 && has_value) {
+            args->world_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--particles") == 0 && has_value) {
+            args->particle_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--steps") == 0 && has_value) {
+            args->steps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && has_value) {
+            args->threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--spawn-radius") == 0 && has_value) {
+            args->spawn_radius = float(atof(argv[++i]));
+        } else if (strcmp(argv[i], "--kernel") == 0 && has_value) {
+            const char *name = argv[++i];
+            SimKernel kernels[] = { SimKernel::AUTO, SimKernel::SCALAR, SimKernel::AVX2, SimKernel::AVX512 };
+            bool found = false;
+            for (int k = 0; k < 4; ++k) {
+                if (strcmp(name, sim::get_kernel_name(kernels[k])) == 0) {
+                    args->kernel = kernels[k];
+                    found = true;
+                }
+            }
+            if (!found) return false;
+        } else if (strcmp(argv[i], "--heading") == 0 && has_value) {
+            const char *name = argv[++i];
+            if (strcmp(name, "angles") == 0) {
+                args->heading = SimHeading::ANGLES;
+            } else if (strcmp(name, "direction") == 0) {
+                args->heading = SimHeading::DIRECTION;
+            } else {
+                return false;
+            }
+        } else if (strcmp(argv[i], "--trail") == 0 && has_value) {
+            const char *name = argv[++i];
+            SimTrailFormat formats[] = { SimTrailFormat::FLOAT32, SimTrailFormat::FLOAT16, SimTrailFormat::UNORM8 };
+            bool found = false;
+            for (int f = 0; f < 3; ++f) {
+                if (strcmp(name, sim::get_trail_format_name(formats[f])) == 0) {
+                    args->trail_format = formats[f];
+                    found = true;
+                }
+            }
+            if (!found) return false;
+        } else if (strcmp(argv[i], "--trail-drift") == 0) {
+            args->trail_drift = true;
+        } else if (strcmp(argv[i], "--in-place-decay") == 0) {
+            args->decay_buffer = SimDecayBuffer::IN_PLACE;
+        } else if (strcmp(argv[i], "--samples") == 0 && has_value) {
+            args->sample_points = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--paused-decay") == 0 && has_value) {
+            args->paused_decay_steps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sort") == 0 && has_value) {
+            args->sort_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--slabs") == 0 && has_value) {
+            args->slab_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--slab-process") == 0 && i + 2 < argc) {
+            args->slab_rank = atoi(argv[++i]);
+            args->slab_name = argv[++i];
+        } else if (strcmp(argv[i], "--brick-threshold") == 0 && has_value) {
+            args->brick_threshold = float(atof(argv[++i]));
+        } else if (strcmp(argv[i], "--load") == 0 && has_value) {
+            args->load_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && has_value) {
+            args->replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--save") == 0 && has_value) {
+            args->save_path = argv[++i];
+        } else if (strcmp(argv[i], "--emit") == 0 && i + 5 < argc) {
+            if (args->particle_pool.emitter_count == SIM_MAX_EMITTERS) return false;
+            ParticleEmitter *emitter = &args->particle_pool.emitters[args->particle_pool.emitter_count++];
+            emitter->x = float(atof(argv[++i]));
+            emitter->y = float(atof(argv[++i]));
+            emitter->z = float(atof(argv[++i]));
+            emitter->radius = float(atof(argv[++i]));
+            emitter->rate = float(atof(argv[++i]));
+        } else if (strcmp(argv[i], "--lifetime") == 0 && has_value) {
+            args->particle_pool.lifetime = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cull-density") == 0 && has_value) {
+            args->particle_pool.density_limit = float(atof(argv[++i]));
+        } else if (strcmp(argv[i], "--max-particles") == 0 && has_value) {
+            args->particle_pool.max_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ramp") == 0 && has_value) {
+            char *list = argv[++i];
+            while (*list) {
+                if (args->ramp_size_count == RAMP_MAX_SIZES) return false;
+                char *end;
+                uint32_t size = uint32_t(strtoul(list, &end, 10));
+                if (end == list || size == 0) return false;
+                args->ramp_sizes[args->ramp_size_count++] = size;
+                list = *end == ',' ? end + 1 : end;
+            }
+        } else if (strcmp(argv[i], "--render") == 0 && has_value) {
+            const char *name = argv[++i];
+            args->render = true;
+            if (strcmp(name, "trail") == 0) {
+                args->dof_mode = DofMode::TRAIL;
+            } else if (strcmp(name, "particles") == 0) {
+                args->dof_mode = DofMode::PARTICLES;
+            } else if (strcmp(name, "pairs") == 0) {
+                args->dof_mode = DofMode::PARTICLE_PAIRS;
+            } else if (strcmp(name, "volume") == 0) {
+                args->raymarch = true;
+            } else {
+                return false;
+            }
+        } else if (strcmp(argv[i], "--grid") == 0) {
+            args->show_grid = true;
+        } else if (strcmp(argv[i], "--iterations") == 0 && has_value) {
+            args->iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--progressive") == 0 && has_value) {
+            args->progressive_frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--image") == 0 && i + 2 < argc) {
+            args->image_width = atoi(argv[++i]);
+            args->image_height = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--output") == 0 && has_value) {
+            args->output_path = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && has_value) {
+            args->record_dir = argv[++i];
+        } else if (strcmp(argv[i], "--record-interval") == 0 && has_value) {
+            args->record_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--record-drop") == 0) {
+            args->record_drop = true;
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            args->pipeline = true;
+        } else if (strcmp(argv[i], "--render-threads") == 0 && has_value) {
+            args->render_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--profile") == 0 && has_value) {
+            args->profile_path = argv[++i];
+        } else if (strcmp(argv[i], "--sweep") == 0 && i + 4 < argc) {
+            if (args->sweep_range_count == SWEEP_MAX_RANGES) return false;
+            SweepRange *range = &args->sweep_ranges[args->sweep_range_count++];
+            range->field = sweep::find_field(argv[++i]);
+            range->min = float(atof(argv[++i]));
+            range->max = float(atof(argv[++i]));
+            range->count = atoi(argv[++i]);
+            if (range->field < 0 || range->count == 0) return false;
+        } else if (strcmp(argv[i], "--sweep-random") == 0 && has_value) {
+            args->sweep_random_samples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sweep-dir") == 0 && has_value) {
+            args->sweep_dir = argv[++i];
+        } else if (strcmp(argv[i], "--thumbnail") == 0 && has_value) {
+            args->thumbnail_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--scaling") == 0) {
+            args->scaling = true;
+        } else if (strcmp(argv[i], "--2d") == 0) {
+            args->mode_2d = true;
+        } else {
+            return false;
+        }
+    }
+    if (args->slab_name && (args->slab_rank >= args->slab_count || args->scaling || args->ramp_size_count > 0 || args->replay_path)) {
+        return false;
+    }
+    return args->world_size > 0 && args->particle_count > 0 && args->image_width > 0 && args->image_height > 0 &&
+           args->record_interval > 0 && args->render_threads > 0;
+}
+
+static double get_time() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// State for recording DoF frames during the simulation.
+struct Recording {
+    Recorder *recorder;
+    DofSettings settings;
+    DofImage image;
+    BuddyGrid grid;
+    uint32_t frames;
+    double duration;
+};
+
+// Runs the simulation loop of run_simulation on world split into slabs, starting from the state of world and
+// particles, and copies the final state back into them. Threads of pool are divided between slabs.
+static double run_slabs(Arguments *args, Config *config, World *world, Particles *particles, Recording *recording, ThreadPool *pool) {
+    uint32_t thread_count = thread_pool::get_thread_count(pool);
+    uint32_t threads_per_slab = thread_count > args->slab_count ? thread_count / args->slab_count : 1;
+    SlabWorld slab_world = slabs::get_world(world->width, world->height, world->depth, world->trail_format, world->decay_buffer,
+                                            args->slab_count, threads_per_slab, config);
+    if (slab_world.slab_count == 0) {
+        printf("Failed to allocate slabs\n");
+        return 0.0;
+    }
+    for (uint32_t s = 0; s < slab_world.slab_count; ++s) {
+        slab_world.slabs[s].world.brick_threshold = world->brick_threshold;
+    }
+    slabs::set_particles(&slab_world, particles);
+
+    double start = get_time();
+    for (uint32_t i = 0; i < args->steps; ++i) {
+        if (args->sort_interval > 0 && i % args->sort_interval == 0) {
+            slabs::sort_particles(&slab_world);
+        }
+        slabs::step(&slab_world, config);
+        if (recording && i % args->record_interval == 0) {
+            double record_start = get_time();
+            slabs::get_trail(&slab_world, world);
+            slabs::get_particles(&slab_world, particles);
+            dof::render(&recording->image, &recording->settings, args->dof_mode, world, particles, &recording->grid, pool);
+            recorder::push(recording->recorder, recording->image.pixels, recording->image.width);
+            recording->frames++;
+            recording->duration += get_time() - record_start;
+        }
+        if (profiler::is_enabled()) profiler::end_frame();
+    }
+    double duration = get_time() - start - (recording ? recording->duration : 0.0);
+
+    printf("slabs: %u, halo: %u, threads per slab: %u, NUMA nodes: %u\n", slab_world.slab_count, slab_world.halo, threads_per_slab,
+           thread_pool::get_node_count());
+    slabs::get_trail(&slab_world, world);
+    slabs::get_particles(&slab_world, particles);
+    slabs::release(&slab_world);
+    return double(particles->count) * args->steps / duration;
+}
+
+// Runs the simulation loop of run_slabs as the process simulating slab args->slab_rank, processes of all slabs
+// step together. Recorded frames and the final state are gathered into world and particles of rank 0, other
+// ranks leave them as they were and have no recording. particles_per_second is set to particles per second of
+// all slabs on rank 0 and of its own slab on other ranks, where time spent waiting for rank 0 to render recorded
+// frames counts. Returns false if the process couldn't join or stopped before the last step, world and particles
+// don't hold a complete state then.
+static bool run_slab_process(Arguments *args, Config *config, World *world, Particles *particles, Recording *recording, ThreadPool *pool,
+                             double *particles_per_second) {
+    *particles_per_second = 0.0;
+    SlabProcess process;
+    if (!slabs::open_process(&process, args->slab_name, args->slab_rank, args->slab_count, world->width, world->height, world->depth,
+                             world->trail_format, world->decay_buffer, args->threads, particles->count, config)) {
+        printf("Failed to join %s as slab %u of %u\n", args->slab_name, args->slab_rank, args->slab_count);
+        return false;
+    }
+    Slab *slab = &process.world.slabs[args->slab_rank];
+    slab->world.brick_threshold = world->brick_threshold;
+    slabs::set_particles(&process, particles);
+
+    bool running = true;
+    double start = get_time();
+    for (uint32_t i = 0; i < args->steps && running; ++i) {
+        if (args->sort_interval > 0 && i % args->sort_interval == 0) {
+            slabs::sort_particles(&process);
+        }
+        running = slabs::step(&process, config);
+        if (running && args->record_dir && i % args->record_interval == 0) {
+            double record_start = get_time();
+            running = slabs::gather(&process, world, particles);
+            if (running && recording) {
+                dof::render(&recording->image, &recording->settings, args->dof_mode, world, particles, &recording->grid, pool);
+                recorder::push(recording->recorder, recording->image.pixels, recording->image.width);
+                recording->frames++;
+            }
+            if (recording) recording->duration += get_time() - record_start;
+        }
+        if (profiler::is_enabled()) profiler::end_frame();
+    }
+    double duration = get_time() - start - (recording ? recording->duration : 0.0);
+    uint32_t particle_count = slabs::get_particle_count(&process);
+    if (running) running = slabs::gather(&process, world, particles);
+    if (!running) {
+        printf("Slab %u stopped, another slab process failed or left\n", args->slab_rank);
+    }
+    if (args->slab_rank == 0) particle_count = particles->count;
+
+    printf("slab process: %u of %u, slices: %u-%u, halo: %u, threads: %u, node: %u\n", args->slab_rank, process.world.slab_count,
+           slab->z_begin, slab->z_end, process.world.halo, thread_pool::get_thread_count(slab->pool), slab->node);
+    slabs::release(&process);
+    if (running) *particles_per_second = double(particle_count) * args->steps / duration;
+    return running;
+}
+
+static bool has_particle_pool(Arguments *args) {
+    ParticlePool *particle_pool = &args->particle_pool;
+    return particle_pool->emitter_count > 0 || particle_pool->lifetime > 0 || particle_pool->density_limit > 0.0f;
+}
+
+// Runs the simulation loop of run_simulation with recording on a render thread. Every record_interval-th step
+// is published to the pipeline, render thread renders and pushes the latest state whenever it's done with the
+// previous one, with its own pool of render_threads threads. Steps which finish while a frame is rendered
+// replace the published state, so slow rendering drops frames instead of slowing the simulation. Prints
+// steps and rendered frames per second, returns simulated particles per second including publishing.
+static double run_pipeline(Arguments *args, Config *config, World *world, Particles *particles, Recording *recording, ThreadPool *pool) {
+    ParticlePool particle_pool = args->particle_pool;
+    particle_pool.seed = 1;
+    bool update_pool = has_particle_pool(args);
+    Pipeline *states = pipeline::get(world);
+    ThreadPool *render_pool = thread_pool::get(args->render_threads);
+
+    double start = get_time();
+    std::thread render_thread([&]() {
+        while (PipelineState *state = pipeline::acquire(states)) {
+            double render_start = get_time();
+            dof::render(&recording->image, &recording->settings, args->dof_mode, &state->world, &state->particles, &recording->grid, render_pool);
+            recorder::push(recording->recorder, recording->image.pixels, recording->image.width);
+            recording->frames++;
+            recording->duration += get_time() - render_start;
+        }
+    });
+
+    double particle_steps = 0.0;
+    for (uint32_t i = 0; i < args->steps; ++i) {
+        if (update_pool) {
+            sim::update_pool(particles, world, &particle_pool, i, pool);
+        }
+        if (args->sort_interval > 0 && i % args->sort_interval == 0) {
+            sim::sort_particles(world, particles, pool);
+        }
+        sim::step(world, particles, config, pool);
+        sim::decay(world, config, pool);
+        particle_steps += particles->count;
+        if (i % args->record_interval == 0) {
+            pipeline::publish(states, world, particles, i, pool);
+        }
+        if (profiler::is_enabled()) profiler::end_frame();
+    }
+    double duration = get_time() - start;
+    pipeline::close(states);
+    render_thread.join();
+    double render_duration = get_time() - start;
+
+    PipelineStats stats = pipeline::get_stats(states);
+    printf("pipeline: steps/s: %.1f, frames/s: %.1f, published: %llu, rendered: %llu, publish: %.3f s\n",
+           args->steps / duration, recording->frames / render_duration, (unsigned long long)stats.published,
+           (unsigned long long)stats.acquired, stats.publish_duration);
+    thread_pool::release(render_pool);
+    pipeline::release(states);
+    return particle_steps / duration;
+}
+
+// Loads the checkpoint or spawns particles into a cleared world.
+static void start_simulation(Arguments *args, Config *config, World *world, Particles *particles, ThreadPool *pool) {
+    if (args->load_path) {
+        // Checkpoint was already validated when main loaded it.
+        checkpoint::load(args->load_path, world, particles, config, NULL, 0, pool);
+    } else {
+        // Previous run could have grown or shrunk the pool.
+        sim::reserve_particles(particles, args->particle_count);
+        particles->count = args->particle_count;
+        sim::clear(world, pool);
+        sim::spawn_particles(particles, world, args->spawn_radius, 1);
+    }
+}
+
+// Runs the simulation from a fresh state and returns simulated particles per second. Time spent
+// rendering and pushing recorded frames isn't counted. recording can be NULL. Particle pool isn't
+// updated in slabs.
+static double run_simulation(Arguments *args, Config *config, World *world, Particles *particles, Recording *recording, ThreadPool *pool) {
+    start_simulation(args, config, world, particles, pool);
+    if (args->slab_count > 0) {
+        return run_slabs(args, config, world, particles, recording, pool);
+    }
+    if (recording && args->pipeline) {
+        return run_pipeline(args, config, world, particles, recording, pool);
+    }
+
+    // Emitters carry fractions of particles between steps, every run starts from the same state.
+    ParticlePool particle_pool = args->particle_pool;
+    particle_pool.seed = 1;
+    bool update_pool = has_particle_pool(args);
+    double particle_steps = 0.0;
+    double start = get_time();
+    for (uint32_t i = 0; i < args->steps; ++i) {
+        if (update_pool) {
+            sim::update_pool(particles, world, &particle_pool, i, pool);
+        }
+        if (args->sort_interval > 0 && i % args->sort_interval == 0) {
+            sim::sort_particles(world, particles, pool);
+        }
+        sim::step(world, particles, config, pool);
+        sim::decay(world, config, pool);
+        particle_steps += particles->count;
+        if (recording && i % args->record_interval == 0) {
+            double record_start = get_time();
+            dof::render(&recording->image, &recording->settings, args->dof_mode, world, particles, &recording->grid, pool);
+            recorder::push(recording->recorder, recording->image.pixels, recording->image.width);
+            recording->frames++;
+            recording->duration += get_time() - record_start;
+        }
+        if (profiler::is_enabled()) profiler::end_frame();
+    }
+    double duration = get_time() - start - (recording ? recording->duration : 0.0);
+    return particle_steps / duration;
+}
+
+// Replays control log the way physarum.exe applies live control events: logged events of every frame are
+// pushed into a queue, drained at the frame boundary into the back Config, which is then published. Frames
+// which aren't paused run a step. Starts from an empty world, particles are spawned by the logged particle
+// count. Returns simulated particles per second and sets args->steps to the number of steps, time spent
+// rendering and pushing recorded frames isn't counted.
+static double run_replay(Arguments *args, ControlReplay *replay, Config *config, World *world, Particles *particles, Recording *recording, ThreadPool *pool) {
+    ControlQueue *queue = control::get_queue();
+    ControlConfig controls;
+    control::init(&controls, config);
+    float spawn_radius = args->spawn_radius;
+    bool paused = false;
+    sim::clear(world, pool);
+    particles->count = 0;
+
+    uint32_t steps = 0;
+    double particle_steps = 0.0;
+    double start = get_time();
+    uint32_t frame_count = control::get_frame_count(replay);
+    for (uint32_t frame = 0; frame < frame_count; ++frame) {
+        control::replay_frame(replay, frame, queue);
+        ControlEvent event;
+        while (control::pop(queue, &event)) {
+            if (control::apply(&controls, &event)) continue;
+            if (event.field == ControlField::PARTICLE_COUNT) {
+                sim::resize_particles(particles, world, uint32_t(event.value), spawn_radius, steps, frame + 1);
+            } else if (event.field == ControlField::SPAWN_RADIUS) {
+                spawn_radius = event.value;
+            } else if (event.field == ControlField::PAUSED) {
+                paused = event.value != 0.0f;
+            } else if (event.field == ControlField::RESET) {
+                sim::clear(world, pool);
+                sim::spawn_particles(particles, world, spawn_radius, frame + 1);
+            }
+        }
+        control::publish(&controls);
+        if (paused) continue;
+
+        Config *front = control::get_front(&controls);
+        if (args->sort_interval > 0 && steps % args->sort_interval == 0) {
+            sim::sort_particles(world, particles, pool);
+        }
+        sim::step(world, particles, front, pool);
+        sim::decay(world, front, pool);
+        particle_steps += particles->count;
+        if (recording && steps % args->record_interval == 0) {
+            double record_start = get_time();
+            dof::render(&recording->image, &recording->settings, args->dof_mode, world, particles, &recording->grid, pool);
+            recorder::push(recording->recorder, recording->image.pixels, recording->image.width);
+            recording->frames++;
+            recording->duration += get_time() - record_start;
+        }
+        steps++;
+        if (profiler::is_enabled()) profiler::end_frame();
+    }
+    double duration = get_time() - start - (recording ? recording->duration : 0.0);
+    *config = *control::get_front(&controls);
+    args->steps = steps;
+    control::release(queue);
+    return steps > 0 ? particle_steps / duration : 0.0;
+}
+
+// Resizes particle pool of a running simulation to every ramp size in turn and prints throughput at each.
+// Trail and particles carry over from one size to the next, the way a live run changes particle count.
+static void run_ramp(Arguments *args, Config *config, World *world, Particles *particles, ThreadPool *pool) {
+    sim::reserve_particles(particles, args->particle_count);
+    particles->count = args->particle_count;
+    sim::clear(world, pool);
+    sim::spawn_particles(particles, world, args->spawn_radius, 1);
+    printf("particles, particles/s\n");
+    uint32_t step = 0;
+    for (uint32_t r = 0; r < args->ramp_size_count; ++r) {
+        sim::resize_particles(particles, world, args->ramp_sizes[r], args->spawn_radius, step, r + 2);
+        double start = get_time();
+        for (uint32_t i = 0; i < args->steps; ++i, ++step) {
+            if (args->sort_interval > 0 && step % args->sort_interval == 0) {
+                sim::sort_particles(world, particles, pool);
+            }
+            sim::step(world, particles, config, pool);
+            sim::decay(world, config, pool);
+        }
+        double duration = get_time() - start;
+        printf("%u, %.0f\n", particles->count, double(particles->count) * args->steps / duration);
+    }
+}
+
+static void print_profile() {
+    ProfileStats stats[64];
+    uint32_t stage_count = profiler::get_stats(stats, 64);
+    printf("stage, p50 ms, p99 ms\n");
+    for (uint32_t i = 0; i < stage_count; ++i) {
+        printf("%s, %.3f, %.3f\n", stats[i].name, stats[i].p50, stats[i].p99);
+    }
+}
+
+static bool write_image(DofImage *image, const char *path) {
+    size_t length = strlen(path);
+    bool pfm = length >= 4 && strcmp(path + length - 4, ".pfm") == 0;
+    return pfm ? dof::write_pfm(image, path) : dof::write_pgm(image, path);
+}
+
+static double get_psnr(double squared_error, double count, double peak) {
+    return squared_error > 0.0 ? 10.0 * log10(peak * peak * count / squared_error) : INFINITY;
+}
+
+// Prints difference of trail `buffer` stored in world->trail_format to the FLOAT32 trail of `reference`.
+static void print_trail_difference(const char *label, World *world, const TrailBuffer *buffer, World *reference) {
+    float *row = (float *)malloc(sizeof(float) * world->width);
+    float *reference_row = (float *)malloc(sizeof(float) * world->width);
+    double error_sum = 0.0, reference_sum = 0.0, squared_error = 0.0, max_error = 0.0, max_value = 0.0;
+    double sum_a = 0.0, sum_b = 0.0, sum_aa = 0.0, sum_bb = 0.0, sum_ab = 0.0;
+    for (uint32_t z = 0; z < world->depth; ++z) {
+        for (uint32_t y = 0; y < world->height; ++y) {
+            trail::load_row(world, buffer, 0, y, z, world->width, row);
+            trail::load_row(reference, &reference->trail, 0, y, z, world->width, reference_row);
+            for (uint32_t x = 0; x < world->width; ++x) {
+                double a = row[x], b = reference_row[x];
+                double error = fabs(a - b);
+                error_sum += error;
+                reference_sum += fabs(b);
+                squared_error += error * error;
+                max_error = error > max_error ? error : max_error;
+                max_value = b > max_value ? b : max_value;
+                sum_a += a;
+                sum_b += b;
+                sum_aa += a * a;
+                sum_bb += b * b;
+                sum_ab += a * b;
+            }
+        }
+    }
+    free(reference_row);
+    free(row);
+
+    double count = double(sim::get_voxel_count(world));
+    double covariance = sum_ab - sum_a * sum_b / count;
+    double variance = (sum_aa - sum_a * sum_a / count) * (sum_bb - sum_b * sum_b / count);
+    printf("%s vs fp32: relative L1 %.3e, max error %.3e (%.3e of fp32 max), PSNR %.2f dB, correlation %.6f\n", label,
+           reference_sum > 0.0 ? error_sum / reference_sum : 0.0, max_error, max_value > 0.0 ? max_error / max_value : 0.0,
+           get_psnr(squared_error, count, max_value), variance > 0.0 ? covariance / sqrt(variance) : 1.0);
+}
+
+// Reruns the simulation from the same start with FLOAT32 trail and compares its trail to the one of `world`,
+// and DoF images of both when rendering. Drift includes particles taking different paths after sensing rounded
+// trail, which grows with the number of steps, rounding is the error of storing the fp32 result alone.
+static void print_trail_drift(Arguments *args, Config *config, World *world, Particles *particles, ThreadPool *pool) {
+    World reference = sim::get_world(world->width, world->height, world->depth, SimTrailFormat::FLOAT32, world->decay_buffer);
+    Particles reference_particles = sim::get_particles(particles->count);
+    if (!reference.trail.voxels || !reference.occupancy || !reference_particles.x) {
+        printf("Failed to allocate fp32 reference world\n");
+        sim::release(&reference_particles);
+        sim::release(&reference);
+        return;
+    }
+    sim::set_heading(&reference_particles, particles->heading);
+    reference.brick_threshold = world->brick_threshold;
+    Config reference_config = *config;
+    run_simulation(args, &reference_config, &reference, &reference_particles, NULL, pool);
+
+    // Reference trail stored in the tested format, difference to it is the rounding error alone.
+    TrailBuffer rounded = {};
+    float *brick = (float *)malloc(sizeof(float) * SIM_BRICK_SIZE * SIM_BRICK_SIZE * SIM_BRICK_SIZE);
+    if (trail::allocate(world, &rounded) && brick) {
+        for (uint32_t b = 0; b < sim::get_brick_count(world); ++b) {
+            trail::load_brick(&reference, &reference.trail, b, brick);
+            trail::store_brick(world, &rounded, b, brick);
+        }
+        print_trail_difference("trail rounding", world, &rounded, &reference);
+    }
+    free(brick);
+    trail::release(&rounded);
+    print_trail_difference("trail drift", world, &world->trail, &reference);
+
+    if (args->render) {
+        DofSettings settings = dof::get_settings(args->image_width, args->image_height);
+        settings.iterations = args->iterations;
+        DofImage image = dof::get_image(args->image_width, args->image_height);
+        DofImage reference_image = dof::get_image(args->image_width, args->image_height);
+        BuddyGrid grid = dof::get_buddy_grid();
+        dof::render(&image, &settings, args->dof_mode, world, particles, &grid, pool);
+        dof::render(&reference_image, &settings, args->dof_mode, &reference, &reference_particles, &grid, pool);
+        double image_error = 0.0, image_max = 0.0;
+        size_t pixel_count = size_t(image.width) * image.height;
+        for (size_t i = 0; i < pixel_count; ++i) {
+            double error = double(image.pixels[i]) - reference_image.pixels[i];
+            image_error += error * error;
+            image_max = reference_image.pixels[i] > image_max ? reference_image.pixels[i] : image_max;
+        }
+        printf("dof image drift vs fp32: PSNR %.2f dB\n", get_psnr(image_error, double(pixel_count), image_max));
+        dof::release(&grid);
+        dof::release(&reference_image);
+        dof::release(&image);
+    }
+    sim::release(&reference_particles);
+    sim::release(&reference);
+}
+
+// Runs 2D simulation on world_size x world_size world instead of the 3D one.
+static int run_2d(Arguments *args, Config *config) {
+    World2D world = sim2d::get_world(args->world_size, args->world_size);
+    Particles2D particles = sim2d::get_particles(args->particle_count);
+    if (!world.trail || !world.trail_back || !particles.x || !particles.y || !particles.dir_x || !particles.dir_y) {
+        printf("Failed to allocate 2D world of size %u with %u particles\n", args->world_size, args->particle_count);
+        return 1;
+    }
+    ThreadPool *pool = thread_pool::get(args->threads);
+    sim2d::spawn_particles(&particles, &world, args->spawn_radius, 1);
+    profiler::set_enabled(args->profile_path != NULL);
+
+    double start = get_time();
+    for (uint32_t i = 0; i < args->steps; ++i) {
+        if (args->sort_interval > 0 && i % args->sort_interval == 0) {
+            sim2d::sort_particles(&world, &particles, pool);
+        }
+        sim2d::step(&world, &particles, config, pool);
+        sim2d::decay(&world, config, pool);
+        if (profiler::is_enabled()) profiler::end_frame();
+    }
+    double duration = get_time() - start;
+    printf("threads: %u, steps: %u, particles/s: %.0f, steps/s: %.2f\n", thread_pool::get_thread_count(pool), args->steps,
+           double(particles.count) * args->steps / duration, args->steps / duration);
+    if (args->profile_path) {
+        print_profile();
+    }
+
+    if (args->render) {
+        DofImage image = dof::get_image(args->image_width, args->image_height);
+        sim2d::get_image(&world, image.pixels, image.width, image.height, pool);
+        if (!write_image(&image, args->output_path)) {
+            printf("Failed to write %s\n", args->output_path);
+        }
+        dof::release(&image);
+    }
+    thread_pool::release(pool);
+
+    if (args->profile_path) {
+        if (!profiler::write_trace(args->profile_path)) {
+            printf("Failed to write %s\n", args->profile_path);
+        }
+        profiler::release();
+    }
+    sim2d::release(&particles);
+    sim2d::release(&world);
+    return 0;
+}
+
+// Runs sweep over Config values instead of a single simulation, each run on its own thread.
+static int run_sweep(Arguments *args, Config *config) {
+    SweepSettings settings = {};
+    settings.base = *config;
+    memcpy(settings.ranges, args->sweep_ranges, sizeof(SweepRange) * args->sweep_range_count);
+    settings.range_count = args->sweep_range_count;
+    settings.random_samples = args->sweep_random_samples;
+    settings.seed = 1;
+    settings.world_size = args->world_size;
+    settings.particle_count = args->particle_count;
+    settings.steps = args->steps;
+    settings.spawn_radius = args->spawn_radius;
+    settings.thumbnail_size = args->thumbnail_size;
+    // Single sample per trail thread is plenty for a thumbnail and keeps rendering cheaper than the run.
+    settings.thumbnail_iterations = 1;
+    settings.output_dir = args->sweep_dir;
+
+    ThreadPool *pool = thread_pool::get(args->threads);
+    uint32_t run_count = sweep::get_run_count(&settings);
+    printf("sweep runs: %u, threads: %u\n", run_count, thread_pool::get_thread_count(pool));
+    double start = get_time();
+    SweepResult *results = sweep::run(&settings, pool);
+    double duration = get_time() - start;
+    thread_pool::release(pool);
+    printf("sweep time: %.3f s, runs/hour: %.0f\n", duration, run_count / duration * 3600.0);
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/sweep.csv", args->sweep_dir);
+    bool written = sweep::write_summary(&settings, results, path);
+    free(results);
+    if (!written) {
+        printf("Failed to write %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    Arguments args = {};
+    args.world_size = 480;
+    args.particle_count = 100000;
+    args.steps = 100;
+    args.threads = 0;
+    args.spawn_radius = 50.0f;
+    args.kernel = SimKernel::AUTO;
+    args.brick_threshold = SIM_BRICK_THRESHOLD;
+    args.iterations = 32;
+    args.progressive_frames = 1;
+    args.image_width = 1400;
+    args.image_height = 800;
+    args.output_path = "dof.pgm";
+    args.record_interval = 1;
+    args.render_threads = 1;
+    args.thumbnail_size = 128;
+    args.sweep_dir = ".";
+    if (!parse_arguments(argc, argv, &args)) {
+        print_usage();
+        return 1;
+    }
+    if (!sim::set_kernel(args.kernel)) {
+        printf("Kernel %s is not supported by this CPU\n", sim::get_kernel_name(args.kernel));
+        return 1;
+    }
+    printf("kernel: %s\n", sim::get_kernel_name(sim::get_kernel()));
+
+    uint32_t width = args.world_size, height = args.world_size, depth = args.world_size;
+    ControlReplay *replay = NULL;
+    if (args.replay_path) {
+        replay = control::open_replay(args.replay_path, &width, &height, &depth);
+        if (!replay) {
+            printf("Failed to read control log %s\n", args.replay_path);
+            return 1;
+        }
+        printf("replay: %u frames, world: %ux%ux%u\n", control::get_frame_count(replay), width, height, depth);
+    }
+
+    // Same defaults as physarum.exe.
+    Config config = {};
+    config.sense_spread = 0.48f;
+    config.sense_distance = 23.0f;
+    config.turn_angle = 0.63f;
+    config.move_distance = 2.77f;
+    config.deposit_value = 5.0f;
+    config.decay_factor = 0.32f;
+    config.collision = 0.0f;
+    config.center_attraction = 1.0f;
+    config.world_width = int(width);
+    config.world_height = int(height);
+    config.world_depth = int(depth);
+    config.move_sense_coef = 0.0f;
+    config.move_sense_offset = 1.0f;
+    config.sample_points = args.sample_points;
+
+    if (args.sweep_range_count > 0) {
+        return run_sweep(&args, &config);
+    }
+    if (args.mode_2d) {
+        return run_2d(&args, &config);
+    }
+
+    World world = sim::get_world(width, height, depth, args.trail_format, args.decay_buffer);
+    Particles particles = sim::get_particles(args.particle_count);
+    sim::set_heading(&particles, args.heading);
+    if (!world.trail.voxels || !world.occupancy) {
+        printf("Failed to allocate world of size %ux%ux%u\n", width, height, depth);
+        return 1;
+    }
+    printf("trail: %s, %.1f MB\n", sim::get_trail_format_name(world.trail_format), sim::get_trail_size(&world) * 1e-6);
+    world.brick_threshold = args.brick_threshold;
+
+    ThreadPool *pool = thread_pool::get(args.threads);
+    if (args.load_path) {
+        double start = get_time();
+        if (!checkpoint::load(args.load_path, &world, &particles, &config, NULL, 0, pool)) {
+            printf("Failed to load checkpoint %s\n", args.load_path);
+            return 1;
+        }
+        printf("checkpoint load: %.3f s, world: %ux%ux%u, particles: %u\n", get_time() - start,
+               world.width, world.height, world.depth, particles.count);
+    }
+    uint32_t max_threads = thread_pool::get_thread_count(pool);
+    if (args.ramp_size_count > 0) {
+        run_ramp(&args, &config, &world, &particles, pool);
+        thread_pool::release(pool);
+    } else if (args.scaling) {
+        thread_pool::release(pool);
+        double single_thread = 0.0;
+        printf("threads, particles/s, speedup, efficiency\n");
+        for (uint32_t threads = 1; threads <= max_threads; threads = threads * 2 > max_threads && threads != max_threads ? max_threads : threads * 2) {
+            pool = thread_pool::get(threads);
+            double pps = run_simulation(&args, &config, &world, &particles, NULL, pool);
+            thread_pool::release(pool);
+            if (threads == 1) single_thread = pps;
+            double speedup = pps / single_thread;
+            printf("%u, %.0f, %.2f, %.2f\n", threads, pps, speedup, speedup / threads);
+        }
+    } else {
+        Recording recording = {};
+        // Only rank 0 of slab processes gets the gathered state.
+        bool gathered = !args.slab_name || args.slab_rank == 0;
+        if (args.record_dir && gathered) {
+            recording.settings = dof::get_settings(args.image_width, args.image_height);
+            recording.settings.iterations = args.iterations;
+            recording.image = dof::get_image(args.image_width, args.image_height);
+            recording.grid = dof::get_buddy_grid();
+            recording.recorder = recorder::get(args.record_dir, args.image_width, args.image_height, 16, 0, args.record_drop);
+        }
+        profiler::set_enabled(args.profile_path != NULL);
+        double pps = 0.0;
+        bool completed = true;
+        if (replay) {
+            pps = run_replay(&args, replay, &config, &world, &particles, args.record_dir ? &recording : NULL, pool);
+            control::release(replay);
+        } else if (args.slab_name) {
+            start_simulation(&args, &config, &world, &particles, pool);
+            completed = run_slab_process(&args, &config, &world, &particles, args.record_dir && gathered ? &recording : NULL, pool, &pps);
+        } else {
+            pps = run_simulation(&args, &config, &world, &particles, args.record_dir && gathered ? &recording : NULL, pool);
+        }
+        printf("threads: %u, steps: %u, particles/s: %.0f\n", max_threads, args.steps, pps);
+        // State of a slab process which didn't finish is incomplete, nothing is written from it.
+        if (!completed || !gathered) {
+            if (args.record_dir && gathered) {
+                recorder::release(recording.recorder);
+                dof::release(&recording.grid);
+                dof::release(&recording.image);
+            }
+            thread_pool::release(pool);
+            sim::release(&particles);
+            sim::release(&world);
+            return completed ? 0 : 1;
+        }
+        if (has_particle_pool(&args)) {
+            printf("particles: %u, capacity: %u\n", particles.count, particles.capacity);
+        }
+        if (args.profile_path) {
+            print_profile();
+        }
+        if (args.record_dir) {
+            double start = get_time();
+            recorder::flush(recording.recorder);
+            double flush_duration = get_time() - start;
+            RecorderStats stats = recorder::get_stats(recording.recorder);
+            printf("recorded frames: %u, render + push: %.3f s, final flush: %.3f s\n", recording.frames, recording.duration, flush_duration);
+            printf("written: %llu, dropped: %llu, stalls: %llu, failed: %llu\n", (unsigned long long)stats.written,
+                   (unsigned long long)stats.dropped, (unsigned long long)stats.stalls, (unsigned long long)stats.failed);
+            recorder::release(recording.recorder);
+            dof::release(&recording.grid);
+            dof::release(&recording.image);
+        }
+        printf("active bricks: %u/%u\n", world.active_brick_count, sim::get_brick_count(&world));
+        printf("estimated trail cache misses per particle: %.3f\n", sim::measure_locality(&world, &particles));
+        if (args.sort_interval > 0) {
+            sim::sort_particles(&world, &particles, pool);
+            printf("estimated trail cache misses per particle after sort: %.3f\n", sim::measure_locality(&world, &particles));
+        }
+
+        if (args.trail_drift) {
+            print_trail_drift(&args, &config, &world, &particles, pool);
+        }
+
+        if (args.paused_decay_steps > 0) {
+            double start = get_time();
+            sim::decay_steps(&world, &config, args.paused_decay_steps, pool);
+            double duration = get_time() - start;
+            double voxels = double(sim::get_voxel_count(&world)) * args.paused_decay_steps;
+            printf("paused decay steps: %u, voxel updates/s: %.0f\n", args.paused_decay_steps, voxels / duration);
+        }
+
+        if (args.save_path) {
+            CheckpointWriter *writer = checkpoint::get_writer();
+            double start = get_time();
+            checkpoint::save(writer, args.save_path, &world, &particles, &config, NULL, 0, pool);
+            double encode_duration = get_time() - start;
+            bool written = checkpoint::wait(writer);
+            printf("checkpoint encode: %.3f s, write: %.3f s\n", encode_duration, get_time() - start - encode_duration);
+            if (!written) {
+                printf("Failed to write %s\n", args.save_path);
+            }
+            checkpoint::release(writer);
+        }
+
+        if (args.render && args.raymarch) {
+            RaymarchSettings settings = raymarch::get_settings(args.image_width, args.image_height);
+            settings.show_grid = args.show_grid;
+            DofImage image = dof::get_image(args.image_width, args.image_height);
+            RaymarchPyramid pyramid = raymarch::get_pyramid();
+            double start = get_time();
+            raymarch::update(&pyramid, &world, &settings, pool);
+            double pyramid_duration = get_time() - start;
+            uint64_t samples = raymarch::render(&image, &settings, &world, &pyramid, pool);
+            double duration = get_time() - start;
+            printf("volume render: %.3f s, pyramid: %.3f s, samples per pixel: %.1f\n", duration, pyramid_duration,
+                   double(samples) / (double(image.width) * image.height));
+
+            if (!write_image(&image, args.output_path)) {
+                printf("Failed to write %s\n", args.output_path);
+            }
+            raymarch::release(&pyramid);
+            dof::release(&image);
+        } else if (args.render) {
+            DofSettings settings = dof::get_settings(args.image_width, args.image_height);
+            settings.iterations = args.iterations;
+            DofImage image = dof::get_image(args.image_width, args.image_height);
+            double start = get_time();
+            BuddyGrid grid = dof::get_buddy_grid();
+            // Simulation is done, so every frame accumulates into the same still.
+            for (int frame = 0; frame < args.progressive_frames || frame == 0; ++frame) {
+                settings.progressive_frame = frame;
+                dof::render(&image, &settings, args.dof_mode, &world, &particles, &grid, pool);
+            }
+            double duration = get_time() - start;
+            printf("dof render: %.3f s\n", duration);
+
+            if (!write_image(&image, args.output_path)) {
+                printf("Failed to write %s\n", args.output_path);
+            }
+            dof::release(&grid);
+            dof::release(&image);
+        }
+        thread_pool::release(pool);
+
+        if (args.profile_path) {
+            if (!profiler::write_trace(args.profile_path)) {
+                printf("Failed to write %s\n", args.profile_path);
+            }
+            profiler::release();
+        }
+    }
+
+    sim::release(&particles);
+    sim::release(&world);
+    return 0;
+}
@@ -7,9 +7,22 @@
 #include "ui_draw.h"
 #include "font.h"
 #include "input.h"
+#include "config.h"
+#include "recorder.h"
+#include "pipeline.h"
+#include "control.h"
+#include "profiler.h"
+#include "sim2d.h"
+#include "thread_pool.h"
 #include <cassert>
 #include <mmsystem.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
 #define MIDI_DEFINE
 #include "midi.h"
 
@@ -29,16 +42,50 @@ float quad_vertices[] = {
     1.0f, 1.0f,
 };
 
+// Recorded frames are read back from this many staging textures in round robin, so reading a frame
+// doesn't wait for the GPU to finish rendering it.
+#define RECORD_LATENCY 3
+
+// Maximum number of stages shown in profiler overlay (F7).
+#define PROFILER_OVERLAY_STAGES 16
+
+// CPU 2D preview (F10) world size, agent count and how often agents are sorted by trail tile.
+#define PREVIEW_2D_SIZE 2048
+#define PREVIEW_2D_PARTICLES 4000000
+#define PREVIEW_2D_SORT_INTERVAL 16
+// Threads of the frame loop turning published 2D states into images, simulation thread uses all cores.
+#define PREVIEW_2D_RENDER_THREADS 2
+// Seconds over which 2D preview steps and frames per second are averaged.
+#define PREVIEW_2D_RATE_INTERVAL 0.5
+
+// Particle shaders run groups of PARTICLE_GROUP_SIZE threads, dispatched in rows of PARTICLE_GROUPS_X groups.
+// Both have to match the shaders.
+#define PARTICLE_GROUP_SIZE 256
+#define PARTICLE_GROUPS_X 65535
+
+// Progressive DoF stops rendering once this many frames are accumulated, the image doesn't visibly change anymore.
+#define DOF_PROGRESSIVE_MAX_FRAMES 1024
+
+// AKAI MIDIMIX sliders bound to Config fields, controller value 0-1 is multiplied by scale.
+static const MidiBinding midi_bindings[] = {
+    { AKAI_MIDIMIX_SLIDER_0, ControlField::SENSE_SPREAD, 1.57079632f },
+    { AKAI_MIDIMIX_SLIDER_1, ControlField::SENSE_DISTANCE, 100.0f },
+    { AKAI_MIDIMIX_SLIDER_2, ControlField::TURN_ANGLE, 1.57079632f },
+    { AKAI_MIDIMIX_SLIDER_3, ControlField::MOVE_DISTANCE, 20.0f },
+    { AKAI_MIDIMIX_SLIDER_4, ControlField::DEPOSIT_VALUE, 5.0f },
+    { AKAI_MIDIMIX_SLIDER_5, ControlField::DECAY_FACTOR, 1.0f },
+};
+
 uint32_t quad_vertices_stride = sizeof(float) * 6;
 uint32_t quad_vertices_count = 6;
 
 int main(int argc, char **argv)
 {
-    int midi_error = midi::init();
-    bool use_midi = true;
-    if (midi_error != MIDI_OK) {
-        use_midi = false;
-    }
+    // MIDI callback thread produces into its own queue, UI and keyboard into another one on the main thread.
+    // Without a MIDI device its queue just stays empty.
+    ControlQueue *midi_queue = control::get_queue();
+    ControlQueue *input_queue = control::get_queue();
+    midi::init(midi_queue, midi_bindings, sizeof(midi_bindings) / sizeof(midi_bindings[0]));
 
     // Set up window
     uint32_t window_width = 1400, window_height = 800;
@@ -62,7 +109,9 @@ int main(int argc, char **argv)
     // Simulation params
     uint32_t world_width = 480, world_height = 480, world_depth = 480;
     float spawn_radius = 50.0f;
-    const int NUM_PARTICLES = 100000;
+    // Particle buffers have room for particle_capacity particles, shaders only process the first particle_count.
+    uint32_t particle_count = 100000;
+    uint32_t particle_capacity = particle_count;
 
     // DoF rendering shader for rendering trail.
     File draw_compute_shader_file_trail = file_system::read_file("dof_shader_trail.hlsl");
@@ -127,23 +176,22 @@ int main(int argc, char **argv)
     // Textures for the simulation
     Texture3D trail_tex_A = graphics::get_texture3D(NULL, world_width, world_height, world_depth, DXGI_FORMAT_R16_FLOAT, 2);
     Texture3D trail_tex_B = graphics::get_texture3D(NULL, world_width, world_height, world_depth, DXGI_FORMAT_R16_FLOAT, 2);
-    Texture3D occ_tex = graphics::get_texture3D(NULL, world_width, world_height, world_depth, DXGI_FORMAT_R32_UINT, 4);
+    // Occupancy is a bit map, every texel holds 32 voxels along x.
+    Texture3D occ_tex = graphics::get_texture3D(NULL, (world_width + 31) / 32, world_height, world_depth, DXGI_FORMAT_R32_UINT, 4);
     Texture2D display_tex = graphics::get_texture2D(NULL, window_width, window_height, DXGI_FORMAT_R32_FLOAT, 4);
     Texture2D display_tex_uint = graphics::get_texture2D(NULL, window_width, window_height, DXGI_FORMAT_R32_UINT, 4);
+    // Sum of progressive DoF frames.
+    Texture2D display_tex_accum = graphics::get_texture2D(NULL, window_width, window_height, DXGI_FORMAT_R32_FLOAT, 4);
 
 	graphics::set_blend_state(BlendType::ALPHA);
 
     // Particles setup
-    struct Particle3D {
-        float x; float y; float z; float phi; float theta; float pad1; float pad2; float pad3;
-    };
-    Particle3D *particles = memory::alloc_heap<Particle3D>(NUM_PARTICLES);
-    float *particles_x = memory::alloc_heap<float>(NUM_PARTICLES);
-    float *particles_y = memory::alloc_heap<float>(NUM_PARTICLES);
-    float *particles_z = memory::alloc_heap<float>(NUM_PARTICLES);
-    float *particles_phi = memory::alloc_heap<float>(NUM_PARTICLES);
-    float *particles_theta = memory::alloc_heap<float>(NUM_PARTICLES);
-    unsigned int *particles_pair = memory::alloc_heap<unsigned int>(NUM_PARTICLES);
+    float *particles_x = NULL;
+    float *particles_y = NULL;
+    float *particles_z = NULL;
+    float *particles_phi = NULL;
+    float *particles_theta = NULL;
+    unsigned int *particles_pair = NULL;
 
     auto update_particles = [&world_width, &world_height, &world_depth](float *px, float *py, float *pz, float *pp, float *pt, unsigned int *pb, int count, float spawn_radius) {
         for (int i = 0; i < count; ++i) {
@@ -156,24 +204,90 @@ int main(int argc, char **argv)
             pz[i] = math::cos(phi) * math::sin(theta) * radius + world_depth / 2.0f;
             pp[i] = math::acos(2 * math::random_uniform(0, 1.0) - 1);
             pt[i] = math::random_uniform(0, math::PI2);
-            pb[i] = 100000000; // particle ID 100 million means no pair.
+            pb[i] = 100000000; // particle ID past particle_count means no pair.
         }
     };
-    update_particles(particles_x, particles_y, particles_z, particles_phi, particles_theta, particles_pair, NUM_PARTICLES, spawn_radius);
 
     // Set up buffer containing particle data
-    StructuredBuffer particles_buffer_x = graphics::get_structured_buffer(sizeof(float), NUM_PARTICLES);
-    graphics::update_structured_buffer(&particles_buffer_x, particles_x);
-    StructuredBuffer particles_buffer_y = graphics::get_structured_buffer(sizeof(float), NUM_PARTICLES);
-    graphics::update_structured_buffer(&particles_buffer_y, particles_y);
-    StructuredBuffer particles_buffer_z = graphics::get_structured_buffer(sizeof(float), NUM_PARTICLES);
-    graphics::update_structured_buffer(&particles_buffer_z, particles_z);
-    StructuredBuffer particles_buffer_phi = graphics::get_structured_buffer(sizeof(float), NUM_PARTICLES);
-    graphics::update_structured_buffer(&particles_buffer_phi, particles_phi);
-    StructuredBuffer particles_buffer_theta = graphics::get_structured_buffer(sizeof(float), NUM_PARTICLES);
-    graphics::update_structured_buffer(&particles_buffer_theta, particles_theta);
-    StructuredBuffer particles_buffer_pair = graphics::get_structured_buffer(sizeof(unsigned int), NUM_PARTICLES);
-    graphics::update_structured_buffer(&particles_buffer_pair, particles_pair);
+    StructuredBuffer particles_buffer_x, particles_buffer_y, particles_buffer_z;
+    StructuredBuffer particles_buffer_phi, particles_buffer_theta, particles_buffer_pair;
+    auto spawn_particles = [&]() {
+        update_particles(particles_x, particles_y, particles_z, particles_phi, particles_theta, particles_pair, particle_capacity, spawn_radius);
+        graphics::update_structured_buffer(&particles_buffer_x, particles_x);
+        graphics::update_structured_buffer(&particles_buffer_y, particles_y);
+        graphics::update_structured_buffer(&particles_buffer_z, particles_z);
+        graphics::update_structured_buffer(&particles_buffer_phi, particles_phi);
+        graphics::update_structured_buffer(&particles_buffer_theta, particles_theta);
+        graphics::update_structured_buffer(&particles_buffer_pair, particles_pair);
+    };
+    auto allocate_particles = [&]() {
+        particles_x = (float *)realloc(particles_x, sizeof(float) * particle_capacity);
+        particles_y = (float *)realloc(particles_y, sizeof(float) * particle_capacity);
+        particles_z = (float *)realloc(particles_z, sizeof(float) * particle_capacity);
+        particles_phi = (float *)realloc(particles_phi, sizeof(float) * particle_capacity);
+        particles_theta = (float *)realloc(particles_theta, sizeof(float) * particle_capacity);
+        particles_pair = (unsigned int *)realloc(particles_pair, sizeof(unsigned int) * particle_capacity);
+        particles_buffer_x = graphics::get_structured_buffer(sizeof(float), particle_capacity);
+        particles_buffer_y = graphics::get_structured_buffer(sizeof(float), particle_capacity);
+        particles_buffer_z = graphics::get_structured_buffer(sizeof(float), particle_capacity);
+        particles_buffer_phi = graphics::get_structured_buffer(sizeof(float), particle_capacity);
+        particles_buffer_theta = graphics::get_structured_buffer(sizeof(float), particle_capacity);
+        particles_buffer_pair = graphics::get_structured_buffer(sizeof(unsigned int), particle_capacity);
+    };
+    auto release_particle_buffers = [&]() {
+        graphics::release(&particles_buffer_x);
+        graphics::release(&particles_buffer_y);
+        graphics::release(&particles_buffer_z);
+        graphics::release(&particles_buffer_phi);
+        graphics::release(&particles_buffer_theta);
+        graphics::release(&particles_buffer_pair);
+    };
+    allocate_particles();
+    spawn_particles();
+
+    // Shrinking only lowers the count, particles past it stay in the buffers and continue where they stopped
+    // when the count grows again. Growing past capacity allocates larger buffers with some headroom, copies all
+    // particles of the old buffers over on GPU and spawns only the particles past the old capacity.
+    auto resize_particles = [&](uint32_t count) {
+        if (count > particle_capacity) {
+            uint32_t old_capacity = particle_capacity;
+            StructuredBuffer old_buffers[6] = {
+                particles_buffer_x, particles_buffer_y, particles_buffer_z,
+                particles_buffer_phi, particles_buffer_theta, particles_buffer_pair,
+            };
+            particle_capacity = count + count / 4;
+            allocate_particles();
+            update_particles(particles_x + old_capacity, particles_y + old_capacity, particles_z + old_capacity,
+                             particles_phi + old_capacity, particles_theta + old_capacity, particles_pair + old_capacity,
+                             particle_capacity - old_capacity, spawn_radius);
+
+            // All particle attributes are 4 bytes, buffers are copied and updated as byte ranges.
+            StructuredBuffer *new_buffers[6] = {
+                &particles_buffer_x, &particles_buffer_y, &particles_buffer_z,
+                &particles_buffer_phi, &particles_buffer_theta, &particles_buffer_pair,
+            };
+            void *spawned[6] = {
+                particles_x + old_capacity, particles_y + old_capacity, particles_z + old_capacity,
+                particles_phi + old_capacity, particles_theta + old_capacity, particles_pair + old_capacity,
+            };
+            D3D11_BOX kept = {0, 0, 0, sizeof(float) * old_capacity, 1, 1};
+            D3D11_BOX added = {sizeof(float) * old_capacity, 0, 0, sizeof(float) * particle_capacity, 1, 1};
+            for (uint32_t i = 0; i < 6; ++i) {
+                graphics_context->context->CopySubresourceRegion(new_buffers[i]->buffer, 0, 0, 0, 0, old_buffers[i].buffer, 0, &kept);
+                graphics_context->context->UpdateSubresource(new_buffers[i]->buffer, 0, &added, spawned[i], 0, 0);
+                graphics::release(&old_buffers[i]);
+            }
+        }
+        particle_count = count;
+    };
+
+    // Runs current compute shader once for every live particle.
+    auto run_particle_compute = [&]() {
+        uint32_t groups = (particle_count + PARTICLE_GROUP_SIZE - 1) / PARTICLE_GROUP_SIZE;
+        if (groups == 0) return;
+        uint32_t groups_x = groups < PARTICLE_GROUPS_X ? groups : PARTICLE_GROUPS_X;
+        graphics::run_compute(groups_x, (groups + PARTICLE_GROUPS_X - 1) / PARTICLE_GROUPS_X, 1);
+    };
 
     // Set up 3D texture quad mesh.
     float super_quad_vertices_template[] = {
@@ -246,8 +360,9 @@ int main(int argc, char **argv)
 
         float screen_height;
         float sample_weight;
-        int filler1;
-        int filler2;
+        int particle_count;
+        // Number of DoF frames accumulated before this one, 0 starts a new image.
+        int progressive_frame;
     };
 
     RenderingSettings rendering_settings = {};
@@ -275,47 +390,34 @@ int main(int argc, char **argv)
     TextureSampler tex_sampler = graphics::get_texture_sampler();
     bool is_a = true;
 
-    struct Config {
-        float sense_spread;;
-        float sense_distance;
-        float turn_angle;
-        float move_distance;
-
-        float deposit_value;
-        float decay_factor;
-        float collision;
-        float center_attraction;
-
-        int world_width;
-        int world_height;
-        int world_depth;
-        float move_sense_coef;
-
-        float move_sense_offset;
-        int filler1;
-        int filler2;
-        int filler3;
-    };
-
-    Config config = {
-        0.48f,
-        23.0f,
-        0.63f,
-        2.77f,
-        5.0f,
-        0.32f,
-        0.0f,
-        1.0f,
-        int(world_width),
-        int(world_height),
-        int(world_depth),
-        0.0f,
-        1.0f,
-    };
+    Config initial_config = {};
+    initial_config.sense_spread = 0.48f;
+    initial_config.sense_distance = 23.0f;
+    initial_config.turn_angle = 0.63f;
+    initial_config.move_distance = 2.77f;
+    initial_config.deposit_value = 5.0f;
+    initial_config.decay_factor = 0.32f;
+    initial_config.collision = 0.0f;
+    initial_config.center_attraction = 1.0f;
+    initial_config.world_width = int(world_width);
+    initial_config.world_height = int(world_height);
+    initial_config.world_depth = int(world_depth);
+    initial_config.move_sense_coef = 0.0f;
+    initial_config.move_sense_offset = 1.0f;
     ConstantBuffer config_buffer = graphics::get_constant_buffer(sizeof(Config));
+    ControlConfig controls;
+    control::init(&controls, &initial_config);
 
-    Timer timer = timer::get();
-    timer::start(&timer);
+    // Control events applied at the start of every frame, sorted by time. Session log (F11) is written
+    // into controls.log in the working directory, frames count from its start.
+    ControlEvent *frame_events = (ControlEvent *)malloc(sizeof(ControlEvent) * CONTROL_QUEUE_SIZE * 2);
+    ControlLog *control_log = NULL;
+    uint32_t control_frame = 0;
+    uint32_t log_start_frame = 0;
+
+    // Markers measure CPU time of each stage, so GPU stages show the cost of submitting work and waiting for
+    // the GPU ends up in present.
+    profiler::set_enabled(true);
 
     // Render loop
     bool is_running = true;
@@ -323,15 +425,117 @@ int main(int argc, char **argv)
     bool run_mold = true;
     bool turning_camera = false;
     bool render_dof = false;
+    bool show_profiler = false;
+    ProfileStats profile_stats[PROFILER_OVERLAY_STAGES];
+    char profile_labels[PROFILER_OVERLAY_STAGES][64];
     enum DofType {
         TRAIL,
         PARTICLES,
         PARTICLE_PAIRS
     };
     DofType dof_type = DofType::TRAIL;
+
+    // Progressive DoF keeps adding frames with new samples while the simulation is paused and nothing which
+    // affects the image changed, so the image converges instead of staying noisy.
+    bool progressive_dof = false;
+    bool simulation_changed = true;
+    RenderingSettings last_dof_settings = {};
+    DofType last_dof_type = dof_type;
+
+    // CPU 2D preview (F10) replaces the GPU simulation and rendering while it runs, state is created on first use.
+    // Simulation runs on its own thread and publishes every step through a pipeline, frame loop renders the
+    // latest published state (and records it), so steps per second don't depend on the frame rate.
+    bool run_2d = false;
+    ThreadPool *pool_2d = NULL;
+    ThreadPool *render_pool_2d = NULL;
+    World2D world_2d = {};
+    Particles2D particles_2d = {};
+    Pipeline *pipeline_2d = NULL;
+    float *pixels_2d = NULL;
+    std::thread thread_2d;
+    // Frame loop hands Config, pause and reset to the simulation thread under the mutex once per frame.
+    std::mutex mutex_2d;
+    Config config_2d = {};
+    bool paused_2d = false;
+    bool reset_pending_2d = true;
+    bool stop_2d = false;
+    auto run_simulation_2d = [&]() {
+        uint32_t steps = 0;
+        for (;;) {
+            Config step_config;
+            bool paused;
+            bool reset;
+            {
+                std::lock_guard<std::mutex> lock(mutex_2d);
+                if (stop_2d) break;
+                step_config = config_2d;
+                paused = paused_2d;
+                reset = reset_pending_2d;
+                reset_pending_2d = false;
+            }
+            if (reset) {
+                sim2d::clear(&world_2d, pool_2d);
+                sim2d::spawn_particles(&particles_2d, &world_2d, PREVIEW_2D_SIZE / 4.0f, 1);
+                steps = 0;
+                pipeline::publish(pipeline_2d, &world_2d, steps, pool_2d);
+                continue;
+            }
+            if (paused) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            PROFILE_SCOPE("step_2d");
+            if (steps % PREVIEW_2D_SORT_INTERVAL == 0) {
+                sim2d::sort_particles(&world_2d, &particles_2d, pool_2d);
+            }
+            sim2d::step(&world_2d, &particles_2d, &step_config, pool_2d);
+            sim2d::decay(&world_2d, &step_config, pool_2d);
+            steps++;
+            pipeline::publish(pipeline_2d, &world_2d, steps, pool_2d);
+        }
+    };
+    auto stop_simulation_2d = [&]() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_2d);
+            stop_2d = true;
+        }
+        thread_2d.join();
+    };
+    // Steps and frames per second of the 2D preview, counted from pipeline stats.
+    std::chrono::steady_clock::time_point rate_start_2d = std::chrono::steady_clock::now();
+    PipelineStats rate_stats_2d = {};
+    float steps_per_second_2d = 0.0f;
+    float frames_per_second_2d = 0.0f;
+    char rate_labels_2d[2][32];
+
+    // Recording of DoF frames (F6), frames are written as PNGs into the working directory.
+    Recorder *recorder = NULL;
+    ID3D11Texture2D *record_staging[RECORD_LATENCY] = {};
+    uint32_t record_copies = 0;
+    auto read_recorded_frame = [&](uint32_t copy) {
+        ID3D11Texture2D *staging = record_staging[copy % RECORD_LATENCY];
+        D3D11_MAPPED_SUBRESOURCE mapped;
+        if (SUCCEEDED(graphics_context->context->Map(staging, 0, D3D11_MAP_READ, 0, &mapped))) {
+            recorder::push(recorder, (float *)mapped.pData, mapped.RowPitch / sizeof(float));
+            graphics_context->context->Unmap(staging, 0);
+        }
+    };
+    auto stop_recording = [&]() {
+        uint32_t first_pending = record_copies > RECORD_LATENCY - 1 ? record_copies - (RECORD_LATENCY - 1) : 0;
+        for (uint32_t copy = first_pending; copy < record_copies; ++copy) {
+            read_recorded_frame(copy);
+        }
+        RecorderStats stats = recorder::get_stats(recorder);
+        recorder::release(recorder);
+        printf("recorded frames: %llu, dropped: %llu, stalls: %llu, failed: %llu\n", stats.pushed, stats.dropped, stats.stalls, stats.failed);
+        for (int i = 0; i < RECORD_LATENCY; ++i) {
+            record_staging[i]->Release();
+            record_staging[i] = NULL;
+        }
+        recorder = NULL;
+    };
     while(is_running)
     {
-        printf("%f\n", timer::checkpoint(&timer));
         input::reset();
 
         // Event loop
@@ -353,6 +557,7 @@ int main(int argc, char **argv)
 
         // React to inputs
         {
+            PROFILE_SCOPE("input");
             if(!ui::is_registering_input()) {
                 radius -= input::mouse_scroll_delta() * 0.1f;
 
@@ -378,32 +583,137 @@ int main(int argc, char **argv)
             if (input::key_pressed(KeyCode::F5)) turning_camera = !turning_camera;
             if (input::key_pressed(KeyCode::ESC)) is_running = false;
             if (input::key_pressed(KeyCode::F1)) show_ui = !show_ui;
-            if (input::key_pressed(KeyCode::F3)) run_mold = !run_mold;
+            if (input::key_pressed(KeyCode::F3)) control::push(input_queue, ControlField::PAUSED, ControlSource::KEYBOARD, run_mold ? 1.0f : 0.0f);
             if (input::key_pressed(KeyCode::F9)) render_dof = !render_dof;
-            if (input::key_pressed(KeyCode::F2)) {
-                // Reset particles + trails + occupancy map
-                update_particles(particles_x, particles_y, particles_z, particles_phi, particles_theta, particles_pair, NUM_PARTICLES, spawn_radius);
-                graphics::update_structured_buffer(&particles_buffer_z, particles_z);
-                graphics::update_structured_buffer(&particles_buffer_phi, particles_phi);
-                graphics::update_structured_buffer(&particles_buffer_x, particles_x);
-                graphics::update_structured_buffer(&particles_buffer_y, particles_y);
-                graphics::update_structured_buffer(&particles_buffer_theta, particles_theta);
-                float clear_tex[4] = {0, 0, 0, 0};
-                graphics_context->context->ClearUnorderedAccessViewFloat(trail_tex_A.ua_view, clear_tex);
-                graphics_context->context->ClearUnorderedAccessViewFloat(trail_tex_B.ua_view, clear_tex);
-                uint32_t clear_tex_uint[4] = {0, 0, 0, 0};
-                graphics_context->context->ClearUnorderedAccessViewUint(occ_tex.ua_view, clear_tex_uint);
+            if (input::key_pressed(KeyCode::F7)) show_profiler = !show_profiler;
+            if (input::key_pressed(KeyCode::F10)) run_2d = !run_2d;
+            if (input::key_pressed(KeyCode::F8)) {
+                if (!profiler::write_trace("trace.json")) {
+                    printf("Failed to write trace.json\n");
+                }
+            }
+            if (input::key_pressed(KeyCode::F6)) {
+                if (recorder) {
+                    stop_recording();
+                } else {
+                    D3D11_TEXTURE2D_DESC desc = {};
+                    desc.Width = window_width;
+                    desc.Height = window_height;
+                    desc.MipLevels = 1;
+                    desc.ArraySize = 1;
+                    desc.Format = DXGI_FORMAT_R32_FLOAT;
+                    desc.SampleDesc.Count = 1;
+                    desc.Usage = D3D11_USAGE_STAGING;
+                    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+                    for (int i = 0; i < RECORD_LATENCY; ++i) {
+                        graphics_context->device->CreateTexture2D(&desc, NULL, &record_staging[i]);
+                    }
+                    record_copies = 0;
+                    recorder = recorder::get(".", window_width, window_height, 16, 0, false);
+                }
+            }
+            if (input::key_pressed(KeyCode::F2)) control::push(input_queue, ControlField::RESET, ControlSource::KEYBOARD, 0.0f);
+            if (input::key_pressed(KeyCode::F11)) {
+                if (control_log) {
+                    if (!control::close_log(control_log, control_frame - log_start_frame)) {
+                        printf("Failed to write controls.log\n");
+                    }
+                    control_log = NULL;
+                } else {
+                    control_log = control::open_log("controls.log", world_width, world_height, world_depth, control::get_front(&controls));
+                    log_start_frame = control_frame;
+                    if (control_log) {
+                        // Spawn radius comes first, replay spawns particles when it sees the count.
+                        ControlEvent event = {};
+                        event.source = ControlSource::KEYBOARD;
+                        event.field = ControlField::SPAWN_RADIUS;
+                        event.value = spawn_radius;
+                        control::write(control_log, &event);
+                        event.field = ControlField::PARTICLE_COUNT;
+                        event.value = float(particle_count);
+                        control::write(control_log, &event);
+                        event.field = ControlField::PAUSED;
+                        event.value = run_mold ? 0.0f : 1.0f;
+                        control::write(control_log, &event);
+                    } else {
+                        printf("Failed to create controls.log\n");
+                    }
+                }
+            }
+        }
+
+        // Frame boundary: events pushed since the last frame are applied in the order they happened, Config
+        // changes go to the back Config which becomes the one simulation reads.
+        {
+            PROFILE_SCOPE("controls");
+            uint32_t event_count = 0;
+            while (control::pop(midi_queue, &frame_events[event_count])) event_count++;
+            while (control::pop(input_queue, &frame_events[event_count])) event_count++;
+            std::stable_sort(frame_events, frame_events + event_count, [](const ControlEvent &a, const ControlEvent &b) {
+                return a.time < b.time;
+            });
+            for (uint32_t i = 0; i < event_count; ++i) {
+                ControlEvent *event = &frame_events[i];
+                event->frame = control_frame - log_start_frame;
+                if (control_log) control::write(control_log, event);
+                if (control::apply(&controls, event)) continue;
+
+                switch (event->field) {
+                    case ControlField::PARTICLE_COUNT:
+                    {
+                        resize_particles(uint32_t(event->value));
+                    }
+                    break;
+                    case ControlField::SPAWN_RADIUS:
+                    {
+                        spawn_radius = event->value;
+                    }
+                    break;
+                    case ControlField::PAUSED:
+                    {
+                        run_mold = event->value == 0.0f;
+                    }
+                    break;
+                    case ControlField::RESET:
+                    {
+                        // Reset particles + trails + occupancy map
+                        spawn_particles();
+                        simulation_changed = true;
+                        float clear_tex[4] = {0, 0, 0, 0};
+                        graphics_context->context->ClearUnorderedAccessViewFloat(trail_tex_A.ua_view, clear_tex);
+                        graphics_context->context->ClearUnorderedAccessViewFloat(trail_tex_B.ua_view, clear_tex);
+                        uint32_t clear_tex_uint[4] = {0, 0, 0, 0};
+                        graphics_context->context->ClearUnorderedAccessViewUint(occ_tex.ua_view, clear_tex_uint);
+                        std::lock_guard<std::mutex> lock(mutex_2d);
+                        reset_pending_2d = true;
+                    }
+                    break;
+                    default:
+                    break;
+                };
             }
+            // Particle count is state of the frame loop, resizes are logged as PARTICLE_COUNT events, shaders
+            // get it with the rest of the published Config.
+            control::get_back(&controls)->particle_count = int(particle_count);
+            control::publish(&controls);
+            control_frame++;
         }
+        Config *config = control::get_front(&controls);
 
         // Update simulation config
-        graphics::update_constant_buffer(&config_buffer, &config);
-        graphics::set_constant_buffer(&config_buffer, 0);
+        {
+            PROFILE_SCOPE("config_upload");
+            rendering_settings.particle_count = int(particle_count);
+            graphics::update_constant_buffer(&config_buffer, config);
+            graphics::set_constant_buffer(&config_buffer, 0);
+        }
 
         // Particle simulation
-        if (run_mold)
+        if (run_mold && !run_2d)
         {
+            PROFILE_SCOPE("particle_step");
             is_a = !is_a;
+            simulation_changed = true;
             graphics::set_compute_shader(&compute_shader);
             uint32_t clear_tex_uint[4] = {0, 0, 0, 0};
             graphics_context->context->ClearUnorderedAccessViewUint(occ_tex.ua_view, clear_tex_uint);
@@ -418,14 +728,15 @@ int main(int argc, char **argv)
             graphics::set_structured_buffer(&particles_buffer_z, 4);
             graphics::set_structured_buffer(&particles_buffer_phi, 5);
             graphics::set_structured_buffer(&particles_buffer_theta, 6);
-            graphics::run_compute(10, 10, 1);
+            run_particle_compute();
             graphics::unset_texture_compute(0);
             graphics::unset_texture_compute(1);
         }
 
         // Decay/diffusion
-        if (run_mold)
+        if (run_mold && !run_2d)
         {
+            PROFILE_SCOPE("decay");
             graphics::set_compute_shader(&decay_compute_shader);
             if (is_a) {
                 graphics::set_texture_compute(&trail_tex_A, 0);
@@ -439,43 +750,125 @@ int main(int argc, char **argv)
             graphics::unset_texture_compute(1);
         }
 
+        // 2D preview simulation runs on its own thread while the preview is shown, it gets this frame's Config.
+        {
+            if (run_2d && !pool_2d) {
+                pool_2d = thread_pool::get(0);
+                render_pool_2d = thread_pool::get(PREVIEW_2D_RENDER_THREADS);
+                world_2d = sim2d::get_world(PREVIEW_2D_SIZE, PREVIEW_2D_SIZE);
+                particles_2d = sim2d::get_particles(PREVIEW_2D_PARTICLES);
+                pipeline_2d = pipeline::get(&world_2d);
+                pixels_2d = (float *)malloc(sizeof(float) * window_width * window_height);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_2d);
+                config_2d = *config;
+                paused_2d = !run_mold;
+            }
+            if (run_2d && !thread_2d.joinable()) {
+                stop_2d = false;
+                thread_2d = std::thread(run_simulation_2d);
+            } else if (!run_2d && thread_2d.joinable()) {
+                stop_simulation_2d();
+            }
+        }
+
         // Rendering
         {
             graphics::set_render_targets_viewport(&render_target_window);
             graphics::clear_render_target(&render_target_window, 0.0f, 0.0f, 0.0f, 1);
 
-            if(render_dof) {
-                uint32_t clear_tex_uint[4] = {0, 0, 0, 0};
-                graphics_context->context->ClearUnorderedAccessViewUint(display_tex_uint.ua_view, clear_tex_uint);
+            if (run_2d) {
+                PROFILE_SCOPE("render_2d");
+                // Preview overwrites display_tex, so progressive DoF can't continue from it.
+                simulation_changed = true;
+                // display_tex keeps showing the last state until the simulation thread publishes a newer one.
+                if (PipelineState *state = pipeline::try_acquire(pipeline_2d)) {
+                    sim2d::get_image(&state->world_2d, pixels_2d, window_width, window_height, render_pool_2d);
+                    graphics_context->context->UpdateSubresource(display_tex.texture, 0, NULL, pixels_2d, sizeof(float) * window_width, 0);
+                    if (recorder) {
+                        recorder::push(recorder, pixels_2d, window_width);
+                    }
+                }
 
-                graphics::update_constant_buffer(&rendering_settings_buffer, &rendering_settings);
-                graphics::set_texture_compute(&display_tex_uint, 1);
+                PipelineStats stats = pipeline::get_stats(pipeline_2d);
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                double elapsed = std::chrono::duration<double>(now - rate_start_2d).count();
+                if (elapsed >= PREVIEW_2D_RATE_INTERVAL) {
+                    steps_per_second_2d = float((stats.published - rate_stats_2d.published) / elapsed);
+                    frames_per_second_2d = float((stats.acquired - rate_stats_2d.acquired) / elapsed);
+                    rate_stats_2d = stats;
+                    rate_start_2d = now;
+                }
 
-                if (dof_type == DofType::TRAIL) {
-                    graphics::set_compute_shader(&draw_compute_shader_trail);
-                    if (is_a) {
-                        graphics::set_texture_compute(&trail_tex_B, 0);
-                    } else {
-                        graphics::set_texture_compute(&trail_tex_A, 0);
-                    }
-                    graphics::run_compute(world_width / 2, world_height / 2, world_depth / 2);
-                } else {
-                    if (dof_type == DofType::PARTICLES) {
-                        graphics::set_compute_shader(&draw_compute_shader_particle);
+                graphics::set_vertex_shader(&vertex_shader_2d);
+                graphics::set_pixel_shader(&pixel_shader_2d);
+                graphics::set_texture(&display_tex, 0);
+                graphics::set_texture_sampler(&tex_sampler, 0);
+                graphics::draw_mesh(&quad_mesh);
+                graphics::unset_texture(0);
+            } else if(render_dof) {
+                PROFILE_SCOPE("dof_render");
+                // Any change of the settings (camera included) or of the simulation starts a new image.
+                RenderingSettings dof_settings = rendering_settings;
+                dof_settings.progressive_frame = 0;
+                bool same_image = progressive_dof && !simulation_changed && dof_type == last_dof_type &&
+                                  memcmp(&dof_settings, &last_dof_settings, sizeof(RenderingSettings)) == 0;
+                last_dof_settings = dof_settings;
+                last_dof_type = dof_type;
+                simulation_changed = false;
+                bool converged = same_image && rendering_settings.progressive_frame + 1 >= DOF_PROGRESSIVE_MAX_FRAMES;
+                if (!same_image) {
+                    rendering_settings.progressive_frame = 0;
+                } else if (!converged) {
+                    rendering_settings.progressive_frame++;
+                }
+
+                // Converged image stays in display_tex.
+                if (!converged) {
+                    uint32_t clear_tex_uint[4] = {0, 0, 0, 0};
+                    graphics_context->context->ClearUnorderedAccessViewUint(display_tex_uint.ua_view, clear_tex_uint);
+
+                    graphics::update_constant_buffer(&rendering_settings_buffer, &rendering_settings);
+                    graphics::set_texture_compute(&display_tex_uint, 1);
+
+                    if (dof_type == DofType::TRAIL) {
+                        graphics::set_compute_shader(&draw_compute_shader_trail);
+                        if (is_a) {
+                            graphics::set_texture_compute(&trail_tex_B, 0);
+                        } else {
+                            graphics::set_texture_compute(&trail_tex_A, 0);
+                        }
+                        graphics::run_compute(world_width / 2, world_height / 2, world_depth / 2);
                     } else {
-                        graphics::set_compute_shader(&draw_compute_shader_particle_pair);
-                        graphics::set_structured_buffer(&particles_buffer_pair, 6);
+                        if (dof_type == DofType::PARTICLES) {
+                            graphics::set_compute_shader(&draw_compute_shader_particle);
+                        } else {
+                            graphics::set_compute_shader(&draw_compute_shader_particle_pair);
+                            graphics::set_structured_buffer(&particles_buffer_pair, 6);
+                        }
+                        run_particle_compute();
                     }
-                    graphics::run_compute(10, 10, 1);
-                }
 
-                graphics::set_compute_shader(&blit_compute_shader);
-                graphics::set_texture_compute(&display_tex_uint, 0);
-                graphics::set_texture_compute(&display_tex, 1);
-                graphics::run_compute(window_width, window_height, 1);
+                    graphics::set_compute_shader(&blit_compute_shader);
+                    graphics::set_texture_compute(&display_tex_uint, 0);
+                    graphics::set_texture_compute(&display_tex, 1);
+                    graphics::set_texture_compute(&display_tex_accum, 2);
+                    graphics::run_compute(window_width, window_height, 1);
 
-                graphics::unset_texture_compute(0);
-                graphics::unset_texture_compute(1);
+                    graphics::unset_texture_compute(0);
+                    graphics::unset_texture_compute(1);
+                    graphics::unset_texture_compute(2);
+                }
+
+                if (recorder) {
+                    graphics_context->context->CopyResource(record_staging[record_copies % RECORD_LATENCY], display_tex.texture);
+                    record_copies++;
+                    // Oldest copy is done by now, so mapping it doesn't stall.
+                    if (record_copies >= RECORD_LATENCY) {
+                        read_recorded_frame(record_copies - RECORD_LATENCY);
+                    }
+                }
 
                 graphics::set_vertex_shader(&vertex_shader_2d);
                 graphics::set_pixel_shader(&pixel_shader_2d);
@@ -489,6 +882,7 @@ int main(int argc, char **argv)
                 graphics::draw_mesh(&quad_mesh);
                 graphics::unset_texture(0);
             } else {
+                PROFILE_SCOPE("slice_render");
                 graphics::set_vertex_shader(&vertex_shader);
                 graphics::set_pixel_shader(&pixel_shader);
 
@@ -519,52 +913,50 @@ int main(int argc, char **argv)
 
         // UI
         if (show_ui) {
+            PROFILE_SCOPE("ui");
             graphics::set_render_targets_viewport(&render_target_window);
 
             Panel panel = ui::start_panel("", Vector2(10.0f, 10.0f));
 
-            if (use_midi) {
-                config.sense_spread = midi::get_controller_state(AKAI_MIDIMIX_SLIDER_0) * math::PIHALF;
-            }
-            float ss = math::rad2deg(config.sense_spread);
+            // Sliders edit a copy, changes reach the simulation as control events in the next frame.
+            Config ui_config = *config;
+            float ss = math::rad2deg(ui_config.sense_spread);
             ui::add_slider(&panel, "SENSE SPREAD", &ss, 0.0, 90.0);
-            config.sense_spread = math::deg2rad(ss);
+            if (ss != math::rad2deg(config->sense_spread)) ui_config.sense_spread = math::deg2rad(ss);
 
-            if (use_midi) {
-                config.sense_distance = midi::get_controller_state(AKAI_MIDIMIX_SLIDER_1) * 100.0f;
-            }
-            ui::add_slider(&panel, "SENSE DISTANCE", &config.sense_distance, 0.0, 100.0);
+            ui::add_slider(&panel, "SENSE DISTANCE", &ui_config.sense_distance, 0.0, 100.0);
 
-            if (use_midi) {
-                config.turn_angle = midi::get_controller_state(AKAI_MIDIMIX_SLIDER_2) * math::PIHALF;
-            }
-            float ts = math::rad2deg(config.turn_angle);
+            float ts = math::rad2deg(ui_config.turn_angle);
             ui::add_slider(&panel, "TURN ANGLE", &ts, 0.0, 90.0);
-            config.turn_angle = math::deg2rad(ts);
-
-            if (use_midi) {
-                config.move_distance = midi::get_controller_state(AKAI_MIDIMIX_SLIDER_3) * 20.0f;
-            }
-            ui::add_slider(&panel, "MOVE DISTANCE", &config.move_distance, 0.0, 20.0);
-
-            if (use_midi) {
-                config.deposit_value = midi::get_controller_state(AKAI_MIDIMIX_SLIDER_4) * 5.0;
-            }
-            ui::add_slider(&panel, "DEPOSIT VALUE", &config.deposit_value, 0.0, 5.0);
-
-            if (use_midi) {
-                config.decay_factor = midi::get_controller_state(AKAI_MIDIMIX_SLIDER_5) * 1.0;
-            }
-            ui::add_slider(&panel, "DECAY FACTOR", &config.decay_factor, 0.0, 1.0);
-            ui::add_slider(&panel, "SPAWN RADIUS", &spawn_radius, 20.0f, world_height / 2.0f);
-            ui::add_slider(&panel, "CENTER ATTRACTION", &config.center_attraction, 0.0, 5.0);
-            ui::add_slider(&panel, "MOVE SENSE COEF", &config.move_sense_coef, -1.0, 1.0);
-            ui::add_slider(&panel, "MOVE SENSE OFFSET", &config.move_sense_offset, 0.0, 1.0);
-            bool collision = config.collision > 0.0f;
+            if (ts != math::rad2deg(config->turn_angle)) ui_config.turn_angle = math::deg2rad(ts);
+
+            ui::add_slider(&panel, "MOVE DISTANCE", &ui_config.move_distance, 0.0, 20.0);
+            ui::add_slider(&panel, "DEPOSIT VALUE", &ui_config.deposit_value, 0.0, 5.0);
+            ui::add_slider(&panel, "DECAY FACTOR", &ui_config.decay_factor, 0.0, 1.0);
+            float ui_spawn_radius = spawn_radius;
+            ui::add_slider(&panel, "SPAWN RADIUS", &ui_spawn_radius, 20.0f, world_height / 2.0f);
+            if (ui_spawn_radius != spawn_radius) control::push(input_queue, ControlField::SPAWN_RADIUS, ControlSource::UI, ui_spawn_radius);
+            float particles_k = particle_count / 1000.0f;
+            ui::add_slider(&panel, "PARTICLES (K)", &particles_k, 1.0f, 4000.0f);
+            uint32_t ui_particle_count = uint32_t(particles_k * 1000.0f + 0.5f);
+            if (ui_particle_count != particle_count) control::push(input_queue, ControlField::PARTICLE_COUNT, ControlSource::UI, float(ui_particle_count));
+            ui::add_slider(&panel, "CENTER ATTRACTION", &ui_config.center_attraction, 0.0, 5.0);
+            ui::add_slider(&panel, "MOVE SENSE COEF", &ui_config.move_sense_coef, -1.0, 1.0);
+            ui::add_slider(&panel, "MOVE SENSE OFFSET", &ui_config.move_sense_offset, 0.0, 1.0);
+            bool collision = ui_config.collision > 0.0f;
             ui::add_toggle(&panel, "COLLISION", &collision);
-            config.collision = collision ? 1.0f : 0.0f;
+            ui_config.collision = collision ? 1.0f : 0.0f;
+            control::push_changes(input_queue, ControlSource::UI, config, &ui_config);
 
             ui::add_toggle(&panel, "DoF RENDERING", &render_dof);
+            ui::add_toggle(&panel, "2D PREVIEW", &run_2d);
+            if (run_2d) {
+                // Simulation and rendering run at their own rates, bars show them against 120 per second.
+                snprintf(rate_labels_2d[0], sizeof(rate_labels_2d[0]), "2D STEPS/S %.1f", steps_per_second_2d);
+                ui::add_slider(&panel, rate_labels_2d[0], &steps_per_second_2d, 0.0, 120.0);
+                snprintf(rate_labels_2d[1], sizeof(rate_labels_2d[1]), "2D FRAMES/S %.1f", frames_per_second_2d);
+                ui::add_slider(&panel, rate_labels_2d[1], &frames_per_second_2d, 0.0, 120.0);
+            }
             ui::end_panel(&panel);
 
             Vector4 panel_rect = ui::get_panel_rect(&panel);
@@ -599,13 +991,44 @@ int main(int argc, char **argv)
                 ui::add_slider(&panel, "ITERATION", &i, 0.0, 2500);
                 rendering_settings.iterations = int(i);
                 ui::add_slider(&panel, "PAIR BREAK DISTANCE", &rendering_settings.break_distance, 0.0, 512);
+                ui::add_toggle(&panel, "PROGRESSIVE", &progressive_dof);
+                ui::end_panel(&panel);
+            }
+
+            // Per stage p50/p99 over the last PROFILE_HISTORY frames, bars show p50 against a 60 Hz frame.
+            if (show_profiler) {
+                Panel panel = ui::start_panel("", Vector2(window_width - 320.0f, 10.0f));
+                uint32_t stage_count = profiler::get_stats(profile_stats, PROFILER_OVERLAY_STAGES);
+                for (uint32_t i = 0; i < stage_count; ++i) {
+                    snprintf(profile_labels[i], sizeof(profile_labels[i]), "%s %.2f/%.2f MS", profile_stats[i].name, profile_stats[i].p50, profile_stats[i].p99);
+                    ui::add_slider(&panel, profile_labels[i], &profile_stats[i].p50, 0.0, 16.7);
+                }
                 ui::end_panel(&panel);
             }
 
             ui::end_frame();
         }
 
-        graphics::swap_frames();
+        {
+            PROFILE_SCOPE("present");
+            graphics::swap_frames();
+        }
+        profiler::end_frame();
+    }
+
+    if (recorder) {
+        stop_recording();
+    }
+    if (thread_2d.joinable()) {
+        stop_simulation_2d();
+    }
+    if (pool_2d) {
+        thread_pool::release(pool_2d);
+        thread_pool::release(render_pool_2d);
+        pipeline::release(pipeline_2d);
+        sim2d::release(&particles_2d);
+        sim2d::release(&world_2d);
+        free(pixels_2d);
     }
 
     graphics::release(&render_target_window);
@@ -626,15 +1049,17 @@ int main(int argc, char **argv)
     graphics::release(&trail_tex_B);
     graphics::release(&display_tex);
     graphics::release(&display_tex_uint);
+    graphics::release(&display_tex_accum);
     graphics::release(&occ_tex);
     graphics::release(&tex_sampler);
     graphics::release(&config_buffer);
-    graphics::release(&particles_buffer_x);
-    graphics::release(&particles_buffer_y);
-    graphics::release(&particles_buffer_theta);
-    graphics::release(&particles_buffer_z);
-    graphics::release(&particles_buffer_phi);
-    graphics::release(&particles_buffer_pair);
+    release_particle_buffers();
+    free(particles_x);
+    free(particles_y);
+    free(particles_z);
+    free(particles_phi);
+    free(particles_theta);
+    free(particles_pair);
     graphics::release(&rendering_settings_buffer);
 
     //graphics::show_live_objects();
@@ -642,6 +1067,11 @@ int main(int argc, char **argv)
     graphics::release();
 
     midi::release();
+    if (control_log) control::close_log(control_log, control_frame - log_start_frame);
+    control::release(midi_queue);
+    control::release(input_queue);
+    free(frame_events);
+    profiler::release();
 
     return 0;
 }
\ No newline at end of file
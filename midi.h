@@ -1,10 +1,21 @@
 #pragma once
 
 #include <stdint.h>
+#include "control.h"
   
+// Controller bound to a control field, its value 0-1 is multiplied by scale.
+struct MidiBinding {
+    uint8_t controller_id;
+    ControlField field;
+    float scale;
+};
+
 // API definition
 namespace midi {
-    int  init();
+    // Changes of bound controllers are pushed into `queue` from the MIDI callback thread as events of their
+    // fields, changes of other controllers only update their state. Queue can be NULL. Bindings are not copied
+    // and have to outlive the device.
+    int  init(ControlQueue *queue, const MidiBinding *bindings, uint32_t binding_count);
     void release();
 
     float get_controller_state(uint8_t controller_id);
@@ -84,6 +95,10 @@ namespace midi {
 // Globally stored handle to a device
 static HMIDIIN device_handle;
 
+// Bindings of controllers to control fields, only read by the callback
+static const MidiBinding *controller_bindings;
+static uint32_t controller_binding_count;
+
 // Storing button states
 static uint8_t controller_states[256];
 static bool    button_states[256];
@@ -95,11 +110,19 @@ void CALLBACK MidiInProc(HMIDIIN hMidiIn, UINT wMsg, DWORD_PTR dwInstance, DWORD
     if (wMsg == MIM_DATA) {
         uint8_t controller_id = first_byte;
         uint8_t value = second_byte;
+        ControlQueue *queue = (ControlQueue *)dwInstance;
         switch (status_byte) {
             case 0xB0:
             {
                 // Controller value changed
                 controller_states[controller_id] = value;
+                if (queue) {
+                    for (uint32_t i = 0; i < controller_binding_count; ++i) {
+                        const MidiBinding *binding = &controller_bindings[i];
+                        if (binding->controller_id != controller_id) continue;
+                        control::push(queue, binding->field, ControlSource::MIDI, value / 127.0f * binding->scale);
+                    }
+                }
             }
             break;
             case 0x90:
@@ -119,13 +142,17 @@ void CALLBACK MidiInProc(HMIDIIN hMidiIn, UINT wMsg, DWORD_PTR dwInstance, DWORD
     return;
 }
 
-int midi::init() {
+int midi::init(ControlQueue *queue, const MidiBinding *bindings, uint32_t binding_count) {
+    // Set before the device is opened, the callback can run as soon as it is.
+    controller_bindings = bindings;
+    controller_binding_count = binding_count;
+
     UINT num = midiInGetNumDevs();
     if (num == 0) {
         return MIDI_NO_DEVICE_FOUND;
     }
 
-    MMRESULT result = midiInOpen(&device_handle, 0, (DWORD_PTR)&MidiInProc, 0, CALLBACK_FUNCTION | MIDI_IO_STATUS);
+    MMRESULT result = midiInOpen(&device_handle, 0, (DWORD_PTR)&MidiInProc, (DWORD_PTR)queue, CALLBACK_FUNCTION | MIDI_IO_STATUS);
     if (result != MMSYSERR_NOERROR) {
         return MIDI_CANNOT_OPEN_HANDLE;
     }
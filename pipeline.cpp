@@ -0,0 +1,208 @@
+#include "pipeline.h"
+#include "sim_trail.h"
+#include "thread_pool.h"
+#include "profiler.h"
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+// Bit of Pipeline::middle set while middle state is newer than consumer's front state.
+#define PIPELINE_FRESH 4
+// Bytes of trail copied by a single thread pool task.
+#define COPY_CHUNK_SIZE (1 << 20)
+
+struct Pipeline {
+    PipelineState states[3];
+    // Index of middle state, with PIPELINE_FRESH. Swapped by both sides, back and front are private.
+    std::atomic<uint32_t> middle;
+    uint32_t back;
+    uint32_t front;
+    // Pairs of the consumer's last state, saved before its state goes back to the simulation.
+    uint32_t *pairs;
+    uint32_t pair_count;
+    uint32_t pair_capacity;
+
+    // Only used to let consumer sleep while there's nothing new.
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool closed;
+
+    std::atomic<uint64_t> published;
+    std::atomic<uint64_t> acquired;
+    // Written by the simulation thread only, atomic so stats can be read while it runs.
+    std::atomic<double> publish_duration;
+};
+
+static double get_time() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void copy(void *dst, const void *src, size_t size, ThreadPool *pool) {
+    uint32_t chunk_count = uint32_t((size + COPY_CHUNK_SIZE - 1) / COPY_CHUNK_SIZE);
+    thread_pool::run(pool, chunk_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        size_t offset = size_t(begin) * COPY_CHUNK_SIZE;
+        size_t last = size_t(end) * COPY_CHUNK_SIZE < size ? size_t(end) * COPY_CHUNK_SIZE : size;
+        memcpy((uint8_t *)dst + offset, (const uint8_t *)src + offset, last - offset);
+    });
+}
+
+static Pipeline *get_pipeline() {
+    Pipeline *pipeline = new Pipeline();
+    for (uint32_t i = 0; i < 3; ++i) {
+        PipelineState *state = &pipeline->states[i];
+        state->world = {};
+        state->particles = sim::get_particles(0);
+        state->world_2d = {};
+        state->step = 0;
+    }
+    pipeline->middle = 1;
+    pipeline->back = 0;
+    pipeline->front = 2;
+    pipeline->pairs = NULL;
+    pipeline->pair_count = 0;
+    pipeline->pair_capacity = 0;
+    pipeline->closed = false;
+    pipeline->published = 0;
+    pipeline->acquired = 0;
+    pipeline->publish_duration = 0.0;
+    return pipeline;
+}
+
+Pipeline *pipeline::get(World *world) {
+    Pipeline *pipeline = get_pipeline();
+    for (uint32_t i = 0; i < 3; ++i) {
+        // States are only read, a single trail buffer is enough.
+        pipeline->states[i].world = sim::get_world(world->width, world->height, world->depth, world->trail_format, SimDecayBuffer::IN_PLACE);
+    }
+    return pipeline;
+}
+
+Pipeline *pipeline::get(World2D *world) {
+    Pipeline *pipeline = get_pipeline();
+    for (uint32_t i = 0; i < 3; ++i) {
+        World2D *out = &pipeline->states[i].world_2d;
+        *out = *world;
+        out->trail = (float *)calloc(size_t(world->tiles_x) * world->tiles_y * SIM2D_TILE_SIZE * SIM2D_TILE_SIZE, sizeof(float));
+        out->trail_back = NULL;
+    }
+    return pipeline;
+}
+
+void pipeline::release(Pipeline *pipeline) {
+    for (uint32_t i = 0; i < 3; ++i) {
+        sim::release(&pipeline->states[i].world);
+        sim::release(&pipeline->states[i].particles);
+        sim2d::release(&pipeline->states[i].world_2d);
+    }
+    free(pipeline->pairs);
+    delete pipeline;
+}
+
+// Publishes the back state, start is when its copy started.
+static void swap_back(Pipeline *pipeline, double start) {
+    // Acquire-release pairs with the consumer's exchange, so the copy is visible before the index.
+    uint32_t previous = pipeline->middle.exchange(pipeline->back | PIPELINE_FRESH, std::memory_order_acq_rel);
+    pipeline->back = previous & ~PIPELINE_FRESH;
+    pipeline->published.fetch_add(1, std::memory_order_relaxed);
+    {
+        // Taking the lock keeps the notification from slipping between consumer's check and its wait.
+        std::lock_guard<std::mutex> lock(pipeline->mutex);
+    }
+    pipeline->ready.notify_one();
+    pipeline->publish_duration.store(pipeline->publish_duration.load(std::memory_order_relaxed) + get_time() - start, std::memory_order_relaxed);
+}
+
+void pipeline::publish(Pipeline *pipeline, World *world, Particles *particles, uint32_t step, ThreadPool *pool) {
+    PROFILE_SCOPE("publish");
+    double start = get_time();
+    PipelineState *state = &pipeline->states[pipeline->back];
+    World *out = &state->world;
+    uint32_t brick_count = sim::get_brick_count(world);
+    copy(out->trail.voxels, world->trail.voxels, sim::get_voxel_count(world) * trail::get_voxel_size(world->trail_format), pool);
+    if (world->trail_format == SimTrailFormat::UNORM8) {
+        memcpy(out->trail.brick_offset, world->trail.brick_offset, sizeof(float) * brick_count);
+        memcpy(out->trail.brick_scale, world->trail.brick_scale, sizeof(float) * brick_count);
+    }
+    memcpy(out->brick_flags, world->brick_flags, sizeof(uint8_t) * brick_count);
+    memcpy(out->active_bricks, world->active_bricks, sizeof(uint32_t) * world->active_brick_count);
+    memcpy(out->brick_max, world->brick_max, sizeof(float) * brick_count);
+    out->active_brick_count = world->active_brick_count;
+    out->brick_threshold = world->brick_threshold;
+    out->center_z = world->center_z;
+
+    Particles *out_particles = &state->particles;
+    sim::reserve_particles(out_particles, particles->count);
+    copy(out_particles->x, particles->x, sizeof(float) * particles->count, pool);
+    copy(out_particles->y, particles->y, sizeof(float) * particles->count, pool);
+    copy(out_particles->z, particles->z, sizeof(float) * particles->count, pool);
+    out_particles->count = particles->count;
+    state->step = step;
+
+    swap_back(pipeline, start);
+}
+
+void pipeline::publish(Pipeline *pipeline, World2D *world, uint32_t step, ThreadPool *pool) {
+    PROFILE_SCOPE("publish");
+    double start = get_time();
+    PipelineState *state = &pipeline->states[pipeline->back];
+    size_t cell_count = size_t(world->tiles_x) * world->tiles_y * SIM2D_TILE_SIZE * SIM2D_TILE_SIZE;
+    copy(state->world_2d.trail, world->trail, sizeof(float) * cell_count, pool);
+    state->step = step;
+    swap_back(pipeline, start);
+}
+
+void pipeline::close(Pipeline *pipeline) {
+    {
+        std::lock_guard<std::mutex> lock(pipeline->mutex);
+        pipeline->closed = true;
+    }
+    pipeline->ready.notify_one();
+}
+
+PipelineState *pipeline::acquire(Pipeline *pipeline) {
+    {
+        std::unique_lock<std::mutex> lock(pipeline->mutex);
+        pipeline->ready.wait(lock, [pipeline]() {
+            return (pipeline->middle.load(std::memory_order_acquire) & PIPELINE_FRESH) || pipeline->closed;
+        });
+    }
+    return pipeline::try_acquire(pipeline);
+}
+
+PipelineState *pipeline::try_acquire(Pipeline *pipeline) {
+    if (!(pipeline->middle.load(std::memory_order_acquire) & PIPELINE_FRESH)) return NULL;
+
+    // Front state can be overwritten by the simulation as soon as it's swapped out, pairs are saved first.
+    Particles *previous = &pipeline->states[pipeline->front].particles;
+    if (previous->count > pipeline->pair_capacity) {
+        pipeline->pair_capacity = previous->count;
+        pipeline->pairs = (uint32_t *)realloc(pipeline->pairs, sizeof(uint32_t) * pipeline->pair_capacity);
+    }
+    memcpy(pipeline->pairs, previous->pair, sizeof(uint32_t) * previous->count);
+    pipeline->pair_count = previous->count;
+
+    uint32_t middle = pipeline->middle.exchange(pipeline->front, std::memory_order_acq_rel);
+    pipeline->front = middle & ~PIPELINE_FRESH;
+    pipeline->acquired.fetch_add(1, std::memory_order_relaxed);
+
+    // Pairs past the previous count, SIM_NO_PAIR included, mean no buddy yet.
+    Particles *particles = &pipeline->states[pipeline->front].particles;
+    uint32_t kept = pipeline->pair_count < particles->count ? pipeline->pair_count : particles->count;
+    memcpy(particles->pair, pipeline->pairs, sizeof(uint32_t) * kept);
+    for (uint32_t i = kept; i < particles->count; ++i) {
+        particles->pair[i] = SIM_NO_PAIR;
+    }
+    return &pipeline->states[pipeline->front];
+}
+
+PipelineStats pipeline::get_stats(Pipeline *pipeline) {
+    PipelineStats stats = {};
+    stats.published = pipeline->published.load(std::memory_order_relaxed);
+    stats.acquired = pipeline->acquired.load(std::memory_order_relaxed);
+    stats.publish_duration = pipeline->publish_duration.load(std::memory_order_relaxed);
+    return stats;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include "sim.h"
+#include "sim2d.h"
+
+// Hands simulation state from the simulation thread to a consumer thread (DoF render + frame encode, or the
+// frame loop showing the 2D preview) through a triple buffer. Simulation copies trail and particles into its
+// back state and swaps it with the middle one, consumer swaps its front state with the middle one whenever a
+// newer state was published. Neither side waits for the other: simulation overwrites states the consumer
+// didn't get to, consumer always renders the latest one, so simulation speed doesn't depend on how long
+// rendering and encoding take.
+//
+// States hold trail with its bricks (everything renderers read) and particle positions. Particle pairs belong
+// to the consumer, they carry over from state to state, so DoF particle pairs keep their buddies. States of a
+// 2D pipeline only hold the trail map of world_2d, which is all the 2D preview image is made of.
+struct PipelineState {
+    World world;
+    Particles particles;
+    World2D world_2d;
+    uint32_t step;
+};
+
+struct PipelineStats {
+    uint64_t published;
+    uint64_t acquired;
+    // Time simulation thread spent copying states, in seconds.
+    double publish_duration;
+};
+
+struct Pipeline;
+
+namespace pipeline {
+    // States have the size and trail format of `world`, particle arrays grow with published counts.
+    Pipeline *get(World *world);
+    // 2D pipeline, states have the size of `world`.
+    Pipeline *get(World2D *world);
+    void release(Pipeline *pipeline);
+
+    // Simulation side. Copies state into the back state, using threads of pool, and publishes it.
+    void publish(Pipeline *pipeline, World *world, Particles *particles, uint32_t step, ThreadPool *pool);
+    void publish(Pipeline *pipeline, World2D *world, uint32_t step, ThreadPool *pool);
+    // No more states will be published, acquire returns NULL once the last one was taken.
+    void close(Pipeline *pipeline);
+
+    // Consumer side. Waits for a state newer than the previous one and returns it, it stays valid until the
+    // next acquire. Returns NULL after close.
+    PipelineState *acquire(Pipeline *pipeline);
+    // Same as acquire without waiting, returns NULL if nothing newer was published. Previous state stays valid
+    // then, so a frame loop can keep showing it.
+    PipelineState *try_acquire(Pipeline *pipeline);
+
+    PipelineStats get_stats(Pipeline *pipeline);
+}
@@ -0,0 +1,196 @@
+// Every ring has a single writer, its thread. Readers (end_frame, write_trace) copy events between their
+// cursor and the write index and then check the write index again: events the writer might have
+// overwritten during the copy are thrown away, so readers never block the writer.
+#include "profiler.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define RING_SIZE 4096
+#define MAX_STAGES 64
+
+struct ProfileEvent {
+    const char *name;
+    uint64_t begin;
+    uint64_t end;
+};
+
+struct ProfileRing {
+    ProfileEvent events[RING_SIZE];
+    std::atomic<uint64_t> write_index;
+    // Next event end_frame hasn't seen yet.
+    uint64_t frame_cursor;
+    uint32_t thread_id;
+};
+
+struct ProfileStage {
+    const char *name;
+    float frame_time;
+    float history[PROFILE_HISTORY];
+    uint32_t history_count;
+};
+
+static std::atomic<bool> enabled(false);
+static std::mutex rings_mutex;
+static std::vector<ProfileRing *> rings;
+static thread_local ProfileRing *thread_ring = NULL;
+
+static ProfileStage stages[MAX_STAGES];
+static uint32_t stage_count = 0;
+static uint64_t frame_count = 0;
+
+static inline uint64_t get_ticks() {
+    using namespace std::chrono;
+    return uint64_t(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count());
+}
+
+static ProfileRing *get_thread_ring() {
+    if (!thread_ring) {
+        ProfileRing *ring = new ProfileRing();
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        ring->thread_id = uint32_t(rings.size());
+        rings.push_back(ring);
+        thread_ring = ring;
+    }
+    return thread_ring;
+}
+
+// Copies events [from, write index) which are still in the ring, returns index after the last copied one.
+static uint64_t read_events(ProfileRing *ring, uint64_t from, std::vector<ProfileEvent> *events) {
+    uint64_t end = ring->write_index.load(std::memory_order_acquire);
+    uint64_t begin = end > RING_SIZE && from < end - RING_SIZE ? end - RING_SIZE : from;
+    size_t first = events->size();
+    for (uint64_t i = begin; i < end; ++i) {
+        events->push_back(ring->events[i % RING_SIZE]);
+    }
+    // Writer could have overwritten the oldest events while they were copied, including the slot
+    // it might be writing right now.
+    uint64_t new_end = ring->write_index.load(std::memory_order_acquire) + 1;
+    uint64_t overwritten = new_end > RING_SIZE + begin ? new_end - RING_SIZE - begin : 0;
+    overwritten = std::min(overwritten, end - begin);
+    events->erase(events->begin() + first, events->begin() + first + size_t(overwritten));
+    return end;
+}
+
+ProfileScope::ProfileScope(const char *name) {
+    this->name = name;
+    this->begin = enabled.load(std::memory_order_relaxed) ? get_ticks() : 0;
+}
+
+ProfileScope::~ProfileScope() {
+    if (!begin) return;
+    ProfileRing *ring = get_thread_ring();
+    uint64_t index = ring->write_index.load(std::memory_order_relaxed);
+    ProfileEvent *event = &ring->events[index % RING_SIZE];
+    event->name = name;
+    event->begin = begin;
+    event->end = get_ticks();
+    ring->write_index.store(index + 1, std::memory_order_release);
+}
+
+void profiler::set_enabled(bool is_enabled) {
+    enabled.store(is_enabled);
+}
+
+bool profiler::is_enabled() {
+    return enabled.load();
+}
+
+static ProfileStage *get_stage(const char *name) {
+    for (uint32_t i = 0; i < stage_count; ++i) {
+        if (stages[i].name == name || strcmp(stages[i].name, name) == 0) return &stages[i];
+    }
+    if (stage_count == MAX_STAGES) return NULL;
+    ProfileStage *stage = &stages[stage_count++];
+    memset(stage, 0, sizeof(ProfileStage));
+    stage->name = name;
+    return stage;
+}
+
+void profiler::end_frame() {
+    std::vector<ProfileEvent> events;
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        for (ProfileRing *ring : rings) {
+            ring->frame_cursor = read_events(ring, ring->frame_cursor, &events);
+        }
+    }
+
+    for (uint32_t i = 0; i < stage_count; ++i) {
+        stages[i].frame_time = 0.0f;
+    }
+    for (ProfileEvent &event : events) {
+        ProfileStage *stage = get_stage(event.name);
+        if (stage) stage->frame_time += float(event.end - event.begin) * 1e-6f;
+    }
+    // Stages which didn't run this frame count as zero, so p50 reflects how often they run.
+    for (uint32_t i = 0; i < stage_count; ++i) {
+        ProfileStage *stage = &stages[i];
+        stage->history[frame_count % PROFILE_HISTORY] = stage->frame_time;
+        if (stage->history_count < PROFILE_HISTORY) stage->history_count++;
+    }
+    frame_count++;
+}
+
+uint32_t profiler::get_stats(ProfileStats *stats, uint32_t max_count) {
+    uint32_t count = std::min(stage_count, max_count);
+    float sorted[PROFILE_HISTORY];
+    for (uint32_t i = 0; i < count; ++i) {
+        ProfileStage *stage = &stages[i];
+        uint32_t n = stage->history_count;
+        memcpy(sorted, stage->history, sizeof(float) * n);
+        std::sort(sorted, sorted + n);
+        stats[i].name = stage->name;
+        stats[i].last = stage->frame_time;
+        stats[i].p50 = n ? sorted[n / 2] : 0.0f;
+        stats[i].p99 = n ? sorted[std::min(n - 1, n * 99 / 100)] : 0.0f;
+    }
+    return count;
+}
+
+bool profiler::write_trace(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) return false;
+
+    std::vector<ProfileEvent> events;
+    std::vector<uint32_t> thread_ids;
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        for (ProfileRing *ring : rings) {
+            size_t first = events.size();
+            read_events(ring, 0, &events);
+            thread_ids.insert(thread_ids.end(), events.size() - first, ring->thread_id);
+        }
+    }
+    uint64_t origin = UINT64_MAX;
+    for (ProfileEvent &event : events) {
+        origin = std::min(origin, event.begin);
+    }
+
+    // Complete events ("X"), timestamps and durations in microseconds.
+    fprintf(file, "{\"traceEvents\":[\n");
+    for (size_t i = 0; i < events.size(); ++i) {
+        ProfileEvent *event = &events[i];
+        fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+                event->name, thread_ids[i], double(event->begin - origin) * 1e-3, double(event->end - event->begin) * 1e-3,
+                i + 1 < events.size() ? "," : "");
+    }
+    fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(file) == 0;
+}
+
+void profiler::release() {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    for (ProfileRing *ring : rings) {
+        delete ring;
+    }
+    rings.clear();
+    thread_ring = NULL;
+    stage_count = 0;
+    frame_count = 0;
+}
@@ -0,0 +1,397 @@
+// CPU volume renderer for previews of the trail, replacement of the slice view of physarum.exe, which blends
+// 3 * world_depth textured quads over the whole screen no matter how much of the volume is empty.
+//
+// Every pixel casts a ray through the world and composites trilinear samples front to back. Empty space is
+// skipped with a max pyramid built from World::brick_max: a ray in a cell with no visible trail jumps to the
+// cell's exit and continues one level up, non-empty cells are descended into, so rays only take samples in
+// bricks next to trail. Rays stop once they are opaque. Cost follows visible structure instead of world size.
+#include "raymarch.h"
+#include "sim_trail.h"
+#include "thread_pool.h"
+#include "profiler.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TILE_SIZE 16
+
+// pixel_shader.hlsl displays image values divided by 5.
+#define DISPLAY_SCALE (1.0f / 5.0f)
+
+// Grid of pixel_shader_3d.hlsl: GRID_SIZE + 1 points along every axis, each a cube 1 / N of grid cell wide.
+#define GRID_N 30.0f
+#define GRID_SIZE 5.0f
+#define GRID_OPACITY 0.3f
+
+// Ray positions are looked up this far past a cell boundary, so a ray at the boundary is in the next cell.
+#define CELL_EPSILON 1e-3f
+
+struct Float3 {
+    float x, y, z;
+};
+
+static void multiply(const float *a, const float *b, float *out) {
+    for (int r = 0; r < 4; ++r) {
+        for (int c = 0; c < 4; ++c) {
+            out[r * 4 + c] = a[r * 4] * b[c] + a[r * 4 + 1] * b[4 + c] + a[r * 4 + 2] * b[8 + c] + a[r * 4 + 3] * b[12 + c];
+        }
+    }
+}
+
+// Gauss-Jordan elimination with partial pivoting. Returns false for singular matrix.
+static bool invert(const float *m, float *out) {
+    double a[4][8];
+    for (int r = 0; r < 4; ++r) {
+        for (int c = 0; c < 4; ++c) {
+            a[r][c] = m[r * 4 + c];
+            a[r][c + 4] = r == c ? 1.0 : 0.0;
+        }
+    }
+    for (int c = 0; c < 4; ++c) {
+        int pivot = c;
+        for (int r = c + 1; r < 4; ++r) {
+            if (fabs(a[r][c]) > fabs(a[pivot][c])) pivot = r;
+        }
+        if (a[pivot][c] == 0.0) return false;
+        for (int i = 0; i < 8; ++i) {
+            double tmp = a[c][i];
+            a[c][i] = a[pivot][i];
+            a[pivot][i] = tmp;
+        }
+        double inverse_pivot = 1.0 / a[c][c];
+        for (int i = 0; i < 8; ++i) a[c][i] *= inverse_pivot;
+        for (int r = 0; r < 4; ++r) {
+            if (r == c || a[r][c] == 0.0) continue;
+            double factor = a[r][c];
+            for (int i = 0; i < 8; ++i) a[r][i] -= factor * a[c][i];
+        }
+    }
+    for (int r = 0; r < 4; ++r) {
+        for (int c = 0; c < 4; ++c) {
+            out[r * 4 + c] = float(a[r][c + 4]);
+        }
+    }
+    return true;
+}
+
+// Unprojects normalized device coordinates into world voxel space. Scene space is the [-1, 1] cube with y and z
+// flipped relative to voxels, same as to_view_space in dof.cpp.
+static Float3 unproject(const float *inverse, World *world, float x, float y, float z) {
+    float p[4];
+    for (int r = 0; r < 4; ++r) {
+        p[r] = inverse[r * 4] * x + inverse[r * 4 + 1] * y + inverse[r * 4 + 2] * z + inverse[r * 4 + 3];
+    }
+    Float3 result = {
+        (p[0] / p[3] + 1.0f) * 0.5f * float(world->width),
+        (1.0f - p[1] / p[3]) * 0.5f * float(world->height),
+        (1.0f - p[2] / p[3]) * 0.5f * float(world->depth),
+    };
+    return result;
+}
+
+// Whether position (in voxels) along an axis of `size` voxels is inside one of the grid cubes.
+static inline bool on_grid(float position, float size) {
+    float g = position / size * (GRID_SIZE + 1.0f / GRID_N);
+    return g - floorf(g) < 1.0f / GRID_N;
+}
+
+// Whether any position of [begin, end) along an axis is inside one of the grid cubes.
+static bool range_on_grid(float begin, float end, float size) {
+    float scale = (GRID_SIZE + 1.0f / GRID_N) / size;
+    float g0 = begin * scale, g1 = end * scale;
+    return g0 - floorf(g0) < 1.0f / GRID_N || ceilf(g0) < g1;
+}
+
+RaymarchSettings raymarch::get_settings(uint32_t width, uint32_t height) {
+    DofSettings camera = dof::get_settings(width, height);
+    RaymarchSettings settings = {};
+    memcpy(settings.projection, camera.projection, sizeof(settings.projection));
+    memcpy(settings.view, camera.view, sizeof(settings.view));
+    settings.opacity_scale = DISPLAY_SCALE;
+    // Slice view blends a slice per voxel.
+    settings.step = 1.0f;
+    // Skipped cells can't add more than this per sample, which is invisible in 16-bit output.
+    settings.empty_opacity = 1e-5f;
+    settings.max_opacity = 0.999f;
+    return settings;
+}
+
+RaymarchPyramid raymarch::get_pyramid() {
+    RaymarchPyramid pyramid = {};
+    return pyramid;
+}
+
+void raymarch::release(RaymarchPyramid *pyramid) {
+    free(pyramid->levels[0]);
+    *pyramid = {};
+}
+
+static inline size_t get_cell_index(RaymarchPyramid *pyramid, uint32_t level, uint32_t x, uint32_t y, uint32_t z) {
+    return (size_t(z) * pyramid->heights[level] + y) * pyramid->widths[level] + x;
+}
+
+// Max of every cell of layer z of level 0 and its two neighbours along `axis`.
+static void dilate_layer(RaymarchPyramid *pyramid, const float *src, float *dst, uint32_t z, uint32_t axis) {
+    uint32_t w = pyramid->widths[0], h = pyramid->heights[0], d = pyramid->depths[0];
+    size_t strides[3] = { 1, w, size_t(w) * h };
+    uint32_t sizes[3] = { w, h, d };
+    size_t stride = strides[axis];
+    for (uint32_t y = 0; y < h; ++y) {
+        for (uint32_t x = 0; x < w; ++x) {
+            uint32_t coords[3] = { x, y, z };
+            size_t i = get_cell_index(pyramid, 0, x, y, z);
+            float value = src[i];
+            if (coords[axis] > 0 && src[i - stride] > value) value = src[i - stride];
+            if (coords[axis] + 1 < sizes[axis] && src[i + stride] > value) value = src[i + stride];
+            dst[i] = value;
+        }
+    }
+}
+
+void raymarch::update(RaymarchPyramid *pyramid, World *world, RaymarchSettings *settings, ThreadPool *pool) {
+    PROFILE_SCOPE("raymarch_pyramid");
+    uint32_t w = world->brick_width, h = world->brick_height, d = world->brick_depth;
+    size_t cell_count = 0;
+    uint32_t level_count = 0;
+    while (level_count < RAYMARCH_MAX_LEVELS) {
+        pyramid->widths[level_count] = w;
+        pyramid->heights[level_count] = h;
+        pyramid->depths[level_count] = d;
+        cell_count += size_t(w) * h * d;
+        level_count++;
+        if (w == 1 && h == 1 && d == 1) break;
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        d = (d + 1) / 2;
+    }
+    pyramid->level_count = level_count;
+
+    // Level 0 is dilated through a scratch copy of itself at the end of the buffer.
+    size_t brick_count = sim::get_brick_count(world);
+    if (cell_count + brick_count > pyramid->capacity) {
+        free(pyramid->levels[0]);
+        pyramid->levels[0] = (float *)malloc(sizeof(float) * (cell_count + brick_count));
+        pyramid->capacity = uint32_t(cell_count + brick_count);
+    }
+    for (uint32_t level = 1; level < level_count; ++level) {
+        uint32_t previous = level - 1;
+        pyramid->levels[level] = pyramid->levels[previous] + size_t(pyramid->widths[previous]) * pyramid->heights[previous] * pyramid->depths[previous];
+    }
+    float *scratch = pyramid->levels[0] + cell_count;
+    float *base = pyramid->levels[0];
+
+    // Grid overlay, a brick holds a grid cube if it's on grid along all axes.
+    w = world->brick_width;
+    h = world->brick_height;
+    d = world->brick_depth;
+    uint8_t *grid = (uint8_t *)calloc(w + h + d, 1);
+    if (settings->show_grid) {
+        const float S = float(SIM_BRICK_SIZE);
+        for (uint32_t x = 0; x < w; ++x) grid[x] = range_on_grid(x * S, (x + 1) * S, float(world->width));
+        for (uint32_t y = 0; y < h; ++y) grid[w + y] = range_on_grid(y * S, (y + 1) * S, float(world->height));
+        for (uint32_t z = 0; z < d; ++z) grid[w + h + z] = range_on_grid(z * S, (z + 1) * S, float(world->depth));
+    }
+
+    float scale = settings->opacity_scale;
+    thread_pool::run(pool, d, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t z = begin; z < end; ++z) {
+            for (uint32_t y = 0; y < h; ++y) {
+                for (uint32_t x = 0; x < w; ++x) {
+                    size_t i = get_cell_index(pyramid, 0, x, y, z);
+                    float opacity = world->brick_max[i] * scale;
+                    opacity = opacity < 1.0f ? opacity : 1.0f;
+                    if (grid[x] && grid[w + y] && grid[w + h + z] && opacity < GRID_OPACITY) opacity = GRID_OPACITY;
+                    scratch[i] = opacity;
+                }
+            }
+        }
+    });
+    free(grid);
+    thread_pool::run(pool, d, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t z = begin; z < end; ++z) dilate_layer(pyramid, scratch, base, z, 0);
+    });
+    thread_pool::run(pool, d, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t z = begin; z < end; ++z) dilate_layer(pyramid, base, scratch, z, 1);
+    });
+    thread_pool::run(pool, d, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t z = begin; z < end; ++z) dilate_layer(pyramid, scratch, base, z, 2);
+    });
+
+    for (uint32_t level = 1; level < level_count; ++level) {
+        uint32_t previous = level - 1;
+        uint32_t pw = pyramid->widths[previous], ph = pyramid->heights[previous], pd = pyramid->depths[previous];
+        const float *src = pyramid->levels[previous];
+        float *dst = pyramid->levels[level];
+        thread_pool::run(pool, pyramid->depths[level], 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+            for (uint32_t z = begin; z < end; ++z) {
+                for (uint32_t y = 0; y < pyramid->heights[level]; ++y) {
+                    for (uint32_t x = 0; x < pyramid->widths[level]; ++x) {
+                        float value = 0.0f;
+                        for (uint32_t cz = 2 * z; cz < 2 * z + 2 && cz < pd; ++cz) {
+                            for (uint32_t cy = 2 * y; cy < 2 * y + 2 && cy < ph; ++cy) {
+                                for (uint32_t cx = 2 * x; cx < 2 * x + 2 && cx < pw; ++cx) {
+                                    float child = src[(size_t(cz) * ph + cy) * pw + cx];
+                                    value = child > value ? child : value;
+                                }
+                            }
+                        }
+                        dst[get_cell_index(pyramid, level, x, y, z)] = value;
+                    }
+                }
+            }
+        });
+    }
+}
+
+// Trilinear sample of the trail at position in voxels, voxel centers are at half voxels and positions are
+// clamped to the edge voxels, same as texture sampling.
+static inline float sample_trail(World *world, Float3 p) {
+    float q[3] = { p.x - 0.5f, p.y - 0.5f, p.z - 0.5f };
+    uint32_t sizes[3] = { world->width, world->height, world->depth };
+    uint32_t i0[3], i1[3];
+    float f[3];
+    for (int a = 0; a < 3; ++a) {
+        float base = floorf(q[a]);
+        f[a] = q[a] - base;
+        int i = int(base);
+        int last = int(sizes[a]) - 1;
+        i0[a] = uint32_t(i < 0 ? 0 : (i > last ? last : i));
+        i1[a] = uint32_t(i + 1 < 0 ? 0 : (i + 1 > last ? last : i + 1));
+    }
+    const TrailBuffer *trail = &world->trail;
+    float c00 = trail::load(world, trail, i0[0], i0[1], i0[2]) * (1.0f - f[0]) + trail::load(world, trail, i1[0], i0[1], i0[2]) * f[0];
+    float c10 = trail::load(world, trail, i0[0], i1[1], i0[2]) * (1.0f - f[0]) + trail::load(world, trail, i1[0], i1[1], i0[2]) * f[0];
+    float c01 = trail::load(world, trail, i0[0], i0[1], i1[2]) * (1.0f - f[0]) + trail::load(world, trail, i1[0], i0[1], i1[2]) * f[0];
+    float c11 = trail::load(world, trail, i0[0], i1[1], i1[2]) * (1.0f - f[0]) + trail::load(world, trail, i1[0], i1[1], i1[2]) * f[0];
+    float c0 = c00 * (1.0f - f[1]) + c10 * f[1];
+    float c1 = c01 * (1.0f - f[1]) + c11 * f[1];
+    return c0 * (1.0f - f[2]) + c1 * f[2];
+}
+
+// Marches a single ray and returns its opacity, `samples` counts samples taken.
+static float march_ray(World *world, RaymarchSettings *settings, RaymarchPyramid *pyramid, Float3 origin, Float3 dir,
+                       float t_begin, float t_end, uint64_t *samples) {
+    const float S = float(SIM_BRICK_SIZE);
+    float inverse_dir[3] = { 1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z };
+    float o[3] = { origin.x, origin.y, origin.z };
+    float step = settings->step;
+    float opacity = 0.0f;
+    uint32_t top = pyramid->level_count - 1;
+    uint32_t level = top;
+    float t = t_begin;
+    while (t < t_end && opacity < settings->max_opacity) {
+        float cell_size = S * float(1u << level);
+        uint32_t dims[3] = { pyramid->widths[level], pyramid->heights[level], pyramid->depths[level] };
+        uint32_t cell[3];
+        float t_exit = t_end;
+        for (int a = 0; a < 3; ++a) {
+            float d = a == 0 ? dir.x : (a == 1 ? dir.y : dir.z);
+            float p = o[a] + d * (t + CELL_EPSILON);
+            int c = int(floorf(p / cell_size));
+            c = c < 0 ? 0 : (c >= int(dims[a]) ? int(dims[a]) - 1 : c);
+            cell[a] = uint32_t(c);
+            // Division by zero direction gives infinity, which never wins.
+            float boundary = d > 0.0f ? float(c + 1) * cell_size : float(c) * cell_size;
+            float t_axis = (boundary - o[a]) * inverse_dir[a];
+            if (d != 0.0f && t_axis < t_exit) t_exit = t_axis;
+        }
+        if (t_exit < t + CELL_EPSILON) t_exit = t + CELL_EPSILON;
+
+        float value = pyramid->levels[level][get_cell_index(pyramid, level, cell[0], cell[1], cell[2])];
+        if (value <= settings->empty_opacity) {
+            t = t_exit;
+            if (level < top) level++;
+            continue;
+        }
+        if (level > 0) {
+            level--;
+            continue;
+        }
+
+        // Samples are at t_begin + (k + 0.5) * step, whether or not cells before them were skipped.
+        float k = ceilf((t - t_begin) / step - 0.5f);
+        for (float t_sample = t_begin + (k + 0.5f) * step; t_sample < t_exit && t_sample < t_end; k += 1.0f, t_sample = t_begin + (k + 0.5f) * step) {
+            Float3 p = { origin.x + dir.x * t_sample, origin.y + dir.y * t_sample, origin.z + dir.z * t_sample };
+            float alpha = sample_trail(world, p) * settings->opacity_scale;
+            alpha = alpha < 1.0f ? alpha : 1.0f;
+            if (settings->show_grid && alpha < GRID_OPACITY && on_grid(p.x, float(world->width)) &&
+                on_grid(p.y, float(world->height)) && on_grid(p.z, float(world->depth))) {
+                alpha = GRID_OPACITY;
+            }
+            if (step != 1.0f) alpha = 1.0f - powf(1.0f - alpha, step);
+            opacity += (1.0f - opacity) * alpha;
+            (*samples)++;
+            if (opacity >= settings->max_opacity) break;
+        }
+        t = t_exit;
+        if (level < top) level++;
+    }
+    return opacity;
+}
+
+uint64_t raymarch::render(DofImage *image, RaymarchSettings *settings, World *world, RaymarchPyramid *pyramid, ThreadPool *pool) {
+    PROFILE_SCOPE("raymarch");
+    float view_projection[16], inverse[16];
+    multiply(settings->projection, settings->view, view_projection);
+    if (!invert(view_projection, inverse)) {
+        memset(image->pixels, 0, sizeof(float) * image->width * image->height);
+        return 0;
+    }
+
+    uint32_t tiles_x = (image->width + TILE_SIZE - 1) / TILE_SIZE;
+    uint32_t tiles_y = (image->height + TILE_SIZE - 1) / TILE_SIZE;
+    uint32_t thread_count = thread_pool::get_thread_count(pool);
+    uint64_t *samples = (uint64_t *)calloc(thread_count, sizeof(uint64_t));
+    float size[3] = { float(world->width), float(world->height), float(world->depth) };
+    thread_pool::run(pool, tiles_x * tiles_y, 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+        for (uint32_t tile = begin; tile < end; ++tile) {
+            uint32_t x0 = tile % tiles_x * TILE_SIZE, y0 = tile / tiles_x * TILE_SIZE;
+            uint32_t x1 = x0 + TILE_SIZE < image->width ? x0 + TILE_SIZE : image->width;
+            uint32_t y1 = y0 + TILE_SIZE < image->height ? y0 + TILE_SIZE : image->height;
+            for (uint32_t y = y0; y < y1; ++y) {
+                for (uint32_t x = x0; x < x1; ++x) {
+                    // Row 0 is the bottom row, NDC y goes up.
+                    float nx = (float(x) + 0.5f) / float(image->width) * 2.0f - 1.0f;
+                    float ny = (float(y) + 0.5f) / float(image->height) * 2.0f - 1.0f;
+                    Float3 near_point = unproject(inverse, world, nx, ny, 0.0f);
+                    Float3 far_point = unproject(inverse, world, nx, ny, 1.0f);
+                    Float3 dir = { far_point.x - near_point.x, far_point.y - near_point.y, far_point.z - near_point.z };
+                    float length = sqrtf(dir.x * dir.x + dir.y * dir.y + dir.z * dir.z);
+                    dir.x /= length;
+                    dir.y /= length;
+                    dir.z /= length;
+
+                    // Clip the ray between near and far planes to the world box.
+                    float o[3] = { near_point.x, near_point.y, near_point.z };
+                    float d[3] = { dir.x, dir.y, dir.z };
+                    float t_begin = 0.0f, t_end = length;
+                    for (int a = 0; a < 3; ++a) {
+                        if (d[a] == 0.0f) {
+                            if (o[a] < 0.0f || o[a] > size[a]) t_end = -1.0f;
+                            continue;
+                        }
+                        float t0 = (0.0f - o[a]) / d[a], t1 = (size[a] - o[a]) / d[a];
+                        if (t0 > t1) {
+                            float tmp = t0;
+                            t0 = t1;
+                            t1 = tmp;
+                        }
+                        t_begin = t0 > t_begin ? t0 : t_begin;
+                        t_end = t1 < t_end ? t1 : t_end;
+                    }
+                    float opacity = 0.0f;
+                    if (t_begin < t_end) {
+                        opacity = march_ray(world, settings, pyramid, near_point, dir, t_begin, t_end, &samples[thread_index]);
+                    }
+                    image->pixels[size_t(y) * image->width + x] = opacity / DISPLAY_SCALE;
+                }
+            }
+        }
+    });
+    uint64_t sample_count = 0;
+    for (uint32_t i = 0; i < thread_count; ++i) {
+        sample_count += samples[i];
+    }
+    free(samples);
+    return sample_count;
+}
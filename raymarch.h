@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include "sim.h"
+#include "dof.h"
+
+struct ThreadPool;
+
+// Settings of the CPU volume renderer. Matrices are the same as in DofSettings, trail is shown the same way
+// as the slice view of physarum.exe (pixel_shader_3d.hlsl): white with opacity of trail / 5 over black.
+struct RaymarchSettings {
+    float projection[16];
+    float view[16];
+
+    bool show_grid;
+    // Opacity of a sample per unit of trail.
+    float opacity_scale;
+    // Distance between samples along a ray, in voxels. A sample covers this length of the ray.
+    float step;
+    // Cells of the pyramid with lower max opacity are skipped, negative disables empty space skipping.
+    float empty_opacity;
+    // Rays stop once they are this opaque, above 1 disables early termination.
+    float max_opacity;
+};
+
+#define RAYMARCH_MAX_LEVELS 16
+
+// Max pyramid over bricks of the trail, in opacity. Level 0 has a cell for every brick holding max opacity of
+// the brick and its neighbours (samples interpolate voxels of neighbouring bricks), every next level halves
+// the resolution. Kept between renders so buffers are reused.
+struct RaymarchPyramid {
+    uint32_t level_count;
+    uint32_t widths[RAYMARCH_MAX_LEVELS];
+    uint32_t heights[RAYMARCH_MAX_LEVELS];
+    uint32_t depths[RAYMARCH_MAX_LEVELS];
+    float *levels[RAYMARCH_MAX_LEVELS];
+    uint32_t capacity;
+};
+
+namespace raymarch {
+    // Default camera same as dof::get_settings.
+    RaymarchSettings get_settings(uint32_t width, uint32_t height);
+
+    RaymarchPyramid get_pyramid();
+    void release(RaymarchPyramid *pyramid);
+    // Rebuilds pyramid from World::brick_max, so it has to be called after decay. Grid of show_grid is
+    // included in level 0, so it isn't skipped.
+    void update(RaymarchPyramid *pyramid, World *world, RaymarchSettings *settings, ThreadPool *pool);
+
+    // Raymarches trail front to back into image (same orientation as DofImage), in screen tiles spread over
+    // threads. Rays skip the largest empty pyramid cell they are in, samples are still taken at the same
+    // positions along the ray as without skipping. Pixels hold opacity * 5, so dof::write_pgm shows them at
+    // the brightness of the slice view. Returns number of samples taken.
+    uint64_t render(DofImage *image, RaymarchSettings *settings, World *world, RaymarchPyramid *pyramid, ThreadPool *pool);
+}
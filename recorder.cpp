@@ -0,0 +1,464 @@
+// Frame recorder. Producer copies frames into ring slots in order, encoders claim queued slots in the same
+// order, but can finish out of order, so every slot has its own state and producer waits only for the slot
+// it's about to overwrite.
+//
+// PNG encoder is self-contained: every row gets the PNG filter with the smallest sum of residuals, filtered
+// image is compressed with LZ77 over hash chains and fixed Huffman codes. DoF frames are mostly black with
+// smooth gradients, which this handles well without dynamic Huffman tables.
+#include "recorder.h"
+#include <condition_variable>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+// pixel_shader.hlsl displays image values divided by 5.
+#define DISPLAY_SCALE (1.0f / 5.0f)
+#define PATH_LENGTH 1024
+
+#define WINDOW_SIZE 32768
+#define HASH_BITS 15
+#define HASH_SIZE (1 << HASH_BITS)
+#define MAX_CHAIN 32
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+
+enum FrameState {
+    FRAME_FREE,
+    FRAME_QUEUED,
+    FRAME_ENCODING,
+};
+
+struct RecorderFrame {
+    uint8_t *pixels;
+    uint32_t index;
+    FrameState state;
+};
+
+struct Recorder {
+    char directory[PATH_LENGTH];
+    uint32_t width;
+    uint32_t height;
+    uint32_t capacity;
+    bool drop_on_overflow;
+
+    RecorderFrame *frames;
+    // Slot which producer fills next and slot which encoders claim next.
+    uint32_t head;
+    uint32_t tail;
+    RecorderStats stats;
+
+    std::vector<std::thread> encoders;
+    std::mutex mutex;
+    std::condition_variable frame_queued;
+    std::condition_variable frame_done;
+    bool is_running;
+};
+
+// Per-encoder scratch memory.
+struct Encoder {
+    uint8_t *filtered;
+    uint8_t *compressed;
+    size_t compressed_capacity;
+    int32_t *head;
+    int32_t *prev;
+};
+
+struct BitWriter {
+    uint8_t *data;
+    size_t size;
+    uint64_t bits;
+    uint32_t bit_count;
+};
+
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t distance_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+    4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t distance_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static uint32_t crc_table[256];
+
+static void init_crc_table() {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size) {
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t adler32(const uint8_t *data, size_t size) {
+    uint32_t a = 1, b = 0;
+    while (size > 0) {
+        // Largest block for which b can't overflow before the modulo.
+        size_t block = size < 5552 ? size : 5552;
+        for (size_t i = 0; i < block; ++i) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += block;
+        size -= block;
+    }
+    return (b << 16) | a;
+}
+
+static inline void put_bits(BitWriter *writer, uint32_t value, uint32_t count) {
+    writer->bits |= uint64_t(value) << writer->bit_count;
+    writer->bit_count += count;
+    while (writer->bit_count >= 8) {
+        writer->data[writer->size++] = uint8_t(writer->bits);
+        writer->bits >>= 8;
+        writer->bit_count -= 8;
+    }
+}
+
+// Huffman codes are stored starting with the most significant bit.
+static inline void put_code(BitWriter *writer, uint32_t code, uint32_t length) {
+    uint32_t reversed = 0;
+    for (uint32_t i = 0; i < length; ++i) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    put_bits(writer, reversed, length);
+}
+
+// Fixed Huffman code of literal/length symbol.
+static inline void put_symbol(BitWriter *writer, uint32_t symbol) {
+    if (symbol < 144) {
+        put_code(writer, 0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        put_code(writer, 0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        put_code(writer, symbol - 256, 7);
+    } else {
+        put_code(writer, 0xC0 + symbol - 280, 8);
+    }
+}
+
+static inline void put_match(BitWriter *writer, uint32_t length, uint32_t distance) {
+    int l = 28;
+    while (length_base[l] > length) l--;
+    // 258 has its own symbol, even though it fits into the range of the previous one.
+    put_symbol(writer, 257 + l);
+    put_bits(writer, length - length_base[l], length_extra[l]);
+    int d = 29;
+    while (distance_base[d] > distance) d--;
+    put_code(writer, d, 5);
+    put_bits(writer, distance - distance_base[d], distance_extra[d]);
+}
+
+static inline uint32_t hash3(const uint8_t *data) {
+    uint32_t v = data[0] | (data[1] << 8) | (data[2] << 16);
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Compresses data into a single fixed Huffman deflate block wrapped in zlib stream, returns compressed size.
+// Falls back to stored blocks when that would be smaller.
+static size_t compress(Encoder *encoder, const uint8_t *data, size_t size) {
+    BitWriter writer = {};
+    writer.data = encoder->compressed;
+    // zlib header, deflate with 32K window and default compression level.
+    writer.data[writer.size++] = 0x78;
+    writer.data[writer.size++] = 0x9C;
+    // Final block, fixed Huffman codes.
+    put_bits(&writer, 1, 1);
+    put_bits(&writer, 1, 2);
+
+    int32_t *head = encoder->head, *prev = encoder->prev;
+    for (int i = 0; i < HASH_SIZE; ++i) head[i] = -1;
+    size_t i = 0;
+    while (i < size) {
+        uint32_t best_length = 0, best_distance = 0;
+        if (i + MIN_MATCH <= size) {
+            uint32_t hash = hash3(data + i);
+            uint32_t max_length = size - i < MAX_MATCH ? uint32_t(size - i) : MAX_MATCH;
+            int32_t candidate = head[hash];
+            for (int chain = 0; chain < MAX_CHAIN && candidate >= 0 && i - candidate <= WINDOW_SIZE; ++chain) {
+                const uint8_t *a = data + candidate, *b = data + i;
+                uint32_t length = 0;
+                while (length < max_length && a[length] == b[length]) length++;
+                if (length > best_length) {
+                    best_length = length;
+                    best_distance = uint32_t(i - candidate);
+                    if (length == max_length) break;
+                }
+                int32_t next = prev[candidate & (WINDOW_SIZE - 1)];
+                // Slot may have been reused by a newer position, chains only go back in time.
+                if (next >= candidate) break;
+                candidate = next;
+            }
+            prev[i & (WINDOW_SIZE - 1)] = head[hash];
+            head[hash] = int32_t(i);
+        }
+
+        if (best_length >= MIN_MATCH) {
+            put_match(&writer, best_length, best_distance);
+            for (size_t k = i + 1; k < i + best_length && k + MIN_MATCH <= size; ++k) {
+                uint32_t hash = hash3(data + k);
+                prev[k & (WINDOW_SIZE - 1)] = head[hash];
+                head[hash] = int32_t(k);
+            }
+            i += best_length;
+        } else {
+            put_symbol(&writer, data[i]);
+            i++;
+        }
+    }
+    put_symbol(&writer, 256);
+    if (writer.bit_count > 0) put_bits(&writer, 0, 8 - writer.bit_count);
+
+    // Noisy frames (e.g. DoF with few iterations) can grow with fixed codes, store those uncompressed.
+    size_t stored_size = 2 + size + (size / 65535 + 1) * 5;
+    if (writer.size > stored_size) {
+        writer.size = 2;
+        size_t offset = 0;
+        do {
+            size_t block = size - offset < 65535 ? size - offset : 65535;
+            bool is_final = offset + block == size;
+            writer.data[writer.size++] = is_final ? 1 : 0;
+            writer.data[writer.size++] = uint8_t(block);
+            writer.data[writer.size++] = uint8_t(block >> 8);
+            writer.data[writer.size++] = uint8_t(~block);
+            writer.data[writer.size++] = uint8_t(~block >> 8);
+            memcpy(writer.data + writer.size, data + offset, block);
+            writer.size += block;
+            offset += block;
+        } while (offset < size);
+    }
+
+    uint32_t adler = adler32(data, size);
+    writer.data[writer.size++] = uint8_t(adler >> 24);
+    writer.data[writer.size++] = uint8_t(adler >> 16);
+    writer.data[writer.size++] = uint8_t(adler >> 8);
+    writer.data[writer.size++] = uint8_t(adler);
+    return writer.size;
+}
+
+static inline uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+    int p = int(a) + int(b) - int(c);
+    int pa = abs(p - int(a)), pb = abs(p - int(b)), pc = abs(p - int(c));
+    if (pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+// Filters every row with the filter giving the smallest sum of absolute residuals.
+static void filter_rows(const uint8_t *pixels, uint32_t width, uint32_t height, uint8_t *filtered) {
+    for (uint32_t y = 0; y < height; ++y) {
+        const uint8_t *row = pixels + size_t(y) * width;
+        const uint8_t *up = y > 0 ? row - width : NULL;
+        uint8_t *dst = filtered + size_t(y) * (width + 1);
+
+        uint32_t sums[5] = {};
+        for (uint32_t x = 0; x < width; ++x) {
+            uint8_t a = x > 0 ? row[x - 1] : 0;
+            uint8_t b = up ? up[x] : 0;
+            uint8_t c = up && x > 0 ? up[x - 1] : 0;
+            sums[0] += abs(int8_t(row[x]));
+            sums[1] += abs(int8_t(row[x] - a));
+            sums[2] += abs(int8_t(row[x] - b));
+            sums[4] += abs(int8_t(row[x] - paeth(a, b, c)));
+        }
+        uint8_t filter = 0;
+        if (sums[1] < sums[filter]) filter = 1;
+        if (sums[2] < sums[filter]) filter = 2;
+        if (sums[4] < sums[filter]) filter = 4;
+
+        dst[0] = filter;
+        for (uint32_t x = 0; x < width; ++x) {
+            uint8_t a = x > 0 ? row[x - 1] : 0;
+            uint8_t b = up ? up[x] : 0;
+            uint8_t c = up && x > 0 ? up[x - 1] : 0;
+            uint8_t predicted = filter == 1 ? a : (filter == 2 ? b : (filter == 4 ? paeth(a, b, c) : 0));
+            dst[x + 1] = uint8_t(row[x] - predicted);
+        }
+    }
+}
+
+static void write_chunk(FILE *file, const char *type, const uint8_t *data, size_t size) {
+    uint8_t header[8] = {
+        uint8_t(size >> 24), uint8_t(size >> 16), uint8_t(size >> 8), uint8_t(size),
+        uint8_t(type[0]), uint8_t(type[1]), uint8_t(type[2]), uint8_t(type[3]),
+    };
+    uint32_t crc = crc32(crc32(0, header + 4, 4), data, size);
+    uint8_t footer[4] = { uint8_t(crc >> 24), uint8_t(crc >> 16), uint8_t(crc >> 8), uint8_t(crc) };
+    fwrite(header, 1, 8, file);
+    fwrite(data, 1, size, file);
+    fwrite(footer, 1, 4, file);
+}
+
+// 8-bit grayscale PNG, pixels start with the top row.
+static bool write_png(Encoder *encoder, const char *path, const uint8_t *pixels, uint32_t width, uint32_t height) {
+    filter_rows(pixels, width, height, encoder->filtered);
+    size_t compressed_size = compress(encoder, encoder->filtered, size_t(width + 1) * height);
+
+    FILE *file = fopen(path, "wb");
+    if (!file) return false;
+    const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    fwrite(signature, 1, 8, file);
+    uint8_t header[13] = {
+        uint8_t(width >> 24), uint8_t(width >> 16), uint8_t(width >> 8), uint8_t(width),
+        uint8_t(height >> 24), uint8_t(height >> 16), uint8_t(height >> 8), uint8_t(height),
+        8, 0, 0, 0, 0,
+    };
+    write_chunk(file, "IHDR", header, sizeof(header));
+    write_chunk(file, "IDAT", encoder->compressed, compressed_size);
+    write_chunk(file, "IEND", NULL, 0);
+    bool failed = ferror(file) != 0;
+    return fclose(file) == 0 && !failed;
+}
+
+static void encoder_loop(Recorder *recorder) {
+    size_t filtered_size = size_t(recorder->width + 1) * recorder->height;
+    Encoder encoder = {};
+    encoder.filtered = (uint8_t *)malloc(filtered_size);
+    // Fixed Huffman codes take at most 9 bits per byte.
+    encoder.compressed_capacity = filtered_size / 8 * 9 + 1024;
+    encoder.compressed = (uint8_t *)malloc(encoder.compressed_capacity);
+    encoder.head = (int32_t *)malloc(sizeof(int32_t) * HASH_SIZE);
+    encoder.prev = (int32_t *)malloc(sizeof(int32_t) * WINDOW_SIZE);
+
+    std::unique_lock<std::mutex> lock(recorder->mutex);
+    while (true) {
+        recorder->frame_queued.wait(lock, [recorder] {
+            return recorder->frames[recorder->tail].state == FRAME_QUEUED || !recorder->is_running;
+        });
+        // Queued frames are still written when recorder is released.
+        if (recorder->frames[recorder->tail].state != FRAME_QUEUED) break;
+        RecorderFrame *frame = &recorder->frames[recorder->tail];
+        frame->state = FRAME_ENCODING;
+        recorder->tail = (recorder->tail + 1) % recorder->capacity;
+        lock.unlock();
+
+        char path[PATH_LENGTH + 32];
+        snprintf(path, sizeof(path), "%s/frame_%06u.png", recorder->directory, frame->index);
+        bool written = write_png(&encoder, path, frame->pixels, recorder->width, recorder->height);
+
+        lock.lock();
+        frame->state = FRAME_FREE;
+        if (written) {
+            recorder->stats.written++;
+        } else {
+            recorder->stats.failed++;
+        }
+        recorder->frame_done.notify_all();
+    }
+
+    free(encoder.filtered);
+    free(encoder.compressed);
+    free(encoder.head);
+    free(encoder.prev);
+}
+
+Recorder *recorder::get(const char *directory, uint32_t width, uint32_t height, uint32_t capacity, uint32_t encoder_count, bool drop_on_overflow) {
+    static std::once_flag crc_initialized;
+    std::call_once(crc_initialized, init_crc_table);
+
+    Recorder *recorder = new Recorder();
+    snprintf(recorder->directory, PATH_LENGTH, "%s", directory);
+    recorder->width = width;
+    recorder->height = height;
+    recorder->capacity = capacity > 0 ? capacity : 1;
+    recorder->drop_on_overflow = drop_on_overflow;
+    recorder->frames = (RecorderFrame *)calloc(recorder->capacity, sizeof(RecorderFrame));
+    for (uint32_t i = 0; i < recorder->capacity; ++i) {
+        recorder->frames[i].pixels = (uint8_t *)malloc(size_t(width) * height);
+    }
+    recorder->is_running = true;
+
+    if (encoder_count == 0) {
+        encoder_count = std::thread::hardware_concurrency() / 2;
+        if (encoder_count == 0) encoder_count = 1;
+    }
+    for (uint32_t i = 0; i < encoder_count; ++i) {
+        recorder->encoders.emplace_back(encoder_loop, recorder);
+    }
+    return recorder;
+}
+
+void recorder::release(Recorder *recorder) {
+    {
+        std::lock_guard<std::mutex> lock(recorder->mutex);
+        recorder->is_running = false;
+    }
+    recorder->frame_queued.notify_all();
+    for (auto &encoder : recorder->encoders) {
+        encoder.join();
+    }
+    for (uint32_t i = 0; i < recorder->capacity; ++i) {
+        free(recorder->frames[i].pixels);
+    }
+    free(recorder->frames);
+    delete recorder;
+}
+
+bool recorder::push(Recorder *recorder, const float *pixels, uint32_t row_pitch) {
+    RecorderFrame *frame;
+    {
+        std::unique_lock<std::mutex> lock(recorder->mutex);
+        frame = &recorder->frames[recorder->head];
+        if (frame->state != FRAME_FREE) {
+            if (recorder->drop_on_overflow) {
+                recorder->stats.dropped++;
+                return false;
+            }
+            recorder->stats.stalls++;
+            recorder->frame_done.wait(lock, [frame] { return frame->state == FRAME_FREE; });
+        }
+    }
+
+    // Slot at head is owned by producer until it's queued, so it's filled without holding the lock.
+    uint32_t width = recorder->width, height = recorder->height;
+    for (uint32_t y = 0; y < height; ++y) {
+        const float *src = pixels + size_t(height - 1 - y) * row_pitch;
+        uint8_t *dst = frame->pixels + size_t(y) * width;
+        for (uint32_t x = 0; x < width; ++x) {
+            float v = src[x] * DISPLAY_SCALE;
+            v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+            dst[x] = uint8_t(v * 255.0f + 0.5f);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(recorder->mutex);
+        frame->index = uint32_t(recorder->stats.pushed++);
+        frame->state = FRAME_QUEUED;
+        recorder->head = (recorder->head + 1) % recorder->capacity;
+    }
+    recorder->frame_queued.notify_one();
+    return true;
+}
+
+void recorder::flush(Recorder *recorder) {
+    std::unique_lock<std::mutex> lock(recorder->mutex);
+    recorder->frame_done.wait(lock, [recorder] {
+        return recorder->stats.written + recorder->stats.failed == recorder->stats.pushed;
+    });
+}
+
+RecorderStats recorder::get_stats(Recorder *recorder) {
+    std::lock_guard<std::mutex> lock(recorder->mutex);
+    RecorderStats stats = recorder->stats;
+    stats.queued = uint32_t(stats.pushed - stats.written - stats.failed);
+    return stats;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+// Frame recorder. Frames are copied into a bounded ring of 8-bit frames and encoder threads compress
+// them into numbered PNG files (frame_000000.png, ...) in the background, so the caller only pays for
+// the copy. When the ring is full, push either waits for a free slot or drops the frame.
+struct Recorder;
+
+struct RecorderStats {
+    uint64_t pushed;
+    uint64_t written;
+    uint64_t dropped;
+    // Number of pushes which had to wait for an encoder to free a slot.
+    uint64_t stalls;
+    uint64_t failed;
+    // Frames in the ring waiting for or being encoded.
+    uint32_t queued;
+};
+
+namespace recorder {
+    // Directory has to exist. encoder_count of 0 means one encoder per two hardware cores.
+    Recorder *get(const char *directory, uint32_t width, uint32_t height, uint32_t capacity, uint32_t encoder_count, bool drop_on_overflow);
+    // Encodes all queued frames before returning.
+    void release(Recorder *recorder);
+
+    // Copies float frame with rows starting at the bottom (same as display_tex and DofImage), scaled
+    // the same way as pixel_shader.hlsl displays it. row_pitch is in floats. Returns false if frame was dropped.
+    bool push(Recorder *recorder, const float *pixels, uint32_t row_pitch);
+    // Waits until all pushed frames are written.
+    void flush(Recorder *recorder);
+    RecorderStats get_stats(Recorder *recorder);
+}
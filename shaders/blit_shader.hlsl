@@ -1,5 +1,6 @@
 RWTexture2D<uint> tex_in: register(u0);
 RWTexture2D<float> tex_out: register(u1);
+RWTexture2D<float> tex_accum: register(u2);
 
 cbuffer ConfigBuffer : register(b4)
 {
@@ -20,11 +21,19 @@ cbuffer ConfigBuffer : register(b4)
     float screen_width;
     float screen_height;
     float sample_weight;
+    int particle_count;
+    int progressive_frame;
 };
 
 
 [numthreads(1, 1, 1)]
 void main(uint3 threadIDInGroup : SV_GroupThreadID, uint3 groupID : SV_GroupID,
           uint3 dispatchThreadId : SV_DispatchThreadID){
-    tex_out[dispatchThreadId.xy] = tex_in[dispatchThreadId.xy] / 1000.0 * sample_weight;
+    float value = tex_in[dispatchThreadId.xy] / 1000.0 * sample_weight;
+    // Progressive DoF adds every frame into tex_accum and shows the mean of the frames, first frame restarts it.
+    if (progressive_frame > 0) {
+        value += tex_accum[dispatchThreadId.xy];
+    }
+    tex_accum[dispatchThreadId.xy] = value;
+    tex_out[dispatchThreadId.xy] = value / (progressive_frame + 1);
 }
\ No newline at end of file
@@ -21,6 +21,9 @@ cbuffer ConfigBuffer : register(b4)
     float world_depth;
     float screen_width;
     float screen_height;
+    float sample_weight;
+    int particle_count;
+    int progressive_frame;
 };
 
 uint wang_hash(uint seed)
@@ -52,10 +55,15 @@ float3 random_sphere(uint hash)
 	return result;
 }
 
-[numthreads(10, 10, 10)]
-void main(uint3 threadIDInGroup : SV_GroupThreadID, uint3 group_id : SV_GroupID,
-          uint3 dispatchThreadId : SV_DispatchThreadID, uint index : SV_GroupIndex){
-    uint idx = index + 1000 * (group_id.x + group_id.y * 10 + group_id.z * 100);
+#define PARTICLE_GROUP_SIZE 256
+#define PARTICLE_GROUPS_X 65535
+
+[numthreads(PARTICLE_GROUP_SIZE, 1, 1)]
+void main(uint3 dispatchThreadId : SV_DispatchThreadID){
+    uint idx = dispatchThreadId.x + dispatchThreadId.y * PARTICLE_GROUPS_X * PARTICLE_GROUP_SIZE;
+    if (idx >= uint(particle_count)) {
+        return;
+    }
     
     float x = particles_x[idx];
     float y = particles_y[idx];
@@ -73,7 +81,9 @@ void main(uint3 threadIDInGroup : SV_GroupThreadID, uint3 group_id : SV_GroupID,
     // DoF with sampling.
     float d = length(world_pos.xyz);
     float r = m * pow(abs(f - d) / g, e);
-    for (int i = 0; i < iterations; ++i) {
+    // Progressive frames continue the random sequence of the frames before them.
+    int first = progressive_frame * iterations;
+    for (int i = first; i < first + iterations; ++i) {
         float3 sample_pos = world_pos;
         sample_pos.xyz += random_sphere(idx * 33 + i) * r;
 
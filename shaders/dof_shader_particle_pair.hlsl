@@ -22,6 +22,9 @@ cbuffer ConfigBuffer : register(b4)
     float world_depth;
     float screen_width;
     float screen_height;
+    float sample_weight;
+    int particle_count;
+    int progressive_frame;
 };
 
 uint wang_hash(uint seed)
@@ -54,10 +57,15 @@ float3 random_sphere(uint hash)
 	return result;
 }
 
-[numthreads(10, 10, 10)]
-void main(uint3 threadIDInGroup : SV_GroupThreadID, uint3 group_id : SV_GroupID,
-          uint3 dispatchThreadId : SV_DispatchThreadID, uint index : SV_GroupIndex){
-    uint idx = index + 1000 * (group_id.x + group_id.y * 10 + group_id.z * 100);
+#define PARTICLE_GROUP_SIZE 256
+#define PARTICLE_GROUPS_X 65535
+
+[numthreads(PARTICLE_GROUP_SIZE, 1, 1)]
+void main(uint3 dispatchThreadId : SV_DispatchThreadID){
+    uint idx = dispatchThreadId.x + dispatchThreadId.y * PARTICLE_GROUPS_X * PARTICLE_GROUP_SIZE;
+    if (idx >= uint(particle_count)) {
+        return;
+    }
 
     float x = particles_x[idx];
     float y = particles_y[idx];
@@ -71,9 +79,9 @@ void main(uint3 threadIDInGroup : SV_GroupThreadID, uint3 group_id : SV_GroupID,
     float x2 = x;
     float y2 = y;
     float z2 = z;
-    // If buddy_idx is over 9000000, this means that the buddy index array has just been initialized,
-    // so we have to search for a closest buddy.
-    if (buddy_idx > 9000000) {
+    // Buddy index past the live particles means the buddy index array has just been initialized or the
+    // buddy was removed, so we have to search for a closest buddy.
+    if (buddy_idx >= uint(particle_count)) {
         need_new_buddy = true;
     } else {
         float xb = particles_x[buddy_idx];
@@ -91,7 +99,7 @@ void main(uint3 threadIDInGroup : SV_GroupThreadID, uint3 group_id : SV_GroupID,
     if(need_new_buddy) {
         // Find a new buddy.
         float buddy_distance = break_distance;
-        for (int i = 1; i < 1000 && idx; ++i) {
+        for (uint i = 1; i < 1000 && idx + i < uint(particle_count); ++i) {
             float xb = particles_x[idx + i];
             float yb = particles_y[idx + i];
             float zb = particles_z[idx + i];
@@ -118,7 +126,9 @@ void main(uint3 threadIDInGroup : SV_GroupThreadID, uint3 group_id : SV_GroupID,
     float4 in_posf2 = float4(in_pos2 / world_size * 2.0 - 1.0, 1.0);
     in_posf2.yz *= -1;
 
-    for (int i = 0; i < iterations; ++i) {
+    // Progressive frames continue the random sequence of the frames before them.
+    int first = progressive_frame * iterations;
+    for (int i = first; i < first + iterations; ++i) {
         // Pick a random point on a line between two selected points.
         float rand = random(idx + i * 32 * 13);
         float4 line_pos = rand * in_posf + (1 - rand) * in_posf2;
@@ -19,6 +19,9 @@ cbuffer ConfigBuffer : register(b4)
     float world_depth;
     float screen_width;
     float screen_height;
+    float sample_weight;
+    int particle_count;
+    int progressive_frame;
 };
 
 uint wang_hash(uint seed)
@@ -56,7 +59,9 @@ void main(uint3 threadIDInGroup : SV_GroupThreadID, uint3 groupID : SV_GroupID,
     uint idx = dispatchThreadId.x + dispatchThreadId.y * 800 + dispatchThreadId.z * 800 * 800;
     float3 world_size = float3(world_width, world_height, world_depth);
     
-    for (int i = 0; i < iterations; ++i) {
+    // Progressive frames continue the random sequence of the frames before them.
+    int first = progressive_frame * iterations;
+    for (int i = first; i < first + iterations; ++i) {
         // We're going to be sampling points in 2x2x2 area.
         float3 in_pos = groupID.xyz * 2.0;
         in_pos.x += random(idx * 11 + i * 33) * 2.0;
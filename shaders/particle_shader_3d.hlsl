@@ -17,21 +17,30 @@ uint wang_hash(uint seed)
     return seed;
 }
 
+// Same layout as Config in config.h, in rows of 16 bytes.
 cbuffer ConfigBuffer : register(b0)
 {
     float sense_spread;
     float sense_distance;
     float turn_angle;
     float move_distance;
+
     float deposit_value;
     float decay_factor;
     float collision;
     float center_attraction;
+
     int world_width;
     int world_height;
     int world_depth;
     float move_sense_coef;
+
     float move_sense_offset;
+    // Live slot of Config, read by the CPU simulation only, this shader always senses 8 directions.
+    int sample_points;
+    int particle_count;
+    // Padding to a full row, same as in config.h.
+    int filler3;
 };
 
 float3 rotate(float3 v, float3 a, float angle) {
@@ -47,9 +56,16 @@ float mod(float x, float y) {
      return x - y * floor(x / y);
 }
 
-[numthreads(10,10,10)]
-void main(uint index : SV_GroupIndex, uint3 group_id :SV_GroupID){
-    uint idx = index + 1000 * (group_id.x + group_id.y * 10 + group_id.z * 100);
+// Particles are dispatched in rows of PARTICLE_GROUPS_X groups, threads past particle_count do nothing.
+#define PARTICLE_GROUP_SIZE 256
+#define PARTICLE_GROUPS_X 65535
+
+[numthreads(PARTICLE_GROUP_SIZE, 1, 1)]
+void main(uint3 dispatch_id : SV_DispatchThreadID){
+    uint idx = dispatch_id.x + dispatch_id.y * PARTICLE_GROUPS_X * PARTICLE_GROUP_SIZE;
+    if (idx >= uint(particle_count)) {
+        return;
+    }
     float halfpi = 3.1415 / 2.0f;
     float pi = 3.1415;
 
@@ -130,8 +146,9 @@ void main(uint index : SV_GroupIndex, uint3 group_id :SV_GroupID){
 
     // Check for collisions
     uint val = 0;
-    InterlockedCompareExchange(tex_occ[uint3(x, y, z)], 0, uint(collision), val);
-    if (val == 1.0) {
+    uint bit = 1u << (uint(x) % 32);
+    InterlockedOr(tex_occ[uint3(uint(x) / 32, y, z)], uint(collision) != 0 ? bit : 0, val);
+    if (val & bit) {
         x = particles_x[idx];
         y = particles_y[idx];
         z = particles_z[idx];
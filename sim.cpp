@@ -0,0 +1,513 @@
+#include "sim.h"
+#include "sim_trail.h"
+#include "thread_pool.h"
+#include "profiler.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define SIM_LANES_SCALAR
+#include "sim_lanes.h"
+#include "sim_kernel.h"
+
+// Number of particles processed by a single thread pool task.
+#define PARTICLE_CHUNK_SIZE 4096
+// Number of particles binned together by deposit.
+#define DEPOSIT_BLOCK_SIZE (16 * 1024)
+#define NO_VOXEL 0xFFFFFFFF
+
+// Vectorized builds of step kernels, defined in sim_avx2.cpp and sim_avx512.cpp.
+void fill_step_table_avx2(StepTable *table);
+void fill_step_table_avx512(StepTable *table);
+
+static SimKernel selected_kernel = SimKernel::AUTO;
+
+// Tables are filled on first use, indexed by SimKernel (scalar, AVX2, AVX-512).
+static StepTable *get_step_tables() {
+    static StepTable tables[3] = {};
+    static bool filled = [] {
+        fill_step_table<lanes_scalar::Lanes>(&tables[0]);
+        fill_step_table_avx2(&tables[1]);
+        fill_step_table_avx512(&tables[2]);
+        return true;
+    }();
+    (void)filled;
+    return tables;
+}
+
+// Picks kernel specialization for the config, sample counts other than 4, 8, 16 and 26 use the closest one.
+static StepFunction get_step_function(StepTable *table, Particles *particles, Config *config) {
+    int samples = config->sample_points > 0 ? config->sample_points : SIM_SAMPLE_POINTS;
+    uint32_t variant = 0;
+    for (uint32_t i = 1; i < SIM_SAMPLE_VARIANTS; ++i) {
+        if (abs(sim_sample_counts[i] - samples) < abs(sim_sample_counts[variant] - samples)) variant = i;
+    }
+    uint32_t flags = 0;
+    // Collision flag is truncated to an integer, same as in particle_shader_3d.hlsl, so values in (0, 1) are off.
+    if (uint32_t(config->collision) != 0) flags |= SIM_STEP_COLLISION;
+    if (config->center_attraction != 0.0f) flags |= SIM_STEP_CENTER_ATTRACTION;
+    if (config->move_sense_coef != 0.0f) flags |= SIM_STEP_DENSITY_MOVE;
+    uint32_t heading = particles->heading == SimHeading::DIRECTION ? 1 : 0;
+    return table->functions[heading][variant][flags];
+}
+
+static inline uint32_t wang_hash(uint32_t seed) {
+    seed = (seed ^ 61) ^ (seed >> 16);
+    seed *= 9;
+    seed = seed ^ (seed >> 4);
+    seed *= 0x27d4eb2d;
+    seed = seed ^ (seed >> 15);
+    return seed;
+}
+
+// Returns false if the position falls outside of the world, writes to such voxels are dropped on GPU.
+static inline bool voxel_index(World *world, float x, float y, float z, size_t *index) {
+    uint32_t ix = uint32_t(x), iy = uint32_t(y), iz = uint32_t(z);
+    if (ix >= world->width || iy >= world->height || iz >= world->depth) {
+        return false;
+    }
+    *index = (size_t(iz) * world->height + iy) * world->width + ix;
+    return true;
+}
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIM_X86
+#ifdef _MSC_VER
+#include <immintrin.h>
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+    __cpuidex((int *)regs, int(leaf), int(subleaf));
+}
+static uint64_t xgetbv() {
+    return _xgetbv(0);
+}
+#else
+#include <cpuid.h>
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]) {
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+}
+static uint64_t xgetbv() {
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (uint64_t(edx) << 32) | eax;
+}
+#endif
+#endif
+
+static bool is_kernel_supported(SimKernel kernel) {
+    if (kernel == SimKernel::SCALAR || kernel == SimKernel::AUTO) {
+        return true;
+    }
+#ifdef SIM_X86
+    uint32_t regs[4];
+    cpuid(0, 0, regs);
+    if (regs[0] < 7) {
+        return false;
+    }
+    // OS has to support saving of AVX registers. Vector kernels also convert FLOAT16 trail with F16C,
+    // which every CPU with AVX2 has.
+    cpuid(1, 0, regs);
+    bool osxsave = (regs[2] & (1u << 27)) != 0;
+    bool avx = (regs[2] & (1u << 28)) != 0;
+    bool f16c = (regs[2] & (1u << 29)) != 0;
+    if (!osxsave || !avx || !f16c) {
+        return false;
+    }
+    uint64_t xcr0 = xgetbv();
+    cpuid(7, 0, regs);
+    if (kernel == SimKernel::AVX2) {
+        return (xcr0 & 0x6) == 0x6 && (regs[1] & (1u << 5));
+    }
+    if (kernel == SimKernel::AVX512) {
+        return (xcr0 & 0xE6) == 0xE6 && (regs[1] & (1u << 16));
+    }
+#endif
+    return false;
+}
+
+bool sim::set_kernel(SimKernel kernel) {
+    if (!is_kernel_supported(kernel)) {
+        return false;
+    }
+    selected_kernel = kernel;
+    return true;
+}
+
+SimKernel sim::get_kernel() {
+    if (selected_kernel == SimKernel::AUTO) {
+        if (is_kernel_supported(SimKernel::AVX512)) {
+            selected_kernel = SimKernel::AVX512;
+        } else if (is_kernel_supported(SimKernel::AVX2)) {
+            selected_kernel = SimKernel::AVX2;
+        } else {
+            selected_kernel = SimKernel::SCALAR;
+        }
+    }
+    return selected_kernel;
+}
+
+const char *sim::get_kernel_name(SimKernel kernel) {
+    switch (kernel) {
+        case SimKernel::AUTO: return "auto";
+        case SimKernel::SCALAR: return "scalar";
+        case SimKernel::AVX2: return "avx2";
+        case SimKernel::AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+const char *sim::get_trail_format_name(SimTrailFormat format) {
+    switch (format) {
+        case SimTrailFormat::FLOAT32: return "fp32";
+        case SimTrailFormat::FLOAT16: return "fp16";
+        case SimTrailFormat::UNORM8: return "u8";
+    }
+    return "unknown";
+}
+
+static void *alloc_zeroed(size_t size) {
+    void *result = calloc(1, size);
+    return result;
+}
+
+static inline size_t get_occupancy_word_count(World *world) {
+    return (size_t(world->width) * world->height * world->depth + 31) / 32;
+}
+
+static inline uint32_t brick_count(uint32_t size) {
+    return (size + SIM_BRICK_SIZE - 1) / SIM_BRICK_SIZE;
+}
+
+World sim::get_world(uint32_t width, uint32_t height, uint32_t depth, SimTrailFormat trail_format, SimDecayBuffer decay_buffer) {
+    World world = {};
+    world.width = width;
+    world.height = height;
+    world.depth = depth;
+    size_t voxel_count = size_t(width) * height * depth;
+    // Step kernels index trail with 32 bit integers.
+    assert(voxel_count < (size_t(1) << 31));
+    world.occupancy = (uint32_t *)alloc_zeroed(get_occupancy_word_count(&world) * sizeof(uint32_t));
+
+    world.brick_width = brick_count(width);
+    world.brick_height = brick_count(height);
+    world.brick_depth = brick_count(depth);
+    size_t bricks = size_t(world.brick_width) * world.brick_height * world.brick_depth;
+    world.brick_flags = (uint8_t *)alloc_zeroed(bricks * sizeof(uint8_t));
+    world.active_bricks = (uint32_t *)alloc_zeroed(bricks * sizeof(uint32_t));
+    world.brick_max = (float *)alloc_zeroed(bricks * sizeof(float));
+    world.brick_threshold = SIM_BRICK_THRESHOLD;
+    world.center_z = float(depth) * 0.5f;
+
+    // Failed allocation leaves voxels NULL, which callers check.
+    world.trail_format = trail_format;
+    world.decay_buffer = decay_buffer;
+    bool ping_pong = decay_buffer == SimDecayBuffer::PING_PONG;
+    if (!trail::allocate(&world, &world.trail) || (ping_pong && !trail::allocate(&world, &world.trail_back))) {
+        trail::release(&world.trail);
+        trail::release(&world.trail_back);
+    }
+    return world;
+}
+
+void sim::release(World *world) {
+    trail::release(&world->trail);
+    trail::release(&world->trail_back);
+    free(world->occupancy);
+    free(world->occupancy_dirty);
+    free(world->brick_flags);
+    free(world->active_bricks);
+    free(world->brick_max);
+    *world = {};
+}
+
+uint64_t sim::get_voxel_count(World *world) {
+    return uint64_t(world->width) * world->height * world->depth;
+}
+
+void sim::clear(World *world, ThreadPool *pool) {
+    // Split by brick layers, so UNORM8 brick ranges are cleared together with their voxels.
+    thread_pool::run(pool, world->brick_depth, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        uint32_t z_begin = begin * SIM_BRICK_SIZE;
+        uint32_t z_end = end * SIM_BRICK_SIZE < world->depth ? end * SIM_BRICK_SIZE : world->depth;
+        trail::clear(world, &world->trail, z_begin, z_end);
+        if (world->trail_back.voxels) {
+            trail::clear(world, &world->trail_back, z_begin, z_end);
+        }
+    });
+    memset(world->occupancy, 0, get_occupancy_word_count(world) * sizeof(uint32_t));
+    world->occupancy_dirty_count = 0;
+    memset(world->brick_flags, 0, sim::get_brick_count(world) * sizeof(uint8_t));
+    memset(world->brick_max, 0, sim::get_brick_count(world) * sizeof(float));
+    world->active_brick_count = 0;
+}
+
+uint32_t sim::get_brick_count(World *world) {
+    return world->brick_width * world->brick_height * world->brick_depth;
+}
+
+float sim::get_trail(World *world, uint32_t x, uint32_t y, uint32_t z) {
+    return trail::load(world, &world->trail, x, y, z);
+}
+
+uint64_t sim::get_trail_size(World *world) {
+    uint64_t size = sim::get_voxel_count(world) * trail::get_voxel_size(world->trail_format);
+    if (world->trail_format == SimTrailFormat::UNORM8) {
+        size += uint64_t(sim::get_brick_count(world)) * 2 * sizeof(float);
+    }
+    return world->decay_buffer == SimDecayBuffer::PING_PONG ? size * 2 : size;
+}
+
+void sim::activate_bricks(World *world) {
+    uint32_t brick_count = sim::get_brick_count(world);
+    for (uint32_t i = 0; i < brick_count; ++i) {
+        world->brick_flags[i] = 1;
+        world->active_bricks[i] = i;
+    }
+    world->active_brick_count = brick_count;
+}
+
+Particles sim::get_particles(uint32_t count) {
+    Particles particles = {};
+    particles.count = count;
+    particles.capacity = count;
+    particles.x = (float *)malloc(sizeof(float) * count);
+    particles.y = (float *)malloc(sizeof(float) * count);
+    particles.z = (float *)malloc(sizeof(float) * count);
+    particles.phi = (float *)malloc(sizeof(float) * count);
+    particles.theta = (float *)malloc(sizeof(float) * count);
+    particles.pair = (uint32_t *)malloc(sizeof(uint32_t) * count);
+    return particles;
+}
+
+void sim::release(Particles *particles) {
+    free(particles->x);
+    free(particles->y);
+    free(particles->z);
+    free(particles->phi);
+    free(particles->theta);
+    free(particles->pair);
+    free(particles->dir_x);
+    free(particles->dir_y);
+    free(particles->dir_z);
+    free(particles->birth);
+    *particles = {};
+}
+
+void sim::set_heading(Particles *particles, SimHeading heading) {
+    if (particles->heading == heading) {
+        return;
+    }
+    if (heading == SimHeading::DIRECTION) {
+        particles->dir_x = (float *)malloc(sizeof(float) * particles->capacity);
+        particles->dir_y = (float *)malloc(sizeof(float) * particles->capacity);
+        particles->dir_z = (float *)malloc(sizeof(float) * particles->capacity);
+        particles->heading = heading;
+        sim::update_directions(particles);
+    } else {
+        sim::update_angles(particles);
+        free(particles->dir_x);
+        free(particles->dir_y);
+        free(particles->dir_z);
+        particles->dir_x = particles->dir_y = particles->dir_z = NULL;
+        particles->heading = heading;
+    }
+}
+
+// Same mapping as the GPU simulation uses: theta is angle from +y, phi is angle in xz plane from +x towards +z.
+void sim::update_angles(Particles *particles) {
+    if (particles->heading != SimHeading::DIRECTION) {
+        return;
+    }
+    for (uint32_t i = 0; i < particles->count; ++i) {
+        float y = particles->dir_y[i];
+        particles->theta[i] = acosf(y < -1.0f ? -1.0f : (y > 1.0f ? 1.0f : y));
+        particles->phi[i] = atan2f(particles->dir_z[i], particles->dir_x[i]);
+    }
+}
+
+static void update_directions(Particles *particles, uint32_t begin, uint32_t end) {
+    if (particles->heading != SimHeading::DIRECTION) {
+        return;
+    }
+    for (uint32_t i = begin; i < end; ++i) {
+        float sin_theta = sinf(particles->theta[i]);
+        particles->dir_x[i] = sin_theta * cosf(particles->phi[i]);
+        particles->dir_y[i] = cosf(particles->theta[i]);
+        particles->dir_z[i] = sin_theta * sinf(particles->phi[i]);
+    }
+}
+
+void sim::update_directions(Particles *particles) {
+    update_directions(particles, 0, particles->count);
+}
+
+// Uniform random number in [0, 1) from a running hash state.
+static inline float random_uniform(uint32_t *state) {
+    *state = wang_hash(*state + 0x9E3779B9u);
+    return float(*state >> 8) / float(1 << 24);
+}
+
+// Spawns particles [begin, end) uniformly inside a sphere with random headings.
+static void spawn_range(Particles *particles, uint32_t begin, uint32_t end, float x, float y, float z, float spawn_radius, uint32_t step, uint32_t seed) {
+    const float PI2 = 6.28318530718f;
+    uint32_t state = seed;
+    for (uint32_t i = begin; i < end; ++i) {
+        float phi = random_uniform(&state) * PI2;
+        float theta = acosf(2 * random_uniform(&state) - 1);
+        float radius = random_uniform(&state);
+        radius = powf(radius, 1.0f / 3.0f) * spawn_radius;
+        particles->x[i] = sinf(phi) * sinf(theta) * radius + x;
+        particles->y[i] = cosf(theta) * radius + y;
+        particles->z[i] = cosf(phi) * sinf(theta) * radius + z;
+        particles->phi[i] = acosf(2 * random_uniform(&state) - 1);
+        particles->theta[i] = random_uniform(&state) * PI2;
+        particles->pair[i] = SIM_NO_PAIR;
+        if (particles->birth) particles->birth[i] = step;
+    }
+    update_directions(particles, begin, end);
+}
+
+void sim::spawn_particles(Particles *particles, World *world, float spawn_radius, uint32_t seed) {
+    spawn_range(particles, 0, particles->count, world->width / 2.0f, world->height / 2.0f, world->depth / 2.0f, spawn_radius, 0, seed);
+}
+
+void sim::add_particles(Particles *particles, float x, float y, float z, float radius, uint32_t count, uint32_t step, uint32_t seed) {
+    uint32_t begin = particles->count;
+    sim::reserve_particles(particles, begin + count);
+    particles->count = begin + count;
+    spawn_range(particles, begin, begin + count, x, y, z, radius, step, seed);
+}
+
+// Deposits are binned into slabs of brick layers and every slab is applied by a single thread in particle
+// index order, so there are no atomics even when many particles share a voxel, and result is the same
+// for any thread count.
+void sim::deposit(World *world, Particles *particles, Config *config, ThreadPool *pool) {
+    PROFILE_SCOPE("deposit");
+    uint32_t count = particles->count;
+    uint32_t slice_size = world->width * world->height;
+    uint32_t slab_count = thread_pool::get_thread_count(pool) * 4;
+    if (slab_count > world->brick_depth) slab_count = world->brick_depth;
+    uint32_t block_count = (count + DEPOSIT_BLOCK_SIZE - 1) / DEPOSIT_BLOCK_SIZE;
+
+    uint32_t *particle_voxels = (uint32_t *)malloc(sizeof(uint32_t) * count * 3);
+    uint32_t *voxels = particle_voxels + count;
+    uint32_t *new_bricks = voxels + count;
+    uint32_t *offsets = (uint32_t *)malloc(sizeof(uint32_t) * (block_count * slab_count + slab_count * 2 + 1));
+    uint32_t *slab_offsets = offsets + block_count * slab_count;
+    uint32_t *new_brick_counts = slab_offsets + slab_count + 1;
+
+    auto get_slab = [&](uint32_t voxel) {
+        uint32_t layer = voxel / slice_size / SIM_BRICK_SIZE;
+        return layer * slab_count / world->brick_depth;
+    };
+
+    // Count deposits of every block per slab.
+    thread_pool::run(pool, block_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t block = begin; block < end; ++block) {
+            uint32_t *histogram = offsets + block * slab_count;
+            memset(histogram, 0, sizeof(uint32_t) * slab_count);
+            uint32_t last = (block + 1) * DEPOSIT_BLOCK_SIZE < count ? (block + 1) * DEPOSIT_BLOCK_SIZE : count;
+            for (uint32_t idx = block * DEPOSIT_BLOCK_SIZE; idx < last; ++idx) {
+                size_t voxel;
+                if (voxel_index(world, particles->x[idx], particles->y[idx], particles->z[idx], &voxel)) {
+                    particle_voxels[idx] = uint32_t(voxel);
+                    histogram[get_slab(uint32_t(voxel))]++;
+                } else {
+                    particle_voxels[idx] = NO_VOXEL;
+                }
+            }
+        }
+    });
+
+    // Slab major prefix sum, deposits of every slab end up sorted by particle index.
+    uint32_t offset = 0;
+    for (uint32_t slab = 0; slab < slab_count; ++slab) {
+        slab_offsets[slab] = offset;
+        for (uint32_t block = 0; block < block_count; ++block) {
+            uint32_t value = offsets[block * slab_count + slab];
+            offsets[block * slab_count + slab] = offset;
+            offset += value;
+        }
+    }
+    slab_offsets[slab_count] = offset;
+
+    thread_pool::run(pool, block_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t block = begin; block < end; ++block) {
+            uint32_t *block_offsets = offsets + block * slab_count;
+            uint32_t last = (block + 1) * DEPOSIT_BLOCK_SIZE < count ? (block + 1) * DEPOSIT_BLOCK_SIZE : count;
+            for (uint32_t idx = block * DEPOSIT_BLOCK_SIZE; idx < last; ++idx) {
+                uint32_t voxel = particle_voxels[idx];
+                if (voxel != NO_VOXEL) {
+                    voxels[block_offsets[get_slab(voxel)]++] = voxel;
+                }
+            }
+        }
+    });
+
+    // Slabs don't share bricks, newly activated bricks are collected per slab and appended to the
+    // active list afterwards, in slab order.
+    thread_pool::run(pool, slab_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t slab = begin; slab < end; ++slab) {
+            uint32_t *slab_new_bricks = new_bricks + slab_offsets[slab];
+            uint32_t new_brick_count = 0;
+            for (uint32_t i = slab_offsets[slab]; i < slab_offsets[slab + 1]; ++i) {
+                uint32_t voxel = voxels[i];
+                uint32_t x = voxel % world->width, y = voxel / world->width % world->height, z = voxel / slice_size;
+                uint32_t brick = get_voxel_brick(world, x, y, z);
+                // Bricks of a slab are only written by its thread, so UNORM8 bricks can be rescaled here.
+                trail::add(world, &world->trail, voxel, brick, config->deposit_value);
+                if (!world->brick_flags[brick]) {
+                    world->brick_flags[brick] = 1;
+                    slab_new_bricks[new_brick_count++] = brick;
+                }
+            }
+            new_brick_counts[slab] = new_brick_count;
+        }
+    });
+    for (uint32_t slab = 0; slab < slab_count; ++slab) {
+        for (uint32_t i = 0; i < new_brick_counts[slab]; ++i) {
+            world->active_bricks[world->active_brick_count++] = new_bricks[slab_offsets[slab] + i];
+        }
+    }
+
+    free(offsets);
+    free(particle_voxels);
+}
+
+void sim::move_particles(World *world, Particles *particles, Config *config, ThreadPool *pool) {
+    PROFILE_SCOPE("move_particles");
+    // Only words set by the previous step have to be cleared.
+    for (uint32_t i = 0; i < world->occupancy_dirty_count; ++i) {
+        world->occupancy[world->occupancy_dirty[i]] = 0;
+    }
+    world->occupancy_dirty_count = 0;
+    // Every particle sets at most one word.
+    if (world->occupancy_dirty_capacity < particles->count) {
+        free(world->occupancy_dirty);
+        world->occupancy_dirty = (uint32_t *)malloc(sizeof(uint32_t) * particles->count);
+        world->occupancy_dirty_capacity = particles->count;
+    }
+
+    StepTable *tables = get_step_tables();
+    StepFunction scalar_function = get_step_function(&tables[0], particles, config);
+    StepFunction step_function = scalar_function;
+    SimKernel kernel = sim::get_kernel();
+    if (kernel == SimKernel::AVX2) {
+        step_function = get_step_function(&tables[1], particles, config);
+    } else if (kernel == SimKernel::AVX512) {
+        step_function = get_step_function(&tables[2], particles, config);
+    }
+
+    thread_pool::run(pool, particles->count, PARTICLE_CHUNK_SIZE, [&](uint32_t begin, uint32_t end, uint32_t) {
+        // Vector kernels process whole blocks of particles, scalar kernel finishes the rest.
+        uint32_t processed = step_function(world, particles, config, begin, end);
+        scalar_function(world, particles, config, processed, end);
+    });
+}
+
+void sim::step(World *world, Particles *particles, Config *config, ThreadPool *pool) {
+    sim::move_particles(world, particles, config, pool);
+    // Deposit after all particles moved. On GPU deposits race with sensing of other particles,
+    // here every particle senses the same trail state.
+    sim::deposit(world, particles, config, pool);
+}
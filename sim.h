@@ -0,0 +1,216 @@
+#pragma once
+
+#include <stdint.h>
+#include "config.h"
+
+struct ThreadPool;
+
+// How particle headings are stored. ANGLES keeps phi/theta, same as the GPU simulation. DIRECTION keeps
+// a unit heading vector, which step turns and pulls towards the center with multiply-adds instead of
+// converting between angles and vectors with sin/cos/acos/atan2 several times per step.
+enum class SimHeading {
+    ANGLES,
+    DIRECTION,
+};
+
+// Particle state in SoA layout, same as the structured buffers used by the GPU simulation.
+struct Particles {
+    float *x;
+    float *y;
+    float *z;
+    float *phi;
+    float *theta;
+    uint32_t *pair;
+    uint32_t count;
+    // Length of allocated arrays, count can grow up to it without reallocating them.
+    uint32_t capacity;
+
+    // Heading vectors, only allocated with SimHeading::DIRECTION. phi/theta aren't updated by step then,
+    // sim::update_angles brings them up to date.
+    SimHeading heading;
+    float *dir_x;
+    float *dir_y;
+    float *dir_z;
+
+    // Step every particle was spawned in, only allocated once particles have a lifetime (see ParticlePool).
+    uint32_t *birth;
+};
+
+#define SIM_MAX_EMITTERS 8
+
+// Spawns `rate` particles per step uniformly inside a sphere, with random headings. Fractions of a particle
+// carry over to the next step.
+struct ParticleEmitter {
+    float x, y, z;
+    float radius;
+    float rate;
+    float carry;
+};
+
+// Runtime spawning and culling of particles, see sim::update_pool.
+struct ParticlePool {
+    ParticleEmitter emitters[SIM_MAX_EMITTERS];
+    uint32_t emitter_count;
+    // Particles older than this many steps are culled, 0 means particles live forever.
+    uint32_t lifetime;
+    // Particles standing in trail above this value are culled with probability 1 - density_limit / trail,
+    // which thins out dense filaments and leaves room for new particles. 0 disables density culling.
+    float density_limit;
+    // Emitters stop spawning at this many particles, 0 means no limit.
+    uint32_t max_count;
+    uint32_t seed;
+};
+
+// How trail voxels are stored. FLOAT32 is exact, FLOAT16 is the R16_FLOAT the GPU simulation uses and halves
+// memory and bandwidth, UNORM8 quarters them: every voxel is 8 bits scaled by an offset and scale shared by
+// its brick. Kernels decode voxels as they read them, values outside of half range saturate.
+enum class SimTrailFormat {
+    FLOAT32,
+    FLOAT16,
+    UNORM8,
+};
+
+// Where decay/diffusion writes its output. PING_PONG decays into a second trail buffer and swaps the buffers,
+// same as trail_tex_A/trail_tex_B of the GPU simulation. IN_PLACE overwrites the trail, keeping copies of only
+// the rows and slices that neighbouring tasks still have to read, which halves trail memory. Results are identical.
+enum class SimDecayBuffer {
+    PING_PONG,
+    IN_PLACE,
+};
+
+// Trail volume in World::trail_format, voxels are in the same x-major order in every format.
+struct TrailBuffer {
+    // float, uint16_t or uint8_t per voxel.
+    void *voxels;
+    // UNORM8 only, voxel decodes to brick_offset + value * brick_scale of its brick.
+    float *brick_offset;
+    float *brick_scale;
+};
+
+// Simulation environment for CPU simulation. Equivalent of trail_tex_A/trail_tex_B and occ_tex.
+struct World {
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+
+    // Trail map which particles sense and deposit into and buffer which decay/diffusion writes into.
+    // Buffers are swapped after every decay, so `trail` always holds the latest state. With
+    // SimDecayBuffer::IN_PLACE `trail_back` isn't allocated.
+    SimTrailFormat trail_format;
+    SimDecayBuffer decay_buffer;
+    TrailBuffer trail;
+    TrailBuffer trail_back;
+
+    // Occupancy bit map used for collision checks, one bit per voxel. Words set during a step are recorded
+    // in `occupancy_dirty`, so the next step only has to clear those instead of the whole map.
+    uint32_t *occupancy;
+    uint32_t *occupancy_dirty;
+    uint32_t occupancy_dirty_count;
+    uint32_t occupancy_dirty_capacity;
+
+    // Trail is split into bricks of SIM_BRICK_SIZE^3 voxels. Bricks are activated by deposits and retired
+    // by decay once all their voxels fall below `brick_threshold`. Inactive bricks are zero in both trail
+    // buffers, so decay only has to visit active bricks and their neighbours.
+    uint32_t brick_width;
+    uint32_t brick_height;
+    uint32_t brick_depth;
+    uint8_t *brick_flags;
+    uint32_t *active_bricks;
+    uint32_t active_brick_count;
+    // Zero disables retiring.
+    float brick_threshold;
+    // Max trail value of every brick, written by decay, so it doesn't include deposits made since. Zero for
+    // inactive bricks. Renderers use it to skip empty space (see raymarch.h).
+    float *brick_max;
+
+    // Z of the point center attraction pulls towards. Middle of the world, unless the world is a slab of
+    // a larger one (see sim_slabs.h).
+    float center_z;
+};
+
+#define SIM_BRICK_SHIFT 3
+#define SIM_BRICK_SIZE (1 << SIM_BRICK_SHIFT)
+// Default brick_threshold. Trail values this small don't change sensing in any visible way.
+#define SIM_BRICK_THRESHOLD 1e-4f
+
+// Implementation of particle step kernel. AUTO picks the widest instruction set supported by CPU,
+// all kernels produce identical results.
+enum class SimKernel {
+    AUTO,
+    SCALAR,
+    AVX2,
+    AVX512,
+};
+
+// Particle pair value meaning there's no pair assigned, same as in main.cpp.
+#define SIM_NO_PAIR 100000000
+
+namespace sim {
+    World get_world(uint32_t width, uint32_t height, uint32_t depth, SimTrailFormat trail_format, SimDecayBuffer decay_buffer);
+    void release(World *world);
+    // Zeroes trail and occupancy maps and deactivates all bricks.
+    void clear(World *world, ThreadPool *pool);
+
+    Particles get_particles(uint32_t count);
+    void release(Particles *particles);
+    // Switches how headings are stored, converting current headings. Particles start with ANGLES.
+    void set_heading(Particles *particles, SimHeading heading);
+    // Computes phi/theta from heading vectors and heading vectors from phi/theta. Both do nothing with ANGLES.
+    void update_angles(Particles *particles);
+    void update_directions(Particles *particles);
+    // Spawns particles uniformly inside a sphere in the world center with random headings, same as update_particles in main.cpp.
+    void spawn_particles(Particles *particles, World *world, float spawn_radius, uint32_t seed);
+
+    // Particle pool. Arrays grow on demand, new particles are appended after the live ones and culling moves
+    // survivors to the front, so all stages only process `count` particles and partition work from it.
+    //
+    // Grows arrays to hold at least `capacity` particles, keeping current ones. Capacity grows by a quarter at
+    // least, so adding particles one step at a time doesn't reallocate every step.
+    void reserve_particles(Particles *particles, uint32_t capacity);
+    // Appends `count` particles spawned inside a sphere, born in `step`.
+    void add_particles(Particles *particles, float x, float y, float z, float radius, uint32_t count, uint32_t step, uint32_t seed);
+    // Removes particles past their lifetime or culled by density, keeping order of the rest. Pairs are remapped,
+    // pairs of removed particles are reset. Returns number of removed particles.
+    uint32_t cull_particles(Particles *particles, World *world, ParticlePool *particle_pool, uint32_t step, ThreadPool *pool);
+    // Culls particles and spawns new ones from all emitters, meant to run once per step.
+    void update_pool(Particles *particles, World *world, ParticlePool *particle_pool, uint32_t step, ThreadPool *pool);
+    // Grows pool to `count` particles by spawning them in a sphere in the world center, or shrinks it by dropping
+    // the newest ones.
+    void resize_particles(Particles *particles, World *world, uint32_t count, float spawn_radius, uint32_t step, uint32_t seed);
+
+    // Sense, turn, move, collide and deposit step for all particles. Equivalent of particle_shader_3d.hlsl.
+    void step(World *world, Particles *particles, Config *config, ThreadPool *pool);
+    // Two halves of step, exposed separately for benchmarking. move_particles senses, turns, moves and
+    // collides all particles, deposit then adds trail at their new positions.
+    void move_particles(World *world, Particles *particles, Config *config, ThreadPool *pool);
+    void deposit(World *world, Particles *particles, Config *config, ThreadPool *pool);
+    // 3x3x3 decay/diffusion of the trail map. Equivalent of decay_shader_3d.hlsl.
+    void decay(World *world, Config *config, ThreadPool *pool);
+    // Runs multiple decay steps, fusing them so the volume is read and written once per up to 8 steps.
+    // Meant for running decay while particles are paused. When only a small part of the world holds
+    // trail, both decay functions process just the active bricks instead.
+    void decay_steps(World *world, Config *config, uint32_t steps, ThreadPool *pool);
+
+    uint64_t get_voxel_count(World *world);
+    uint32_t get_brick_count(World *world);
+    // Decoded trail value of voxel (x, y, z), which has to be inside of the world.
+    float get_trail(World *world, uint32_t x, uint32_t y, uint32_t z);
+    // Size of allocated trail buffers in bytes.
+    uint64_t get_trail_size(World *world);
+    // Marks all bricks active. Has to be called after trail is written outside of sim functions.
+    void activate_bricks(World *world);
+
+    // Sorts particles by Morton code of their voxel, so particles close in memory are close in space.
+    // Pairs are remapped to new particle indices.
+    void sort_particles(World *world, Particles *particles, ThreadPool *pool);
+    // Estimates trail cache misses per particle when accessing trail in particle order,
+    // using a simple cache model (~2MB direct mapped). Used to measure effect of sort_particles.
+    float measure_locality(World *world, Particles *particles);
+
+    // Forces kernel used by step. Returns false if the kernel isn't supported by CPU.
+    bool set_kernel(SimKernel kernel);
+    // Kernel which step currently uses, never AUTO.
+    SimKernel get_kernel();
+    const char *get_kernel_name(SimKernel kernel);
+    const char *get_trail_format_name(SimTrailFormat format);
+}
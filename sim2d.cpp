@@ -0,0 +1,403 @@
+#include "sim2d.h"
+#include "sim.h"
+#include "thread_pool.h"
+#include "profiler.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define SIM_LANES_SCALAR
+#include "sim_lanes.h"
+#include "sim_kernel.h"
+#include "sim2d_kernel.h"
+
+// Number of agents processed by a single thread pool task.
+#define PARTICLE_CHUNK_SIZE 4096
+// Number of agents binned together by deposit and sort.
+#define BLOCK_SIZE (64 * 1024)
+#define TILE_CELLS (SIM2D_TILE_SIZE * SIM2D_TILE_SIZE)
+#define PADDED_SIZE (SIM2D_TILE_SIZE + 2)
+
+// Vectorized builds of step_particles_2d, defined in sim_avx2.cpp and sim_avx512.cpp.
+uint32_t step_particles_2d_avx2(World2D *world, Particles2D *particles, Config *config, uint32_t begin, uint32_t end);
+uint32_t step_particles_2d_avx512(World2D *world, Particles2D *particles, Config *config, uint32_t begin, uint32_t end);
+
+typedef uint32_t (*Step2DFunction)(World2D *world, Particles2D *particles, Config *config, uint32_t begin, uint32_t end);
+
+static uint32_t step_particles_2d_scalar(World2D *world, Particles2D *particles, Config *config, uint32_t begin, uint32_t end) {
+    return step_particles_2d<lanes_scalar::Lanes>(world, particles, config, begin, end);
+}
+
+static inline uint32_t hash(uint32_t seed) {
+    seed = (seed ^ 61) ^ (seed >> 16);
+    seed *= 9;
+    seed = seed ^ (seed >> 4);
+    seed *= 0x27d4eb2d;
+    seed = seed ^ (seed >> 15);
+    return seed;
+}
+
+static inline float random_uniform(uint32_t *state) {
+    *state = hash(*state + 0x9E3779B9u);
+    return float(*state >> 8) / float(1 << 24);
+}
+
+static inline uint32_t get_cell(World2D *world, uint32_t x, uint32_t y) {
+    uint32_t tile = (y >> SIM2D_TILE_SHIFT) * world->tiles_x + (x >> SIM2D_TILE_SHIFT);
+    return (tile << (2 * SIM2D_TILE_SHIFT)) | ((y & (SIM2D_TILE_SIZE - 1)) << SIM2D_TILE_SHIFT) | (x & (SIM2D_TILE_SIZE - 1));
+}
+
+// Returns false if the position falls outside of the world.
+static inline bool get_cell(World2D *world, float x, float y, uint32_t *cell) {
+    uint32_t ix = uint32_t(x), iy = uint32_t(y);
+    if (x < 0.0f || y < 0.0f || ix >= world->width || iy >= world->height) {
+        return false;
+    }
+    *cell = get_cell(world, ix, iy);
+    return true;
+}
+
+static inline size_t get_cell_count(World2D *world) {
+    return size_t(world->tiles_x) * world->tiles_y * TILE_CELLS;
+}
+
+World2D sim2d::get_world(uint32_t width, uint32_t height) {
+    World2D world = {};
+    world.width = width;
+    world.height = height;
+    world.tiles_x = (width + SIM2D_TILE_SIZE - 1) / SIM2D_TILE_SIZE;
+    world.tiles_y = (height + SIM2D_TILE_SIZE - 1) / SIM2D_TILE_SIZE;
+    // Step kernels index trail with 32 bit integers.
+    assert(get_cell_count(&world) < (size_t(1) << 31));
+    world.trail = (float *)calloc(get_cell_count(&world), sizeof(float));
+    world.trail_back = (float *)calloc(get_cell_count(&world), sizeof(float));
+    return world;
+}
+
+void sim2d::release(World2D *world) {
+    free(world->trail);
+    free(world->trail_back);
+    *world = {};
+}
+
+void sim2d::clear(World2D *world, ThreadPool *pool) {
+    thread_pool::run(pool, world->tiles_x * world->tiles_y, 64, [&](uint32_t begin, uint32_t end, uint32_t) {
+        size_t offset = size_t(begin) * TILE_CELLS;
+        size_t size = size_t(end - begin) * TILE_CELLS;
+        memset(world->trail + offset, 0, size * sizeof(float));
+        memset(world->trail_back + offset, 0, size * sizeof(float));
+    });
+}
+
+Particles2D sim2d::get_particles(uint32_t count) {
+    Particles2D particles = {};
+    particles.count = count;
+    particles.x = (float *)malloc(sizeof(float) * count);
+    particles.y = (float *)malloc(sizeof(float) * count);
+    particles.dir_x = (float *)malloc(sizeof(float) * count);
+    particles.dir_y = (float *)malloc(sizeof(float) * count);
+    return particles;
+}
+
+void sim2d::release(Particles2D *particles) {
+    free(particles->x);
+    free(particles->y);
+    free(particles->dir_x);
+    free(particles->dir_y);
+    *particles = {};
+}
+
+void sim2d::spawn_particles(Particles2D *particles, World2D *world, float spawn_radius, uint32_t seed) {
+    const float PI2 = 6.28318530718f;
+    uint32_t state = seed;
+    for (uint32_t i = 0; i < particles->count; ++i) {
+        float angle = random_uniform(&state) * PI2;
+        float radius = sqrtf(random_uniform(&state)) * spawn_radius;
+        particles->x[i] = cosf(angle) * radius + world->width / 2.0f;
+        particles->y[i] = sinf(angle) * radius + world->height / 2.0f;
+        float heading = random_uniform(&state) * PI2;
+        particles->dir_x[i] = cosf(heading);
+        particles->dir_y[i] = sinf(heading);
+    }
+}
+
+// Same scheme as sim::deposit: deposits are binned into slabs of tile rows and every slab is applied by
+// a single thread in agent order, so there are no atomics and result doesn't depend on thread count.
+static void deposit(World2D *world, Particles2D *particles, Config *config, ThreadPool *pool) {
+    PROFILE_SCOPE("deposit_2d");
+    uint32_t count = particles->count;
+    uint32_t slab_count = thread_pool::get_thread_count(pool) * 4;
+    if (slab_count > world->tiles_y) slab_count = world->tiles_y;
+    uint32_t block_count = (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t row_cells = world->tiles_x * TILE_CELLS;
+
+    uint32_t *particle_cells = (uint32_t *)malloc(sizeof(uint32_t) * count * 2);
+    uint32_t *cells = particle_cells + count;
+    uint32_t *offsets = (uint32_t *)malloc(sizeof(uint32_t) * (block_count * slab_count + slab_count + 1));
+    uint32_t *slab_offsets = offsets + block_count * slab_count;
+
+    auto get_slab = [&](uint32_t cell) {
+        return cell / row_cells * slab_count / world->tiles_y;
+    };
+
+    thread_pool::run(pool, block_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t block = begin; block < end; ++block) {
+            uint32_t *histogram = offsets + block * slab_count;
+            memset(histogram, 0, sizeof(uint32_t) * slab_count);
+            uint32_t last = (block + 1) * BLOCK_SIZE < count ? (block + 1) * BLOCK_SIZE : count;
+            for (uint32_t idx = block * BLOCK_SIZE; idx < last; ++idx) {
+                uint32_t cell;
+                if (get_cell(world, particles->x[idx], particles->y[idx], &cell)) {
+                    particle_cells[idx] = cell;
+                    histogram[get_slab(cell)]++;
+                } else {
+                    particle_cells[idx] = UINT32_MAX;
+                }
+            }
+        }
+    });
+
+    uint32_t offset = 0;
+    for (uint32_t slab = 0; slab < slab_count; ++slab) {
+        slab_offsets[slab] = offset;
+        for (uint32_t block = 0; block < block_count; ++block) {
+            uint32_t value = offsets[block * slab_count + slab];
+            offsets[block * slab_count + slab] = offset;
+            offset += value;
+        }
+    }
+    slab_offsets[slab_count] = offset;
+
+    thread_pool::run(pool, block_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t block = begin; block < end; ++block) {
+            uint32_t *block_offsets = offsets + block * slab_count;
+            uint32_t last = (block + 1) * BLOCK_SIZE < count ? (block + 1) * BLOCK_SIZE : count;
+            for (uint32_t idx = block * BLOCK_SIZE; idx < last; ++idx) {
+                uint32_t cell = particle_cells[idx];
+                if (cell != UINT32_MAX) {
+                    cells[block_offsets[get_slab(cell)]++] = cell;
+                }
+            }
+        }
+    });
+
+    float deposit_value = config->deposit_value;
+    thread_pool::run(pool, slab_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t slab = begin; slab < end; ++slab) {
+            for (uint32_t i = slab_offsets[slab]; i < slab_offsets[slab + 1]; ++i) {
+                world->trail[cells[i]] += deposit_value;
+            }
+        }
+    });
+
+    free(offsets);
+    free(particle_cells);
+}
+
+void sim2d::step(World2D *world, Particles2D *particles, Config *config, ThreadPool *pool) {
+    {
+        PROFILE_SCOPE("move_particles_2d");
+        Step2DFunction step_function = step_particles_2d_scalar;
+        SimKernel kernel = sim::get_kernel();
+        if (kernel == SimKernel::AVX2) {
+            step_function = step_particles_2d_avx2;
+        } else if (kernel == SimKernel::AVX512) {
+            step_function = step_particles_2d_avx512;
+        }
+        thread_pool::run(pool, particles->count, PARTICLE_CHUNK_SIZE, [&](uint32_t begin, uint32_t end, uint32_t) {
+            uint32_t processed = step_function(world, particles, config, begin, end);
+            step_particles_2d_scalar(world, particles, config, processed, end);
+        });
+    }
+    // Deposit after all agents moved, so every agent senses the same trail state.
+    deposit(world, particles, config, pool);
+}
+
+// Copies tile with a one cell border from neighbouring tiles into a PADDED_SIZE^2 buffer, border outside
+// of the world is zero.
+static void load_padded_tile(World2D *world, uint32_t tx, uint32_t ty, float *padded) {
+    const uint32_t T = SIM2D_TILE_SIZE;
+    auto get_tile = [&](int x, int y) -> const float * {
+        if (x < 0 || y < 0 || x >= int(world->tiles_x) || y >= int(world->tiles_y)) return NULL;
+        return world->trail + (size_t(y) * world->tiles_x + x) * TILE_CELLS;
+    };
+    const float *center = get_tile(tx, ty);
+    const float *left = get_tile(int(tx) - 1, ty);
+    const float *right = get_tile(tx + 1, ty);
+    for (uint32_t r = 0; r < T; ++r) {
+        float *row = padded + size_t(r + 1) * PADDED_SIZE;
+        row[0] = left ? left[r * T + T - 1] : 0.0f;
+        memcpy(row + 1, center + r * T, sizeof(float) * T);
+        row[T + 1] = right ? right[r * T] : 0.0f;
+    }
+    // Row below the tile comes from the top row of the tile below it and the other way around.
+    for (int side = 0; side < 2; ++side) {
+        int neighbour_y = side == 0 ? int(ty) - 1 : int(ty) + 1;
+        uint32_t source_row = side == 0 ? T - 1 : 0;
+        float *row = padded + (side == 0 ? 0 : size_t(T + 1) * PADDED_SIZE);
+        const float *below_left = get_tile(int(tx) - 1, neighbour_y);
+        const float *below = get_tile(tx, neighbour_y);
+        const float *below_right = get_tile(tx + 1, neighbour_y);
+        row[0] = below_left ? below_left[source_row * T + T - 1] : 0.0f;
+        if (below) {
+            memcpy(row + 1, below + source_row * T, sizeof(float) * T);
+        } else {
+            memset(row + 1, 0, sizeof(float) * T);
+        }
+        row[T + 1] = below_right ? below_right[source_row * T] : 0.0f;
+    }
+}
+
+// Every tile is filtered on its own from a padded copy, 3-tap pass along x over all padded rows
+// followed by 3-tap pass along y.
+void sim2d::decay(World2D *world, Config *config, ThreadPool *pool) {
+    PROFILE_SCOPE("decay_2d");
+    const uint32_t T = SIM2D_TILE_SIZE;
+    float factor = config->decay_factor / 9.0f;
+    uint32_t thread_count = thread_pool::get_thread_count(pool);
+    size_t scratch_size = size_t(PADDED_SIZE) * PADDED_SIZE + size_t(PADDED_SIZE) * T;
+    float *scratch = (float *)malloc(sizeof(float) * scratch_size * thread_count);
+
+    thread_pool::run(pool, world->tiles_x * world->tiles_y, 4, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+        float *padded = scratch + scratch_size * thread_index;
+        float *row_sums = padded + PADDED_SIZE * PADDED_SIZE;
+        for (uint32_t tile = begin; tile < end; ++tile) {
+            uint32_t tx = tile % world->tiles_x, ty = tile / world->tiles_x;
+            load_padded_tile(world, tx, ty, padded);
+            for (uint32_t r = 0; r < PADDED_SIZE; ++r) {
+                const float *in = padded + size_t(r) * PADDED_SIZE;
+                float *sum = row_sums + size_t(r) * T;
+                for (uint32_t x = 0; x < T; ++x) {
+                    sum[x] = in[x] + in[x + 1] + in[x + 2];
+                }
+            }
+            float *out = world->trail_back + size_t(tile) * TILE_CELLS;
+            for (uint32_t y = 0; y < T; ++y) {
+                const float *a = row_sums + size_t(y) * T;
+                const float *b = a + T;
+                const float *c = b + T;
+                for (uint32_t x = 0; x < T; ++x) {
+                    out[y * T + x] = (a[x] + b[x] + c[x]) * factor;
+                }
+            }
+
+            // Trail spreads into cells of edge tiles outside of the world, keep them zero.
+            uint32_t valid_x = world->width - tx * T < T ? world->width - tx * T : T;
+            uint32_t valid_y = world->height - ty * T < T ? world->height - ty * T : T;
+            if (valid_x < T || valid_y < T) {
+                for (uint32_t y = 0; y < T; ++y) {
+                    uint32_t first = y < valid_y ? valid_x : 0;
+                    memset(out + y * T + first, 0, sizeof(float) * (T - first));
+                }
+            }
+        }
+    });
+    free(scratch);
+
+    float *tmp = world->trail;
+    world->trail = world->trail_back;
+    world->trail_back = tmp;
+}
+
+// Stable counting sort by tile, blocks of agents are counted and scattered in parallel.
+void sim2d::sort_particles(World2D *world, Particles2D *particles, ThreadPool *pool) {
+    PROFILE_SCOPE("sort_particles_2d");
+    uint32_t count = particles->count;
+    uint32_t tile_count = world->tiles_x * world->tiles_y;
+    uint32_t block_count = (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t *keys = (uint32_t *)malloc(sizeof(uint32_t) * count * 2);
+    uint32_t *order = keys + count;
+    uint32_t *offsets = (uint32_t *)malloc(sizeof(uint32_t) * size_t(block_count) * tile_count);
+
+    thread_pool::run(pool, block_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t block = begin; block < end; ++block) {
+            uint32_t *histogram = offsets + size_t(block) * tile_count;
+            memset(histogram, 0, sizeof(uint32_t) * tile_count);
+            uint32_t last = (block + 1) * BLOCK_SIZE < count ? (block + 1) * BLOCK_SIZE : count;
+            for (uint32_t i = block * BLOCK_SIZE; i < last; ++i) {
+                uint32_t cell = 0;
+                get_cell(world, particles->x[i], particles->y[i], &cell);
+                keys[i] = cell >> (2 * SIM2D_TILE_SHIFT);
+                histogram[keys[i]]++;
+            }
+        }
+    });
+
+    uint32_t offset = 0;
+    for (uint32_t tile = 0; tile < tile_count; ++tile) {
+        for (uint32_t block = 0; block < block_count; ++block) {
+            uint32_t value = offsets[size_t(block) * tile_count + tile];
+            offsets[size_t(block) * tile_count + tile] = offset;
+            offset += value;
+        }
+    }
+
+    thread_pool::run(pool, block_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t block = begin; block < end; ++block) {
+            uint32_t *block_offsets = offsets + size_t(block) * tile_count;
+            uint32_t last = (block + 1) * BLOCK_SIZE < count ? (block + 1) * BLOCK_SIZE : count;
+            for (uint32_t i = block * BLOCK_SIZE; i < last; ++i) {
+                order[block_offsets[keys[i]]++] = i;
+            }
+        }
+    });
+
+    float *tmp = (float *)keys;
+    float *arrays[4] = { particles->x, particles->y, particles->dir_x, particles->dir_y };
+    for (int a = 0; a < 4; ++a) {
+        float *array = arrays[a];
+        thread_pool::run(pool, count, 16 * 1024, [&](uint32_t begin, uint32_t end, uint32_t) {
+            for (uint32_t i = begin; i < end; ++i) {
+                tmp[i] = array[order[i]];
+            }
+        });
+        memcpy(array, tmp, sizeof(float) * count);
+    }
+
+    free(offsets);
+    free(keys);
+}
+
+float sim2d::get_trail(World2D *world, uint32_t x, uint32_t y) {
+    if (x >= world->width || y >= world->height) return 0.0f;
+    return world->trail[get_cell(world, x, y)];
+}
+
+void sim2d::get_image(World2D *world, float *pixels, uint32_t width, uint32_t height, ThreadPool *pool) {
+    // Cells per pixel, world is centered in the image.
+    float scale = float(world->width) / width > float(world->height) / height ?
+                  float(world->width) / width : float(world->height) / height;
+    float offset_x = (width - world->width / scale) * 0.5f;
+    float offset_y = (height - world->height / scale) * 0.5f;
+
+    // Covered cells [begin, end) of pixel p along one axis, empty outside of the world.
+    auto get_range = [&](uint32_t p, float offset, uint32_t size, int *begin, int *end) {
+        float start = (p - offset) * scale;
+        *begin = int(floorf(start));
+        *end = int(ceilf(start + scale));
+        if (*end <= *begin) *end = *begin + 1;
+        if (*begin < 0) *begin = 0;
+        if (*end > int(size)) *end = int(size);
+    };
+
+    thread_pool::run(pool, height, 8, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t py = begin; py < end; ++py) {
+            float *row = pixels + size_t(py) * width;
+            int y0, y1;
+            get_range(py, offset_y, world->height, &y0, &y1);
+            for (uint32_t px = 0; px < width; ++px) {
+                int x0, x1;
+                get_range(px, offset_x, world->width, &x0, &x1);
+                float sum = 0.0f;
+                for (int y = y0; y < y1; ++y) {
+                    for (int x = x0; x < x1; ++x) {
+                        sum += world->trail[get_cell(world, uint32_t(x), uint32_t(y))];
+                    }
+                }
+                int cells = (x1 - x0) * (y1 - y0);
+                row[px] = cells > 0 ? sum / cells : 0.0f;
+            }
+        }
+    });
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include "config.h"
+
+struct ThreadPool;
+
+// 2D CPU simulation, the original slime mould model: every agent senses trail ahead and at sense_spread
+// to its left and right, turns by turn_angle towards the strongest trail, moves and deposits. Uses the same
+// Config as 3D (sense_spread, sense_distance, turn_angle, move_distance, deposit_value, decay_factor,
+// move_sense_coef, move_sense_offset), collision, center_attraction and sample_points are 3D only.
+//
+// Trail is stored in square tiles of SIM2D_TILE_SIZE^2 cells, so sensing, deposits and diffusion of nearby
+// agents touch the same few pages. Cells of edge tiles outside of the world are kept zero.
+#define SIM2D_TILE_SHIFT 6
+#define SIM2D_TILE_SIZE (1 << SIM2D_TILE_SHIFT)
+
+struct World2D {
+    uint32_t width;
+    uint32_t height;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    // Trail which agents sense and deposit into and buffer decay writes into, swapped after every decay.
+    float *trail;
+    float *trail_back;
+};
+
+// Agent state in SoA layout. Heading is a unit vector, turns are constant rotations.
+struct Particles2D {
+    float *x;
+    float *y;
+    float *dir_x;
+    float *dir_y;
+    uint32_t count;
+};
+
+namespace sim2d {
+    World2D get_world(uint32_t width, uint32_t height);
+    void release(World2D *world);
+    void clear(World2D *world, ThreadPool *pool);
+
+    Particles2D get_particles(uint32_t count);
+    void release(Particles2D *particles);
+    // Spawns agents uniformly inside a disc in the world center with random headings.
+    void spawn_particles(Particles2D *particles, World2D *world, float spawn_radius, uint32_t seed);
+
+    // Sense, turn, move and deposit step for all agents, uses the same kernel selection as sim::step.
+    void step(World2D *world, Particles2D *particles, Config *config, ThreadPool *pool);
+    // 3x3 decay/diffusion of the trail map, same as decay_shader_3d.hlsl does in 3D.
+    void decay(World2D *world, Config *config, ThreadPool *pool);
+    // Orders agents by trail tile, so agents close in memory sense and deposit into the same tiles.
+    void sort_particles(World2D *world, Particles2D *particles, ThreadPool *pool);
+
+    // Trail value at cell (x, y), 0 outside of the world.
+    float get_trail(World2D *world, uint32_t x, uint32_t y);
+    // Resamples trail into width x height pixels, fitting the whole world into the image while keeping its
+    // aspect ratio. Every pixel is the average of the cells it covers, so the image can be smaller than the world.
+    void get_image(World2D *world, float *pixels, uint32_t width, uint32_t height, ThreadPool *pool);
+}
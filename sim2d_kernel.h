@@ -0,0 +1,90 @@
+#pragma once
+
+// Agent step kernel of the 2D simulation, written over lane types from sim_lanes.h like sim_kernel.h,
+// which has to be included before this file.
+
+#include "sim2d.h"
+
+// Samples trail at floor(x), floor(y), out of bounds reads return 0 like in 3D.
+template<typename L>
+static inline typename L::F sample_trail_2d(const float *trail, typename L::I size_x, typename L::I size_y, typename L::I tiles_x,
+                                            typename L::F x, typename L::F y) {
+    typedef typename L::I I;
+    typedef typename L::M M;
+    I sx = L::truncate(L::floor(x));
+    I sy = L::truncate(L::floor(y));
+    I minus_one = L::seti(-1);
+    M in_bounds = (sx > minus_one) & (sx < size_x) & (sy > minus_one) & (sy < size_y);
+    I mask = L::seti(SIM2D_TILE_SIZE - 1);
+    I tile = (sy >> SIM2D_TILE_SHIFT) * tiles_x + (sx >> SIM2D_TILE_SHIFT);
+    I index = (tile << (2 * SIM2D_TILE_SHIFT)) | ((sy & mask) << SIM2D_TILE_SHIFT) | (sx & mask);
+    return L::gather(trail, L::select(in_bounds, index, L::seti(0)), in_bounds);
+}
+
+// Sense, turn and move for agents [begin, end). Agent turns towards the strongest of three sensors,
+// straight ahead wins ties, when both side sensors are stronger than the one ahead it turns to a random
+// side. Processes agents in blocks of L::WIDTH and returns index of the first agent it didn't process.
+template<typename L>
+uint32_t step_particles_2d(World2D *world, Particles2D *particles, Config *config, uint32_t begin, uint32_t end) {
+    typedef typename L::F F;
+    typedef typename L::I I;
+    typedef typename L::M M;
+    typedef LaneMath<L> Math;
+    const uint32_t WIDTH = L::WIDTH;
+
+    const float *trail = world->trail;
+    I size_x = L::seti(int32_t(world->width));
+    I size_y = L::seti(int32_t(world->height));
+    I tiles_x = L::seti(int32_t(world->tiles_x));
+    F world_x = L::set(float(world->width));
+    F world_y = L::set(float(world->height));
+    F sense_distance = L::set(config->sense_distance);
+    F cos_spread = L::set(cosf(config->sense_spread));
+    F sin_spread = L::set(sinf(config->sense_spread));
+    F cos_turn = L::set(cosf(config->turn_angle));
+    F sin_turn = L::set(sinf(config->turn_angle));
+    F move_scale_offset = L::set(config->move_sense_offset);
+    F move_scale_coef = L::set(config->move_sense_coef);
+    F move_distance = L::set(config->move_distance);
+
+    uint32_t block_end = begin + (end - begin) / WIDTH * WIDTH;
+    for (uint32_t base = begin; base < block_end; base += WIDTH) {
+        I idx = L::iota(int32_t(base));
+        F x = L::load(particles->x + base);
+        F y = L::load(particles->y + base);
+        F dx = L::load(particles->dir_x + base);
+        F dy = L::load(particles->dir_y + base);
+
+        // Sensors ahead and heading rotated by sense_spread to the left and right.
+        F left_x = dx * cos_spread - dy * sin_spread;
+        F left_y = dx * sin_spread + dy * cos_spread;
+        F right_x = dx * cos_spread + dy * sin_spread;
+        F right_y = dy * cos_spread - dx * sin_spread;
+        F center = sample_trail_2d<L>(trail, size_x, size_y, tiles_x, x + dx * sense_distance, y + dy * sense_distance);
+        F left = sample_trail_2d<L>(trail, size_x, size_y, tiles_x, x + left_x * sense_distance, y + left_y * sense_distance);
+        F right = sample_trail_2d<L>(trail, size_x, size_y, tiles_x, x + right_x * sense_distance, y + right_y * sense_distance);
+
+        I cell = L::truncate(y) * size_x + L::truncate(x);
+        I hash = Math::wang_hash(idx + Math::wang_hash(cell));
+        M coin = (hash & L::seti(1)) == L::seti(0);
+        M ahead = (center > left) & (center > right);
+        M both = (center < left) & (center < right);
+        M turn_left = ~ahead & ((both & coin) | (~both & (left > right)));
+        M turn_right = ~ahead & ((both & ~coin) | (~both & (right > left)));
+
+        F new_dx = L::select(turn_left, dx * cos_turn - dy * sin_turn, L::select(turn_right, dx * cos_turn + dy * sin_turn, dx));
+        F new_dy = L::select(turn_left, dx * sin_turn + dy * cos_turn, L::select(turn_right, dy * cos_turn - dx * sin_turn, dy));
+        // Turns are rotations, renormalizing only removes rounding drift.
+        F length = L::sqrt(new_dx * new_dx + new_dy * new_dy);
+        new_dx = new_dx / length;
+        new_dy = new_dy / length;
+
+        F max_value = L::max(center, L::max(left, right));
+        F step_size = move_distance * (move_scale_offset + max_value * move_scale_coef);
+        L::store(particles->x + base, wrap<L>(x + new_dx * step_size, world_x));
+        L::store(particles->y + base, wrap<L>(y + new_dy * step_size, world_y));
+        L::store(particles->dir_x + base, new_dx);
+        L::store(particles->dir_y + base, new_dy);
+    }
+    return block_end;
+}
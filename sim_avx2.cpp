@@ -0,0 +1,81 @@
+// AVX2 builds of the particle step kernels, selected at runtime by sim::step when CPU supports it, and F16C
+// conversion of FLOAT16 trail rows.
+#include "sim.h"
+#include "sim2d.h"
+#include "sim_trail.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// Only code below is compiled for AVX2 and F16C, standard headers above are included with default target so
+// their inline functions can't leak AVX2 instructions into the rest of the program.
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2,f16c"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2,f16c")
+#endif
+
+#define SIM_LANES_AVX2
+#include "sim_lanes.h"
+#include "sim_kernel.h"
+#include "sim2d_kernel.h"
+
+void fill_step_table_avx2(StepTable *table) {
+    fill_step_table<lanes_avx2::Lanes>(table);
+}
+
+uint32_t step_particles_2d_avx2(World2D *world, Particles2D *particles, Config *config, uint32_t begin, uint32_t end) {
+    return step_particles_2d<lanes_avx2::Lanes>(world, particles, config, begin, end);
+}
+
+void half_to_float_f16c(const uint16_t *src, float *dst, uint32_t count) {
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src + i))));
+    }
+    for (; i < count; ++i) {
+        dst[i] = _cvtsh_ss(src[i]);
+    }
+}
+
+// Same saturation and rounding (to nearest even) as encoding in sim_trail.cpp.
+void float_to_half_f16c(const float *src, uint16_t *dst, uint32_t count) {
+    __m256 max_value = _mm256_set1_ps(TRAIL_HALF_MAX);
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 value = _mm256_min_ps(_mm256_loadu_ps(src + i), max_value);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm256_cvtps_ph(value, _MM_FROUND_TO_NEAREST_INT));
+    }
+    for (; i < count; ++i) {
+        dst[i] = _cvtss_sh(src[i] < TRAIL_HALF_MAX ? src[i] : TRAIL_HALF_MAX, _MM_FROUND_TO_NEAREST_INT);
+    }
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#else
+
+// Not available on this architecture, sim::set_kernel never selects it.
+struct StepTable;
+void fill_step_table_avx2(StepTable *table) {
+}
+
+void half_to_float_f16c(const uint16_t *src, float *dst, uint32_t count) {
+}
+
+void float_to_half_f16c(const float *src, uint16_t *dst, uint32_t count) {
+}
+
+uint32_t step_particles_2d_avx2(World2D *world, Particles2D *particles, Config *config, uint32_t begin, uint32_t end) {
+    return begin;
+}
+
+#endif
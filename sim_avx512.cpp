@@ -0,0 +1,50 @@
+// AVX-512 builds of the particle step kernels, selected at runtime by sim::step when CPU supports it.
+#include "sim.h"
+#include "sim2d.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// Only code below is compiled for AVX-512, standard headers above are included with default target so
+// their inline functions can't leak AVX-512 instructions into the rest of the program.
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+
+#define SIM_LANES_AVX512
+#include "sim_lanes.h"
+#include "sim_kernel.h"
+#include "sim2d_kernel.h"
+
+void fill_step_table_avx512(StepTable *table) {
+    fill_step_table<lanes_avx512::Lanes>(table);
+}
+
+uint32_t step_particles_2d_avx512(World2D *world, Particles2D *particles, Config *config, uint32_t begin, uint32_t end) {
+    return step_particles_2d<lanes_avx512::Lanes>(world, particles, config, begin, end);
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#else
+
+// Not available on this architecture, sim::set_kernel never selects it.
+struct StepTable;
+void fill_step_table_avx512(StepTable *table) {
+}
+
+uint32_t step_particles_2d_avx512(World2D *world, Particles2D *particles, Config *config, uint32_t begin, uint32_t end) {
+    return begin;
+}
+
+#endif
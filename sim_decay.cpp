@@ -0,0 +1,725 @@
+// Decay/diffusion of the trail map for CPU simulation.
+//
+// 3x3x3 box filter is separable, so instead of 27 reads per voxel, every xy slice is first filtered
+// with 3-tap passes along x and y, and output slice is a sum of three consecutive filtered slices.
+// Volume is processed in tiles of rows (y) and bands of slices (z), each tile streams through its
+// slices keeping only a ring of 3 filtered slices, which is small enough to stay in L2.
+//
+// Multiple decay steps can be fused (temporal blocking): every step is a level of the pipeline with
+// its own ring, slices flow from one level to the next, so the volume is read and written only once
+// no matter how many steps are fused. Tiles overlap by one row/slice per fused step.
+//
+// While trail only covers a small part of the world, decay runs over active bricks and their neighbours
+// instead, see World. Bricks are filtered the same way (x, y, z passes), so results are identical to
+// the dense path, except for bricks being retired.
+//
+// Trail in FLOAT16 and UNORM8 is decoded into filtered slices and encoded when output is written. Tiles are
+// aligned to bricks, so UNORM8 output is collected for a whole brick layer of the tile and every brick is
+// encoded with the range of its actual values.
+//
+// With SimDecayBuffer::IN_PLACE output overwrites the trail. A tile has read every input slice before it writes
+// the output slices that depend on it, so only data other tasks overwrite needs copies: every band decodes
+// `steps` slices on each side before any band starts, and tiles of a band run in order, each passing the rows
+// the next tile reads over to it. Bricks are decayed a brick layer at a time, every layer is written only after
+// its side neighbours were decayed and keeps its top slice for the layer above.
+#include "sim.h"
+#include "sim_trail.h"
+#include "thread_pool.h"
+#include "profiler.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Max number of decay steps fused into a single pass over the volume.
+#define MAX_FUSED_STEPS 8
+// Scratch memory budget per thread, tile height is picked so everything fits.
+#define TILE_CACHE_BUDGET (512 * 1024)
+#define MIN_TILE_HEIGHT 8
+// Tiles recompute `steps` halo rows on each side, keep tiles tall enough so the halo stays a small fraction.
+#define MIN_TILE_HEIGHT_PER_STEP 8
+
+#define BRICK_ACTIVE 1
+#define BRICK_SCHEDULED 2
+#define BRICK_PADDED_SIZE (SIM_BRICK_SIZE + 2)
+// Bricked decay is used while scheduled bricks make up less than this fraction of all bricks.
+#define MAX_BRICKED_DECAY_FRACTION 0.5f
+
+// Fused steps can spread trail by at most one brick, see schedule_bricks.
+static_assert(MAX_FUSED_STEPS <= SIM_BRICK_SIZE, "Fused decay can't spread trail further than one brick");
+
+struct DecayTile {
+    World *world;
+    const TrailBuffer *src;
+    TrailBuffer *dst;
+    int width, height, depth;
+    int steps;
+    float factor;
+
+    // Output rows [y0, y1) and slices [z0, z1).
+    int y0, y1;
+    int z0, z1;
+    // Row count of local slices, including halo and a zero padding row on each side.
+    int rows;
+
+    // Scratch memory.
+    float *rings;       // steps * 3 filtered slices
+    float *slice;       // Slice of current level
+    float *row_sums;    // Slice after x pass
+    float *out_row;     // Output row before FLOAT16 encoding
+    float *staging;     // SIM_BRICK_SIZE output slices of the tile before UNORM8 encoding
+    float *brick;       // SIM_BRICK_SIZE^3 values of a single brick
+
+    // In-place decay only, src and dst are the same buffer.
+    const float *below; // `steps` slices before the band, decoded before any band started writing
+    const float *above; // `steps` slices after the band
+    float *edge_rows;   // Last `steps` rows of the previous tile in every slice of the band, replaced by rows of this tile
+};
+
+static inline float *get_ring_slice(DecayTile *tile, int level, int z) {
+    int slot = ((z % 3) + 3) % 3;
+    return tile->rings + (size_t(level) * 3 + slot) * tile->rows * tile->width;
+}
+
+// Filters slice with 3-tap box filter along x and y, zero outside of the slice.
+static void filter_slice(DecayTile *tile, const float *slice, float *out) {
+    int w = tile->width;
+    int rows = tile->rows;
+    float *row_sums = tile->row_sums;
+    for (int r = 0; r < rows; ++r) {
+        const float *in = slice + size_t(r) * w;
+        float *sum = row_sums + size_t(r) * w;
+        if (w == 1) {
+            sum[0] = in[0];
+            continue;
+        }
+        sum[0] = in[0] + in[1];
+        for (int x = 1; x < w - 1; ++x) {
+            sum[x] = in[x - 1] + in[x] + in[x + 1];
+        }
+        sum[w - 1] = in[w - 2] + in[w - 1];
+    }
+
+    // Padding rows are always zero.
+    memset(out, 0, sizeof(float) * w);
+    memset(out + size_t(rows - 1) * w, 0, sizeof(float) * w);
+    for (int r = 1; r < rows - 1; ++r) {
+        const float *a = row_sums + size_t(r - 1) * w;
+        const float *b = row_sums + size_t(r) * w;
+        const float *c = row_sums + size_t(r + 1) * w;
+        float *o = out + size_t(r) * w;
+        for (int x = 0; x < w; ++x) {
+            o[x] = a[x] + b[x] + c[x];
+        }
+    }
+}
+
+// Slices of level k exist for z in [z0 - (steps - k), z1 + (steps - k)), clipped to [-1, depth].
+// Slices -1 and depth are outside of the world and are always zero.
+static inline int level_begin(DecayTile *tile, int level) {
+    int z = tile->z0 - (tile->steps - level);
+    return z < -1 ? -1 : z;
+}
+
+static inline int level_end(DecayTile *tile, int level) {
+    int z = tile->z1 + (tile->steps - level);
+    return z > tile->depth + 1 ? tile->depth + 1 : z;
+}
+
+// Local row range of level k that holds valid data, rows outside of the world are zero.
+static inline void level_rows(DecayTile *tile, int level, int *begin, int *end) {
+    int halo = tile->steps - level;
+    int y_begin = tile->y0 - halo;
+    int y_end = tile->y1 + halo;
+    if (y_begin < 0) y_begin = 0;
+    if (y_end > tile->height) y_end = tile->height;
+    int local_origin = tile->y0 - tile->steps - 1;
+    *begin = y_begin - local_origin;
+    *end = y_end - local_origin;
+}
+
+static void push_slice(DecayTile *tile, int level, int z, const float *slice);
+
+// Folds output row y of slice z into World::brick_max. Tiles and bands start at brick boundaries and emit rows
+// in order, so the first row of a brick resets its max and no other task writes it.
+static void store_row_max(DecayTile *tile, int y, int z, const float *row) {
+    const int S = SIM_BRICK_SIZE;
+    World *world = tile->world;
+    float *brick_max = world->brick_max + (uint32_t(z / S) * world->brick_height + uint32_t(y / S)) * world->brick_width;
+    bool reset = z % S == 0 && y % S == 0;
+    for (int x = 0; x < tile->width; x += S) {
+        int end = x + S < tile->width ? x + S : tile->width;
+        float max_value = 0.0f;
+        for (int i = x; i < end; ++i) {
+            max_value = row[i] > max_value ? row[i] : max_value;
+        }
+        float *value = brick_max + x / S;
+        *value = reset || max_value > *value ? max_value : *value;
+    }
+}
+
+// Encodes bricks of a brick layer of the tile from staging slices.
+static void store_staged_bricks(DecayTile *tile, int layer) {
+    const int S = SIM_BRICK_SIZE;
+    World *world = tile->world;
+    int tile_height = tile->y1 - tile->y0;
+    int slices = tile->depth - layer * S < S ? tile->depth - layer * S : S;
+    for (int y = tile->y0; y < tile->y1; y += S) {
+        int rows = tile->y1 - y < S ? tile->y1 - y : S;
+        for (int x = 0; x < tile->width; x += S) {
+            int columns = tile->width - x < S ? tile->width - x : S;
+            for (int z = 0; z < slices; ++z) {
+                for (int r = 0; r < rows; ++r) {
+                    const float *src = tile->staging + (size_t(z) * tile_height + (y - tile->y0 + r)) * tile->width + x;
+                    memcpy(tile->brick + (z * S + r) * S, src, sizeof(float) * columns);
+                }
+            }
+            uint32_t brick = (uint32_t(layer) * world->brick_height + uint32_t(y / S)) * world->brick_width + uint32_t(x / S);
+            trail::store_brick(world, tile->dst, brick, tile->brick);
+        }
+    }
+}
+
+// Computes slice z of level k from filtered slices z-1, z, z+1 of level k-1.
+static void emit_slice(DecayTile *tile, int level, int z) {
+    int w = tile->width;
+    bool outside = z < 0 || z >= tile->depth;
+    if (level == tile->steps) {
+        // Last level writes FLOAT32 output rows straight into destination volume.
+        if (outside) return;
+        const float *a = get_ring_slice(tile, level - 1, z - 1);
+        const float *b = get_ring_slice(tile, level - 1, z);
+        const float *c = get_ring_slice(tile, level - 1, z + 1);
+        int local_origin = tile->y0 - tile->steps - 1;
+        SimTrailFormat format = tile->world->trail_format;
+        for (int y = tile->y0; y < tile->y1; ++y) {
+            size_t local = size_t(y - local_origin) * w;
+            float *o = tile->out_row;
+            if (format == SimTrailFormat::FLOAT32) {
+                o = (float *)tile->dst->voxels + (size_t(z) * tile->height + y) * w;
+            } else if (format == SimTrailFormat::UNORM8) {
+                o = tile->staging + (size_t(z % SIM_BRICK_SIZE) * (tile->y1 - tile->y0) + (y - tile->y0)) * w;
+            }
+            for (int x = 0; x < w; ++x) {
+                o[x] = (a[local + x] + b[local + x] + c[local + x]) * tile->factor;
+            }
+            store_row_max(tile, y, z, o);
+            if (format == SimTrailFormat::FLOAT16) {
+                trail::store_row(tile->world, tile->dst, 0, uint32_t(y), uint32_t(z), uint32_t(w), o);
+            }
+        }
+        if (format == SimTrailFormat::UNORM8 && ((z + 1) % SIM_BRICK_SIZE == 0 || z + 1 == tile->z1)) {
+            store_staged_bricks(tile, z / SIM_BRICK_SIZE);
+        }
+        return;
+    }
+
+    float *slice = tile->slice;
+    size_t slice_size = size_t(tile->rows) * w;
+    if (outside) {
+        memset(slice, 0, slice_size * sizeof(float));
+    } else {
+        const float *a = get_ring_slice(tile, level - 1, z - 1);
+        const float *b = get_ring_slice(tile, level - 1, z);
+        const float *c = get_ring_slice(tile, level - 1, z + 1);
+        int row_begin, row_end;
+        level_rows(tile, level, &row_begin, &row_end);
+        memset(slice, 0, size_t(row_begin) * w * sizeof(float));
+        for (size_t i = size_t(row_begin) * w; i < size_t(row_end) * w; ++i) {
+            slice[i] = (a[i] + b[i] + c[i]) * tile->factor;
+        }
+        memset(slice + size_t(row_end) * w, 0, (slice_size - size_t(row_end) * w) * sizeof(float));
+    }
+    push_slice(tile, level, z, slice);
+}
+
+// Adds slice z of level k to the pipeline and emits slice z-1 of level k+1 once it has all inputs.
+static void push_slice(DecayTile *tile, int level, int z, const float *slice) {
+    float *filtered = get_ring_slice(tile, level, z);
+    filter_slice(tile, slice, filtered);
+
+    int next_z = z - 1;
+    if (next_z >= level_begin(tile, level + 1) && next_z < level_end(tile, level + 1)) {
+        emit_slice(tile, level + 1, next_z);
+    }
+    // Zero slice past the end of the world has no slice after it which would trigger it, emit it right away.
+    if (z == tile->depth && z < level_end(tile, level + 1)) {
+        emit_slice(tile, level + 1, z);
+    }
+}
+
+// Loads input slice z of an in-place tile. Rows and slices which other tiles and bands may have overwritten
+// already come from their copies.
+static void load_slice_in_place(DecayTile *tile, int z, float *slice) {
+    int w = tile->width, steps = tile->steps;
+    int row_begin, row_end;
+    level_rows(tile, 0, &row_begin, &row_end);
+    int local_origin = tile->y0 - steps - 1;
+    if (z < tile->z0 || z >= tile->z1) {
+        const float *copy = z < tile->z0 ? tile->below + size_t(z - (tile->z0 - steps)) * tile->height * w
+                                         : tile->above + size_t(z - tile->z1) * tile->height * w;
+        memcpy(slice + size_t(row_begin) * w, copy + size_t(row_begin + local_origin) * w, sizeof(float) * (row_end - row_begin) * w);
+        return;
+    }
+
+    float *edge = tile->edge_rows + size_t(z - tile->z0) * steps * w;
+    for (int r = row_begin; r < row_end; ++r) {
+        int y = r + local_origin;
+        if (y < tile->y0) {
+            memcpy(slice + size_t(r) * w, edge + size_t(y - (tile->y0 - steps)) * w, sizeof(float) * w);
+        } else {
+            trail::load_row(tile->world, tile->src, 0, uint32_t(y), uint32_t(z), uint32_t(w), slice + size_t(r) * w);
+        }
+    }
+    // Rows above were read already, so the last rows of this tile can take their place for the next tile.
+    if (tile->y1 < tile->height) {
+        memcpy(edge, slice + size_t(tile->y1 - steps - local_origin) * w, sizeof(float) * steps * w);
+    }
+}
+
+static void process_tile(DecayTile *tile) {
+    int w = tile->width;
+    size_t slice_size = size_t(tile->rows) * w;
+    int row_begin, row_end;
+    level_rows(tile, 0, &row_begin, &row_end);
+    int local_origin = tile->y0 - tile->steps - 1;
+    bool in_place = tile->src == tile->dst;
+
+    for (int z = level_begin(tile, 0); z < level_end(tile, 0); ++z) {
+        float *slice = tile->slice;
+        memset(slice, 0, slice_size * sizeof(float));
+        if (z >= 0 && z < tile->depth) {
+            if (in_place) {
+                load_slice_in_place(tile, z, slice);
+            } else {
+                for (int r = row_begin; r < row_end; ++r) {
+                    trail::load_row(tile->world, tile->src, 0, uint32_t(r + local_origin), uint32_t(z), uint32_t(w), slice + size_t(r) * w);
+                }
+            }
+        }
+        push_slice(tile, 0, z, slice);
+    }
+}
+
+// Max number of bands of a fused decay. Every band recomputes `steps` halo slices on each side, so bands
+// shouldn't be too thin. Every in-place band also decodes those slices before any band starts, copies of all of
+// them should fit into an eighth of the trail. In-place bands are single tasks though, so they are split further,
+// down to a brick layer each, until every thread has one, whatever their copies take. Fused step count stays
+// the same, fp16 and u8 results would change with fewer fused steps.
+static int get_max_band_count(World *world, int steps, bool in_place, uint32_t thread_count) {
+    int max_band_count = int(world->depth) / (4 * steps);
+    if (in_place) {
+        size_t world_slice_size = size_t(world->width) * world->height;
+        int copy_budget = int(sim::get_trail_size(world) / 8 / (sizeof(float) * world_slice_size));
+        if (max_band_count > copy_budget / (2 * steps)) max_band_count = copy_budget / (2 * steps);
+        int layer_count = int(world->brick_depth);
+        int thread_band_count = int(thread_count) < layer_count ? int(thread_count) : layer_count;
+        if (max_band_count < thread_band_count) max_band_count = thread_band_count;
+    }
+    // A single band needs no copies.
+    return max_band_count > 1 ? max_band_count : 1;
+}
+
+// Runs `steps` fused decay steps from src to dst, which can be the same buffer.
+static void decay_fused(World *world, const TrailBuffer *src, TrailBuffer *dst, int steps, float decay_factor, ThreadPool *pool) {
+    const int S = SIM_BRICK_SIZE;
+    int w = int(world->width), h = int(world->height), d = int(world->depth);
+    size_t world_slice_size = size_t(w) * h;
+    bool in_place = src == dst;
+    uint32_t thread_count = thread_pool::get_thread_count(pool);
+
+    int max_band_count = get_max_band_count(world, steps, in_place, thread_count);
+    // UNORM8 output is staged for a brick layer.
+    int staging_slices = world->trail_format == SimTrailFormat::UNORM8 ? S : 0;
+
+    // Pick tile height so rings + two scratch slices (+ staging) fit into the cache budget, tiles start at
+    // brick boundaries.
+    int tile_height = TILE_CACHE_BUDGET / (int(sizeof(float)) * w * (3 * steps + 2 + staging_slices)) - 2 * steps - 2;
+    if (tile_height < MIN_TILE_HEIGHT) tile_height = MIN_TILE_HEIGHT;
+    if (tile_height < MIN_TILE_HEIGHT_PER_STEP * steps) tile_height = MIN_TILE_HEIGHT_PER_STEP * steps;
+    tile_height = (tile_height + S - 1) / S * S;
+    if (tile_height > h) tile_height = h;
+    int tile_count_y = (h + tile_height - 1) / tile_height;
+
+    // Split slices into bands so there's enough tasks for all threads. Tiles of an in-place band run in order,
+    // so there every band is a single task.
+    int band_count = in_place ? int(thread_count) : int((thread_count * 4 + tile_count_y - 1) / tile_count_y);
+    if (band_count > max_band_count) band_count = max_band_count;
+    if (band_count < 1) band_count = 1;
+    int band_depth = (d + band_count - 1) / band_count;
+    band_depth = (band_depth + S - 1) / S * S;
+    band_count = (d + band_depth - 1) / band_depth;
+
+    int rows = tile_height + 2 * steps + 2;
+    size_t slices_size = (size_t(steps) * 3 + 2) * rows * w;
+    size_t edge_size = in_place ? size_t(steps) * band_depth * w : 0;
+    size_t scratch_size = slices_size + w + size_t(staging_slices) * tile_height * w + S * S * S + edge_size;
+    float *scratch = (float *)malloc(sizeof(float) * scratch_size * thread_count);
+
+    // Slices [z0 - steps, z0) and [z1, z1 + steps) of every in-place band.
+    size_t copy_size = size_t(steps) * world_slice_size;
+    float *copies = in_place && band_count > 1 ? (float *)malloc(sizeof(float) * copy_size * 2 * band_count) : NULL;
+    if (copies) {
+        thread_pool::run(pool, uint32_t(band_count), 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+            for (uint32_t band = begin; band < end; ++band) {
+                int z0 = int(band) * band_depth;
+                int z1 = z0 + band_depth > d ? d : z0 + band_depth;
+                float *below = copies + copy_size * 2 * band;
+                float *above = below + copy_size;
+                for (int z = z0 - steps; z < z1 + steps; ++z) {
+                    if (z < 0 || z >= d || (z >= z0 && z < z1)) continue;
+                    float *slice = z < z0 ? below + size_t(z - (z0 - steps)) * world_slice_size : above + size_t(z - z1) * world_slice_size;
+                    for (int y = 0; y < h; ++y) {
+                        trail::load_row(world, src, 0, uint32_t(y), uint32_t(z), uint32_t(w), slice + size_t(y) * w);
+                    }
+                }
+            }
+        });
+    }
+
+    float factor = decay_factor / 27.0f;
+    auto run_tile = [&](int band, int tile_y, uint32_t thread_index) {
+        DecayTile tile = {};
+        tile.world = world;
+        tile.src = src;
+        tile.dst = dst;
+        tile.width = w;
+        tile.height = h;
+        tile.depth = d;
+        tile.steps = steps;
+        tile.factor = factor;
+        tile.y0 = tile_y * tile_height;
+        tile.y1 = tile.y0 + tile_height > h ? h : tile.y0 + tile_height;
+        tile.z0 = band * band_depth;
+        tile.z1 = tile.z0 + band_depth > d ? d : tile.z0 + band_depth;
+        tile.rows = rows;
+        tile.rings = scratch + scratch_size * thread_index;
+        tile.slice = tile.rings + size_t(steps) * 3 * rows * w;
+        tile.row_sums = tile.slice + size_t(rows) * w;
+        tile.out_row = tile.rings + slices_size;
+        tile.staging = tile.out_row + w;
+        tile.brick = tile.staging + size_t(staging_slices) * tile_height * w;
+        tile.edge_rows = tile.brick + S * S * S;
+        if (copies) {
+            tile.below = copies + copy_size * 2 * band;
+            tile.above = tile.below + copy_size;
+        }
+        process_tile(&tile);
+    };
+    if (in_place) {
+        thread_pool::run(pool, uint32_t(band_count), 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+            for (uint32_t band = begin; band < end; ++band) {
+                for (int tile_y = 0; tile_y < tile_count_y; ++tile_y) {
+                    run_tile(int(band), tile_y, thread_index);
+                }
+            }
+        });
+    } else {
+        thread_pool::run(pool, uint32_t(tile_count_y * band_count), 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+            for (uint32_t task = begin; task < end; ++task) {
+                run_tile(int(task / uint32_t(tile_count_y)), int(task % uint32_t(tile_count_y)), thread_index);
+            }
+        });
+    }
+
+    free(copies);
+    free(scratch);
+}
+
+// Schedules active bricks and their neighbours for decay, diffusion spreads trail by one voxel per step,
+// so it can't reach any further. Returns number of bricks written into `scheduled`.
+static uint32_t schedule_bricks(World *world, uint32_t *scheduled) {
+    int bw = int(world->brick_width), bh = int(world->brick_height), bd = int(world->brick_depth);
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < world->active_brick_count; ++i) {
+        int brick = int(world->active_bricks[i]);
+        int bx = brick % bw, by = brick / bw % bh, bz = brick / (bw * bh);
+        for (int z = bz - 1; z <= bz + 1; ++z) {
+            for (int y = by - 1; y <= by + 1; ++y) {
+                for (int x = bx - 1; x <= bx + 1; ++x) {
+                    if (x < 0 || y < 0 || z < 0 || x >= bw || y >= bh || z >= bd) continue;
+                    uint32_t neighbour = uint32_t((z * bh + y) * bw + x);
+                    if (!(world->brick_flags[neighbour] & BRICK_SCHEDULED)) {
+                        world->brick_flags[neighbour] |= BRICK_SCHEDULED;
+                        scheduled[count++] = neighbour;
+                    }
+                }
+            }
+        }
+    }
+    return count;
+}
+
+// Rebuilds active brick list from scheduled bricks, bricks with `keep` set to zero are dropped.
+// Scheduled bricks always include all active bricks, so nothing else has to be touched.
+static void activate_scheduled(World *world, uint32_t *scheduled, uint32_t count, uint8_t *keep) {
+    world->active_brick_count = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t brick = scheduled[i];
+        if (keep && !keep[i]) {
+            world->brick_flags[brick] = 0;
+        } else {
+            world->brick_flags[brick] = BRICK_ACTIVE;
+            world->active_bricks[world->active_brick_count++] = brick;
+        }
+    }
+}
+
+struct BrickBounds {
+    int x0, y0, z0;
+    int x1, y1, z1;
+};
+
+static inline BrickBounds get_brick_bounds(World *world, uint32_t brick) {
+    uint32_t bw = world->brick_width, bh = world->brick_height;
+    BrickBounds b;
+    b.x0 = int(brick % bw) * SIM_BRICK_SIZE;
+    b.y0 = int(brick / bw % bh) * SIM_BRICK_SIZE;
+    b.z0 = int(brick / (bw * bh)) * SIM_BRICK_SIZE;
+    b.x1 = b.x0 + SIM_BRICK_SIZE > int(world->width) ? int(world->width) : b.x0 + SIM_BRICK_SIZE;
+    b.y1 = b.y0 + SIM_BRICK_SIZE > int(world->height) ? int(world->height) : b.y0 + SIM_BRICK_SIZE;
+    b.z1 = b.z0 + SIM_BRICK_SIZE > int(world->depth) ? int(world->depth) : b.z0 + SIM_BRICK_SIZE;
+    return b;
+}
+
+// Top slices of the bricks of a brick layer, kept by in-place decay for the layer above after the layer was
+// overwritten.
+struct BrickFaces {
+    // SIM_BRICK_SIZE^2 values for every brick position of a layer.
+    float *values;
+    // Layer + 1 of the brick a position holds, positions of other layers belong to bricks which weren't
+    // scheduled and are zero.
+    uint32_t *layers;
+    uint32_t layer;
+};
+
+static inline float get_face_value(World *world, const BrickFaces *faces, int x, int y) {
+    const int S = SIM_BRICK_SIZE;
+    uint32_t position = uint32_t(y / S) * world->brick_width + uint32_t(x / S);
+    if (faces->layers[position] != faces->layer + 1) return 0.0f;
+    return faces->values[position * S * S + (y % S) * S + x % S];
+}
+
+// Decays single brick from src into `out` (SIM_BRICK_SIZE^3 values) and returns max value written. Slice below
+// the brick is taken from `below` if it isn't NULL. Scratch has to hold BRICK_PADDED_SIZE^3 +
+// 2 * BRICK_PADDED_SIZE^2 * SIM_BRICK_SIZE floats and holds the brick with its border afterwards.
+static float decay_brick(World *world, const TrailBuffer *src, uint32_t brick, float factor, const BrickFaces *below,
+                         float *scratch, float *out) {
+    const int S = SIM_BRICK_SIZE, P = BRICK_PADDED_SIZE;
+    int w = int(world->width), h = int(world->height), d = int(world->depth);
+    BrickBounds b = get_brick_bounds(world, brick);
+
+    // Brick with one voxel border, zero outside of the world.
+    float *in = scratch;
+    for (int z = 0; z < P; ++z) {
+        for (int y = 0; y < P; ++y) {
+            float *row = in + (z * P + y) * P;
+            memset(row, 0, sizeof(float) * P);
+            int gz = b.z0 - 1 + z, gy = b.y0 - 1 + y;
+            if (gz < 0 || gz >= d || gy < 0 || gy >= h) continue;
+            int gx_begin = b.x0 - 1 < 0 ? 0 : b.x0 - 1;
+            int gx_end = b.x0 - 1 + P > w ? w : b.x0 - 1 + P;
+            if (z == 0 && below) {
+                for (int gx = gx_begin; gx < gx_end; ++gx) {
+                    row[gx - (b.x0 - 1)] = get_face_value(world, below, gx, gy);
+                }
+                continue;
+            }
+            trail::load_row(world, src, uint32_t(gx_begin), uint32_t(gy), uint32_t(gz), uint32_t(gx_end - gx_begin), row + (gx_begin - (b.x0 - 1)));
+        }
+    }
+
+    // Same order of additions as in filter_slice/emit_slice.
+    float *sum_x = in + P * P * P;
+    for (int i = 0; i < P * P; ++i) {
+        const float *row = in + i * P;
+        for (int x = 0; x < S; ++x) {
+            sum_x[i * S + x] = row[x] + row[x + 1] + row[x + 2];
+        }
+    }
+    float *sum_y = sum_x + P * P * S;
+    for (int z = 0; z < P; ++z) {
+        for (int y = 0; y < S; ++y) {
+            const float *a = sum_x + (z * P + y) * S;
+            float *o = sum_y + (z * S + y) * S;
+            for (int x = 0; x < S; ++x) {
+                o[x] = a[x] + a[x + S] + a[x + 2 * S];
+            }
+        }
+    }
+
+    float max_value = 0.0f;
+    for (int z = 0; z < b.z1 - b.z0; ++z) {
+        for (int y = 0; y < b.y1 - b.y0; ++y) {
+            const float *a = sum_y + (z * S + y) * S;
+            float *o = out + (z * S + y) * S;
+            for (int x = 0; x < b.x1 - b.x0; ++x) {
+                float value = (a[x] + a[x + S * S] + a[x + 2 * S * S]) * factor;
+                o[x] = value;
+                max_value = value > max_value ? value : max_value;
+            }
+        }
+    }
+    return max_value;
+}
+
+// Single decay step over scheduled bricks, bricks which fall below threshold are retired.
+static void decay_bricks(World *world, uint32_t *scheduled, uint32_t count, float decay_factor, ThreadPool *pool) {
+    const int P = BRICK_PADDED_SIZE;
+    size_t scratch_size = P * P * P + 2 * P * P * SIM_BRICK_SIZE + SIM_BRICK_SIZE * SIM_BRICK_SIZE * SIM_BRICK_SIZE;
+    uint32_t thread_count = thread_pool::get_thread_count(pool);
+    float *scratch = (float *)malloc(sizeof(float) * scratch_size * thread_count);
+    uint8_t *keep = (uint8_t *)malloc(count);
+
+    float factor = decay_factor / 27.0f;
+    TrailBuffer *src = &world->trail, *dst = &world->trail_back;
+    thread_pool::run(pool, count, 64, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+        float *brick_scratch = scratch + scratch_size * thread_index;
+        float *out = brick_scratch + P * P * P + 2 * P * P * SIM_BRICK_SIZE;
+        for (uint32_t i = begin; i < end; ++i) {
+            float max_value = decay_brick(world, src, scheduled[i], factor, NULL, brick_scratch, out);
+            trail::store_brick(world, dst, scheduled[i], out);
+            keep[i] = max_value >= world->brick_threshold;
+            world->brick_max[scheduled[i]] = keep[i] ? max_value : 0.0f;
+        }
+    });
+    // Retired bricks have to be zero in both buffers. Source can be cleared only after all bricks were
+    // decayed, because neighbouring bricks read from it.
+    thread_pool::run(pool, count, 64, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t i = begin; i < end; ++i) {
+            if (keep[i]) continue;
+            trail::zero_brick(world, src, scheduled[i]);
+            trail::zero_brick(world, dst, scheduled[i]);
+        }
+    });
+    activate_scheduled(world, scheduled, count, keep);
+
+    free(keep);
+    free(scratch);
+}
+
+// Single in-place decay step over scheduled bricks. Layers are decayed bottom up, while one layer is decayed,
+// the one below it is written. Neither touches the other's voxels: the layer reads the slice below it from
+// faces kept while the layer below was decayed.
+static void decay_bricks_in_place(World *world, uint32_t *scheduled, uint32_t count, float decay_factor, ThreadPool *pool) {
+    const int S = SIM_BRICK_SIZE, P = BRICK_PADDED_SIZE;
+    uint32_t layer_size = world->brick_width * world->brick_height;
+    uint32_t layer_count = world->brick_depth;
+
+    // Sort scheduled bricks by layer, activate_scheduled below takes them in the new order.
+    uint32_t *layer_begin = (uint32_t *)calloc(layer_count + 1, sizeof(uint32_t));
+    uint32_t *ordered = (uint32_t *)malloc(sizeof(uint32_t) * count);
+    for (uint32_t i = 0; i < count; ++i) {
+        ++layer_begin[scheduled[i] / layer_size + 1];
+    }
+    uint32_t max_layer_bricks = 0;
+    for (uint32_t layer = 0; layer < layer_count; ++layer) {
+        max_layer_bricks = layer_begin[layer + 1] > max_layer_bricks ? layer_begin[layer + 1] : max_layer_bricks;
+        layer_begin[layer + 1] += layer_begin[layer];
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        ordered[layer_begin[scheduled[i] / layer_size]++] = scheduled[i];
+    }
+    for (uint32_t layer = layer_count; layer > 0; --layer) {
+        layer_begin[layer] = layer_begin[layer - 1];
+    }
+    layer_begin[0] = 0;
+
+    size_t scratch_size = P * P * P + 2 * P * P * S;
+    uint32_t thread_count = thread_pool::get_thread_count(pool);
+    float *scratch = (float *)malloc(sizeof(float) * scratch_size * thread_count);
+    // Output of the layer being decayed and the one being written.
+    float *outputs = (float *)malloc(sizeof(float) * S * S * S * 2 * max_layer_bricks);
+    // Faces of even and odd layers.
+    float *face_values = (float *)malloc(sizeof(float) * S * S * 2 * layer_size);
+    uint32_t *face_layers = (uint32_t *)calloc(2 * layer_size, sizeof(uint32_t));
+    uint8_t *keep = (uint8_t *)malloc(count);
+
+    float factor = decay_factor / 27.0f;
+    TrailBuffer *trail = &world->trail;
+    int written_layer = -1;
+    uint32_t output_index = 0;
+    for (uint32_t layer = 0; layer <= layer_count; ++layer) {
+        uint32_t decayed = layer < layer_count ? layer_begin[layer + 1] - layer_begin[layer] : 0;
+        uint32_t written = written_layer >= 0 ? layer_begin[written_layer + 1] - layer_begin[written_layer] : 0;
+        if (decayed == 0 && written == 0) continue;
+
+        BrickFaces below = { face_values + S * S * layer_size * ((layer + 1) % 2), face_layers + layer_size * ((layer + 1) % 2), layer - 1 };
+        float *decayed_out = outputs + size_t(S * S * S) * max_layer_bricks * output_index;
+        float *written_out = outputs + size_t(S * S * S) * max_layer_bricks * (output_index ^ 1);
+        thread_pool::run(pool, decayed + written, 16, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+            float *brick_scratch = scratch + scratch_size * thread_index;
+            for (uint32_t i = begin; i < end; ++i) {
+                if (i >= decayed) {
+                    uint32_t j = i - decayed;
+                    uint32_t index = layer_begin[written_layer] + j;
+                    if (keep[index]) {
+                        trail::store_brick(world, trail, ordered[index], written_out + S * S * S * j);
+                    } else {
+                        trail::zero_brick(world, trail, ordered[index]);
+                    }
+                    continue;
+                }
+
+                uint32_t index = layer_begin[layer] + i;
+                uint32_t brick = ordered[index];
+                float max_value = decay_brick(world, trail, brick, factor, layer > 0 ? &below : NULL, brick_scratch, decayed_out + S * S * S * i);
+                keep[index] = max_value >= world->brick_threshold;
+                world->brick_max[brick] = keep[index] ? max_value : 0.0f;
+
+                // Top slice of the brick is the last slice of the padded input in full bricks, the top layer
+                // keeps a partial one nobody reads.
+                uint32_t position = brick % layer_size;
+                float *face = face_values + S * S * (layer_size * (layer % 2) + position);
+                for (int y = 0; y < S; ++y) {
+                    memcpy(face + y * S, brick_scratch + (S * P + y + 1) * P + 1, sizeof(float) * S);
+                }
+                face_layers[layer_size * (layer % 2) + position] = layer + 1;
+            }
+        });
+        written_layer = decayed > 0 ? int(layer) : -1;
+        output_index ^= 1;
+    }
+    activate_scheduled(world, ordered, count, keep);
+
+    free(keep);
+    free(face_layers);
+    free(face_values);
+    free(outputs);
+    free(scratch);
+    free(ordered);
+    free(layer_begin);
+}
+
+void sim::decay(World *world, Config *config, ThreadPool *pool) {
+    sim::decay_steps(world, config, 1, pool);
+}
+
+void sim::decay_steps(World *world, Config *config, uint32_t steps, ThreadPool *pool) {
+    PROFILE_SCOPE("decay");
+    uint32_t brick_count = sim::get_brick_count(world);
+    uint32_t *scheduled = (uint32_t *)malloc(sizeof(uint32_t) * brick_count);
+    bool in_place = world->decay_buffer == SimDecayBuffer::IN_PLACE;
+    while (steps > 0) {
+        uint32_t scheduled_count = schedule_bricks(world, scheduled);
+        int fused = 1;
+        if (scheduled_count < brick_count * MAX_BRICKED_DECAY_FRACTION) {
+            if (in_place) {
+                decay_bricks_in_place(world, scheduled, scheduled_count, config->decay_factor, pool);
+            } else {
+                decay_bricks(world, scheduled, scheduled_count, config->decay_factor, pool);
+            }
+        } else {
+            fused = steps > MAX_FUSED_STEPS ? MAX_FUSED_STEPS : int(steps);
+            decay_fused(world, &world->trail, in_place ? &world->trail : &world->trail_back, fused, config->decay_factor, pool);
+            // Dense decay doesn't check brick values, so every brick trail could have reached stays active.
+            activate_scheduled(world, scheduled, scheduled_count, NULL);
+        }
+        steps -= uint32_t(fused);
+
+        if (!in_place) {
+            TrailBuffer tmp = world->trail;
+            world->trail = world->trail_back;
+            world->trail_back = tmp;
+        }
+    }
+    free(scheduled);
+}
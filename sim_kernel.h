@@ -0,0 +1,665 @@
+#pragma once
+
+// Particle step kernel of the CPU simulation, written once over lane types from sim_lanes.h and compiled
+// separately for scalar, AVX2 and AVX-512 code. sim_lanes.h has to be included (with backend selected)
+// before including this file.
+
+#include "sim.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Same constants as particle_shader_3d.hlsl uses, they're not exactly pi on purpose.
+#define SIM_SHADER_PI 3.1415f
+#define SIM_SHADER_HALFPI (3.1415f / 2.0f)
+#define SIM_PI 3.14159265358979f
+#define SIM_HALFPI 1.57079632679490f
+
+// Default sample count, same as SAMPLE_POINTS in particle_shader_3d.hlsl.
+#define SIM_SAMPLE_POINTS 8
+// Kernels are specialized for these sample counts and for every combination of feature flags below, so
+// disabled features cost nothing and sampling loops have constant trip counts.
+#define SIM_SAMPLE_VARIANTS 4
+static const int sim_sample_counts[SIM_SAMPLE_VARIANTS] = { 4, 8, 16, 26 };
+
+#define SIM_STEP_COLLISION 1
+#define SIM_STEP_CENTER_ATTRACTION 2
+// Step size depends on sensed trail value (move_sense_coef != 0).
+#define SIM_STEP_DENSITY_MOVE 4
+#define SIM_STEP_FLAG_COMBINATIONS 8
+
+typedef uint32_t (*StepFunction)(World *world, Particles *particles, Config *config, uint32_t begin, uint32_t end);
+
+// Step kernels of one instruction set indexed by heading, sample count variant and flags.
+struct StepTable {
+    StepFunction functions[2][SIM_SAMPLE_VARIANTS][SIM_STEP_FLAG_COMBINATIONS];
+};
+
+// Equivalent of InterlockedOr, returns the original value.
+static inline uint32_t sim_fetch_or(uint32_t *dst, uint32_t value) {
+#ifdef _MSC_VER
+    return (uint32_t)_InterlockedOr((volatile long *)dst, (long)value);
+#else
+    return __sync_fetch_and_or(dst, value);
+#endif
+}
+
+static inline uint32_t sim_fetch_add(uint32_t *dst, uint32_t value) {
+#ifdef _MSC_VER
+    return (uint32_t)_InterlockedExchangeAdd((volatile long *)dst, (long)value);
+#else
+    return __sync_fetch_and_add(dst, value);
+#endif
+}
+
+// Vectorized math functions. Polynomials are from Cephes single precision library. Both sin/cos and acos/atan2
+// are accurate to a couple of ulps in the range used by the simulation.
+template<typename L>
+struct LaneMath {
+    typedef typename L::F F;
+    typedef typename L::I I;
+    typedef typename L::M M;
+
+    static F abs(F x) {
+        return L::as_float(L::as_int(x) & L::seti(0x7FFFFFFF));
+    }
+
+    static void sincos(F x, F *s, F *c) {
+        I sign_sin = L::as_int(x) & L::seti(int32_t(0x80000000u));
+        x = abs(x);
+
+        I j = L::truncate(x * L::set(1.27323954473516f));
+        j = (j + L::seti(1)) & L::seti(~1);
+        F y = L::to_float(j);
+
+        sign_sin = sign_sin ^ ((j & L::seti(4)) << 29);
+        I sign_cos = ((j - L::seti(2)) & L::seti(4)) ^ L::seti(4);
+        sign_cos = sign_cos << 29;
+        M poly_sin = (j & L::seti(2)) == L::seti(0);
+
+        x = ((x - y * L::set(0.78515625f)) - y * L::set(2.4187564849853515625e-4f)) - y * L::set(3.77489497744594108e-8f);
+        F z = x * x;
+
+        F cos_poly = ((L::set(2.443315711809948e-5f) * z - L::set(1.388731625493765e-3f)) * z + L::set(4.166664568298827e-2f)) * z * z;
+        cos_poly = cos_poly - z * L::set(0.5f) + L::set(1.0f);
+        F sin_poly = ((L::set(-1.9515295891e-4f) * z + L::set(8.3321608736e-3f)) * z - L::set(1.6666654611e-1f)) * z * x + x;
+
+        F sin_result = L::select(poly_sin, sin_poly, cos_poly);
+        F cos_result = L::select(poly_sin, cos_poly, sin_poly);
+        *s = L::as_float(L::as_int(sin_result) ^ sign_sin);
+        *c = L::as_float(L::as_int(cos_result) ^ sign_cos);
+    }
+
+    // Input is clamped to [-1, 1].
+    static F acos(F x) {
+        x = L::min(L::max(x, L::set(-1.0f)), L::set(1.0f));
+        F a = abs(x);
+        M big = a > L::set(0.5f);
+        F z = L::select(big, L::set(0.5f) * (L::set(1.0f) - a), x * x);
+        F s = L::select(big, L::sqrt(z), x);
+        F p = ((((L::set(4.2163199048e-2f) * z + L::set(2.4181311049e-2f)) * z + L::set(4.5470025998e-2f)) * z
+                + L::set(7.4953002686e-2f)) * z + L::set(1.6666752422e-1f)) * z * s + s;
+        F big_result = L::set(2.0f) * p;
+        big_result = L::select(x < L::set(0.0f), L::set(SIM_PI) - big_result, big_result);
+        return L::select(big, big_result, L::set(SIM_HALFPI) - p);
+    }
+
+    static F atan2(F y, F x) {
+        F ax = abs(x);
+        F ay = abs(y);
+        F t = ay / ax;
+
+        // Reduce range of t to [0, tan(pi/8)].
+        M big = t > L::set(2.414213562373095f);
+        M mid = (t > L::set(0.4142135623730950f)) & ~big;
+        F base = L::select(big, L::set(SIM_HALFPI), L::select(mid, L::set(SIM_PI / 4.0f), L::set(0.0f)));
+        t = L::select(big, L::set(-1.0f) / t, L::select(mid, (t - L::set(1.0f)) / (t + L::set(1.0f)), t));
+
+        F z = t * t;
+        F result = base + (((L::set(8.05374449538e-2f) * z - L::set(1.38776856032e-1f)) * z + L::set(1.99777106478e-1f)) * z
+                           - L::set(3.33329491539e-1f)) * z * t + t;
+
+        // Handle quadrants and atan2(0, 0) = 0.
+        result = L::select((ax == L::set(0.0f)) & (ay == L::set(0.0f)), L::set(0.0f), result);
+        result = L::select(x < L::set(0.0f), L::set(SIM_PI) - result, result);
+        return L::select(y < L::set(0.0f), -result, result);
+    }
+
+    static I wang_hash(I seed) {
+        seed = (seed ^ L::seti(61)) ^ (seed >> 16);
+        seed = seed * L::seti(9);
+        seed = seed ^ (seed >> 4);
+        seed = seed * L::seti(0x27d4eb2d);
+        seed = seed ^ (seed >> 15);
+        return seed;
+    }
+
+    // Unsigned h % d for 0 < d <= 1000. There's no vector integer division, so the hash is split
+    // into 16 bit halves, for which float division is exact enough to give correct quotients.
+    static I mod(I h, I d) {
+        F df = L::to_float(d);
+        F hi = L::to_float(h >> 16);
+        F lo = L::to_float(h & L::seti(0xFFFF));
+        F hi_mod = hi - df * L::floor(hi / df);
+        F base_mod = L::set(65536.0f) - df * L::floor(L::set(65536.0f) / df);
+        F r = hi_mod * base_mod + lo;
+        return L::truncate(r - df * L::floor(r / df));
+    }
+
+    static F random(I seed) {
+        return L::to_float(mod(wang_hash(seed), L::seti(1000))) / L::set(1000.0f);
+    }
+};
+
+template<typename L>
+struct Vec3 {
+    typename L::F x, y, z;
+};
+
+template<typename L>
+static inline Vec3<L> rotate(Vec3<L> v, Vec3<L> a, typename L::F s, typename L::F c) {
+    typedef typename L::F F;
+    F d = a.x * v.x + a.y * v.y + a.z * v.z;
+    F one_minus_c = L::set(1.0f) - c;
+    Vec3<L> result;
+    result.x = c * v.x + s * (a.y * v.z - a.z * v.y) + d * one_minus_c * a.x;
+    result.y = c * v.y + s * (a.z * v.x - a.x * v.z) + d * one_minus_c * a.y;
+    result.z = c * v.z + s * (a.x * v.y - a.y * v.x) + d * one_minus_c * a.z;
+    return result;
+}
+
+template<typename L>
+static inline Vec3<L> direction(typename L::F sin_theta, typename L::F cos_theta, typename L::F sin_phi, typename L::F cos_phi) {
+    Vec3<L> result = { sin_theta * cos_phi, cos_theta, sin_theta * sin_phi };
+    return result;
+}
+
+template<typename L>
+static inline typename L::F wrap(typename L::F x, typename L::F size) {
+    return x - size * L::floor(x / size);
+}
+
+// Current trail buffer as seen by sample_trail.
+template<typename L>
+struct TrailSampler {
+    SimTrailFormat format;
+    const float *voxels;
+    // FLOAT16 and UNORM8 voxels are read as the 32 bit words which hold them.
+    const uint32_t *words;
+    const float *brick_offset;
+    const float *brick_scale;
+    typename L::I brick_width;
+    typename L::I brick_height;
+};
+
+template<typename L>
+static inline TrailSampler<L> get_trail_sampler(World *world) {
+    TrailSampler<L> sampler;
+    sampler.format = world->trail_format;
+    sampler.voxels = (const float *)world->trail.voxels;
+    sampler.words = (const uint32_t *)world->trail.voxels;
+    sampler.brick_offset = world->trail.brick_offset;
+    sampler.brick_scale = world->trail.brick_scale;
+    sampler.brick_width = L::seti(int32_t(world->brick_width));
+    sampler.brick_height = L::seti(int32_t(world->brick_height));
+    return sampler;
+}
+
+// Samples trail at p + trunc(offset), out of bounds reads return 0 like texture reads on GPU. FLOAT16 and
+// UNORM8 voxels are decoded in registers, to the same values trail::load decodes them to.
+template<typename L>
+static inline typename L::F sample_trail(const TrailSampler<L> *trail, typename L::I size_x, typename L::I size_y, typename L::I size_z,
+                                         typename L::I px, typename L::I py, typename L::I pz, Vec3<L> offset) {
+    typedef typename L::F F;
+    typedef typename L::I I;
+    typedef typename L::M M;
+    I sx = L::truncate(offset.x) + px;
+    I sy = L::truncate(offset.y) + py;
+    I sz = L::truncate(offset.z) + pz;
+    I minus_one = L::seti(-1);
+    M in_bounds = (sx > minus_one) & (sx < size_x) & (sy > minus_one) & (sy < size_y) & (sz > minus_one) & (sz < size_z);
+    I index = L::select(in_bounds, (sz * size_y + sy) * size_x + sx, L::seti(0));
+    if (trail->format == SimTrailFormat::FLOAT16) {
+        // Moving half bits into float exponent/mantissa position and multiplying by 2^112 rebiases the
+        // exponent, which is exact for zero, subnormals and normals. Stored values are never negative or infinite.
+        I word = L::gatheri(trail->words, index >> 1, in_bounds);
+        I half = (word >> ((index & L::seti(1)) << 4)) & L::seti(0x7FFF);
+        return L::as_float(half << 13) * L::set(5.192296858534828e33f);
+    }
+    if (trail->format == SimTrailFormat::UNORM8) {
+        I word = L::gatheri(trail->words, index >> 2, in_bounds);
+        I value = (word >> ((index & L::seti(3)) << 3)) & L::seti(0xFF);
+        I brick = ((sz >> SIM_BRICK_SHIFT) * trail->brick_height + (sy >> SIM_BRICK_SHIFT)) * trail->brick_width + (sx >> SIM_BRICK_SHIFT);
+        brick = L::select(in_bounds, brick, L::seti(0));
+        F brick_offset = L::gather(trail->brick_offset, brick, in_bounds);
+        F brick_scale = L::gather(trail->brick_scale, brick, in_bounds);
+        return brick_offset + L::to_float(value) * brick_scale;
+    }
+    return L::gather(trail->voxels, index, in_bounds);
+}
+
+// Sense, turn, move and collision check for particles [begin, end), port of particle_shader_3d.hlsl. Processes
+// particles in blocks of L::WIDTH and returns index of the first particle it didn't process.
+// Trail indices are 32 bit, so world has to have less than 2^31 voxels.
+template<typename L, int SAMPLES, uint32_t FLAGS>
+uint32_t step_particles(World *world, Particles *particles, Config *config, uint32_t begin, uint32_t end) {
+    typedef typename L::F F;
+    typedef typename L::I I;
+    typedef typename L::M M;
+    typedef LaneMath<L> Math;
+    const uint32_t WIDTH = L::WIDTH;
+
+    TrailSampler<L> trail = get_trail_sampler<L>(world);
+    I size_x = L::seti(int32_t(world->width));
+    I size_y = L::seti(int32_t(world->height));
+    I size_z = L::seti(int32_t(world->depth));
+    F world_x = L::set(float(world->width));
+    F world_y = L::set(float(world->height));
+    F world_z = L::set(float(world->depth));
+    F center_z = L::set(world->center_z);
+    F sense_distance = L::set(config->sense_distance);
+    F sense_spread = L::set(config->sense_spread);
+    F turn_angle = L::set(config->turn_angle);
+    F move_scale_offset = L::set(config->move_sense_offset);
+    F move_scale_coef = L::set(config->move_sense_coef);
+    F move_distance = L::set(config->move_distance);
+    F center_attraction = L::set(config->center_attraction);
+    F angle_step = L::set(SIM_SHADER_PI * 2.0f / float(SAMPLES));
+
+    uint32_t block_end = begin + (end - begin) / WIDTH * WIDTH;
+    for (uint32_t base = begin; base < block_end; base += WIDTH) {
+        // Fetch current particle state
+        I idx = L::iota(int32_t(base));
+        F x0 = L::load(particles->x + base);
+        F y0 = L::load(particles->y + base);
+        F z0 = L::load(particles->z + base);
+        F t = L::load(particles->theta + base);
+        F ph = L::load(particles->phi + base);
+
+        // Get vector which points in the current particle's direction
+        F sin_t, cos_t, sin_ph, cos_ph;
+        Math::sincos(t, &sin_t, &cos_t);
+        Math::sincos(ph, &sin_ph, &cos_ph);
+        Vec3<L> center_axis = direction<L>(sin_t, cos_t, sin_ph, cos_ph);
+
+        // Get base vector which points away from the current particle's direction and will be used
+        // to sample environment in other directions
+        F sin_st, cos_st;
+        Math::sincos(t - sense_spread, &sin_st, &cos_st);
+        Vec3<L> off_center_base_dir = direction<L>(sin_st, cos_st, sin_ph, cos_ph);
+
+        // Sample environment straight ahead
+        I px = L::truncate(x0), py = L::truncate(y0), pz = L::truncate(z0);
+        Vec3<L> center_sense_pos = { center_axis.x * sense_distance, center_axis.y * sense_distance, center_axis.z * sense_distance };
+        F max_value = sample_trail<L>(&trail, size_x, size_y, size_z, px, py, pz, center_sense_pos);
+
+        // Sample environment away from the center axis. Directions with max value are stored as bits of max_values.
+        I max_value_count = L::seti(1);
+        I max_values = L::seti(1);
+        F start_angle = Math::random(idx * L::seti(42)) * L::set(SIM_SHADER_PI) - L::set(SIM_SHADER_HALFPI);
+        for (int i = 1; i < SAMPLES + 1; ++i) {
+            F angle = start_angle + angle_step * L::set(float(i));
+            F s, c;
+            Math::sincos(angle, &s, &c);
+            Vec3<L> sense_dir = rotate<L>(off_center_base_dir, center_axis, s, c);
+            Vec3<L> sense_position = { sense_dir.x * sense_distance, sense_dir.y * sense_distance, sense_dir.z * sense_distance };
+            F value = sample_trail<L>(&trail, size_x, size_y, size_z, px, py, pz, sense_position);
+
+            M greater = value > max_value;
+            M equal = value == max_value;
+            I bit = L::seti(1 << i);
+            max_value_count = L::select(greater, L::seti(1), L::select(equal, max_value_count + L::seti(1), max_value_count));
+            max_values = L::select(greater, bit, L::select(equal, max_values | bit, max_values));
+            max_value = L::select(greater, value, max_value);
+        }
+
+        // Pick direction with max value sampled, n-th set bit of max_values.
+        I hash = Math::wang_hash(idx * px * py * pz);
+        I remaining = Math::mod(hash, max_value_count);
+        I direction_index = L::seti(0);
+        for (int i = 0; i < SAMPLES + 1; ++i) {
+            M is_set = (max_values & L::seti(1 << i)) == L::seti(1 << i);
+            M take = is_set & (remaining == L::seti(0));
+            direction_index = L::select(take, L::seti(i), direction_index);
+            remaining = L::select(is_set, remaining - L::seti(1), remaining);
+        }
+        M turn = direction_index > L::seti(0);
+        if (L::any(turn)) {
+            F sin_tt, cos_tt;
+            Math::sincos(t - turn_angle, &sin_tt, &cos_tt);
+            Vec3<L> off_center_base_dir_turn = direction<L>(sin_tt, cos_tt, sin_ph, cos_ph);
+            F angle = L::to_float(direction_index) * L::set(SIM_SHADER_PI) * L::set(2.0f) / L::set(float(SAMPLES)) + start_angle;
+            F s, c;
+            Math::sincos(angle, &s, &c);
+            Vec3<L> best = rotate<L>(off_center_base_dir_turn, center_axis, s, c);
+            F best_length = L::sqrt(best.x * best.x + best.y * best.y + best.z * best.z);
+            ph = L::select(turn, Math::atan2(best.z, best.x), ph);
+            t = L::select(turn, Math::acos(best.y / best_length), t);
+        }
+
+        // Compute rotation applied by force pointing to the center of environment.
+        if (FLAGS & SIM_STEP_CENTER_ATTRACTION) {
+            Vec3<L> to_center = { world_x * L::set(0.5f) - x0, world_y * L::set(0.5f) - y0, center_z - z0 };
+            F d_center = L::sqrt(to_center.x * to_center.x + to_center.y * to_center.y + to_center.z * to_center.z);
+            F d_c_turn = L::min(L::max((d_center - L::set(50.0f)) / L::set(150.0f), L::set(0.0f)), L::set(1.0f)) * center_attraction;
+            Math::sincos(t, &sin_t, &cos_t);
+            Math::sincos(ph, &sin_ph, &cos_ph);
+            Vec3<L> dir = direction<L>(sin_t, cos_t, sin_ph, cos_ph);
+            Vec3<L> center_dir = { to_center.x / d_center, to_center.y / d_center, to_center.z / d_center };
+            F center_angle = Math::acos(dir.x * center_dir.x + dir.y * center_dir.y + dir.z * center_dir.z);
+            F st = L::set(0.1f) * d_c_turn;
+            F sin_a, cos_a, sin_b, cos_b, sin_center, cos_center;
+            Math::sincos((L::set(1.0f) - st) * center_angle, &sin_a, &cos_a);
+            Math::sincos(st * center_angle, &sin_b, &cos_b);
+            Math::sincos(center_angle, &sin_center, &cos_center);
+            F a = sin_a / sin_center;
+            F b = sin_b / sin_center;
+            dir.x = a * dir.x + b * center_dir.x;
+            dir.y = a * dir.y + b * center_dir.y;
+            dir.z = a * dir.z + b * center_dir.z;
+            F dir_length = L::sqrt(dir.x * dir.x + dir.y * dir.y + dir.z * dir.z);
+            // NaN (zero angle to center) fails these comparisons, keeping the original heading like on GPU.
+            M valid = (dir_length > L::set(0.0f)) & ((dir.z != L::set(0.0f)) | (dir.x != L::set(0.0f)));
+            t = L::select(valid, Math::acos(dir.y / dir_length), t);
+            ph = L::select(valid, Math::atan2(dir.z, dir.x), ph);
+        }
+
+        // Make a step
+        Math::sincos(t, &sin_t, &cos_t);
+        Math::sincos(ph, &sin_ph, &cos_ph);
+        Vec3<L> dp = direction<L>(sin_t, cos_t, sin_ph, cos_ph);
+        F step_size = (FLAGS & SIM_STEP_DENSITY_MOVE) ? move_distance * (move_scale_offset + max_value * move_scale_coef) : move_distance * move_scale_offset;
+
+        // Keep the particle inside environment
+        F x = wrap<L>(x0 + dp.x * step_size, world_x);
+        F y = wrap<L>(y0 + dp.y * step_size, world_y);
+        F z = wrap<L>(z0 + dp.z * step_size, world_z);
+
+        float out_x[WIDTH], out_y[WIDTH], out_z[WIDTH], out_t[WIDTH], out_ph[WIDTH];
+        L::store(out_x, x);
+        L::store(out_y, y);
+        L::store(out_z, z);
+        L::store(out_t, t);
+        L::store(out_ph, ph);
+
+        // Check for collisions, particles which collide go back to their original position with a random heading.
+        if (FLAGS & SIM_STEP_COLLISION) {
+            I seed = idx * px * py * pz;
+            F revert_t = Math::acos(L::set(2.0f) * L::to_float(Math::mod(Math::wang_hash(seed + L::seti(4)), L::seti(1000))) / L::set(1000.0f) - L::set(1.0f));
+            F revert_ph = L::to_float(Math::mod(Math::wang_hash(seed + L::seti(12)), L::seti(1000))) / L::set(1000.0f) * L::set(SIM_SHADER_PI) * L::set(2.0f);
+            float revert_ts[WIDTH], revert_phs[WIDTH];
+            L::store(revert_ts, revert_t);
+            L::store(revert_phs, revert_ph);
+            for (uint32_t lane = 0; lane < WIDTH; ++lane) {
+                uint32_t ix = uint32_t(out_x[lane]), iy = uint32_t(out_y[lane]), iz = uint32_t(out_z[lane]);
+                if (ix >= world->width || iy >= world->height || iz >= world->depth) {
+                    continue;
+                }
+                size_t voxel = (size_t(iz) * world->height + iy) * world->width + ix;
+                uint32_t bit = 1u << (voxel & 31);
+                uint32_t word = uint32_t(voxel >> 5);
+                uint32_t original = sim_fetch_or(world->occupancy + word, bit);
+                // First bit set in a word, remember it for clearing.
+                if (original == 0) {
+                    world->occupancy_dirty[sim_fetch_add(&world->occupancy_dirty_count, 1)] = word;
+                }
+                if (original & bit) {
+                    out_x[lane] = particles->x[base + lane];
+                    out_y[lane] = particles->y[base + lane];
+                    out_z[lane] = particles->z[base + lane];
+                    out_t[lane] = revert_ts[lane];
+                    out_ph[lane] = revert_phs[lane];
+                }
+            }
+        }
+
+        // Update particle state
+        for (uint32_t lane = 0; lane < WIDTH; ++lane) {
+            particles->x[base + lane] = out_x[lane];
+            particles->y[base + lane] = out_y[lane];
+            particles->z[base + lane] = out_z[lane];
+            particles->theta[base + lane] = out_t[lane];
+            particles->phi[base + lane] = out_ph[lane];
+        }
+    }
+    return block_end;
+}
+
+// Same step as step_particles for particles with SimHeading::DIRECTION, working on heading vectors:
+// - Sensing and turning directions tilt the heading along its meridian (towards +y, same as subtracting from
+//   theta) by constant angles and rotate it around itself. Rotation angles differ by a constant step, so
+//   only the random start angle needs sincos, the rest comes from angle addition.
+// - Center attraction normalizes a linear blend of heading and direction to the center (nlerp) instead of
+//   slerp. It turns by the same fraction of the angle for small angles and a bit less for large ones.
+// - Heading is renormalized whenever it changes, so rounding errors don't accumulate.
+// Collisions pick the same random headings as step_particles.
+template<typename L, int SAMPLES, uint32_t FLAGS>
+uint32_t step_particles_direction(World *world, Particles *particles, Config *config, uint32_t begin, uint32_t end) {
+    typedef typename L::F F;
+    typedef typename L::I I;
+    typedef typename L::M M;
+    typedef LaneMath<L> Math;
+    const uint32_t WIDTH = L::WIDTH;
+
+    TrailSampler<L> trail = get_trail_sampler<L>(world);
+    I size_x = L::seti(int32_t(world->width));
+    I size_y = L::seti(int32_t(world->height));
+    I size_z = L::seti(int32_t(world->depth));
+    F world_x = L::set(float(world->width));
+    F world_y = L::set(float(world->height));
+    F world_z = L::set(float(world->depth));
+    F center_z = L::set(world->center_z);
+    F sense_distance = L::set(config->sense_distance);
+    F cos_spread = L::set(cosf(config->sense_spread));
+    F sin_spread = L::set(sinf(config->sense_spread));
+    F cos_turn = L::set(cosf(config->turn_angle));
+    F sin_turn = L::set(sinf(config->turn_angle));
+    F move_scale_offset = L::set(config->move_sense_offset);
+    F move_scale_coef = L::set(config->move_sense_coef);
+    F move_distance = L::set(config->move_distance);
+    F center_attraction = L::set(config->center_attraction);
+    float angle_step = SIM_SHADER_PI * 2.0f / float(SAMPLES);
+    F cos_step = L::set(cosf(angle_step));
+    F sin_step = L::set(sinf(angle_step));
+
+    uint32_t block_end = begin + (end - begin) / WIDTH * WIDTH;
+    for (uint32_t base = begin; base < block_end; base += WIDTH) {
+        // Fetch current particle state
+        I idx = L::iota(int32_t(base));
+        F x0 = L::load(particles->x + base);
+        F y0 = L::load(particles->y + base);
+        F z0 = L::load(particles->z + base);
+        Vec3<L> center_axis = { L::load(particles->dir_x + base), L::load(particles->dir_y + base), L::load(particles->dir_z + base) };
+
+        // Meridian tangent, derivative of heading by theta. Headings along y axis use phi = 0.
+        F r = L::sqrt(center_axis.x * center_axis.x + center_axis.z * center_axis.z);
+        M has_phi = r > L::set(0.0f);
+        F cos_ph = L::select(has_phi, center_axis.x / r, L::set(1.0f));
+        F sin_ph = L::select(has_phi, center_axis.z / r, L::set(0.0f));
+        Vec3<L> tangent = { center_axis.y * cos_ph, -r, center_axis.y * sin_ph };
+
+        // Get base vector which points away from the current particle's direction and will be used
+        // to sample environment in other directions
+        Vec3<L> off_center_base_dir = {
+            center_axis.x * cos_spread - tangent.x * sin_spread,
+            center_axis.y * cos_spread - tangent.y * sin_spread,
+            center_axis.z * cos_spread - tangent.z * sin_spread,
+        };
+
+        // Sample environment straight ahead
+        I px = L::truncate(x0), py = L::truncate(y0), pz = L::truncate(z0);
+        Vec3<L> center_sense_pos = { center_axis.x * sense_distance, center_axis.y * sense_distance, center_axis.z * sense_distance };
+        F max_value = sample_trail<L>(&trail, size_x, size_y, size_z, px, py, pz, center_sense_pos);
+
+        // Sample environment away from the center axis. Directions with max value are stored as bits of max_values.
+        I max_value_count = L::seti(1);
+        I max_values = L::seti(1);
+        F start_angle = Math::random(idx * L::seti(42)) * L::set(SIM_SHADER_PI) - L::set(SIM_SHADER_HALFPI);
+        F sin_angles[SAMPLES + 1], cos_angles[SAMPLES + 1];
+        Math::sincos(start_angle, &sin_angles[0], &cos_angles[0]);
+        for (int i = 1; i < SAMPLES + 1; ++i) {
+            F s = sin_angles[i - 1] * cos_step + cos_angles[i - 1] * sin_step;
+            F c = cos_angles[i - 1] * cos_step - sin_angles[i - 1] * sin_step;
+            sin_angles[i] = s;
+            cos_angles[i] = c;
+            Vec3<L> sense_dir = rotate<L>(off_center_base_dir, center_axis, s, c);
+            Vec3<L> sense_position = { sense_dir.x * sense_distance, sense_dir.y * sense_distance, sense_dir.z * sense_distance };
+            F value = sample_trail<L>(&trail, size_x, size_y, size_z, px, py, pz, sense_position);
+
+            M greater = value > max_value;
+            M equal = value == max_value;
+            I bit = L::seti(1 << i);
+            max_value_count = L::select(greater, L::seti(1), L::select(equal, max_value_count + L::seti(1), max_value_count));
+            max_values = L::select(greater, bit, L::select(equal, max_values | bit, max_values));
+            max_value = L::select(greater, value, max_value);
+        }
+
+        // Pick direction with max value sampled, n-th set bit of max_values, together with its rotation.
+        I hash = Math::wang_hash(idx * px * py * pz);
+        I remaining = Math::mod(hash, max_value_count);
+        I direction_index = L::seti(0);
+        F s = sin_angles[0], c = cos_angles[0];
+        for (int i = 0; i < SAMPLES + 1; ++i) {
+            M is_set = (max_values & L::seti(1 << i)) == L::seti(1 << i);
+            M take = is_set & (remaining == L::seti(0));
+            direction_index = L::select(take, L::seti(i), direction_index);
+            s = L::select(take, sin_angles[i], s);
+            c = L::select(take, cos_angles[i], c);
+            remaining = L::select(is_set, remaining - L::seti(1), remaining);
+        }
+        Vec3<L> dir = center_axis;
+        M turn = direction_index > L::seti(0);
+        if (L::any(turn)) {
+            Vec3<L> off_center_base_dir_turn = {
+                center_axis.x * cos_turn - tangent.x * sin_turn,
+                center_axis.y * cos_turn - tangent.y * sin_turn,
+                center_axis.z * cos_turn - tangent.z * sin_turn,
+            };
+            Vec3<L> best = rotate<L>(off_center_base_dir_turn, center_axis, s, c);
+            F best_length = L::sqrt(best.x * best.x + best.y * best.y + best.z * best.z);
+            dir.x = L::select(turn, best.x / best_length, dir.x);
+            dir.y = L::select(turn, best.y / best_length, dir.y);
+            dir.z = L::select(turn, best.z / best_length, dir.z);
+        }
+
+        // Turn towards the center of environment, blended heading is renormalized.
+        if (FLAGS & SIM_STEP_CENTER_ATTRACTION) {
+            Vec3<L> to_center = { world_x * L::set(0.5f) - x0, world_y * L::set(0.5f) - y0, center_z - z0 };
+            F d_center = L::sqrt(to_center.x * to_center.x + to_center.y * to_center.y + to_center.z * to_center.z);
+            F d_c_turn = L::min(L::max((d_center - L::set(50.0f)) / L::set(150.0f), L::set(0.0f)), L::set(1.0f)) * center_attraction;
+            F st = L::set(0.1f) * d_c_turn;
+            Vec3<L> blend = {
+                dir.x + st * (to_center.x / d_center - dir.x),
+                dir.y + st * (to_center.y / d_center - dir.y),
+                dir.z + st * (to_center.z / d_center - dir.z),
+            };
+            F blend_length = L::sqrt(blend.x * blend.x + blend.y * blend.y + blend.z * blend.z);
+            // NaN (particle exactly in the center) and opposite directions cancelling out keep the heading.
+            M valid = blend_length > L::set(0.0f);
+            dir.x = L::select(valid, blend.x / blend_length, dir.x);
+            dir.y = L::select(valid, blend.y / blend_length, dir.y);
+            dir.z = L::select(valid, blend.z / blend_length, dir.z);
+        }
+
+        // Make a step
+        F step_size = (FLAGS & SIM_STEP_DENSITY_MOVE) ? move_distance * (move_scale_offset + max_value * move_scale_coef) : move_distance * move_scale_offset;
+
+        // Keep the particle inside environment
+        F x = wrap<L>(x0 + dir.x * step_size, world_x);
+        F y = wrap<L>(y0 + dir.y * step_size, world_y);
+        F z = wrap<L>(z0 + dir.z * step_size, world_z);
+
+        float out_x[WIDTH], out_y[WIDTH], out_z[WIDTH], out_dx[WIDTH], out_dy[WIDTH], out_dz[WIDTH];
+        L::store(out_x, x);
+        L::store(out_y, y);
+        L::store(out_z, z);
+        L::store(out_dx, dir.x);
+        L::store(out_dy, dir.y);
+        L::store(out_dz, dir.z);
+
+        // Check for collisions, particles which collide go back to their original position with a random heading.
+        // Random cos(theta) and phi are the same as in step_particles.
+        if (FLAGS & SIM_STEP_COLLISION) {
+            I seed = idx * px * py * pz;
+            F revert_y = L::set(2.0f) * L::to_float(Math::mod(Math::wang_hash(seed + L::seti(4)), L::seti(1000))) / L::set(1000.0f) - L::set(1.0f);
+            F revert_r = L::sqrt(L::set(1.0f) - revert_y * revert_y);
+            F revert_ph = L::to_float(Math::mod(Math::wang_hash(seed + L::seti(12)), L::seti(1000))) / L::set(1000.0f) * L::set(SIM_SHADER_PI) * L::set(2.0f);
+            F sin_revert, cos_revert;
+            Math::sincos(revert_ph, &sin_revert, &cos_revert);
+            float revert_xs[WIDTH], revert_ys[WIDTH], revert_zs[WIDTH];
+            L::store(revert_xs, revert_r * cos_revert);
+            L::store(revert_ys, revert_y);
+            L::store(revert_zs, revert_r * sin_revert);
+            for (uint32_t lane = 0; lane < WIDTH; ++lane) {
+                uint32_t ix = uint32_t(out_x[lane]), iy = uint32_t(out_y[lane]), iz = uint32_t(out_z[lane]);
+                if (ix >= world->width || iy >= world->height || iz >= world->depth) {
+                    continue;
+                }
+                size_t voxel = (size_t(iz) * world->height + iy) * world->width + ix;
+                uint32_t bit = 1u << (voxel & 31);
+                uint32_t word = uint32_t(voxel >> 5);
+                uint32_t original = sim_fetch_or(world->occupancy + word, bit);
+                // First bit set in a word, remember it for clearing.
+                if (original == 0) {
+                    world->occupancy_dirty[sim_fetch_add(&world->occupancy_dirty_count, 1)] = word;
+                }
+                if (original & bit) {
+                    out_x[lane] = particles->x[base + lane];
+                    out_y[lane] = particles->y[base + lane];
+                    out_z[lane] = particles->z[base + lane];
+                    out_dx[lane] = revert_xs[lane];
+                    out_dy[lane] = revert_ys[lane];
+                    out_dz[lane] = revert_zs[lane];
+                }
+            }
+        }
+
+        // Update particle state
+        for (uint32_t lane = 0; lane < WIDTH; ++lane) {
+            particles->x[base + lane] = out_x[lane];
+            particles->y[base + lane] = out_y[lane];
+            particles->z[base + lane] = out_z[lane];
+            particles->dir_x[base + lane] = out_dx[lane];
+            particles->dir_y[base + lane] = out_dy[lane];
+            particles->dir_z[base + lane] = out_dz[lane];
+        }
+    }
+    return block_end;
+}
+
+template<typename L, bool DIRECTION, int SAMPLES>
+static void fill_step_row(StepFunction *row) {
+    if (DIRECTION) {
+        row[0] = step_particles_direction<L, SAMPLES, 0>;
+        row[1] = step_particles_direction<L, SAMPLES, 1>;
+        row[2] = step_particles_direction<L, SAMPLES, 2>;
+        row[3] = step_particles_direction<L, SAMPLES, 3>;
+        row[4] = step_particles_direction<L, SAMPLES, 4>;
+        row[5] = step_particles_direction<L, SAMPLES, 5>;
+        row[6] = step_particles_direction<L, SAMPLES, 6>;
+        row[7] = step_particles_direction<L, SAMPLES, 7>;
+    } else {
+        row[0] = step_particles<L, SAMPLES, 0>;
+        row[1] = step_particles<L, SAMPLES, 1>;
+        row[2] = step_particles<L, SAMPLES, 2>;
+        row[3] = step_particles<L, SAMPLES, 3>;
+        row[4] = step_particles<L, SAMPLES, 4>;
+        row[5] = step_particles<L, SAMPLES, 5>;
+        row[6] = step_particles<L, SAMPLES, 6>;
+        row[7] = step_particles<L, SAMPLES, 7>;
+    }
+}
+
+// Instantiates all kernel specializations for lane type L, in order of sim_sample_counts.
+template<typename L>
+static void fill_step_table(StepTable *table) {
+    fill_step_row<L, false, 4>(table->functions[0][0]);
+    fill_step_row<L, false, 8>(table->functions[0][1]);
+    fill_step_row<L, false, 16>(table->functions[0][2]);
+    fill_step_row<L, false, 26>(table->functions[0][3]);
+    fill_step_row<L, true, 4>(table->functions[1][0]);
+    fill_step_row<L, true, 8>(table->functions[1][1]);
+    fill_step_row<L, true, 16>(table->functions[1][2]);
+    fill_step_row<L, true, 26>(table->functions[1][3]);
+}
@@ -0,0 +1,265 @@
+#pragma once
+
+// Lane types for the CPU simulation kernels. Every backend defines float vector F, int vector I and mask M
+// with the same set of operators and functions, so kernels can be written once as templates over Lanes.
+//
+// Translation unit including this file has to define exactly one of SIM_LANES_SCALAR, SIM_LANES_AVX2 or
+// SIM_LANES_AVX512. Each backend lives in its own namespace so code compiled for different instruction
+// sets never ends up merged by the linker.
+//
+// All operations are IEEE single precision ops without fused multiply-add, which means scalar and
+// vector backends produce bit-identical results. Compilers are allowed to contract mul+add into FMA,
+// which would break that, so it's explicitly disabled for code which follows.
+
+#include <stdint.h>
+#include <math.h>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#pragma fp_contract(off)
+#elif defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#if defined(SIM_LANES_SCALAR)
+
+namespace lanes_scalar {
+    struct F { float v; };
+    struct I { int32_t v; };
+    struct M { bool v; };
+
+    inline F operator+(F a, F b) { F r = { a.v + b.v }; return r; }
+    inline F operator-(F a, F b) { F r = { a.v - b.v }; return r; }
+    inline F operator*(F a, F b) { F r = { a.v * b.v }; return r; }
+    inline F operator/(F a, F b) { F r = { a.v / b.v }; return r; }
+    inline F operator-(F a) { F r = { -a.v }; return r; }
+    inline M operator<(F a, F b) { M r = { a.v < b.v }; return r; }
+    inline M operator>(F a, F b) { M r = { a.v > b.v }; return r; }
+    inline M operator<=(F a, F b) { M r = { a.v <= b.v }; return r; }
+    inline M operator>=(F a, F b) { M r = { a.v >= b.v }; return r; }
+    inline M operator==(F a, F b) { M r = { a.v == b.v }; return r; }
+    inline M operator!=(F a, F b) { M r = { a.v != b.v }; return r; }
+
+    inline I operator+(I a, I b) { I r = { int32_t(uint32_t(a.v) + uint32_t(b.v)) }; return r; }
+    inline I operator-(I a, I b) { I r = { int32_t(uint32_t(a.v) - uint32_t(b.v)) }; return r; }
+    inline I operator*(I a, I b) { I r = { int32_t(uint32_t(a.v) * uint32_t(b.v)) }; return r; }
+    inline I operator&(I a, I b) { I r = { a.v & b.v }; return r; }
+    inline I operator|(I a, I b) { I r = { a.v | b.v }; return r; }
+    inline I operator^(I a, I b) { I r = { a.v ^ b.v }; return r; }
+    inline I operator>>(I a, int n) { I r = { int32_t(uint32_t(a.v) >> n) }; return r; }
+    inline I operator<<(I a, int n) { I r = { int32_t(uint32_t(a.v) << n) }; return r; }
+    inline I operator>>(I a, I n) { I r = { int32_t(uint32_t(a.v) >> n.v) }; return r; }
+    inline M operator==(I a, I b) { M r = { a.v == b.v }; return r; }
+    inline M operator>(I a, I b) { M r = { a.v > b.v }; return r; }
+    inline M operator<(I a, I b) { M r = { a.v < b.v }; return r; }
+
+    inline M operator&(M a, M b) { M r = { a.v && b.v }; return r; }
+    inline M operator|(M a, M b) { M r = { a.v || b.v }; return r; }
+    inline M operator~(M a) { M r = { !a.v }; return r; }
+
+    struct Lanes {
+        typedef lanes_scalar::F F;
+        typedef lanes_scalar::I I;
+        typedef lanes_scalar::M M;
+        enum { WIDTH = 1 };
+
+        static F set(float v) { F r = { v }; return r; }
+        static I seti(int32_t v) { I r = { v }; return r; }
+        static I iota(int32_t base) { I r = { base }; return r; }
+        static F load(const float *p) { F r = { *p }; return r; }
+        static I loadi(const uint32_t *p) { I r = { int32_t(*p) }; return r; }
+        static void store(float *p, F v) { *p = v.v; }
+        static void storei(int32_t *p, I v) { *p = v.v; }
+
+        static F select(M m, F a, F b) { return m.v ? a : b; }
+        static I select(M m, I a, I b) { return m.v ? a : b; }
+        // Same NaN behaviour as SSE minps/maxps.
+        static F min(F a, F b) { return a.v < b.v ? a : b; }
+        static F max(F a, F b) { return a.v > b.v ? a : b; }
+        static F floor(F a) { F r = { floorf(a.v) }; return r; }
+        static F sqrt(F a) { F r = { sqrtf(a.v) }; return r; }
+        static F to_float(I a) { F r = { float(a.v) }; return r; }
+        static I truncate(F a) { I r = { int32_t(a.v) }; return r; }
+        static I as_int(F a) { I r; memcpy_bits(&r.v, &a.v); return r; }
+        static F as_float(I a) { F r; memcpy_bits(&r.v, &a.v); return r; }
+        static bool any(M m) { return m.v; }
+
+        // Masked off lanes return 0.
+        static F gather(const float *base, I index, M mask) { F r = { mask.v ? base[index.v] : 0.0f }; return r; }
+        static I gatheri(const uint32_t *base, I index, M mask) {
+            uint32_t v = 0;
+            if (mask.v) memcpy_bits(&v, base + index.v);
+            I r = { int32_t(v) };
+            return r;
+        }
+
+        template<typename A, typename B>
+        static void memcpy_bits(A *dst, const B *src) {
+            union { B b; A a; } u;
+            u.b = *src;
+            *dst = u.a;
+        }
+    };
+}
+
+#elif defined(SIM_LANES_AVX2)
+
+#include <immintrin.h>
+
+namespace lanes_avx2 {
+    struct F { __m256 v; };
+    struct I { __m256i v; };
+    struct M { __m256 v; };
+
+    inline F make(__m256 v) { F r = { v }; return r; }
+    inline I make(__m256i v) { I r = { v }; return r; }
+    inline M make_mask(__m256 v) { M r = { v }; return r; }
+    inline M make_mask(__m256i v) { M r = { _mm256_castsi256_ps(v) }; return r; }
+
+    inline F operator+(F a, F b) { return make(_mm256_add_ps(a.v, b.v)); }
+    inline F operator-(F a, F b) { return make(_mm256_sub_ps(a.v, b.v)); }
+    inline F operator*(F a, F b) { return make(_mm256_mul_ps(a.v, b.v)); }
+    inline F operator/(F a, F b) { return make(_mm256_div_ps(a.v, b.v)); }
+    inline F operator-(F a) { return make(_mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f))); }
+    inline M operator<(F a, F b) { return make_mask(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)); }
+    inline M operator>(F a, F b) { return make_mask(_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)); }
+    inline M operator<=(F a, F b) { return make_mask(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)); }
+    inline M operator>=(F a, F b) { return make_mask(_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)); }
+    inline M operator==(F a, F b) { return make_mask(_mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ)); }
+    inline M operator!=(F a, F b) { return make_mask(_mm256_cmp_ps(a.v, b.v, _CMP_NEQ_UQ)); }
+
+    inline I operator+(I a, I b) { return make(_mm256_add_epi32(a.v, b.v)); }
+    inline I operator-(I a, I b) { return make(_mm256_sub_epi32(a.v, b.v)); }
+    inline I operator*(I a, I b) { return make(_mm256_mullo_epi32(a.v, b.v)); }
+    inline I operator&(I a, I b) { return make(_mm256_and_si256(a.v, b.v)); }
+    inline I operator|(I a, I b) { return make(_mm256_or_si256(a.v, b.v)); }
+    inline I operator^(I a, I b) { return make(_mm256_xor_si256(a.v, b.v)); }
+    inline I operator>>(I a, int n) { return make(_mm256_srl_epi32(a.v, _mm_cvtsi32_si128(n))); }
+    inline I operator<<(I a, int n) { return make(_mm256_sll_epi32(a.v, _mm_cvtsi32_si128(n))); }
+    inline I operator>>(I a, I n) { return make(_mm256_srlv_epi32(a.v, n.v)); }
+    inline M operator==(I a, I b) { return make_mask(_mm256_cmpeq_epi32(a.v, b.v)); }
+    inline M operator>(I a, I b) { return make_mask(_mm256_cmpgt_epi32(a.v, b.v)); }
+    inline M operator<(I a, I b) { return make_mask(_mm256_cmpgt_epi32(b.v, a.v)); }
+
+    inline M operator&(M a, M b) { return make_mask(_mm256_and_ps(a.v, b.v)); }
+    inline M operator|(M a, M b) { return make_mask(_mm256_or_ps(a.v, b.v)); }
+    inline M operator~(M a) { return make_mask(_mm256_xor_ps(a.v, _mm256_castsi256_ps(_mm256_set1_epi32(-1)))); }
+
+    struct Lanes {
+        typedef lanes_avx2::F F;
+        typedef lanes_avx2::I I;
+        typedef lanes_avx2::M M;
+        enum { WIDTH = 8 };
+
+        static F set(float v) { return make(_mm256_set1_ps(v)); }
+        static I seti(int32_t v) { return make(_mm256_set1_epi32(v)); }
+        static I iota(int32_t base) { return make(_mm256_add_epi32(_mm256_set1_epi32(base), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))); }
+        static F load(const float *p) { return make(_mm256_loadu_ps(p)); }
+        static I loadi(const uint32_t *p) { return make(_mm256_loadu_si256((const __m256i *)p)); }
+        static void store(float *p, F v) { _mm256_storeu_ps(p, v.v); }
+        static void storei(int32_t *p, I v) { _mm256_storeu_si256((__m256i *)p, v.v); }
+
+        static F select(M m, F a, F b) { return make(_mm256_blendv_ps(b.v, a.v, m.v)); }
+        static I select(M m, I a, I b) {
+            return make(_mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(b.v), _mm256_castsi256_ps(a.v), m.v)));
+        }
+        static F min(F a, F b) { return make(_mm256_min_ps(a.v, b.v)); }
+        static F max(F a, F b) { return make(_mm256_max_ps(a.v, b.v)); }
+        static F floor(F a) { return make(_mm256_floor_ps(a.v)); }
+        static F sqrt(F a) { return make(_mm256_sqrt_ps(a.v)); }
+        static F to_float(I a) { return make(_mm256_cvtepi32_ps(a.v)); }
+        static I truncate(F a) { return make(_mm256_cvttps_epi32(a.v)); }
+        static I as_int(F a) { return make(_mm256_castps_si256(a.v)); }
+        static F as_float(I a) { return make(_mm256_castsi256_ps(a.v)); }
+        static bool any(M m) { return _mm256_movemask_ps(m.v) != 0; }
+
+        static F gather(const float *base, I index, M mask) {
+            return make(_mm256_mask_i32gather_ps(_mm256_setzero_ps(), base, index.v, mask.v, 4));
+        }
+        static I gatheri(const uint32_t *base, I index, M mask) {
+            return make(_mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int *)base, index.v, _mm256_castps_si256(mask.v), 4));
+        }
+    };
+}
+
+#elif defined(SIM_LANES_AVX512)
+
+#include <immintrin.h>
+
+namespace lanes_avx512 {
+    struct F { __m512 v; };
+    struct I { __m512i v; };
+    struct M { __mmask16 v; };
+
+    inline F make(__m512 v) { F r = { v }; return r; }
+    inline I make(__m512i v) { I r = { v }; return r; }
+    inline M make_mask(__mmask16 v) { M r = { v }; return r; }
+
+    inline F operator+(F a, F b) { return make(_mm512_add_ps(a.v, b.v)); }
+    inline F operator-(F a, F b) { return make(_mm512_sub_ps(a.v, b.v)); }
+    inline F operator*(F a, F b) { return make(_mm512_mul_ps(a.v, b.v)); }
+    inline F operator/(F a, F b) { return make(_mm512_div_ps(a.v, b.v)); }
+    inline F operator-(F a) { return make(_mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a.v), _mm512_set1_epi32(int32_t(0x80000000u))))); }
+    inline M operator<(F a, F b) { return make_mask(_mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ)); }
+    inline M operator>(F a, F b) { return make_mask(_mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ)); }
+    inline M operator<=(F a, F b) { return make_mask(_mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ)); }
+    inline M operator>=(F a, F b) { return make_mask(_mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ)); }
+    inline M operator==(F a, F b) { return make_mask(_mm512_cmp_ps_mask(a.v, b.v, _CMP_EQ_OQ)); }
+    inline M operator!=(F a, F b) { return make_mask(_mm512_cmp_ps_mask(a.v, b.v, _CMP_NEQ_UQ)); }
+
+    inline I operator+(I a, I b) { return make(_mm512_add_epi32(a.v, b.v)); }
+    inline I operator-(I a, I b) { return make(_mm512_sub_epi32(a.v, b.v)); }
+    inline I operator*(I a, I b) { return make(_mm512_mullo_epi32(a.v, b.v)); }
+    inline I operator&(I a, I b) { return make(_mm512_and_si512(a.v, b.v)); }
+    inline I operator|(I a, I b) { return make(_mm512_or_si512(a.v, b.v)); }
+    inline I operator^(I a, I b) { return make(_mm512_xor_si512(a.v, b.v)); }
+    inline I operator>>(I a, int n) { return make(_mm512_srl_epi32(a.v, _mm_cvtsi32_si128(n))); }
+    inline I operator<<(I a, int n) { return make(_mm512_sll_epi32(a.v, _mm_cvtsi32_si128(n))); }
+    inline I operator>>(I a, I n) { return make(_mm512_srlv_epi32(a.v, n.v)); }
+    inline M operator==(I a, I b) { return make_mask(_mm512_cmpeq_epi32_mask(a.v, b.v)); }
+    inline M operator>(I a, I b) { return make_mask(_mm512_cmpgt_epi32_mask(a.v, b.v)); }
+    inline M operator<(I a, I b) { return make_mask(_mm512_cmplt_epi32_mask(a.v, b.v)); }
+
+    inline M operator&(M a, M b) { return make_mask(__mmask16(a.v & b.v)); }
+    inline M operator|(M a, M b) { return make_mask(__mmask16(a.v | b.v)); }
+    inline M operator~(M a) { return make_mask(__mmask16(~a.v)); }
+
+    struct Lanes {
+        typedef lanes_avx512::F F;
+        typedef lanes_avx512::I I;
+        typedef lanes_avx512::M M;
+        enum { WIDTH = 16 };
+
+        static F set(float v) { return make(_mm512_set1_ps(v)); }
+        static I seti(int32_t v) { return make(_mm512_set1_epi32(v)); }
+        static I iota(int32_t base) {
+            return make(_mm512_add_epi32(_mm512_set1_epi32(base), _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)));
+        }
+        static F load(const float *p) { return make(_mm512_loadu_ps(p)); }
+        static I loadi(const uint32_t *p) { return make(_mm512_loadu_si512((const void *)p)); }
+        static void store(float *p, F v) { _mm512_storeu_ps(p, v.v); }
+        static void storei(int32_t *p, I v) { _mm512_storeu_si512((void *)p, v.v); }
+
+        static F select(M m, F a, F b) { return make(_mm512_mask_blend_ps(m.v, b.v, a.v)); }
+        static I select(M m, I a, I b) { return make(_mm512_mask_blend_epi32(m.v, b.v, a.v)); }
+        static F min(F a, F b) { return make(_mm512_min_ps(a.v, b.v)); }
+        static F max(F a, F b) { return make(_mm512_max_ps(a.v, b.v)); }
+        static F floor(F a) { return make(_mm512_roundscale_ps(a.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)); }
+        static F sqrt(F a) { return make(_mm512_sqrt_ps(a.v)); }
+        static F to_float(I a) { return make(_mm512_cvtepi32_ps(a.v)); }
+        static I truncate(F a) { return make(_mm512_cvttps_epi32(a.v)); }
+        static I as_int(F a) { return make(_mm512_castps_si512(a.v)); }
+        static F as_float(I a) { return make(_mm512_castsi512_ps(a.v)); }
+        static bool any(M m) { return m.v != 0; }
+
+        static F gather(const float *base, I index, M mask) {
+            return make(_mm512_mask_i32gather_ps(_mm512_setzero_ps(), mask.v, index.v, base, 4));
+        }
+        static I gatheri(const uint32_t *base, I index, M mask) {
+            return make(_mm512_mask_i32gather_epi32(_mm512_setzero_si512(), mask.v, index.v, base, 4));
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,165 @@
+// Particle pool: growing particle arrays, emitters and culling. Culled particles are removed by a stable
+// parallel compaction, every chunk of particles counts its survivors, prefix sum of the counts gives each
+// chunk the index its survivors move to. Particle arrays never shrink, so a pool which oscillates between
+// sizes doesn't reallocate.
+#include "sim.h"
+#include "sim_trail.h"
+#include "thread_pool.h"
+#include "profiler.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Number of particles culled by a single thread pool task.
+#define CULL_CHUNK_SIZE (16 * 1024)
+
+static inline uint32_t wang_hash(uint32_t seed) {
+    seed = (seed ^ 61) ^ (seed >> 16);
+    seed *= 9;
+    seed = seed ^ (seed >> 4);
+    seed *= 0x27d4eb2d;
+    seed = seed ^ (seed >> 15);
+    return seed;
+}
+
+void sim::reserve_particles(Particles *particles, uint32_t capacity) {
+    if (capacity <= particles->capacity) return;
+    uint32_t grown = particles->capacity + particles->capacity / 4 + 1024;
+    capacity = capacity > grown ? capacity : grown;
+    float **arrays[8] = { &particles->x, &particles->y, &particles->z, &particles->phi, &particles->theta,
+                          &particles->dir_x, &particles->dir_y, &particles->dir_z };
+    uint32_t array_count = particles->heading == SimHeading::DIRECTION ? 8 : 5;
+    for (uint32_t i = 0; i < array_count; ++i) {
+        *arrays[i] = (float *)realloc(*arrays[i], sizeof(float) * capacity);
+    }
+    particles->pair = (uint32_t *)realloc(particles->pair, sizeof(uint32_t) * capacity);
+    if (particles->birth) {
+        particles->birth = (uint32_t *)realloc(particles->birth, sizeof(uint32_t) * capacity);
+    }
+    particles->capacity = capacity;
+}
+
+// Moves kept particles of `values` to their new indices, `remap` holds SIM_NO_PAIR for removed particles.
+static void compact(uint32_t *values, uint32_t *tmp, uint32_t *remap, uint32_t count, uint32_t kept, ThreadPool *pool) {
+    thread_pool::run(pool, count, CULL_CHUNK_SIZE, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t i = begin; i < end; ++i) {
+            if (remap[i] != SIM_NO_PAIR) tmp[remap[i]] = values[i];
+        }
+    });
+    memcpy(values, tmp, sizeof(uint32_t) * kept);
+}
+
+uint32_t sim::cull_particles(Particles *particles, World *world, ParticlePool *particle_pool, uint32_t step, ThreadPool *pool) {
+    PROFILE_SCOPE("cull");
+    uint32_t count = particles->count;
+    bool lifetime = particle_pool->lifetime > 0 && particles->birth;
+    float density_limit = particle_pool->density_limit;
+    if (count == 0 || (!lifetime && density_limit <= 0.0f)) return 0;
+
+    // New index of every particle, chunk local at first.
+    uint32_t chunk_count = (count + CULL_CHUNK_SIZE - 1) / CULL_CHUNK_SIZE;
+    uint32_t *remap = (uint32_t *)malloc(sizeof(uint32_t) * count);
+    uint32_t *chunk_offsets = (uint32_t *)malloc(sizeof(uint32_t) * (chunk_count + 1));
+    uint32_t step_hash = wang_hash(step + particle_pool->seed);
+    thread_pool::run(pool, chunk_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t chunk = begin; chunk < end; ++chunk) {
+            uint32_t first = chunk * CULL_CHUNK_SIZE;
+            uint32_t last = first + CULL_CHUNK_SIZE < count ? first + CULL_CHUNK_SIZE : count;
+            uint32_t kept = 0;
+            for (uint32_t i = first; i < last; ++i) {
+                bool keep = !lifetime || step - particles->birth[i] < particle_pool->lifetime;
+                uint32_t x = uint32_t(particles->x[i]), y = uint32_t(particles->y[i]), z = uint32_t(particles->z[i]);
+                if (keep && density_limit > 0.0f && x < world->width && y < world->height && z < world->depth) {
+                    float trail = trail::load(world, &world->trail, x, y, z);
+                    float random = float(wang_hash(i ^ step_hash) >> 8) / float(1 << 24);
+                    keep = trail <= density_limit || random >= 1.0f - density_limit / trail;
+                }
+                remap[i] = keep ? kept++ : SIM_NO_PAIR;
+            }
+            chunk_offsets[chunk + 1] = kept;
+        }
+    });
+    chunk_offsets[0] = 0;
+    for (uint32_t chunk = 0; chunk < chunk_count; ++chunk) {
+        chunk_offsets[chunk + 1] += chunk_offsets[chunk];
+    }
+    uint32_t kept = chunk_offsets[chunk_count];
+    if (kept == count) {
+        free(chunk_offsets);
+        free(remap);
+        return 0;
+    }
+    thread_pool::run(pool, chunk_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t chunk = begin; chunk < end; ++chunk) {
+            uint32_t first = chunk * CULL_CHUNK_SIZE;
+            uint32_t last = first + CULL_CHUNK_SIZE < count ? first + CULL_CHUNK_SIZE : count;
+            for (uint32_t i = first; i < last; ++i) {
+                if (remap[i] != SIM_NO_PAIR) remap[i] += chunk_offsets[chunk];
+            }
+        }
+    });
+
+    // Float arrays are moved as raw 32 bit words.
+    uint32_t *tmp = (uint32_t *)malloc(sizeof(uint32_t) * kept);
+    float *arrays[8] = { particles->x, particles->y, particles->z, particles->phi, particles->theta,
+                         particles->dir_x, particles->dir_y, particles->dir_z };
+    uint32_t array_count = particles->heading == SimHeading::DIRECTION ? 8 : 5;
+    for (uint32_t a = 0; a < array_count; ++a) {
+        compact((uint32_t *)arrays[a], tmp, remap, count, kept, pool);
+    }
+    if (particles->birth) {
+        compact(particles->birth, tmp, remap, count, kept, pool);
+    }
+
+    // Pairs point to particle indices, pairs of removed particles become SIM_NO_PAIR through remap.
+    thread_pool::run(pool, count, CULL_CHUNK_SIZE, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t i = begin; i < end; ++i) {
+            uint32_t pair = particles->pair[i];
+            if (remap[i] != SIM_NO_PAIR) tmp[remap[i]] = pair < count ? remap[pair] : pair;
+        }
+    });
+    memcpy(particles->pair, tmp, sizeof(uint32_t) * kept);
+    particles->count = kept;
+
+    free(tmp);
+    free(chunk_offsets);
+    free(remap);
+    return count - kept;
+}
+
+void sim::update_pool(Particles *particles, World *world, ParticlePool *particle_pool, uint32_t step, ThreadPool *pool) {
+    PROFILE_SCOPE("update_pool");
+    // Particles which existed before lifetime was set are born now.
+    if (particle_pool->lifetime > 0 && !particles->birth) {
+        particles->birth = (uint32_t *)malloc(sizeof(uint32_t) * (particles->capacity > 0 ? particles->capacity : 1));
+        for (uint32_t i = 0; i < particles->count; ++i) {
+            particles->birth[i] = step;
+        }
+    }
+    sim::cull_particles(particles, world, particle_pool, step, pool);
+
+    for (uint32_t e = 0; e < particle_pool->emitter_count; ++e) {
+        ParticleEmitter *emitter = &particle_pool->emitters[e];
+        emitter->carry += emitter->rate;
+        uint32_t count = uint32_t(emitter->carry);
+        emitter->carry -= float(count);
+        if (particle_pool->max_count > 0) {
+            uint32_t room = particle_pool->max_count > particles->count ? particle_pool->max_count - particles->count : 0;
+            count = count < room ? count : room;
+        }
+        if (count == 0) continue;
+        uint32_t seed = wang_hash(particle_pool->seed + step * SIM_MAX_EMITTERS + e);
+        sim::add_particles(particles, emitter->x, emitter->y, emitter->z, emitter->radius, count, step, seed);
+    }
+}
+
+void sim::resize_particles(Particles *particles, World *world, uint32_t count, float spawn_radius, uint32_t step, uint32_t seed) {
+    if (count > particles->count) {
+        sim::add_particles(particles, world->width / 2.0f, world->height / 2.0f, world->depth / 2.0f, spawn_radius,
+                           count - particles->count, step, seed);
+        return;
+    }
+    particles->count = count;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (particles->pair[i] >= count) particles->pair[i] = SIM_NO_PAIR;
+    }
+}
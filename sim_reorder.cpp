@@ -0,0 +1,196 @@
+// Reordering of particles by Morton code of their voxel. Particles spawn in random order and keep their
+// index forever, so consecutive particles touch trail voxels far away from each other. After sorting,
+// neighbouring particles sense, deposit and check collisions in neighbouring cache lines.
+#include "sim.h"
+#include "sim_trail.h"
+#include "thread_pool.h"
+#include "profiler.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+
+// Size of simulated cache used for locality measurement, roughly size of L2.
+#define LOCALITY_CACHE_LINES (32 * 1024)
+#define CACHE_LINE_SIZE 64
+
+// Spreads lower 21 bits of v so there are two zero bits between each of them.
+static inline uint64_t spread_bits(uint64_t v) {
+    v &= 0x1FFFFF;
+    v = (v | (v << 32)) & 0x1F00000000FFFFull;
+    v = (v | (v << 16)) & 0x1F0000FF0000FFull;
+    v = (v | (v << 8)) & 0x100F00F00F00F00Full;
+    v = (v | (v << 4)) & 0x10C30C30C30C30C3ull;
+    v = (v | (v << 2)) & 0x1249249249249249ull;
+    return v;
+}
+
+static inline uint64_t morton_code(uint32_t x, uint32_t y, uint32_t z) {
+    return spread_bits(x) | (spread_bits(y) << 1) | (spread_bits(z) << 2);
+}
+
+static inline uint32_t to_voxel(float v, uint32_t size) {
+    uint32_t result = uint32_t(v);
+    return result < size ? result : size - 1;
+}
+
+// Stable parallel LSD radix sort of keys with their indices. Each pass every thread histograms its own
+// block of input, prefix sum over (digit, thread) gives every thread its output offsets, so scatter
+// needs no synchronization.
+static void radix_sort(uint64_t *keys, uint32_t *indices, uint64_t *keys_tmp, uint32_t *indices_tmp,
+                       uint32_t count, uint32_t key_bits, ThreadPool *pool) {
+    uint32_t thread_count = thread_pool::get_thread_count(pool);
+    uint32_t block_size = (count + thread_count - 1) / thread_count;
+    uint32_t block_count = (count + block_size - 1) / block_size;
+    uint32_t *histograms = (uint32_t *)malloc(sizeof(uint32_t) * RADIX_SIZE * block_count);
+    uint64_t *keys_out = keys;
+    uint32_t *indices_out = indices;
+
+    for (uint32_t shift = 0; shift < key_bits; shift += RADIX_BITS) {
+        thread_pool::run(pool, block_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+            for (uint32_t block = begin; block < end; ++block) {
+                uint32_t *histogram = histograms + block * RADIX_SIZE;
+                memset(histogram, 0, sizeof(uint32_t) * RADIX_SIZE);
+                uint32_t first = block * block_size;
+                uint32_t last = first + block_size < count ? first + block_size : count;
+                for (uint32_t i = first; i < last; ++i) {
+                    histogram[(keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+                }
+            }
+        });
+
+        // Exclusive prefix sum, digit major so output is stable.
+        uint32_t offset = 0;
+        for (uint32_t digit = 0; digit < RADIX_SIZE; ++digit) {
+            for (uint32_t block = 0; block < block_count; ++block) {
+                uint32_t value = histograms[block * RADIX_SIZE + digit];
+                histograms[block * RADIX_SIZE + digit] = offset;
+                offset += value;
+            }
+        }
+
+        thread_pool::run(pool, block_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+            for (uint32_t block = begin; block < end; ++block) {
+                uint32_t *offsets = histograms + block * RADIX_SIZE;
+                uint32_t first = block * block_size;
+                uint32_t last = first + block_size < count ? first + block_size : count;
+                for (uint32_t i = first; i < last; ++i) {
+                    uint32_t destination = offsets[(keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+                    keys_tmp[destination] = keys[i];
+                    indices_tmp[destination] = indices[i];
+                }
+            }
+        });
+
+        uint64_t *swap_keys = keys; keys = keys_tmp; keys_tmp = swap_keys;
+        uint32_t *swap_indices = indices; indices = indices_tmp; indices_tmp = swap_indices;
+    }
+
+    // Odd number of passes leaves result in temporary buffers.
+    if (keys != keys_out) {
+        memcpy(keys_out, keys, sizeof(uint64_t) * count);
+        memcpy(indices_out, indices, sizeof(uint32_t) * count);
+    }
+    free(histograms);
+}
+
+static uint32_t bit_count(uint32_t v) {
+    uint32_t bits = 0;
+    while ((1u << bits) < v && bits < 21) bits++;
+    return bits;
+}
+
+static void permute(float *values, float *tmp, uint32_t *order, uint32_t count, ThreadPool *pool) {
+    thread_pool::run(pool, count, 16 * 1024, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t i = begin; i < end; ++i) {
+            tmp[i] = values[order[i]];
+        }
+    });
+    memcpy(values, tmp, sizeof(float) * count);
+}
+
+void sim::sort_particles(World *world, Particles *particles, ThreadPool *pool) {
+    PROFILE_SCOPE("sort_particles");
+    uint32_t count = particles->count;
+    if (count < 2) return;
+
+    uint64_t *keys = (uint64_t *)malloc(sizeof(uint64_t) * count * 2);
+    uint32_t *order = (uint32_t *)malloc(sizeof(uint32_t) * count * 3);
+    uint32_t *order_tmp = order + count;
+    uint32_t *inverse = order + count * 2;
+
+    thread_pool::run(pool, count, 16 * 1024, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t i = begin; i < end; ++i) {
+            uint32_t x = to_voxel(particles->x[i], world->width);
+            uint32_t y = to_voxel(particles->y[i], world->height);
+            uint32_t z = to_voxel(particles->z[i], world->depth);
+            keys[i] = morton_code(x, y, z);
+            order[i] = i;
+        }
+    });
+
+    uint32_t max_size = world->width > world->height ? world->width : world->height;
+    max_size = max_size > world->depth ? max_size : world->depth;
+    uint32_t key_bits = bit_count(max_size) * 3;
+    radix_sort(keys, order, keys + count, order_tmp, count, key_bits, pool);
+
+    float *tmp = (float *)malloc(sizeof(float) * count);
+    permute(particles->x, tmp, order, count, pool);
+    permute(particles->y, tmp, order, count, pool);
+    permute(particles->z, tmp, order, count, pool);
+    permute(particles->phi, tmp, order, count, pool);
+    permute(particles->theta, tmp, order, count, pool);
+    if (particles->heading == SimHeading::DIRECTION) {
+        permute(particles->dir_x, tmp, order, count, pool);
+        permute(particles->dir_y, tmp, order, count, pool);
+        permute(particles->dir_z, tmp, order, count, pool);
+    }
+
+    // Pairs point to particle indices, which changed, so they have to be remapped.
+    thread_pool::run(pool, count, 16 * 1024, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t i = begin; i < end; ++i) {
+            inverse[order[i]] = i;
+        }
+    });
+    uint32_t *pair_tmp = (uint32_t *)tmp;
+    thread_pool::run(pool, count, 16 * 1024, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t i = begin; i < end; ++i) {
+            uint32_t pair = particles->pair[order[i]];
+            pair_tmp[i] = pair < count ? inverse[pair] : pair;
+        }
+    });
+    memcpy(particles->pair, pair_tmp, sizeof(uint32_t) * count);
+    if (particles->birth) {
+        thread_pool::run(pool, count, 16 * 1024, [&](uint32_t begin, uint32_t end, uint32_t) {
+            for (uint32_t i = begin; i < end; ++i) {
+                pair_tmp[i] = particles->birth[order[i]];
+            }
+        });
+        memcpy(particles->birth, pair_tmp, sizeof(uint32_t) * count);
+    }
+
+    free(tmp);
+    free(keys);
+    free(order);
+}
+
+float sim::measure_locality(World *world, Particles *particles) {
+    // Direct mapped cache model, tags are cache line indices + 1 so zero means empty.
+    uint64_t *tags = (uint64_t *)calloc(LOCALITY_CACHE_LINES, sizeof(uint64_t));
+    uint64_t misses = 0;
+    for (uint32_t i = 0; i < particles->count; ++i) {
+        uint32_t x = to_voxel(particles->x[i], world->width);
+        uint32_t y = to_voxel(particles->y[i], world->height);
+        uint32_t z = to_voxel(particles->z[i], world->depth);
+        uint64_t voxel = (uint64_t(z) * world->height + y) * world->width + x;
+        uint64_t line = voxel * trail::get_voxel_size(world->trail_format) / CACHE_LINE_SIZE + 1;
+        uint64_t *slot = tags + (line * 0x9E3779B97F4A7C15ull >> 40) % LOCALITY_CACHE_LINES;
+        if (*slot != line) {
+            misses++;
+            *slot = line;
+        }
+    }
+    free(tags);
+    return particles->count ? float(double(misses) / particles->count) : 0.0f;
+}
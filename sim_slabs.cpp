@@ -0,0 +1,825 @@
+#include "sim_slabs.h"
+#include "sim_trail.h"
+#include "thread_pool.h"
+#include "profiler.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Number of particles copied by a single thread pool task.
+#define SLAB_PARTICLE_CHUNK_SIZE 16384
+// Particle state arrays: x, y, z, phi, theta, plus dir_x, dir_y, dir_z with SimHeading::DIRECTION.
+#define SLAB_MAX_ARRAYS 8
+
+#define SLAB_SHARED_MAGIC "PHYSSLAB"
+#define SLAB_SHARED_VERSION 1
+// Sections of the shared mapping start at cache lines, so processes writing different sections don't share lines.
+#define SLAB_SHARED_ALIGNMENT 64
+// How long processes wait for the mapping to appear and for all processes to join, in milliseconds.
+#define SLAB_JOIN_TIMEOUT 60000
+#define SLAB_NAME_LENGTH 256
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "Processes synchronize through atomics in shared memory, they have to be lock free");
+
+// Start of the shared mapping. Everything is written by rank 0 before `ready` is set, except for the atomics and
+// counts, which are written before a barrier and read after it.
+struct SlabSharedHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t slab_count;
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+    uint32_t halo;
+    uint32_t trail_format;
+    uint32_t particle_capacity;
+    std::atomic<uint32_t> ready;
+    std::atomic<uint32_t> joined;
+    // Processes at the current barrier and number of barriers all processes passed.
+    std::atomic<uint32_t> arrived;
+    std::atomic<uint32_t> generation;
+    // Set by a process which failed or left, processes waiting at a barrier stop waiting.
+    std::atomic<uint32_t> stopped;
+    uint32_t migrant_counts[SLAB_MAX_COUNT];
+    uint32_t particle_counts[SLAB_MAX_COUNT];
+};
+
+// Shared mapping of a SlabProcess. Sections other than the header are Worlds with only the trail and brick
+// arrays set, pointing into the mapping, see get_view.
+struct SlabShared {
+    uint8_t *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+    char name[SLAB_NAME_LENGTH];
+    SlabSharedHeader *header;
+    // First `halo` owned slices of every slab for the slab below, last ones for the slab above.
+    World bottom_edges[SLAB_MAX_COUNT];
+    World top_edges[SLAB_MAX_COUNT];
+    // Outboxes of all slabs in rank order, particle_capacity particles of SLAB_MAX_ARRAYS floats.
+    float *migrants;
+    // Owned slices of all slabs and their particles, SLAB_MAX_ARRAYS arrays of particle_capacity floats.
+    World gathered;
+    float *gathered_particles;
+};
+
+static uint32_t get_arrays(Particles *particles, float **arrays) {
+    arrays[0] = particles->x;
+    arrays[1] = particles->y;
+    arrays[2] = particles->z;
+    arrays[3] = particles->phi;
+    arrays[4] = particles->theta;
+    if (particles->heading != SimHeading::DIRECTION) return 5;
+    arrays[5] = particles->dir_x;
+    arrays[6] = particles->dir_y;
+    arrays[7] = particles->dir_z;
+    return 8;
+}
+
+// Global z of local slice 0.
+static inline uint32_t get_origin(Slab *slab, SlabWorld *world) {
+    return slab->z_begin > world->halo ? slab->z_begin - world->halo : 0;
+}
+
+static inline uint32_t find_slab(SlabWorld *world, float z) {
+    uint32_t slice = uint32_t(z);
+    for (uint32_t s = 0; s + 1 < world->slab_count; ++s) {
+        if (slice < world->slabs[s].z_end) return s;
+    }
+    return world->slab_count - 1;
+}
+
+// Runs function(slab) for all slabs at once, every slab on its own thread of world->pool.
+template<typename F>
+static void run_slabs(SlabWorld *world, F &&function) {
+    thread_pool::run(world->pool, world->slab_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t s = begin; s < end; ++s) {
+            function(&world->slabs[s]);
+        }
+    });
+}
+
+// Copies `count` slices with their brick ranges and brick maxima and activates bricks active in src. Slices have
+// to start at brick layers and end at a brick layer or world end.
+static void copy_slices(World *dst, uint32_t dst_z, World *src, uint32_t src_z, uint32_t count) {
+    size_t slice_size = size_t(src->width) * src->height * trail::get_voxel_size(src->trail_format);
+    memcpy((uint8_t *)dst->trail.voxels + slice_size * dst_z, (uint8_t *)src->trail.voxels + slice_size * src_z, slice_size * count);
+
+    uint32_t layer_size = src->brick_width * src->brick_height;
+    uint32_t dst_layer = dst_z / SIM_BRICK_SIZE, src_layer = src_z / SIM_BRICK_SIZE;
+    uint32_t layer_count = (count + SIM_BRICK_SIZE - 1) / SIM_BRICK_SIZE;
+    if (src->trail_format == SimTrailFormat::UNORM8) {
+        size_t range_size = sizeof(float) * layer_size * layer_count;
+        memcpy(dst->trail.brick_offset + layer_size * dst_layer, src->trail.brick_offset + layer_size * src_layer, range_size);
+        memcpy(dst->trail.brick_scale + layer_size * dst_layer, src->trail.brick_scale + layer_size * src_layer, range_size);
+    }
+    memcpy(dst->brick_max + layer_size * dst_layer, src->brick_max + layer_size * src_layer, sizeof(float) * layer_size * layer_count);
+    // Bricks active in dst but not in src now hold zeros, decay retires them.
+    for (uint32_t i = 0; i < layer_size * layer_count; ++i) {
+        uint32_t brick = layer_size * dst_layer + i;
+        if (src->brick_flags[layer_size * src_layer + i] && !dst->brick_flags[brick]) {
+            dst->brick_flags[brick] = 1;
+            dst->active_bricks[dst->active_brick_count++] = brick;
+        }
+    }
+}
+
+// Sets halo and slice ranges and nodes of slab_count slabs, fewer if `reduce` is set and the world is too thin.
+// Returns false if it is too thin for slab_count slabs and `reduce` isn't set.
+static bool plan_slabs(SlabWorld *world, uint32_t width, uint32_t height, uint32_t depth, SimTrailFormat trail_format,
+                       uint32_t slab_count, bool reduce, Config *config) {
+    *world = {};
+    world->width = width;
+    world->height = height;
+    world->depth = depth;
+    world->trail_format = trail_format;
+
+    // Sensing reaches sense_distance slices into halo and decay leaves the outermost halo slice wrong. Particles
+    // which cross the world end show up at the other end of an end slab's world, up to a step away from it,
+    // which has to be told apart from particles moving into halo by less than half of it.
+    float step = config->move_distance * fabsf(config->move_sense_offset);
+    float reach = fmaxf(config->sense_distance + 2.0f, 2.0f * step + 1.0f);
+    world->halo = (uint32_t(ceilf(reach)) + SIM_BRICK_SIZE - 1) / SIM_BRICK_SIZE * SIM_BRICK_SIZE;
+
+    // Slabs own whole brick layers and have to be at least as thick as halo, so halo comes from one neighbour.
+    uint32_t layers = (depth + SIM_BRICK_SIZE - 1) / SIM_BRICK_SIZE;
+    uint32_t max_slabs = depth / world->halo;
+    if (max_slabs > SLAB_MAX_COUNT) max_slabs = SLAB_MAX_COUNT;
+    if (max_slabs == 0) max_slabs = 1;
+    if (slab_count > max_slabs && !reduce) return false;
+    if (slab_count > max_slabs) slab_count = max_slabs;
+    if (slab_count == 0) slab_count = 1;
+    world->slab_count = slab_count;
+
+    uint32_t node_count = thread_pool::get_node_count();
+    for (uint32_t s = 0; s < slab_count; ++s) {
+        Slab *slab = &world->slabs[s];
+        slab->z_begin = layers * s / slab_count * SIM_BRICK_SIZE;
+        slab->z_end = s + 1 == slab_count ? depth : layers * (s + 1) / slab_count * SIM_BRICK_SIZE;
+        slab->node = s * node_count / slab_count;
+    }
+    return true;
+}
+
+// Allocates world of the slab and its thread pool pinned to the slab's node. Returns false if the world
+// couldn't be allocated.
+static bool allocate_slab(SlabWorld *world, Slab *slab, SimDecayBuffer decay_buffer, uint32_t threads_per_slab) {
+    if (threads_per_slab == 0) {
+        uint32_t hardware_threads = std::thread::hardware_concurrency();
+        threads_per_slab = hardware_threads > world->slab_count ? hardware_threads / world->slab_count : 1;
+    }
+    slab->pool = thread_pool::get_on_node(threads_per_slab, slab->node);
+
+    // End slabs have no halo on the world end side, so trail there is zero just like outside of the world.
+    uint32_t z0 = get_origin(slab, world);
+    uint32_t z1 = slab->z_end + world->halo < world->depth ? slab->z_end + world->halo : world->depth;
+    slab->world = sim::get_world(world->width, world->height, z1 - z0, world->trail_format, decay_buffer);
+    slab->world.center_z = float(world->depth) * 0.5f - float(z0);
+    slab->particles.heading = SimHeading::ANGLES;
+    return slab->world.trail.voxels && slab->world.occupancy;
+}
+
+SlabWorld slabs::get_world(uint32_t width, uint32_t height, uint32_t depth, SimTrailFormat trail_format,
+                           SimDecayBuffer decay_buffer, uint32_t slab_count, uint32_t threads_per_slab, Config *config) {
+    SlabWorld world;
+    plan_slabs(&world, width, height, depth, trail_format, slab_count, true, config);
+    world.pool = thread_pool::get(world.slab_count);
+
+    bool allocated = true;
+    for (uint32_t s = 0; s < world.slab_count; ++s) {
+        allocated = allocate_slab(&world, &world.slabs[s], decay_buffer, threads_per_slab) && allocated;
+    }
+    if (!allocated) {
+        slabs::release(&world);
+        return world;
+    }
+    // Trail pages are touched first by threads of the slab's node.
+    run_slabs(&world, [&](Slab *slab) {
+        sim::clear(&slab->world, slab->pool);
+    });
+    return world;
+}
+
+void slabs::release(SlabWorld *world) {
+    for (uint32_t s = 0; s < world->slab_count; ++s) {
+        Slab *slab = &world->slabs[s];
+        sim::release(&slab->world);
+        sim::release(&slab->particles);
+        free(slab->outbox);
+        thread_pool::release(slab->pool);
+    }
+    thread_pool::release(world->pool);
+    *world = {};
+}
+
+// Counts particles of every slab, owners get the slab of every particle.
+static void find_owners(SlabWorld *world, Particles *particles, uint32_t *owners, uint32_t *counts) {
+    for (uint32_t i = 0; i < particles->count; ++i) {
+        owners[i] = find_slab(world, particles->z[i]);
+        counts[owners[i]]++;
+    }
+}
+
+// Zeroes trail of the slab and copies the `count` particles it owns into its particles.
+static void take_particles(SlabWorld *world, Slab *slab, Particles *particles, const uint32_t *owners, uint32_t count) {
+    uint32_t s = uint32_t(slab - world->slabs);
+    sim::clear(&slab->world, slab->pool);
+    if (slab->particles.heading != particles->heading) {
+        sim::release(&slab->particles);
+        slab->particles.heading = particles->heading;
+    }
+    sim::reserve_particles(&slab->particles, count);
+    slab->particles.count = count;
+
+    // Indices are gathered on slab's thread, copying runs on the slab's pool, so particle pages are
+    // touched first on its node.
+    uint32_t *indices = (uint32_t *)malloc(sizeof(uint32_t) * (count + 1));
+    uint32_t index_count = 0;
+    for (uint32_t i = 0; i < particles->count; ++i) {
+        if (owners[i] == s) indices[index_count++] = i;
+    }
+    float *src[SLAB_MAX_ARRAYS];
+    uint32_t array_count = get_arrays(particles, src);
+    float *dst[SLAB_MAX_ARRAYS];
+    get_arrays(&slab->particles, dst);
+    float offset = float(get_origin(slab, world));
+    thread_pool::run(slab->pool, index_count, SLAB_PARTICLE_CHUNK_SIZE, [&](uint32_t begin, uint32_t end, uint32_t) {
+        for (uint32_t a = 0; a < array_count; ++a) {
+            for (uint32_t i = begin; i < end; ++i) {
+                dst[a][i] = src[a][indices[i]];
+            }
+        }
+        for (uint32_t i = begin; i < end; ++i) {
+            slab->particles.z[i] -= offset;
+            slab->particles.pair[i] = SIM_NO_PAIR;
+        }
+    });
+    free(indices);
+}
+
+void slabs::set_particles(SlabWorld *world, Particles *particles) {
+    uint32_t *owners = (uint32_t *)malloc(sizeof(uint32_t) * particles->count);
+    uint32_t counts[SLAB_MAX_COUNT] = {};
+    find_owners(world, particles, owners, counts);
+    run_slabs(world, [&](Slab *slab) {
+        take_particles(world, slab, particles, owners, counts[slab - world->slabs]);
+    });
+    free(owners);
+}
+
+void slabs::get_particles(SlabWorld *world, Particles *particles) {
+    float *dst[SLAB_MAX_ARRAYS];
+    uint32_t array_count = get_arrays(particles, dst);
+    uint32_t offset = 0;
+    for (uint32_t s = 0; s < world->slab_count; ++s) {
+        Slab *slab = &world->slabs[s];
+        float *src[SLAB_MAX_ARRAYS];
+        get_arrays(&slab->particles, src);
+        uint32_t count = slab->particles.count;
+        for (uint32_t a = 0; a < array_count; ++a) {
+            memcpy(dst[a] + offset, src[a], sizeof(float) * count);
+        }
+        float z0 = float(get_origin(slab, world));
+        for (uint32_t i = 0; i < count; ++i) {
+            particles->z[offset + i] += z0;
+            particles->pair[offset + i] = SIM_NO_PAIR;
+        }
+        offset += count;
+    }
+    particles->count = offset;
+}
+
+void slabs::get_trail(SlabWorld *world, World *out) {
+    sim::clear(out, world->pool);
+    for (uint32_t s = 0; s < world->slab_count; ++s) {
+        Slab *slab = &world->slabs[s];
+        copy_slices(out, slab->z_begin, &slab->world, slab->z_begin - get_origin(slab, world), slab->z_end - slab->z_begin);
+    }
+}
+
+uint32_t slabs::get_particle_count(SlabWorld *world) {
+    uint32_t count = 0;
+    for (uint32_t s = 0; s < world->slab_count; ++s) {
+        count += world->slabs[s].particles.count;
+    }
+    return count;
+}
+
+// Moves particles which left owned slices of the slab into its outbox, in global coordinates. Particles staying
+// in the slab keep their order and exact position.
+static void collect_migrants(SlabWorld *world, Slab *slab) {
+    float depth = float(world->depth);
+    uint32_t half_halo = world->halo / 2;
+    uint32_t s = uint32_t(slab - world->slabs);
+    float *arrays[SLAB_MAX_ARRAYS];
+    uint32_t array_count = get_arrays(&slab->particles, arrays);
+    uint32_t z0 = get_origin(slab, world);
+    uint32_t local_depth = slab->world.depth;
+    bool halo_below = z0 < slab->z_begin;
+    bool halo_above = z0 + local_depth > slab->z_end;
+    float owned_begin = float(slab->z_begin - z0), owned_end = float(slab->z_end - z0);
+
+    slab->outbox_count = 0;
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < slab->particles.count; ++i) {
+        float z = arrays[2][i];
+        if (z >= owned_begin && z < owned_end) {
+            for (uint32_t a = 0; a < array_count; ++a) arrays[a][kept] = arrays[a][i];
+            kept++;
+            continue;
+        }
+        // Step wraps particles around the slab's world, ones which crossed the world end at the side
+        // without halo arrive within half of halo from the other end.
+        float global_z = z + float(z0);
+        if (!halo_below && halo_above && z >= float(local_depth - half_halo)) global_z -= float(local_depth);
+        if (!halo_above && halo_below && z < float(half_halo)) global_z += float(local_depth);
+        global_z = global_z - depth * floorf(global_z / depth);
+
+        if (slab->outbox_count == slab->outbox_capacity) {
+            slab->outbox_capacity = slab->outbox_capacity * 2 + 1024;
+            slab->outbox = (float *)realloc(slab->outbox, sizeof(float) * SLAB_MAX_ARRAYS * slab->outbox_capacity);
+        }
+        float *out = slab->outbox + SLAB_MAX_ARRAYS * slab->outbox_count++;
+        for (uint32_t a = 0; a < array_count; ++a) out[a] = arrays[a][i];
+        out[2] = global_z;
+        if (find_slab(world, global_z) == s) {
+            // Particle came back to its own owned slices across the world end of a single slab world.
+            slab->outbox_count--;
+            for (uint32_t a = 0; a < array_count; ++a) arrays[a][kept] = out[a];
+            arrays[2][kept] = global_z - float(z0);
+            kept++;
+        }
+    }
+    slab->particles.count = kept;
+}
+
+// Appends particles of an outbox, which the slab owns, to its particles in order.
+static void receive_migrants(SlabWorld *world, Slab *slab, const float *outbox, uint32_t outbox_count) {
+    uint32_t s = uint32_t(slab - world->slabs);
+    float z0 = float(get_origin(slab, world));
+    for (uint32_t i = 0; i < outbox_count; ++i) {
+        const float *in = outbox + SLAB_MAX_ARRAYS * i;
+        if (find_slab(world, in[2]) != s) continue;
+        sim::reserve_particles(&slab->particles, slab->particles.count + 1);
+        float *arrays[SLAB_MAX_ARRAYS];
+        uint32_t array_count = get_arrays(&slab->particles, arrays);
+        uint32_t index = slab->particles.count++;
+        for (uint32_t a = 0; a < array_count; ++a) arrays[a][index] = in[a];
+        arrays[2][index] = in[2] - z0;
+        slab->particles.pair[index] = SIM_NO_PAIR;
+    }
+}
+
+// Moves particles which left owned slices of their slab to the slab owning them. Arriving particles are appended
+// in order of the slab they came from.
+static void migrate_particles(SlabWorld *world) {
+    PROFILE_SCOPE("migrate");
+    run_slabs(world, [&](Slab *slab) {
+        collect_migrants(world, slab);
+    });
+    run_slabs(world, [&](Slab *slab) {
+        for (uint32_t from = 0; from < world->slab_count; ++from) {
+            receive_migrants(world, slab, world->slabs[from].outbox, world->slabs[from].outbox_count);
+        }
+    });
+}
+
+// Fills halo slices of every slab with owned slices of its neighbours.
+static void exchange_halos(SlabWorld *world) {
+    PROFILE_SCOPE("halo_exchange");
+    run_slabs(world, [&](Slab *slab) {
+        uint32_t s = uint32_t(slab - world->slabs);
+        uint32_t z0 = get_origin(slab, world);
+        if (s > 0) {
+            Slab *below = &world->slabs[s - 1];
+            copy_slices(&slab->world, 0, &below->world, slab->z_begin - world->halo - get_origin(below, world), world->halo);
+        }
+        if (s + 1 < world->slab_count) {
+            // Halo above the last slab but one ends at world end if the last slab is thinner than halo.
+            Slab *above = &world->slabs[s + 1];
+            copy_slices(&slab->world, slab->z_end - z0, &above->world, above->z_begin - get_origin(above, world), z0 + slab->world.depth - slab->z_end);
+        }
+    });
+}
+
+void slabs::step(SlabWorld *world, Config *config) {
+    run_slabs(world, [&](Slab *slab) {
+        sim::move_particles(&slab->world, &slab->particles, config, slab->pool);
+    });
+    migrate_particles(world);
+    run_slabs(world, [&](Slab *slab) {
+        sim::deposit(&slab->world, &slab->particles, config, slab->pool);
+    });
+    // Decay of slices next to slab boundaries needs deposits of the neighbour.
+    exchange_halos(world);
+    run_slabs(world, [&](Slab *slab) {
+        sim::decay(&slab->world, config, slab->pool);
+    });
+}
+
+void slabs::sort_particles(SlabWorld *world) {
+    run_slabs(world, [&](Slab *slab) {
+        sim::sort_particles(&slab->world, &slab->particles, slab->pool);
+    });
+}
+
+static inline size_t align_shared(size_t size) {
+    return (size + SLAB_SHARED_ALIGNMENT - 1) / SLAB_SHARED_ALIGNMENT * SLAB_SHARED_ALIGNMENT;
+}
+
+// Size of `depth` slices in the shared mapping: voxels, brick ranges (UNORM8 only), brick maxima and brick
+// flags of their brick layers. If view isn't NULL, it's set to a World of those slices at `data`, which can only
+// be read and written by copy_slices and store_slices.
+static size_t get_view(SlabWorld *world, uint32_t depth, uint8_t *data, World *view) {
+    uint32_t brick_width = (world->width + SIM_BRICK_SIZE - 1) / SIM_BRICK_SIZE;
+    uint32_t brick_height = (world->height + SIM_BRICK_SIZE - 1) / SIM_BRICK_SIZE;
+    uint32_t brick_depth = (depth + SIM_BRICK_SIZE - 1) / SIM_BRICK_SIZE;
+    size_t brick_count = size_t(brick_width) * brick_height * brick_depth;
+    size_t voxels_size = align_shared(size_t(world->width) * world->height * depth * trail::get_voxel_size(world->trail_format));
+    size_t ranges_size = world->trail_format == SimTrailFormat::UNORM8 ? align_shared(sizeof(float) * brick_count) : 0;
+    size_t max_size = align_shared(sizeof(float) * brick_count);
+    if (view) {
+        *view = {};
+        view->width = world->width;
+        view->height = world->height;
+        view->depth = depth;
+        view->trail_format = world->trail_format;
+        view->brick_width = brick_width;
+        view->brick_height = brick_height;
+        view->brick_depth = brick_depth;
+        view->trail.voxels = data;
+        if (ranges_size) {
+            view->trail.brick_offset = (float *)(data + voxels_size);
+            view->trail.brick_scale = (float *)(data + voxels_size + ranges_size);
+        }
+        view->brick_max = (float *)(data + voxels_size + 2 * ranges_size);
+        view->brick_flags = data + voxels_size + 2 * ranges_size + max_size;
+    }
+    return voxels_size + 2 * ranges_size + max_size + align_shared(brick_count);
+}
+
+// Lays sections out in the mapping at shared->data, or just returns its size if data is NULL.
+static size_t set_layout(SlabShared *shared, SlabWorld *world, uint32_t particle_capacity) {
+    uint8_t *data = shared->data;
+    size_t offset = align_shared(sizeof(SlabSharedHeader));
+    shared->header = (SlabSharedHeader *)data;
+    for (uint32_t s = 0; s < world->slab_count; ++s) {
+        offset += get_view(world, world->halo, data ? data + offset : NULL, data ? &shared->bottom_edges[s] : NULL);
+        offset += get_view(world, world->halo, data ? data + offset : NULL, data ? &shared->top_edges[s] : NULL);
+    }
+    size_t particles_size = align_shared(sizeof(float) * SLAB_MAX_ARRAYS * particle_capacity);
+    shared->migrants = data ? (float *)(data + offset) : NULL;
+    offset += particles_size;
+    offset += get_view(world, world->depth, data ? data + offset : NULL, data ? &shared->gathered : NULL);
+    shared->gathered_particles = data ? (float *)(data + offset) : NULL;
+    offset += particles_size;
+    return offset;
+}
+
+// Copies `count` slices with their brick ranges, maxima and flags as they are. Slices have to start at brick
+// layers and end at a brick layer or world end.
+static void store_slices(World *dst, uint32_t dst_z, World *src, uint32_t src_z, uint32_t count) {
+    size_t slice_size = size_t(src->width) * src->height * trail::get_voxel_size(src->trail_format);
+    memcpy((uint8_t *)dst->trail.voxels + slice_size * dst_z, (uint8_t *)src->trail.voxels + slice_size * src_z, slice_size * count);
+
+    uint32_t layer_size = src->brick_width * src->brick_height;
+    uint32_t dst_layer = dst_z / SIM_BRICK_SIZE, src_layer = src_z / SIM_BRICK_SIZE;
+    size_t brick_count = size_t(layer_size) * ((count + SIM_BRICK_SIZE - 1) / SIM_BRICK_SIZE);
+    if (src->trail_format == SimTrailFormat::UNORM8) {
+        memcpy(dst->trail.brick_offset + layer_size * dst_layer, src->trail.brick_offset + layer_size * src_layer, sizeof(float) * brick_count);
+        memcpy(dst->trail.brick_scale + layer_size * dst_layer, src->trail.brick_scale + layer_size * src_layer, sizeof(float) * brick_count);
+    }
+    memcpy(dst->brick_max + layer_size * dst_layer, src->brick_max + layer_size * src_layer, sizeof(float) * brick_count);
+    memcpy(dst->brick_flags + layer_size * dst_layer, src->brick_flags + layer_size * src_layer, brick_count);
+}
+
+static void sleep_ms(uint32_t milliseconds) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+}
+
+// Creates (rank 0) or opens the mapping of shared->size bytes named shared->name. Opening fails while the
+// mapping doesn't exist yet or isn't resized yet, callers retry.
+static bool map_shared(SlabShared *shared, bool create) {
+#ifdef _WIN32
+    if (create) {
+        shared->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, DWORD(uint64_t(shared->size) >> 32),
+                                             DWORD(shared->size), shared->name);
+        if (shared->mapping && GetLastError() == ERROR_ALREADY_EXISTS) {
+            CloseHandle(shared->mapping);
+            return false;
+        }
+    } else {
+        shared->mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, shared->name);
+    }
+    if (!shared->mapping) return false;
+    shared->data = (uint8_t *)MapViewOfFile(shared->mapping, FILE_MAP_ALL_ACCESS, 0, 0, shared->size);
+    if (!shared->data) {
+        CloseHandle(shared->mapping);
+        return false;
+    }
+#else
+    int file = -1;
+    if (create) {
+        // Mapping left behind by a run which crashed.
+        shm_unlink(shared->name);
+        file = shm_open(shared->name, O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (file >= 0 && ftruncate(file, off_t(shared->size)) != 0) {
+            close(file);
+            shm_unlink(shared->name);
+            return false;
+        }
+    } else {
+        file = shm_open(shared->name, O_RDWR, 0);
+        struct stat info;
+        if (file >= 0 && (fstat(file, &info) != 0 || size_t(info.st_size) != shared->size)) {
+            close(file);
+            return false;
+        }
+    }
+    if (file < 0) return false;
+    void *data = mmap(NULL, shared->size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    close(file);
+    if (data == MAP_FAILED) {
+        if (create) shm_unlink(shared->name);
+        return false;
+    }
+    shared->data = (uint8_t *)data;
+#endif
+    return true;
+}
+
+static void unmap_shared(SlabShared *shared) {
+#ifdef _WIN32
+    UnmapViewOfFile(shared->data);
+    CloseHandle(shared->mapping);
+#else
+    munmap(shared->data, shared->size);
+#endif
+}
+
+// Removes the name once all processes mapped it, so nothing is left behind when they exit. Windows removes
+// the mapping with its last handle.
+static void unlink_shared(SlabShared *shared) {
+#ifndef _WIN32
+    shm_unlink(shared->name);
+#else
+    (void)shared;
+#endif
+}
+
+// Waits until all processes arrived. Returns false if a process stopped before all arrived.
+static bool wait_barrier(SlabShared *shared) {
+    SlabSharedHeader *header = shared->header;
+    uint32_t generation = header->generation.load(std::memory_order_acquire);
+    if (header->arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == header->slab_count) {
+        header->arrived.store(0, std::memory_order_relaxed);
+        // Release makes everything written before the barrier by all processes visible to all of them.
+        header->generation.store(generation + 1, std::memory_order_release);
+        return true;
+    }
+    while (header->generation.load(std::memory_order_acquire) == generation) {
+        // Processes which passed the last barrier leave right away, their stop comes after the generation.
+        if (header->stopped.load(std::memory_order_acquire)) {
+            return header->generation.load(std::memory_order_acquire) != generation;
+        }
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+// Prefix sums of counts written by all processes before a barrier. Returns the total.
+static uint32_t get_offsets(const uint32_t *counts, uint32_t slab_count, uint32_t *offsets) {
+    uint32_t total = 0;
+    for (uint32_t s = 0; s < slab_count; ++s) {
+        offsets[s] = total;
+        total += counts[s];
+    }
+    return total;
+}
+
+bool slabs::open_process(SlabProcess *process, const char *name, uint32_t rank, uint32_t slab_count, uint32_t width,
+                         uint32_t height, uint32_t depth, SimTrailFormat trail_format, SimDecayBuffer decay_buffer,
+                         uint32_t threads_per_slab, uint32_t particle_capacity, Config *config) {
+    *process = {};
+    SlabWorld *world = &process->world;
+    if (!plan_slabs(world, width, height, depth, trail_format, slab_count, false, config) || rank >= world->slab_count) {
+        return false;
+    }
+    process->rank = rank;
+
+    SlabShared *shared = (SlabShared *)calloc(1, sizeof(SlabShared));
+#ifdef _WIN32
+    snprintf(shared->name, SLAB_NAME_LENGTH, "Local\\%s", name);
+#else
+    snprintf(shared->name, SLAB_NAME_LENGTH, "/%s", name);
+#endif
+    shared->size = set_layout(shared, world, particle_capacity);
+    bool mapped = map_shared(shared, rank == 0);
+    for (uint32_t waited = 0; !mapped && rank > 0 && waited < SLAB_JOIN_TIMEOUT; waited += 10) {
+        sleep_ms(10);
+        mapped = map_shared(shared, false);
+    }
+    if (!mapped) {
+        free(shared);
+        return false;
+    }
+    set_layout(shared, world, particle_capacity);
+    process->shared = shared;
+
+    SlabSharedHeader *header = shared->header;
+    if (rank == 0) {
+        memcpy(header->magic, SLAB_SHARED_MAGIC, sizeof(header->magic));
+        header->version = SLAB_SHARED_VERSION;
+        header->slab_count = world->slab_count;
+        header->width = width;
+        header->height = height;
+        header->depth = depth;
+        header->halo = world->halo;
+        header->trail_format = uint32_t(trail_format);
+        header->particle_capacity = particle_capacity;
+        header->ready.store(1, std::memory_order_release);
+    } else {
+        for (uint32_t waited = 0; !header->ready.load(std::memory_order_acquire) && waited < SLAB_JOIN_TIMEOUT; waited += 1) {
+            sleep_ms(1);
+        }
+        bool matches = header->ready.load(std::memory_order_acquire) && !header->stopped.load(std::memory_order_acquire) &&
+                       memcmp(header->magic, SLAB_SHARED_MAGIC, sizeof(header->magic)) == 0 &&
+                       header->version == SLAB_SHARED_VERSION && header->slab_count == world->slab_count &&
+                       header->width == width && header->height == height && header->depth == depth &&
+                       header->halo == world->halo && header->trail_format == uint32_t(trail_format) &&
+                       header->particle_capacity == particle_capacity;
+        if (!matches) {
+            slabs::release(process);
+            return false;
+        }
+    }
+
+    Slab *slab = &world->slabs[rank];
+    if (!allocate_slab(world, slab, decay_buffer, threads_per_slab)) {
+        if (rank == 0) unlink_shared(shared);
+        slabs::release(process);
+        return false;
+    }
+    // Trail pages are touched first by threads of the slab's node.
+    sim::clear(&slab->world, slab->pool);
+
+    header->joined.fetch_add(1, std::memory_order_acq_rel);
+    for (uint32_t waited = 0; header->joined.load(std::memory_order_acquire) < world->slab_count; waited += 1) {
+        if (waited == SLAB_JOIN_TIMEOUT || header->stopped.load(std::memory_order_acquire)) {
+            if (rank == 0) unlink_shared(shared);
+            slabs::release(process);
+            return false;
+        }
+        sleep_ms(1);
+    }
+    if (rank == 0) unlink_shared(shared);
+    return true;
+}
+
+void slabs::release(SlabProcess *process) {
+    if (process->shared) {
+        process->shared->header->stopped.store(1, std::memory_order_release);
+        unmap_shared(process->shared);
+        free(process->shared);
+    }
+    slabs::release(&process->world);
+    *process = {};
+}
+
+void slabs::set_particles(SlabProcess *process, Particles *particles) {
+    SlabWorld *world = &process->world;
+    uint32_t *owners = (uint32_t *)malloc(sizeof(uint32_t) * particles->count);
+    uint32_t counts[SLAB_MAX_COUNT] = {};
+    find_owners(world, particles, owners, counts);
+    take_particles(world, &world->slabs[process->rank], particles, owners, counts[process->rank]);
+    free(owners);
+}
+
+uint32_t slabs::get_particle_count(SlabProcess *process) {
+    return process->world.slabs[process->rank].particles.count;
+}
+
+bool slabs::step(SlabProcess *process, Config *config) {
+    SlabWorld *world = &process->world;
+    SlabShared *shared = process->shared;
+    SlabSharedHeader *header = shared->header;
+    uint32_t rank = process->rank;
+    Slab *slab = &world->slabs[rank];
+    sim::move_particles(&slab->world, &slab->particles, config, slab->pool);
+
+    {
+        // Outboxes are packed in rank order, every process reads all of them in that order, same as
+        // migrate_particles.
+        PROFILE_SCOPE("migrate");
+        collect_migrants(world, slab);
+        header->migrant_counts[rank] = slab->outbox_count;
+        if (!wait_barrier(shared)) return false;
+        uint32_t counts[SLAB_MAX_COUNT], offsets[SLAB_MAX_COUNT];
+        memcpy(counts, header->migrant_counts, sizeof(uint32_t) * world->slab_count);
+        if (get_offsets(counts, world->slab_count, offsets) > header->particle_capacity) {
+            header->stopped.store(1, std::memory_order_release);
+            return false;
+        }
+        memcpy(shared->migrants + SLAB_MAX_ARRAYS * size_t(offsets[rank]), slab->outbox, sizeof(float) * SLAB_MAX_ARRAYS * counts[rank]);
+        if (!wait_barrier(shared)) return false;
+        for (uint32_t from = 0; from < world->slab_count; ++from) {
+            receive_migrants(world, slab, shared->migrants + SLAB_MAX_ARRAYS * size_t(offsets[from]), counts[from]);
+        }
+    }
+
+    sim::deposit(&slab->world, &slab->particles, config, slab->pool);
+
+    {
+        // Same slices as exchange_halos copies, going through edges of the mapping. Edges are only written
+        // again after the next migration barrier, which every process passes after reading them.
+        PROFILE_SCOPE("halo_exchange");
+        uint32_t z0 = get_origin(slab, world);
+        uint32_t owned = slab->z_end - slab->z_begin;
+        if (rank > 0) {
+            store_slices(&shared->bottom_edges[rank], 0, &slab->world, slab->z_begin - z0, owned < world->halo ? owned : world->halo);
+        }
+        if (rank + 1 < world->slab_count) {
+            store_slices(&shared->top_edges[rank], 0, &slab->world, slab->z_end - world->halo - z0, world->halo);
+        }
+        if (!wait_barrier(shared)) return false;
+        if (rank > 0) {
+            copy_slices(&slab->world, 0, &shared->top_edges[rank - 1], 0, world->halo);
+        }
+        if (rank + 1 < world->slab_count) {
+            copy_slices(&slab->world, slab->z_end - z0, &shared->bottom_edges[rank + 1], 0, z0 + slab->world.depth - slab->z_end);
+        }
+    }
+
+    sim::decay(&slab->world, config, slab->pool);
+    return true;
+}
+
+void slabs::sort_particles(SlabProcess *process) {
+    Slab *slab = &process->world.slabs[process->rank];
+    sim::sort_particles(&slab->world, &slab->particles, slab->pool);
+}
+
+bool slabs::gather(SlabProcess *process, World *out, Particles *particles) {
+    PROFILE_SCOPE("gather");
+    SlabWorld *world = &process->world;
+    SlabShared *shared = process->shared;
+    SlabSharedHeader *header = shared->header;
+    uint32_t rank = process->rank;
+    Slab *slab = &world->slabs[rank];
+    uint32_t capacity = header->particle_capacity;
+
+    header->particle_counts[rank] = slab->particles.count;
+    if (!wait_barrier(shared)) return false;
+    uint32_t counts[SLAB_MAX_COUNT], offsets[SLAB_MAX_COUNT];
+    memcpy(counts, header->particle_counts, sizeof(uint32_t) * world->slab_count);
+    uint32_t total = get_offsets(counts, world->slab_count, offsets);
+    if (total > capacity) {
+        header->stopped.store(1, std::memory_order_release);
+        return false;
+    }
+
+    uint32_t z0 = get_origin(slab, world);
+    store_slices(&shared->gathered, slab->z_begin, &slab->world, slab->z_begin - z0, slab->z_end - slab->z_begin);
+    float *src[SLAB_MAX_ARRAYS];
+    uint32_t array_count = get_arrays(&slab->particles, src);
+    for (uint32_t a = 0; a < array_count; ++a) {
+        memcpy(shared->gathered_particles + size_t(capacity) * a + offsets[rank], src[a], sizeof(float) * counts[rank]);
+    }
+    float *z = shared->gathered_particles + size_t(capacity) * 2 + offsets[rank];
+    for (uint32_t i = 0; i < counts[rank]; ++i) {
+        z[i] += float(z0);
+    }
+    // Gathered sections are only written again in the next gather, after its first barrier, which rank 0
+    // passes after reading them.
+    if (!wait_barrier(shared)) return false;
+    if (rank != 0) return true;
+
+    sim::clear(out, slab->pool);
+    copy_slices(out, 0, &shared->gathered, 0, world->depth);
+    float *dst[SLAB_MAX_ARRAYS];
+    array_count = get_arrays(particles, dst);
+    for (uint32_t a = 0; a < array_count; ++a) {
+        memcpy(dst[a], shared->gathered_particles + size_t(capacity) * a, sizeof(float) * total);
+    }
+    for (uint32_t i = 0; i < total; ++i) {
+        particles->pair[i] = SIM_NO_PAIR;
+    }
+    particles->count = total;
+    return true;
+}
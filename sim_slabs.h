@@ -0,0 +1,112 @@
+#pragma once
+
+#include "sim.h"
+
+// World split along z into slabs for machines with several NUMA nodes. Every slab is a World of its own,
+// holding the slices it owns plus `halo` slices of both neighbours on each side, and the particles inside
+// of its owned slices. Slab memory is touched first and simulated by a thread pool pinned to the slab's
+// node, so particles only read trail of their own node.
+//
+// Step runs every stage on all slabs at once. After particles move, the ones which left their slab's owned
+// slices migrate to the slab which owns their new position. After deposit, halos are filled with owned
+// slices of neighbours, so decay of boundary slices sees deposits on the other side and sensing in the next
+// step reads up to date trail. Halo is at least sense_distance + move_distance + 1 slices, decay can't
+// compute the outermost halo slice correctly, but no particle senses that far.
+//
+// Slabs only access each other in halo exchange and migration, which copy whole slices and particles between
+// them. Results don't depend on thread count, but differ from simulation of a single World the same way they
+// differ after reordering particles: random turns depend on particle index and voxel. Collisions are only
+// checked against particles of the same slab.
+//
+// The same decomposition runs across processes (SlabProcess), one slab per process, so a simulation can span
+// sockets with every process pinned to its own node. Processes share a named memory mapping, which holds the
+// edge slices every slab publishes for halos of its neighbours, particles migrating in the current step and room
+// to gather the whole world, and meet at barriers in it. A step does the same copies in the same order as
+// slabs::step, so results are identical to slabs::step with the same slab count.
+#define SLAB_MAX_COUNT 64
+
+struct Slab {
+    World world;
+    // Particles in local coordinates, local slice `halo` is global slice z_begin.
+    Particles particles;
+    uint32_t z_begin;
+    uint32_t z_end;
+    uint32_t node;
+    ThreadPool *pool;
+
+    // Particles which left the slab during current migration, in global coordinates. Same layout as
+    // particle arrays: x, y, z, phi, theta and dir_x, dir_y, dir_z with SimHeading::DIRECTION.
+    float *outbox;
+    uint32_t outbox_count;
+    uint32_t outbox_capacity;
+};
+
+struct SlabWorld {
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+    uint32_t halo;
+    SimTrailFormat trail_format;
+    uint32_t slab_count;
+    Slab slabs[SLAB_MAX_COUNT];
+    // One thread per slab, each drives thread pool of its slab.
+    ThreadPool *pool;
+};
+
+namespace slabs {
+    // Splits world into slab_count slabs, fewer if the world is too thin for slabs to be thicker than halo.
+    // Slabs are spread over NUMA nodes in order, each gets threads_per_slab threads, 0 means all cores of its
+    // node divided by slabs on the node. Halo is sized for the sense and move distance of `config`, which
+    // mustn't grow afterwards. Returns world with slab_count 0 if allocation failed.
+    SlabWorld get_world(uint32_t width, uint32_t height, uint32_t depth, SimTrailFormat trail_format,
+                        SimDecayBuffer decay_buffer, uint32_t slab_count, uint32_t threads_per_slab, Config *config);
+    void release(SlabWorld *world);
+    // Zeroes trail of all slabs and distributes particles (in world coordinates) to slabs owning them.
+    void set_particles(SlabWorld *world, Particles *particles);
+    // Copies particles of all slabs into `particles` in world coordinates, in slab order. Particles has to
+    // have room for all of them and the same heading mode, pairs are reset.
+    void get_particles(SlabWorld *world, Particles *particles);
+    // Copies owned slices of all slabs into `out`, which has to have the same size and trail format.
+    void get_trail(SlabWorld *world, World *out);
+    uint32_t get_particle_count(SlabWorld *world);
+
+    // Same as sim::step followed by sim::decay.
+    void step(SlabWorld *world, Config *config);
+    void sort_particles(SlabWorld *world);
+}
+
+struct SlabShared;
+
+// One slab of a SlabWorld simulated by this process. Other slabs of the world only have their slice range and
+// node, their trail and particles live in other processes.
+struct SlabProcess {
+    SlabWorld world;
+    uint32_t rank;
+    SlabShared *shared;
+};
+
+namespace slabs {
+    // Joins the simulation `name` as the process simulating slab `rank`. All slab_count processes call it with
+    // the same arguments except rank, rank 0 creates the mapping, others wait for it to appear. Slab count isn't
+    // reduced, fails if the world is too thin for it. particle_capacity is the max number of particles of all
+    // slabs together. Waits until all processes joined. Returns false if the mapping can't be created or
+    // opened, doesn't match the arguments or the slab can't be allocated.
+    bool open_process(SlabProcess *process, const char *name, uint32_t rank, uint32_t slab_count, uint32_t width,
+                      uint32_t height, uint32_t depth, SimTrailFormat trail_format, SimDecayBuffer decay_buffer,
+                      uint32_t threads_per_slab, uint32_t particle_capacity, Config *config);
+    // Tells other processes to stop waiting for this one if it leaves early.
+    void release(SlabProcess *process);
+    // Zeroes trail of the slab and takes particles (in world coordinates) it owns, particles have to be the
+    // same in all processes.
+    void set_particles(SlabProcess *process, Particles *particles);
+    uint32_t get_particle_count(SlabProcess *process);
+
+    // All processes step together. Returns false if another process failed or left.
+    bool step(SlabProcess *process, Config *config);
+    void sort_particles(SlabProcess *process);
+    // All processes call it, rank 0 gets trail of all slabs in `out` and their particles in `particles` in world
+    // coordinates, the same as slabs::get_trail and slabs::get_particles return. Particles of rank 0 have to
+    // have room for particle_capacity. out and particles of other ranks are unused and can be NULL. Returns false
+    // if another process failed or left.
+    bool gather(SlabProcess *process, World *out, Particles *particles);
+}
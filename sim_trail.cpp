@@ -0,0 +1,236 @@
+#include "sim_trail.h"
+#include <stdlib.h>
+
+// F16C builds of FLOAT16 row conversion, defined in sim_avx2.cpp. Vector kernels are only selected on CPUs
+// with F16C, so they're used whenever the selected kernel isn't scalar.
+void half_to_float_f16c(const uint16_t *src, float *dst, uint32_t count);
+void float_to_half_f16c(const float *src, uint16_t *dst, uint32_t count);
+
+static inline bool use_f16c() {
+    return sim::get_kernel() != SimKernel::SCALAR;
+}
+
+static inline uint16_t encode_half(float value) {
+    return float_to_half(value < TRAIL_HALF_MAX ? value : TRAIL_HALF_MAX);
+}
+
+static inline uint8_t encode_unorm(float value, float offset, float inverse_scale) {
+    float q = (value - offset) * inverse_scale + 0.5f;
+    return uint8_t(q < 255.0f ? q : 255.0f);
+}
+
+static inline size_t get_voxel_index(World *world, uint32_t x, uint32_t y, uint32_t z) {
+    return (size_t(z) * world->height + y) * world->width + x;
+}
+
+struct BrickExtent {
+    uint32_t x0, y0, z0;
+    // Voxels of the brick inside of the world along each axis.
+    uint32_t nx, ny, nz;
+};
+
+static inline BrickExtent get_brick_extent(World *world, uint32_t brick) {
+    BrickExtent e;
+    e.x0 = brick % world->brick_width * SIM_BRICK_SIZE;
+    e.y0 = brick / world->brick_width % world->brick_height * SIM_BRICK_SIZE;
+    e.z0 = brick / (world->brick_width * world->brick_height) * SIM_BRICK_SIZE;
+    e.nx = world->width - e.x0 < SIM_BRICK_SIZE ? world->width - e.x0 : SIM_BRICK_SIZE;
+    e.ny = world->height - e.y0 < SIM_BRICK_SIZE ? world->height - e.y0 : SIM_BRICK_SIZE;
+    e.nz = world->depth - e.z0 < SIM_BRICK_SIZE ? world->depth - e.z0 : SIM_BRICK_SIZE;
+    return e;
+}
+
+bool trail::allocate(World *world, TrailBuffer *buffer) {
+    *buffer = {};
+    // Step kernels read voxels in 32 bit words, so the last word has to be inside of the allocation.
+    size_t size = (sim::get_voxel_count(world) * trail::get_voxel_size(world->trail_format) + 3) / 4 * 4;
+    buffer->voxels = calloc(1, size);
+    if (world->trail_format == SimTrailFormat::UNORM8) {
+        uint32_t brick_count = sim::get_brick_count(world);
+        buffer->brick_offset = (float *)calloc(brick_count, sizeof(float));
+        buffer->brick_scale = (float *)calloc(brick_count, sizeof(float));
+        return buffer->voxels && buffer->brick_offset && buffer->brick_scale;
+    }
+    return buffer->voxels != NULL;
+}
+
+void trail::release(TrailBuffer *buffer) {
+    free(buffer->voxels);
+    free(buffer->brick_offset);
+    free(buffer->brick_scale);
+    *buffer = {};
+}
+
+void trail::clear(World *world, TrailBuffer *buffer, uint32_t z_begin, uint32_t z_end) {
+    size_t voxel_size = trail::get_voxel_size(world->trail_format);
+    size_t slice_size = size_t(world->width) * world->height;
+    memset((uint8_t *)buffer->voxels + slice_size * z_begin * voxel_size, 0, slice_size * (z_end - z_begin) * voxel_size);
+    if (world->trail_format == SimTrailFormat::UNORM8) {
+        uint32_t layer_size = world->brick_width * world->brick_height;
+        uint32_t layer_begin = z_begin / SIM_BRICK_SIZE;
+        uint32_t layer_end = (z_end + SIM_BRICK_SIZE - 1) / SIM_BRICK_SIZE;
+        memset(buffer->brick_offset + layer_size * layer_begin, 0, sizeof(float) * layer_size * (layer_end - layer_begin));
+        memset(buffer->brick_scale + layer_size * layer_begin, 0, sizeof(float) * layer_size * (layer_end - layer_begin));
+    }
+}
+
+void trail::load_row(World *world, const TrailBuffer *buffer, uint32_t x, uint32_t y, uint32_t z, uint32_t count, float *out) {
+    size_t index = get_voxel_index(world, x, y, z);
+    switch (world->trail_format) {
+        case SimTrailFormat::FLOAT32: {
+            memcpy(out, (const float *)buffer->voxels + index, sizeof(float) * count);
+            break;
+        }
+        case SimTrailFormat::FLOAT16: {
+            const uint16_t *src = (const uint16_t *)buffer->voxels + index;
+            if (use_f16c()) {
+                half_to_float_f16c(src, out, count);
+            } else {
+                for (uint32_t i = 0; i < count; ++i) {
+                    out[i] = half_to_float(src[i]);
+                }
+            }
+            break;
+        }
+        case SimTrailFormat::UNORM8: {
+            // Row crosses a brick every SIM_BRICK_SIZE voxels, range is constant in between.
+            const uint8_t *src = (const uint8_t *)buffer->voxels + index;
+            uint32_t row_brick = get_voxel_brick(world, 0, y, z);
+            for (uint32_t i = 0; i < count;) {
+                uint32_t brick_x = (x + i) / SIM_BRICK_SIZE;
+                uint32_t run = (brick_x + 1) * SIM_BRICK_SIZE - (x + i);
+                if (run > count - i) run = count - i;
+                float offset = buffer->brick_offset[row_brick + brick_x];
+                float scale = buffer->brick_scale[row_brick + brick_x];
+                for (uint32_t j = i; j < i + run; ++j) {
+                    out[j] = offset + float(src[j]) * scale;
+                }
+                i += run;
+            }
+            break;
+        }
+    }
+}
+
+void trail::store_row(World *world, TrailBuffer *buffer, uint32_t x, uint32_t y, uint32_t z, uint32_t count, const float *values) {
+    size_t index = get_voxel_index(world, x, y, z);
+    if (world->trail_format == SimTrailFormat::FLOAT32) {
+        memcpy((float *)buffer->voxels + index, values, sizeof(float) * count);
+    } else if (world->trail_format == SimTrailFormat::FLOAT16) {
+        uint16_t *dst = (uint16_t *)buffer->voxels + index;
+        if (use_f16c()) {
+            float_to_half_f16c(values, dst, count);
+        } else {
+            for (uint32_t i = 0; i < count; ++i) {
+                dst[i] = encode_half(values[i]);
+            }
+        }
+    }
+}
+
+void trail::load_brick(World *world, const TrailBuffer *buffer, uint32_t brick, float *values) {
+    const uint32_t S = SIM_BRICK_SIZE;
+    BrickExtent e = get_brick_extent(world, brick);
+    if (e.nx < S || e.ny < S || e.nz < S) {
+        memset(values, 0, sizeof(float) * S * S * S);
+    }
+    for (uint32_t z = 0; z < e.nz; ++z) {
+        for (uint32_t y = 0; y < e.ny; ++y) {
+            trail::load_row(world, buffer, e.x0, e.y0 + y, e.z0 + z, e.nx, values + (z * S + y) * S);
+        }
+    }
+}
+
+void trail::store_brick(World *world, TrailBuffer *buffer, uint32_t brick, const float *values) {
+    const uint32_t S = SIM_BRICK_SIZE;
+    BrickExtent e = get_brick_extent(world, brick);
+    if (world->trail_format != SimTrailFormat::UNORM8) {
+        for (uint32_t z = 0; z < e.nz; ++z) {
+            for (uint32_t y = 0; y < e.ny; ++y) {
+                trail::store_row(world, buffer, e.x0, e.y0 + y, e.z0 + z, e.nx, values + (z * S + y) * S);
+            }
+        }
+        return;
+    }
+
+    // Range of the brick spans exactly its values, so 8 bits cover whatever part of the value range the brick holds.
+    float min_value = values[0], max_value = values[0];
+    for (uint32_t z = 0; z < e.nz; ++z) {
+        for (uint32_t y = 0; y < e.ny; ++y) {
+            const float *row = values + (z * S + y) * S;
+            for (uint32_t x = 0; x < e.nx; ++x) {
+                min_value = row[x] < min_value ? row[x] : min_value;
+                max_value = row[x] > max_value ? row[x] : max_value;
+            }
+        }
+    }
+    float scale = (max_value - min_value) / 255.0f;
+    float inverse_scale = scale > 0.0f ? 1.0f / scale : 0.0f;
+    buffer->brick_offset[brick] = min_value;
+    buffer->brick_scale[brick] = scale;
+    for (uint32_t z = 0; z < e.nz; ++z) {
+        for (uint32_t y = 0; y < e.ny; ++y) {
+            const float *row = values + (z * S + y) * S;
+            uint8_t *dst = (uint8_t *)buffer->voxels + get_voxel_index(world, e.x0, e.y0 + y, e.z0 + z);
+            for (uint32_t x = 0; x < e.nx; ++x) {
+                dst[x] = encode_unorm(row[x], min_value, inverse_scale);
+            }
+        }
+    }
+}
+
+void trail::zero_brick(World *world, TrailBuffer *buffer, uint32_t brick) {
+    BrickExtent e = get_brick_extent(world, brick);
+    size_t voxel_size = trail::get_voxel_size(world->trail_format);
+    for (uint32_t z = 0; z < e.nz; ++z) {
+        for (uint32_t y = 0; y < e.ny; ++y) {
+            size_t index = get_voxel_index(world, e.x0, e.y0 + y, e.z0 + z);
+            memset((uint8_t *)buffer->voxels + index * voxel_size, 0, e.nx * voxel_size);
+        }
+    }
+    if (world->trail_format == SimTrailFormat::UNORM8) {
+        buffer->brick_offset[brick] = 0.0f;
+        buffer->brick_scale[brick] = 0.0f;
+    }
+}
+
+// Requantizes UNORM8 brick to a new scale, offset stays the same.
+static void rescale_brick(World *world, TrailBuffer *buffer, uint32_t brick, float scale) {
+    BrickExtent e = get_brick_extent(world, brick);
+    float old_scale = buffer->brick_scale[brick];
+    float ratio = old_scale / scale;
+    for (uint32_t z = 0; z < e.nz; ++z) {
+        for (uint32_t y = 0; y < e.ny; ++y) {
+            uint8_t *row = (uint8_t *)buffer->voxels + get_voxel_index(world, e.x0, e.y0 + y, e.z0 + z);
+            for (uint32_t x = 0; x < e.nx; ++x) {
+                float q = float(row[x]) * ratio + 0.5f;
+                row[x] = uint8_t(q < 255.0f ? q : 255.0f);
+            }
+        }
+    }
+    buffer->brick_scale[brick] = scale;
+}
+
+void trail::add(World *world, TrailBuffer *buffer, size_t voxel, uint32_t brick, float value) {
+    switch (world->trail_format) {
+        case SimTrailFormat::FLOAT32: {
+            ((float *)buffer->voxels)[voxel] += value;
+            break;
+        }
+        case SimTrailFormat::FLOAT16: {
+            uint16_t *half = (uint16_t *)buffer->voxels + voxel;
+            *half = encode_half(half_to_float(*half) + value);
+            break;
+        }
+        case SimTrailFormat::UNORM8: {
+            uint8_t *q = (uint8_t *)buffer->voxels + voxel;
+            float offset = buffer->brick_offset[brick];
+            float sum = offset + float(*q) * buffer->brick_scale[brick] + value;
+            if (sum > offset + 255.0f * buffer->brick_scale[brick]) {
+                rescale_brick(world, buffer, brick, (sum * TRAIL_DEPOSIT_HEADROOM - offset) / 255.0f);
+            }
+            *q = encode_unorm(sum, offset, 1.0f / buffer->brick_scale[brick]);
+            break;
+        }
+    }
+}
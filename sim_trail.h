@@ -0,0 +1,117 @@
+#pragma once
+
+// Encoding and decoding of trail voxels in every SimTrailFormat, shared by the simulation, decay, DoF rendering
+// and checkpoints. Rows and bricks are converted in bulk, FLOAT16 rows with F16C when the selected kernel is
+// vectorized. Step kernels decode voxels in registers instead, see sample_trail in sim_kernel.h.
+
+#include "sim.h"
+#include <string.h>
+
+// Largest finite half, FLOAT16 voxels saturate to it instead of becoming infinity.
+#define TRAIL_HALF_MAX 65504.0f
+// Deposit which doesn't fit into range of its UNORM8 brick rescales the brick so the range ends this many
+// times above the new value, following deposits then rarely have to rescale it again.
+#define TRAIL_DEPOSIT_HEADROOM 1.5f
+
+// IEEE half conversion with round to nearest even, values above half range become infinity.
+static inline uint16_t float_to_half(float value) {
+    uint32_t f;
+    memcpy(&f, &value, sizeof(f));
+    uint32_t sign = (f >> 16) & 0x8000;
+    uint32_t exponent = (f >> 23) & 0xFF;
+    uint32_t mantissa = f & 0x7FFFFF;
+    if (exponent == 0xFF) return uint16_t(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+    int half_exponent = int(exponent) - 127 + 15;
+    if (half_exponent >= 31) return uint16_t(sign | 0x7C00);
+    if (half_exponent <= 0) {
+        // Subnormal half, or zero if value is too small.
+        if (half_exponent < -10) return uint16_t(sign);
+        mantissa |= 0x800000;
+        uint32_t shift = uint32_t(14 - half_exponent);
+        uint32_t half_mantissa = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half_mantissa & 1))) half_mantissa++;
+        return uint16_t(sign | half_mantissa);
+    }
+    uint32_t half = sign | (uint32_t(half_exponent) << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1FFF;
+    // Carry from rounding can overflow into exponent, which still gives the correct result.
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+    return uint16_t(half);
+}
+
+static inline float half_to_float(uint16_t half) {
+    uint32_t sign = uint32_t(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1F;
+    uint32_t mantissa = half & 0x3FF;
+    uint32_t f;
+    if (exponent == 0x1F) {
+        f = sign | 0x7F800000 | (mantissa << 13);
+    } else if (exponent == 0) {
+        if (mantissa == 0) {
+            f = sign;
+        } else {
+            // Normalize subnormal half.
+            exponent = 127 - 15 + 1;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                exponent--;
+            }
+            f = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+        }
+    } else {
+        f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+    float value;
+    memcpy(&value, &f, sizeof(value));
+    return value;
+}
+
+static inline uint32_t get_voxel_brick(World *world, uint32_t x, uint32_t y, uint32_t z) {
+    return (z / SIM_BRICK_SIZE * world->brick_height + y / SIM_BRICK_SIZE) * world->brick_width + x / SIM_BRICK_SIZE;
+}
+
+namespace trail {
+    inline size_t get_voxel_size(SimTrailFormat format) {
+        switch (format) {
+            case SimTrailFormat::FLOAT16: return sizeof(uint16_t);
+            case SimTrailFormat::UNORM8: return sizeof(uint8_t);
+            default: return sizeof(float);
+        }
+    }
+
+    // Allocates zeroed buffer in world->trail_format, returns false if allocation failed.
+    bool allocate(World *world, TrailBuffer *buffer);
+    void release(TrailBuffer *buffer);
+    // Zeroes voxels of slices [z_begin, z_end) and brick ranges of bricks within them, slices have to be
+    // whole brick layers unless z_end is the world depth.
+    void clear(World *world, TrailBuffer *buffer, uint32_t z_begin, uint32_t z_end);
+
+    // Decodes `count` voxels starting at (x, y, z) along x.
+    void load_row(World *world, const TrailBuffer *buffer, uint32_t x, uint32_t y, uint32_t z, uint32_t count, float *out);
+    // Encodes `count` voxels starting at (x, y, z) along x. FLOAT32 and FLOAT16 only, UNORM8 voxels are written
+    // in whole bricks, so their brick range fits.
+    void store_row(World *world, TrailBuffer *buffer, uint32_t x, uint32_t y, uint32_t z, uint32_t count, const float *values);
+    // Brick values are SIM_BRICK_SIZE^3 floats in x-major order. Voxels of partial edge bricks outside of
+    // the world load as zero and aren't stored.
+    void load_brick(World *world, const TrailBuffer *buffer, uint32_t brick, float *values);
+    void store_brick(World *world, TrailBuffer *buffer, uint32_t brick, const float *values);
+    void zero_brick(World *world, TrailBuffer *buffer, uint32_t brick);
+    // Adds value to a voxel of the given brick, UNORM8 brick is rescaled when the result doesn't fit.
+    void add(World *world, TrailBuffer *buffer, size_t voxel, uint32_t brick, float value);
+
+    inline float load(World *world, const TrailBuffer *buffer, uint32_t x, uint32_t y, uint32_t z) {
+        size_t voxel = (size_t(z) * world->height + y) * world->width + x;
+        switch (world->trail_format) {
+            case SimTrailFormat::FLOAT16:
+                return half_to_float(((const uint16_t *)buffer->voxels)[voxel]);
+            case SimTrailFormat::UNORM8: {
+                uint32_t brick = get_voxel_brick(world, x, y, z);
+                return buffer->brick_offset[brick] + float(((const uint8_t *)buffer->voxels)[voxel]) * buffer->brick_scale[brick];
+            }
+            default:
+                return ((const float *)buffer->voxels)[voxel];
+        }
+    }
+}
@@ -0,0 +1,228 @@
+// Parameter sweeps over Config space. Sweeps are many small simulations, which are too small to scale
+// across cores on their own, so instead of splitting each run across threads, every thread runs whole
+// simulations one after another. Worlds, particles and thumbnail images are allocated once per thread.
+#include "sweep.h"
+#include "sim.h"
+#include "sim_trail.h"
+#include "dof.h"
+#include "thread_pool.h"
+#include <chrono>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PATH_LENGTH 1024
+
+struct SweepField {
+    const char *name;
+    size_t offset;
+};
+
+// Config fields which can be swept. World size and fillers aren't parameters.
+static const SweepField fields[] = {
+    { "sense_spread", offsetof(Config, sense_spread) },
+    { "sense_distance", offsetof(Config, sense_distance) },
+    { "turn_angle", offsetof(Config, turn_angle) },
+    { "move_distance", offsetof(Config, move_distance) },
+    { "deposit_value", offsetof(Config, deposit_value) },
+    { "decay_factor", offsetof(Config, decay_factor) },
+    { "collision", offsetof(Config, collision) },
+    { "center_attraction", offsetof(Config, center_attraction) },
+    { "move_sense_coef", offsetof(Config, move_sense_coef) },
+    { "move_sense_offset", offsetof(Config, move_sense_offset) },
+};
+#define FIELD_COUNT int(sizeof(fields) / sizeof(fields[0]))
+
+// Per-thread state reused between runs.
+struct SweepThread {
+    World world;
+    Particles particles;
+    DofImage image;
+};
+
+static inline uint32_t wang_hash(uint32_t seed) {
+    seed = (seed ^ 61) ^ (seed >> 16);
+    seed *= 9;
+    seed = seed ^ (seed >> 4);
+    seed *= 0x27d4eb2d;
+    seed = seed ^ (seed >> 15);
+    return seed;
+}
+
+static double get_time() {
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+int sweep::find_field(const char *name) {
+    for (int i = 0; i < FIELD_COUNT; ++i) {
+        if (strcmp(fields[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+const char *sweep::get_field_name(int field) {
+    return fields[field].name;
+}
+
+uint32_t sweep::get_run_count(SweepSettings *settings) {
+    if (settings->random_samples > 0) return settings->random_samples;
+    uint32_t count = 1;
+    for (uint32_t i = 0; i < settings->range_count; ++i) {
+        count *= settings->ranges[i].count;
+    }
+    return count;
+}
+
+Config sweep::get_config(SweepSettings *settings, uint32_t run) {
+    Config config = settings->base;
+    config.world_width = config.world_height = config.world_depth = int(settings->world_size);
+    // Grid runs are numbered with the first range changing fastest.
+    uint32_t grid_index = run;
+    for (uint32_t i = 0; i < settings->range_count; ++i) {
+        SweepRange *range = &settings->ranges[i];
+        float t;
+        if (settings->random_samples > 0) {
+            uint32_t hash = wang_hash(settings->seed ^ wang_hash(run * SWEEP_MAX_RANGES + i));
+            t = float(hash >> 8) / float((1 << 24) - 1);
+        } else {
+            uint32_t step = grid_index % range->count;
+            grid_index /= range->count;
+            t = range->count > 1 ? float(step) / float(range->count - 1) : 0.0f;
+        }
+        float *value = (float *)((char *)&config + fields[range->field].offset);
+        *value = range->min + (range->max - range->min) * t;
+    }
+    return config;
+}
+
+static void measure(SweepResult *result, World *world, Particles *particles) {
+    uint64_t voxel_count = sim::get_voxel_count(world);
+    float *row = (float *)malloc(sizeof(float) * world->width);
+    double sum = 0.0, sum_squares = 0.0;
+    float max_trail = 0.0f;
+    for (uint32_t z = 0; z < world->depth; ++z) {
+        for (uint32_t y = 0; y < world->height; ++y) {
+            trail::load_row(world, &world->trail, 0, y, z, world->width, row);
+            for (uint32_t x = 0; x < world->width; ++x) {
+                float v = row[x];
+                sum += v;
+                sum_squares += double(v) * v;
+                max_trail = fmaxf(max_trail, v);
+            }
+        }
+    }
+    uint64_t covered = 0;
+    for (uint32_t z = 0; z < world->depth; ++z) {
+        for (uint32_t y = 0; y < world->height; ++y) {
+            trail::load_row(world, &world->trail, 0, y, z, world->width, row);
+            for (uint32_t x = 0; x < world->width; ++x) {
+                covered += row[x] > max_trail * 0.01f;
+            }
+        }
+    }
+    free(row);
+    double mean = sum / double(voxel_count);
+    double variance = fmax(sum_squares / double(voxel_count) - mean * mean, 0.0);
+
+    double distance_sum = 0.0;
+    for (uint32_t i = 0; i < particles->count; ++i) {
+        double dx = particles->x[i] - world->width / 2.0;
+        double dy = particles->y[i] - world->height / 2.0;
+        double dz = particles->z[i] - world->depth / 2.0;
+        distance_sum += dx * dx + dy * dy + dz * dz;
+    }
+
+    result->mean_trail = float(mean);
+    result->max_trail = max_trail;
+    result->coverage = float(double(covered) / double(voxel_count));
+    result->contrast = mean > 0.0 ? float(sqrt(variance) / mean) : 0.0f;
+    result->active_bricks = float(world->active_brick_count) / float(sim::get_brick_count(world));
+    result->spread = float(sqrt(distance_sum / fmax(particles->count, 1)) / world->width);
+}
+
+SweepResult *sweep::run(SweepSettings *settings, ThreadPool *pool) {
+    uint32_t run_count = sweep::get_run_count(settings);
+    uint32_t thread_count = thread_pool::get_thread_count(pool);
+    SweepThread *threads = (SweepThread *)calloc(thread_count, sizeof(SweepThread));
+    SweepResult *results = (SweepResult *)calloc(run_count, sizeof(SweepResult));
+    uint32_t size = settings->world_size;
+
+    // Chunks of a single run, so runs of different length balance out across threads.
+    thread_pool::run(pool, run_count, 1, [&](uint32_t begin, uint32_t end, uint32_t thread_index) {
+        SweepThread *thread = &threads[thread_index];
+        if (!thread->world.trail.voxels) {
+            thread->world = sim::get_world(size, size, size, SimTrailFormat::FLOAT32, SimDecayBuffer::PING_PONG);
+            thread->particles = sim::get_particles(settings->particle_count);
+            thread->image = dof::get_image(settings->thumbnail_size, settings->thumbnail_size);
+        }
+        World *world = &thread->world;
+        Particles *particles = &thread->particles;
+
+        for (uint32_t run = begin; run < end; ++run) {
+            SweepResult *result = &results[run];
+            result->config = sweep::get_config(settings, run);
+
+            // Every run starts from the same spawn, so differences come only from parameters.
+            double start = get_time();
+            sim::clear(world, NULL);
+            sim::spawn_particles(particles, world, settings->spawn_radius, settings->seed);
+            for (uint32_t i = 0; i < settings->steps; ++i) {
+                sim::step(world, particles, &result->config, NULL);
+                sim::decay(world, &result->config, NULL);
+            }
+            result->duration = float(get_time() - start);
+            measure(result, world, particles);
+
+            if (settings->thumbnail_size > 0) {
+                DofSettings dof_settings = dof::get_settings(settings->thumbnail_size, settings->thumbnail_size);
+                dof_settings.iterations = settings->thumbnail_iterations;
+                dof::render(&thread->image, &dof_settings, DofMode::TRAIL, world, particles, NULL, NULL);
+                char path[PATH_LENGTH];
+                snprintf(path, PATH_LENGTH, "%s/sweep_%04u.pgm", settings->output_dir, run);
+                if (!dof::write_pgm(&thread->image, path)) {
+                    printf("Failed to write %s\n", path);
+                }
+            }
+        }
+    });
+
+    for (uint32_t i = 0; i < thread_count; ++i) {
+        if (!threads[i].world.trail.voxels) continue;
+        sim::release(&threads[i].world);
+        sim::release(&threads[i].particles);
+        dof::release(&threads[i].image);
+    }
+    free(threads);
+    return results;
+}
+
+bool sweep::write_summary(SweepSettings *settings, SweepResult *results, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) return false;
+    fprintf(file, "run");
+    for (uint32_t i = 0; i < settings->range_count; ++i) {
+        fprintf(file, ",%s", fields[settings->ranges[i].field].name);
+    }
+    fprintf(file, ",mean_trail,max_trail,coverage,contrast,active_bricks,spread,duration,thumbnail\n");
+
+    uint32_t run_count = sweep::get_run_count(settings);
+    for (uint32_t run = 0; run < run_count; ++run) {
+        SweepResult *result = &results[run];
+        fprintf(file, "%u", run);
+        for (uint32_t i = 0; i < settings->range_count; ++i) {
+            float *value = (float *)((char *)&result->config + fields[settings->ranges[i].field].offset);
+            fprintf(file, ",%g", *value);
+        }
+        fprintf(file, ",%g,%g,%g,%g,%g,%g,%.3f", result->mean_trail, result->max_trail, result->coverage,
+                result->contrast, result->active_bricks, result->spread, result->duration);
+        if (settings->thumbnail_size > 0) {
+            fprintf(file, ",sweep_%04u.pgm\n", run);
+        } else {
+            fprintf(file, ",\n");
+        }
+    }
+    return fclose(file) == 0;
+}
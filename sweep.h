@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include "config.h"
+
+struct ThreadPool;
+
+#define SWEEP_MAX_RANGES 8
+
+// Config field varied by a sweep. Grid sweeps take `count` evenly spaced values from [min, max],
+// random sweeps sample values uniformly from [min, max] and ignore `count`.
+struct SweepRange {
+    int field;
+    float min;
+    float max;
+    uint32_t count;
+};
+
+struct SweepSettings {
+    // Fields which aren't swept keep their value from `base`. World size in `base` is ignored.
+    Config base;
+    SweepRange ranges[SWEEP_MAX_RANGES];
+    uint32_t range_count;
+    // Number of random configurations, 0 means full grid over all ranges.
+    uint32_t random_samples;
+    uint32_t seed;
+
+    uint32_t world_size;
+    uint32_t particle_count;
+    uint32_t steps;
+    float spawn_radius;
+
+    // Thumbnails are DoF renders of the final trail, 0 disables them.
+    uint32_t thumbnail_size;
+    int thumbnail_iterations;
+    // Directory for thumbnails and summary, has to exist.
+    const char *output_dir;
+};
+
+// Summary of a single run. Trail statistics are computed over the whole world after the last step.
+struct SweepResult {
+    Config config;
+    float mean_trail;
+    float max_trail;
+    // Fraction of voxels above 1% of max trail value.
+    float coverage;
+    // Standard deviation of trail divided by mean, high for thin filaments, low for diffuse clouds.
+    float contrast;
+    float active_bricks;
+    // RMS distance of particles from world center relative to world size.
+    float spread;
+    float duration;
+};
+
+namespace sweep {
+    // Index of Config float field with given name, -1 if there's no such field.
+    int find_field(const char *name);
+    const char *get_field_name(int field);
+
+    uint32_t get_run_count(SweepSettings *settings);
+    Config get_config(SweepSettings *settings, uint32_t run);
+
+    // Runs all configurations of the sweep. Every run is a small single threaded simulation, runs are
+    // spread across pool threads and every thread reuses its own world, particles and image between runs.
+    // Writes thumbnails to output_dir and returns results indexed by run, free with free().
+    SweepResult *run(SweepSettings *settings, ThreadPool *pool);
+    // CSV with swept fields and metrics of every run.
+    bool write_summary(SweepSettings *settings, SweepResult *results, const char *path);
+}
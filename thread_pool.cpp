@@ -0,0 +1,228 @@
+#include "thread_pool.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#endif
+
+#define NO_NODE 0xFFFFFFFF
+
+struct ThreadPool {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable job_ready;
+    std::condition_variable job_done;
+
+    // Current job, valid while job_id changes haven't been consumed by all workers.
+    TaskFunction function;
+    void *data;
+    uint32_t count;
+    uint32_t chunk_size;
+    std::atomic<uint32_t> next_item;
+    uint32_t active_workers;
+    uint64_t job_id;
+    bool is_running;
+    // NUMA node workers are pinned to, NO_NODE if they aren't.
+    uint32_t node;
+};
+
+// Claims chunks of the current job until there's nothing left.
+static void process_job(ThreadPool *pool, uint32_t thread_index) {
+    while (true) {
+        uint32_t begin = pool->next_item.fetch_add(pool->chunk_size);
+        if (begin >= pool->count) {
+            break;
+        }
+        uint32_t end = begin + pool->chunk_size;
+        if (end > pool->count || end < begin) {
+            end = pool->count;
+        }
+        pool->function(pool->data, begin, end, thread_index);
+    }
+}
+
+#ifdef _WIN32
+static bool get_node_affinity(uint32_t node, GROUP_AFFINITY *affinity) {
+    ULONG highest_node;
+    if (!GetNumaHighestNodeNumber(&highest_node) || node > highest_node) return false;
+    *affinity = {};
+    return GetNumaNodeProcessorMaskEx(USHORT(node), affinity) && affinity->Mask != 0;
+}
+
+static uint32_t get_node_core_count(uint32_t node) {
+    GROUP_AFFINITY affinity;
+    if (!get_node_affinity(node, &affinity)) return 0;
+    uint32_t count = 0;
+    for (KAFFINITY mask = affinity.Mask; mask; mask &= mask - 1) count++;
+    return count;
+}
+
+static void pin_current_thread(uint32_t node) {
+    GROUP_AFFINITY affinity;
+    if (get_node_affinity(node, &affinity)) {
+        SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL);
+    }
+}
+#else
+// Reads cpulist of the node from sysfs ("0-7,16-23"), returns false if the node doesn't exist.
+static bool get_node_cpus(uint32_t node, cpu_set_t *cpus) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+    FILE *file = fopen(path, "r");
+    if (!file) return false;
+    CPU_ZERO(cpus);
+    unsigned first, last;
+    int separator;
+    while (fscanf(file, "%u", &first) == 1) {
+        last = first;
+        separator = fgetc(file);
+        if (separator == '-') {
+            if (fscanf(file, "%u", &last) != 1) break;
+            separator = fgetc(file);
+        }
+        for (unsigned cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) CPU_SET(cpu, cpus);
+        if (separator != ',') break;
+    }
+    fclose(file);
+    return CPU_COUNT(cpus) > 0;
+}
+
+static uint32_t get_node_core_count(uint32_t node) {
+    cpu_set_t cpus;
+    return get_node_cpus(node, &cpus) ? uint32_t(CPU_COUNT(&cpus)) : 0;
+}
+
+static void pin_current_thread(uint32_t node) {
+    cpu_set_t cpus;
+    if (get_node_cpus(node, &cpus)) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+}
+#endif
+
+static void worker_loop(ThreadPool *pool, uint32_t thread_index) {
+    if (pool->node != NO_NODE) {
+        pin_current_thread(pool->node);
+    }
+    uint64_t last_job_id = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->job_ready.wait(lock, [&]() { return !pool->is_running || pool->job_id != last_job_id; });
+            if (!pool->is_running) {
+                return;
+            }
+            last_job_id = pool->job_id;
+        }
+
+        process_job(pool, thread_index);
+
+        std::unique_lock<std::mutex> lock(pool->mutex);
+        pool->active_workers--;
+        if (pool->active_workers == 0) {
+            pool->job_done.notify_one();
+        }
+    }
+}
+
+static ThreadPool *create_pool(uint32_t thread_count, uint32_t node) {
+    ThreadPool *pool = new ThreadPool();
+    pool->function = NULL;
+    pool->data = NULL;
+    pool->count = 0;
+    pool->chunk_size = 1;
+    pool->next_item = 0;
+    pool->active_workers = 0;
+    pool->job_id = 0;
+    pool->is_running = true;
+    pool->node = node;
+
+    // Calling thread is thread 0, workers get the rest of indices.
+    for (uint32_t i = 1; i < thread_count; ++i) {
+        pool->workers.push_back(std::thread(worker_loop, pool, i));
+    }
+    return pool;
+}
+
+ThreadPool *thread_pool::get(uint32_t thread_count) {
+    if (thread_count == 0) {
+        thread_count = std::thread::hardware_concurrency();
+        if (thread_count == 0) {
+            thread_count = 1;
+        }
+    }
+    return create_pool(thread_count, NO_NODE);
+}
+
+uint32_t thread_pool::get_node_count() {
+    uint32_t count = 0;
+    while (get_node_core_count(count) > 0) {
+        count++;
+    }
+    return count > 0 ? count : 1;
+}
+
+ThreadPool *thread_pool::get_on_node(uint32_t thread_count, uint32_t node) {
+    uint32_t core_count = get_node_core_count(node);
+    if (core_count == 0) {
+        // Node isn't known, e.g. single node system which doesn't report NUMA topology.
+        return thread_pool::get(thread_count);
+    }
+    return create_pool(thread_count > 0 ? thread_count : core_count, node);
+}
+
+void thread_pool::release(ThreadPool *pool) {
+    if (!pool) return;
+    {
+        std::unique_lock<std::mutex> lock(pool->mutex);
+        pool->is_running = false;
+    }
+    pool->job_ready.notify_all();
+    for (size_t i = 0; i < pool->workers.size(); ++i) {
+        pool->workers[i].join();
+    }
+    delete pool;
+}
+
+uint32_t thread_pool::get_thread_count(ThreadPool *pool) {
+    if (!pool) return 1;
+    return uint32_t(pool->workers.size()) + 1;
+}
+
+void thread_pool::run(ThreadPool *pool, uint32_t count, uint32_t chunk_size, TaskFunction function, void *data) {
+    if (count == 0) return;
+    if (chunk_size == 0) chunk_size = 1;
+
+    // Not worth waking up workers if there's only a single chunk.
+    if (!pool || pool->workers.empty() || count <= chunk_size) {
+        function(data, 0, count, 0);
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(pool->mutex);
+        pool->function = function;
+        pool->data = data;
+        pool->count = count;
+        pool->chunk_size = chunk_size;
+        pool->next_item = 0;
+        pool->active_workers = uint32_t(pool->workers.size());
+        pool->job_id++;
+    }
+    pool->job_ready.notify_all();
+
+    process_job(pool, 0);
+
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->job_done.wait(lock, [&]() { return pool->active_workers == 0; });
+}
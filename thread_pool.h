@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <type_traits>
+
+// Pool of persistent worker threads. Work is submitted as a range [0, count) which is split
+// into chunks, workers (and the calling thread) claim chunks until the whole range is done.
+struct ThreadPool;
+
+// Function processing items [begin, end). thread_index is in [0, thread count) and can be used
+// to index per-thread scratch memory.
+typedef void (*TaskFunction)(void *data, uint32_t begin, uint32_t end, uint32_t thread_index);
+
+namespace thread_pool {
+    // thread_count of 0 means one thread per hardware core. Calling thread counts as one of the threads.
+    ThreadPool *get(uint32_t thread_count);
+    void release(ThreadPool *pool);
+
+    uint32_t get_thread_count(ThreadPool *pool);
+
+    // Number of NUMA nodes, 1 if the system doesn't report any.
+    uint32_t get_node_count();
+    // Same as get, with worker threads pinned to cores of NUMA node `node`, so memory they touch first is
+    // allocated on that node. thread_count of 0 means one thread per core of the node. Calling thread isn't pinned.
+    ThreadPool *get_on_node(uint32_t thread_count, uint32_t node);
+
+    // Blocks until all chunks are processed. Pool can be NULL, in which case the work runs on calling thread.
+    void run(ThreadPool *pool, uint32_t count, uint32_t chunk_size, TaskFunction function, void *data);
+
+    // Convenience wrapper for lambdas with signature (uint32_t begin, uint32_t end, uint32_t thread_index).
+    template<typename F>
+    void run(ThreadPool *pool, uint32_t count, uint32_t chunk_size, F &&function) {
+        typedef typename std::remove_reference<F>::type FunctionType;
+        TaskFunction trampoline = [](void *data, uint32_t begin, uint32_t end, uint32_t thread_index) {
+            (*(FunctionType *)data)(begin, end, thread_index);
+        };
+        run(pool, count, chunk_size, trampoline, (void *)&function);
+    }
+}